@@ -0,0 +1,450 @@
+#include "Benchmark.h"
+#include "DepthFilter.h"
+#include "FrameCodec.h"
+#include "Helpers.h"
+#include "pngio.h"
+#include "ThreadPlacement.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+using namespace common;
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  typedef std::chrono::high_resolution_clock clock_type;
+
+  double elapsed_ms ( clock_type::time_point start )
+  {
+    return std::chrono::duration<double, std::milli> ( clock_type::now () - start ).count ();
+  }
+
+  std::vector<FrameImage> load_frames ( const fs::path& folder, int maxFrames )
+  {
+    // sharded captures keep their frames in sub folders, sorted paths still follow the frame numbers
+    std::vector<std::string> files;
+    for (auto& entry : fs::recursive_directory_iterator ( folder ))
+    {
+      if (fs::is_regular_file ( entry.path () ))
+        files.push_back ( entry.path ().string () );
+    }
+
+    std::sort ( files.begin (), files.end () );
+
+    std::vector<FrameImage> frames;
+    for (auto& file : files)
+    {
+      if ((int)frames.size () >= maxFrames)
+        break;
+
+      FrameImage image;
+      if (DecodeFrameFile ( file, image ) && image.format == PixelFormat::RGB8)
+        frames.push_back ( std::move ( image ) );
+    }
+
+    return frames;
+  }
+
+  BenchmarkResult run_pngio ( const std::vector<FrameImage>& frames, const std::string& tmp )
+  {
+    BenchmarkResult result = { "pngio", (int)frames.size (), 0, 0, 0 };
+
+    CodecSettings settings;
+    std::unique_ptr<FrameCodec> decoder ( CreateCodec ( settings ) );
+    std::vector<unsigned char> buffer;
+    FrameImage decoded;
+    std::unique_ptr<pngio> png;
+    int width = 0;
+    int height = 0;
+
+    for (auto& frame : frames)
+    {
+      auto start = clock_type::now ();
+
+      // one per size, like a saving thread would keep it
+      if (!png || width != frame.width || height != frame.height)
+      {
+        png.reset ( new pngio ( frame.width, frame.height, png_color_type::RGB ) );
+        width = frame.width;
+        height = frame.height;
+      }
+
+      png->Save ( tmp.c_str (), frame.data.data () );
+
+      result.encodeMs += elapsed_ms ( start );
+
+      ReadBuffer ( tmp, buffer );
+      result.bytes += buffer.size ();
+
+      start = clock_type::now ();
+      decoder->Decode ( buffer.data (), buffer.size (), decoded );
+      result.decodeMs += elapsed_ms ( start );
+    }
+
+    return result;
+  }
+
+  unsigned int next_noise ( unsigned int& state )
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  // the synthetic camera's floor with stronger noise, a new draw every frame so the temporal filter has something to do
+  void make_depth_frame ( std::vector<uint16_t>& depth, int width, int height, int frame )
+  {
+    depth.resize ( (size_t)width * height );
+    unsigned int noise = 0x9E3779B9u + frame;
+
+    for (int y = 0; y < height; y++)
+    {
+      int py = (y + frame * 4) % height;
+
+      for (int x = 0; x < width; x++)
+      {
+        unsigned int n = next_noise ( noise );
+        uint16_t value = (uint16_t)(600 + py * 2400 / height + (n & 31));
+
+        // fixed holes plus a few percent that come and go
+        if (((x / 40) * 7 + (py / 40) * 13) % 29 == 0 || (n >> 24) < 8)
+          value = 0;
+
+        depth[(size_t)y * width + x] = value;
+      }
+    }
+  }
+
+  DepthFilterResult run_depth_filter ( const char* name, const DepthFilterSettings& settings, int width, int height, int frames, FrameCodec* png )
+  {
+    DepthFilterResult result = { name, settings.threads, frames, 0, 0 };
+
+    DepthFilter filter;
+    filter.Configure ( settings );
+
+    std::vector<uint16_t> depth;
+    std::vector<unsigned char> encoded;
+
+    for (int i = 0; i < frames; i++)
+    {
+      make_depth_frame ( depth, width, height, i );
+
+      auto start = clock_type::now ();
+      filter.Process ( depth.data (), width, height );
+      result.ms += elapsed_ms ( start );
+
+      if (png->Encode ( reinterpret_cast<const unsigned char*>(depth.data ()), filter.OutputWidth ( width ), filter.OutputHeight ( height ), PixelFormat::Z16, encoded ))
+        result.bytes += encoded.size ();
+    }
+
+    result.ms /= std::max ( 1, frames );
+    result.bytes /= std::max ( 1, frames );
+
+    return result;
+  }
+
+  IsolationResult run_isolation ( const char* name, const fs::path& path, int devices, double seconds, int hogThreads, const MultiCaptureSettings& settings )
+  {
+    IsolationResult result = { name, 0, 0, 0, 0 };
+
+    fs::remove_all ( path );
+
+    // plain busy loops at normal priority that may run anywhere, like a training job next to the capture
+    std::atomic<bool> hogging ( true );
+    std::vector<std::thread> hogs;
+    for (int i = 0; i < hogThreads; i++)
+    {
+      hogs.emplace_back ( [&hogging]()
+      {
+        volatile double x = 1;
+        while (hogging)
+          x = x * 1.0000001 + 0.0000001;
+      } );
+    }
+
+    MultiCapture capture;
+    std::vector<CaptureSource> sources ( devices, CaptureSource { SourceSynthetic, std::string () } );
+
+    if (capture.Start ( sources, path.string (), settings ))
+    {
+      auto start = clock_type::now ();
+      std::this_thread::sleep_for ( std::chrono::duration<double> ( seconds ) );
+      double elapsed = elapsed_ms ( start ) / 1000.0;
+
+      capture.Stop ();
+
+      for (int i = 0; i < capture.DeviceCount (); i++)
+      {
+        result.expected += (int)(capture.Device ( i )->GetSensorFps () * elapsed);
+        result.acquired += capture.Device ( i )->GetFramesAcquired ();
+        result.dropped += capture.FramesDropped ( i );
+        result.saved += capture.FramesSaved ( i );
+      }
+    }
+
+    hogging = false;
+    for (auto& hog : hogs)
+      hog.join ();
+
+    fs::remove_all ( path );
+
+    return result;
+  }
+
+  BenchmarkResult run_codec ( const std::vector<FrameImage>& frames, const std::string& tmp, CodecType type, const char* name )
+  {
+    BenchmarkResult result = { name, (int)frames.size (), 0, 0, 0 };
+
+    CodecSettings settings;
+    settings.codec = type;
+    std::unique_ptr<FrameCodec> codec ( CreateCodec ( settings ) );
+    std::vector<unsigned char> buffer;
+    FrameImage decoded;
+
+    for (auto& frame : frames)
+    {
+      auto start = clock_type::now ();
+
+      codec->Encode ( frame.data.data (), frame.width, frame.height, frame.format, buffer );
+      WriteBuffer ( tmp, buffer );
+
+      result.encodeMs += elapsed_ms ( start );
+      result.bytes += buffer.size ();
+
+      start = clock_type::now ();
+      codec->Decode ( buffer.data (), buffer.size (), decoded );
+      result.decodeMs += elapsed_ms ( start );
+    }
+
+    return result;
+  }
+}
+
+std::vector<BenchmarkResult> EF::BenchmarkColorCodecs ( const std::string& folder, int maxFrames ) try
+{
+  std::vector<BenchmarkResult> results;
+
+  auto frames = load_frames ( fs::path ( folder ) / "rgb", maxFrames );
+  if (frames.empty ())
+  {
+    DebugOut ( "BenchmarkColorCodecs: no color frames in %s", folder.c_str () );
+    return results;
+  }
+
+  auto tmp = (fs::path ( folder ) / "benchmark.tmp").string ();
+
+  results.push_back ( run_pngio ( frames, tmp ) );
+  results.push_back ( run_codec ( frames, tmp, CodecType::Png, "png striped" ) );
+  results.push_back ( run_codec ( frames, tmp, CodecType::Qoi, "qoi" ) );
+  results.push_back ( run_codec ( frames, tmp, CodecType::Jpeg, "jpeg q95" ) );
+  results.push_back ( run_codec ( frames, tmp, CodecType::Lz4, "lz4" ) );
+  results.push_back ( run_codec ( frames, tmp, CodecType::Zstd, "zstd" ) );
+
+  fs::remove ( tmp );
+
+  for (auto& result : results)
+  {
+    result.encodeMs /= result.frames;
+    result.decodeMs /= result.frames;
+    result.bytes /= result.frames;
+  }
+
+  return results;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "BenchmarkColorCodecs exp: %s", e.what () );
+  return std::vector<BenchmarkResult> ();
+}
+
+std::string EF::FormatBenchmark ( const BenchmarkResult& result, const BenchmarkResult& baseline )
+{
+  return Format ( "%-12s %4d frames  encode %7.2f ms (%5.1fx)  decode %7.2f ms  %8.0f KB (%3.0f%%)",
+    result.name.c_str (),
+    result.frames,
+    result.encodeMs,
+    result.encodeMs > 0 ? baseline.encodeMs / result.encodeMs : 0.0,
+    result.decodeMs,
+    result.bytes / 1024.0,
+    baseline.bytes > 0 ? 100.0 * result.bytes / baseline.bytes : 0.0 );
+}
+
+std::vector<ScalingResult> EF::BenchmarkMultiCapture ( const std::string& folder, int maxDevices, double seconds, const MultiCaptureSettings& settings ) try
+{
+  std::vector<ScalingResult> results;
+
+  auto path = fs::path ( folder ) / "scaling";
+
+  for (int devices = 1; devices <= maxDevices; devices++)
+  {
+    fs::remove_all ( path );
+
+    std::vector<CaptureSource> sources ( devices, CaptureSource { SourceSynthetic, std::string () } );
+
+    MultiCapture capture;
+    auto start = clock_type::now ();
+
+    if (!capture.Start ( sources, path.string (), settings ))
+      break;
+
+    std::this_thread::sleep_for ( std::chrono::duration<double> ( seconds ) );
+    capture.Stop ();
+
+    ScalingResult result = { devices, elapsed_ms ( start ) / 1000.0, 0, 0, 0, 0 };
+    long long bytes = 0;
+
+    for (int i = 0; i < capture.DeviceCount (); i++)
+    {
+      result.framesSaved += capture.FramesSaved ( i );
+      result.framesDropped += capture.FramesDropped ( i );
+      bytes += capture.BytesSaved ( i );
+    }
+
+    result.fps = result.framesSaved / result.seconds;
+    result.mbps = bytes / (1024.0 * 1024.0) / result.seconds;
+
+    results.push_back ( result );
+  }
+
+  fs::remove_all ( path );
+
+  return results;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "BenchmarkMultiCapture exp: %s", e.what () );
+  return std::vector<ScalingResult> ();
+}
+
+std::vector<IsolationResult> EF::BenchmarkThreadIsolation ( const std::string& folder, int devices, double seconds, int hogThreads, const MultiCaptureSettings& settings ) try
+{
+  std::vector<IsolationResult> results;
+
+  auto path = fs::path ( folder ) / "isolation";
+
+  results.push_back ( run_isolation ( "unloaded", path, devices, seconds, 0, settings ) );
+  results.push_back ( run_isolation ( "cpu hog", path, devices, seconds, hogThreads, settings ) );
+
+  // the acquisition threads (and the pump) get processors of their own, the encoders share the rest with the hog
+  int processors = std::min ( ProcessorCount (), 64 );
+  int acquisitionProcessors = std::max ( 1, std::min ( devices + 1, processors / 4 ) );
+
+  MultiCaptureSettings isolated = settings;
+  isolated.acquisitionPlacement.affinity = ProcessorMask ( 0, acquisitionProcessors );
+  isolated.acquisitionPlacement.priority = SchedulingPriority::Highest;
+  isolated.encodePlacement.affinity = processors > acquisitionProcessors ? ProcessorMask ( acquisitionProcessors, processors - acquisitionProcessors ) : 0;
+  isolated.encodePlacement.priority = SchedulingPriority::AboveNormal;
+
+  results.push_back ( run_isolation ( "cpu hog isolated", path, devices, seconds, hogThreads, isolated ) );
+
+  return results;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "BenchmarkThreadIsolation exp: %s", e.what () );
+  return std::vector<IsolationResult> ();
+}
+
+std::string EF::FormatIsolation ( const IsolationResult& result )
+{
+  int missed = std::max ( 0, result.expected - result.acquired );
+
+  return Format ( "%-18s %6d expected  %6d acquired (%5.1f%% missed)  %5d dropped  %6d saved",
+    result.name.c_str (),
+    result.expected,
+    result.acquired,
+    result.expected > 0 ? 100.0 * missed / result.expected : 0.0,
+    result.dropped,
+    result.saved );
+}
+
+std::vector<DepthFilterResult> EF::BenchmarkDepthFilters ( int width, int height, int frames, const DepthFilterSettings& settings ) try
+{
+  std::vector<DepthFilterResult> results;
+
+  CodecSettings codec;
+  std::unique_ptr<FrameCodec> png ( CreateCodec ( codec ) );
+
+  DepthFilterSettings none = settings;
+  none.decimation = 1;
+  none.spatial = false;
+  none.temporal = false;
+  none.holeFill = HoleFill::None;
+  none.threads = 1;
+
+  results.push_back ( run_depth_filter ( "none", none, width, height, frames, png.get () ) );
+
+  int threads = settings.threads > 0 ? settings.threads : std::max ( 1, (int)std::thread::hardware_concurrency () );
+
+  for (int t : { 1, threads })
+  {
+    DepthFilterSettings single = none;
+    single.threads = t;
+
+    DepthFilterSettings decimation = single;
+    decimation.decimation = settings.decimation > 1 ? settings.decimation : 2;
+
+    DepthFilterSettings spatial = single;
+    spatial.spatial = true;
+
+    DepthFilterSettings temporal = single;
+    temporal.temporal = true;
+
+    DepthFilterSettings holeFill = single;
+    holeFill.holeFill = settings.holeFill != HoleFill::None ? settings.holeFill : HoleFill::Farthest;
+
+    DepthFilterSettings all = single;
+    all.decimation = decimation.decimation;
+    all.spatial = true;
+    all.temporal = true;
+    all.holeFill = holeFill.holeFill;
+
+    results.push_back ( run_depth_filter ( "decimation", decimation, width, height, frames, png.get () ) );
+    results.push_back ( run_depth_filter ( "spatial", spatial, width, height, frames, png.get () ) );
+    results.push_back ( run_depth_filter ( "temporal", temporal, width, height, frames, png.get () ) );
+    results.push_back ( run_depth_filter ( "hole fill", holeFill, width, height, frames, png.get () ) );
+    results.push_back ( run_depth_filter ( "all", all, width, height, frames, png.get () ) );
+
+    if (threads == 1)
+      break;
+  }
+
+  return results;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "BenchmarkDepthFilters exp: %s", e.what () );
+  return std::vector<DepthFilterResult> ();
+}
+
+std::string EF::FormatDepthFilter ( const DepthFilterResult& result, const DepthFilterResult& baseline )
+{
+  return Format ( "%-12s %2d threads  %4d frames  %6.2f ms  %8.0f KB png (%3.0f%%)",
+    result.name.c_str (),
+    result.threads,
+    result.frames,
+    result.ms,
+    result.bytes / 1024.0,
+    baseline.bytes > 0 ? 100.0 * result.bytes / baseline.bytes : 0.0 );
+}
+
+std::string EF::FormatScaling ( const ScalingResult& result, const ScalingResult& baseline )
+{
+  // 100% means every device saves as fast as a single one did
+  double perDevice = baseline.devices > 0 ? baseline.fps / baseline.devices : 0.0;
+
+  return Format ( "%2d devices  %6d saved  %5d dropped  %7.1f fps  %7.1f MB/s  scaling %3.0f%%",
+    result.devices,
+    result.framesSaved,
+    result.framesDropped,
+    result.fps,
+    result.mbps,
+    perDevice > 0 ? 100.0 * result.fps / (perDevice * result.devices) : 0.0 );
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "MultiCapture.h"
+
+#include <string>
+#include <vector>
+
+namespace EF
+{
+  struct BenchmarkResult
+  {
+    std::string name;
+    int frames;
+    double encodeMs;  // average per frame, including the write to disk
+    double decodeMs;  // average per frame
+    double bytes;     // average per frame
+  };
+
+  // Re-encodes the recorded rgb\ frames of a capture folder with pngio (the original
+  // per frame save path) and every color codec, up to maxFrames frames.
+  std::vector<BenchmarkResult> BenchmarkColorCodecs ( const std::string& folder, int maxFrames );
+
+  std::string FormatBenchmark ( const BenchmarkResult& result, const BenchmarkResult& baseline );
+
+  struct ScalingResult
+  {
+    int devices;
+    double seconds;     // capture time plus the time the encoders needed to drain
+    int framesSaved;    // over all devices
+    int framesDropped;  // at the queue, because the encoders or the disk fell behind
+    double fps;         // frames saved per second over all devices
+    double mbps;        // megabytes written per second
+  };
+
+  // Captures from 1 to maxDevices synthetic sources for the given number of seconds each into
+  // folder\scaling, which is removed after every run. Saved frames per second grow with the source
+  // count until the encoders or the disk saturate, from there the extra frames are dropped instead.
+  std::vector<ScalingResult> BenchmarkMultiCapture ( const std::string& folder, int maxDevices, double seconds, const MultiCaptureSettings& settings );
+
+  std::string FormatScaling ( const ScalingResult& result, const ScalingResult& baseline );
+
+  struct IsolationResult
+  {
+    std::string name;
+    int expected;       // framesets the sources should have delivered at their sensor rate
+    int acquired;
+    int dropped;        // at the queue
+    int saved;
+  };
+
+  // Captures from synthetic sources for the given number of seconds three times: unloaded, with
+  // hogThreads busy threads competing for every core, and with the same load but the acquisition
+  // threads on their own processors at Highest priority and the encoders AboveNormal on the rest.
+  // Framesets the acquisition threads were too late for never count as acquired.
+  std::vector<IsolationResult> BenchmarkThreadIsolation ( const std::string& folder, int devices, double seconds, int hogThreads, const MultiCaptureSettings& settings );
+
+  std::string FormatIsolation ( const IsolationResult& result );
+
+  struct DepthFilterResult
+  {
+    std::string name;
+    int threads;
+    int frames;
+    double ms;     // average per frame
+    double bytes;  // average png size of the filtered frames
+  };
+
+  // Runs every depth filter on its own and then all of them together over frames synthetic
+  // width x height frames (a sloping floor with sensor noise and holes), once on a single thread
+  // and once on settings.threads. Filters settings leaves off run with their defaults, decimation
+  // with 2 and hole filling with Farthest. The first result is the unfiltered baseline.
+  std::vector<DepthFilterResult> BenchmarkDepthFilters ( int width, int height, int frames, const DepthFilterSettings& settings );
+
+  std::string FormatDepthFilter ( const DepthFilterResult& result, const DepthFilterResult& baseline );
+}
@@ -0,0 +1,103 @@
+#include "CaptureFolder.h"
+#include "Helpers.h"
+#include "ThreadPlacement.h"
+
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
+
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  const char* const kDeletingSuffix = ".deleting.";
+
+  std::mutex g_delete_mutex;
+  std::condition_variable g_delete_done;
+  std::set<std::string> g_deleting;  // guarded by g_delete_mutex
+
+  void delete_in_background ( const fs::path& path )
+  {
+    {
+      std::lock_guard<std::mutex> guard ( g_delete_mutex );
+      if (!g_deleting.insert ( path.string () ).second)
+        return;
+    }
+
+    std::thread ( [path]()
+    {
+      ThreadPlacement placement;
+      placement.priority = SchedulingPriority::Lowest;
+      ApplyThreadPlacement ( placement, "rsds cleanup" );
+
+      std::error_code error;
+      fs::remove_all ( path, error );
+      if (error)
+        DebugOut ( "PrepareCaptureFolder failed to delete %s: %s", path.string ().c_str (), error.message ().c_str () );
+
+      std::lock_guard<std::mutex> guard ( g_delete_mutex );
+      g_deleting.erase ( path.string () );
+      g_delete_done.notify_all ();
+    } ).detach ();
+  }
+}
+
+bool EF::PrepareCaptureFolder ( const std::string& folder, FolderMode mode ) try
+{
+  fs::path path = fs::path ( folder );
+
+  // ones a previous run did not get to finish
+  fs::path parent = fs::absolute ( path ).parent_path ();
+  auto prefix = path.filename ().string () + kDeletingSuffix;
+
+  if (mode == FolderMode::Overwrite && fs::is_directory ( parent ))
+  {
+    for (auto& entry : fs::directory_iterator ( parent ))
+    {
+      if (entry.path ().filename ().string ().compare ( 0, prefix.size (), prefix ) == 0)
+        delete_in_background ( entry.path () );
+    }
+  }
+
+  if (mode == FolderMode::Overwrite && fs::exists ( path ) && !fs::is_empty ( path ))
+  {
+    // a rename is a single metadata update however much the folder holds
+    fs::path aside;
+    for (int n = 1; fs::exists ( aside = parent / Format ( "%s%d", prefix.c_str (), n ) ); n++);
+
+    std::error_code error;
+    fs::rename ( path, aside, error );
+
+    if (!error)
+      delete_in_background ( aside );
+    else
+    {
+      DebugOut ( "PrepareCaptureFolder could not move %s aside (%s), deleting it in place", folder.c_str (), error.message ().c_str () );
+      fs::remove_all ( path );
+    }
+  }
+
+  fs::create_directories ( path );
+  return true;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "PrepareCaptureFolder exp: %s", e.what () );
+  return false;
+}
+
+int EF::PendingDeletes ()
+{
+  std::lock_guard<std::mutex> guard ( g_delete_mutex );
+  return (int)g_deleting.size ();
+}
+
+void EF::WaitForDeletes ()
+{
+  std::unique_lock<std::mutex> lock ( g_delete_mutex );
+  g_delete_done.wait ( lock, []() { return g_deleting.empty (); } );
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+namespace EF
+{
+  enum class FolderMode : int
+  {
+    Overwrite,  // an earlier capture in the folder is moved aside and deleted in the background
+    Append,     // new frames are numbered after the ones already there and start a new session in the index
+  };
+
+  // Gets path ready for a capture without walking what is already in it, so starting takes about the
+  // same time on an empty folder and on one holding millions of frames. Creates path when needed.
+  bool PrepareCaptureFolder ( const std::string& path, FolderMode mode );
+
+  // folders moved aside by PrepareCaptureFolder that are still being deleted
+  int PendingDeletes ();
+  // blocks until the background deletes are done
+  void WaitForDeletes ();
+}
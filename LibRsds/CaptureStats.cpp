@@ -0,0 +1,165 @@
+#include "CaptureStats.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace RS;
+
+const char* RS::DropCauseName (DropCause cause)
+{
+  switch (cause)
+  {
+  case DropSensor: return "sensor";
+  case DropPairing: return "pairing";
+  case DropQueue: return "queue";
+  case DropThrottle: return "throttle";
+  case DropShed: return "shed";
+  case DropVideo: return "video";
+  case DropEncode: return "encode";
+  default: return "";
+  }
+}
+
+DropMonitor::DropMonitor ()
+  : _stall_timeout_ms (2000)
+{
+  Reset (0);
+}
+
+void DropMonitor::Reset (double nowMs)
+{
+  memset (_totals, 0, sizeof (_totals));
+  memset (_sensor_drops, 0, sizeof (_sensor_drops));
+  memset (_buckets, 0, sizeof (_buckets));
+
+  _second = (long long)(nowMs / 1000);
+  _start_ms = nowMs;
+  _last_frameset_ms = nowMs;
+  _stalls = 0;
+
+  Resync ();
+}
+
+void DropMonitor::Resync ()
+{
+  memset (_last_number, 0, sizeof (_last_number));
+}
+
+void DropMonitor::Acquired (const unsigned long long frameNumbers[], double nowMs)
+{
+  long long lost = 0;
+
+  for (int i = 0; i < kStatsStreams; i++)
+  {
+    unsigned long long number = frameNumbers[i];
+    if (!number)
+      continue;
+
+    // a number that goes back is a new run of the sensor, not a drop
+    if (_last_number[i] && number > _last_number[i] + 1)
+    {
+      long long gap = (long long)(number - _last_number[i] - 1);
+      _sensor_drops[i] += gap;
+      lost = std::max (lost, gap);
+    }
+
+    _last_number[i] = number;
+  }
+
+  _last_frameset_ms = nowMs;
+
+  Add (kAcquired, 1, nowMs);
+  if (lost)
+    Add (DropSensor, lost, nowMs);
+}
+
+void DropMonitor::Kept (double nowMs)
+{
+  Add (kKept, 1, nowMs);
+}
+
+void DropMonitor::Dropped (DropCause cause, int count, double nowMs)
+{
+  if (cause >= 0 && cause < DropCauseCount && count > 0)
+    Add (cause, count, nowMs);
+}
+
+void DropMonitor::Stalled ()
+{
+  _stalls++;
+}
+
+CaptureStats DropMonitor::Stats (double nowMs)
+{
+  Advance (nowMs);
+
+  CaptureStats stats;
+  memset (&stats, 0, sizeof (stats));
+
+  // the window is shorter right after a reset
+  double seconds = std::min ((double)kSeconds - 1 + (nowMs / 1000 - _second), (nowMs - _start_ms) / 1000);
+  seconds = std::max (seconds, 0.001);
+
+  float rates[kCounters];
+  for (int c = 0; c < kCounters; c++)
+  {
+    long long sum = 0;
+    for (int s = 0; s < kSeconds; s++)
+      sum += _buckets[s][c];
+    rates[c] = (float)(sum / seconds);
+  }
+
+  stats.acquired = _totals[kAcquired];
+  stats.kept = _totals[kKept];
+  stats.acquiredRate = rates[kAcquired];
+  stats.keptRate = rates[kKept];
+
+  for (int c = 0; c < DropCauseCount; c++)
+  {
+    stats.drops[c] = _totals[c];
+    stats.dropRates[c] = rates[c];
+  }
+
+  for (int i = 0; i < kStatsStreams; i++)
+    stats.sensorDrops[i] = _sensor_drops[i];
+
+  stats.stalls = _stalls;
+  stats.msSinceFrameset = nowMs - _last_frameset_ms;
+  stats.stalled = _stall_timeout_ms > 0 && stats.msSinceFrameset > _stall_timeout_ms;
+
+  return stats;
+}
+
+void DropMonitor::Add (int counter, long long count, double nowMs)
+{
+  Advance (nowMs);
+
+  _totals[counter] += count;
+  _buckets[_second % kSeconds][counter] += count;
+}
+
+void DropMonitor::Advance (double nowMs)
+{
+  long long second = (long long)(nowMs / 1000);
+
+  // buckets of the seconds that went by without a count are emptied on the way
+  for (long long s = _second + 1; s <= second && s <= _second + kSeconds; s++)
+    memset (_buckets[s % kSeconds], 0, sizeof (_buckets[0]));
+
+  _second = std::max (_second, second);
+}
+
+std::string RS::FormatCaptureStats (const CaptureStats& stats)
+{
+  auto text = Format ("acquired %lld (%.1f/s)  kept %lld (%.1f/s)", stats.acquired, stats.acquiredRate, stats.kept, stats.keptRate);
+
+  for (int c = 0; c < DropCauseCount; c++)
+    text += Format ("  %s %lld (%.1f/s)", DropCauseName ((DropCause)c), stats.drops[c], stats.dropRates[c]);
+
+  text += Format ("  stalls %d", stats.stalls);
+  if (stats.stalled)
+    text += Format (" (stalled for %.0f ms)", stats.msSinceFrameset);
+
+  return text;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+
+namespace RS
+{
+  const int kStatsStreams = 4;  // RS::StreamCount, this header comes before it
+
+  // where a frame that never reached the encoders was lost
+  enum DropCause
+  {
+    DropSensor,    // missing sensor frame numbers, lost by the camera, usb or librealsense
+    DropPairing,   // framesets without every enabled stream
+    DropQueue,     // overwritten in the frameset queue or refused by a full encoder queue
+    DropThrottle,  // sensor frames beyond the save rate, dropped on purpose
+    DropShed,      // not queued by the load shedding of an encoder that fell behind
+    DropVideo,     // color frames the video encoder or muxer failed on
+    DropEncode,    // per frame files an encoder skipped or could not write, and the deltas that needed them
+    DropCauseCount,
+  };
+
+  const char* DropCauseName (DropCause cause);
+
+  struct CaptureStats
+  {
+    long long acquired;                       // framesets from the sensor
+    long long kept;                           // queued for the encoders
+    long long drops[DropCauseCount];
+    long long sensorDrops[kStatsStreams];     // DropSensor per StreamType
+    float acquiredRate;                       // per second over the last few seconds
+    float keptRate;
+    float dropRates[DropCauseCount];
+    int stalls;                               // waits that ran into the stall timeout
+    bool stalled;                             // nothing arrived for longer than the timeout, also while still waiting
+    double msSinceFrameset;
+  };
+
+  // Counts what happens to every sensor frame, by cause, with totals and rolling per second rates.
+  // Not thread safe, RealsenseController calls it under its own lock.
+  class DropMonitor
+  {
+  public:
+    DropMonitor ();
+
+    void Reset (double nowMs);
+    void SetStallTimeout (int ms) { _stall_timeout_ms = ms; }
+    int GetStallTimeout () { return _stall_timeout_ms; }
+
+    // frameNumbers of the streams in the frameset, 0 for the ones it lacks. A gap in a stream's numbers
+    // is counted as sensor drops, the frameset as lost as its worst stream.
+    void Acquired (const unsigned long long frameNumbers[], double nowMs);
+    // the next numbers do not follow the last ones, after a pipeline restart or a looping recording
+    void Resync ();
+    void Kept (double nowMs);
+    void Dropped (DropCause cause, int count, double nowMs);
+    void Stalled ();
+
+    CaptureStats Stats (double nowMs);
+
+  private:
+    enum { kSeconds = 10, kAcquired = DropCauseCount, kKept, kCounters };
+
+    unsigned long long _last_number[kStatsStreams];
+    long long _totals[kCounters];
+    long long _sensor_drops[kStatsStreams];
+    long long _buckets[kSeconds][kCounters];  // one per second, a ring
+    long long _second;                        // of the newest bucket
+    double _start_ms;
+    double _last_frameset_ms;
+    int _stall_timeout_ms;
+    int _stalls;
+
+    void Add (int counter, long long count, double nowMs);
+    void Advance (double nowMs);
+  };
+
+  // one line with the totals and rates of every cause
+  std::string FormatCaptureStats (const CaptureStats& stats);
+}
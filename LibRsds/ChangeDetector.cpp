@@ -0,0 +1,169 @@
+#define NOMINMAX
+#include "ChangeDetector.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <emmintrin.h>
+
+using namespace RS;
+
+namespace
+{
+  inline int popcount16 (int mask)
+  {
+    int count = 0;
+    for (; mask; mask &= mask - 1)
+      count++;
+    return count;
+  }
+
+  // pixels with depth in either frame, and those of them that moved more than delta or lost or gained depth
+  void compare_depth (const uint16_t* a, const uint16_t* b, size_t count, int delta, int& valid, int& changed)
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i delta8 = _mm_set1_epi16 ((short)std::min (delta, 65535));
+
+    valid = 0;
+    changed = 0;
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      __m128i va = _mm_loadu_si128 ((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128 ((const __m128i*)(b + i));
+
+      __m128i holeA = _mm_cmpeq_epi16 (va, zero);
+      __m128i holeB = _mm_cmpeq_epi16 (vb, zero);
+      __m128i absdiff = _mm_or_si128 (_mm_subs_epu16 (va, vb), _mm_subs_epu16 (vb, va));
+      __m128i moved = _mm_andnot_si128 (_mm_cmpeq_epi16 (_mm_subs_epu16 (absdiff, delta8), zero), _mm_set1_epi16 (-1));
+
+      // two bits of the byte mask per pixel
+      valid += popcount16 (_mm_movemask_epi8 (_mm_andnot_si128 (_mm_and_si128 (holeA, holeB), _mm_set1_epi16 (-1)))) / 2;
+      changed += popcount16 (_mm_movemask_epi8 (_mm_or_si128 (moved, _mm_xor_si128 (holeA, holeB)))) / 2;
+    }
+
+    for (; i < count; i++)
+    {
+      if (!a[i] && !b[i])
+        continue;
+
+      valid++;
+      if (!a[i] || !b[i] || std::abs ((int)a[i] - (int)b[i]) > delta)
+        changed++;
+    }
+  }
+
+  // sum of absolute differences, psadbw does sixteen pixels at a time
+  long long luma_sad (const uint8_t* a, const uint8_t* b, size_t count)
+  {
+    __m128i sum = _mm_setzero_si128 ();
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      sum = _mm_add_epi64 (sum, _mm_sad_epu8 (_mm_loadu_si128 ((const __m128i*)(a + i)), _mm_loadu_si128 ((const __m128i*)(b + i))));
+
+    long long total = _mm_cvtsi128_si32 (sum) + _mm_cvtsi128_si32 (_mm_srli_si128 (sum, 8));
+
+    for (; i < count; i++)
+      total += std::abs ((int)a[i] - (int)b[i]);
+
+    return total;
+  }
+}
+
+ChangeDetector::ChangeDetector ()
+  : _has_reference (false)
+  , _last_kept_ms (0)
+  , _depth_score (0)
+  , _luma_score (0)
+  , _kept (0)
+  , _skipped (0)
+{
+}
+
+void ChangeDetector::Configure (const ChangeSettings& settings)
+{
+  _settings = settings;
+  _settings.downsample = std::min (std::max (settings.downsample, 1), 16);
+  _settings.depthDelta = std::max (settings.depthDelta, 0);
+
+  Reset ();
+}
+
+void ChangeDetector::Reset ()
+{
+  _has_reference = false;
+  _kept = 0;
+  _skipped = 0;
+}
+
+bool ChangeDetector::Check (const uint16_t* depth, int depthWidth, int depthHeight, const uint8_t* color, int colorWidth, int colorHeight, double timestampMs)
+{
+  int step = _settings.downsample;
+
+  _depth_sample.clear ();
+  if (depth)
+  {
+    for (int y = step / 2; y < depthHeight; y += step)
+    {
+      const uint16_t* row = depth + (size_t)y * depthWidth;
+      for (int x = step / 2; x < depthWidth; x += step)
+        _depth_sample.push_back (row[x]);
+    }
+  }
+
+  _luma_sample.clear ();
+  if (color && _settings.luma)
+  {
+    for (int y = step / 2; y < colorHeight; y += step)
+    {
+      const uint8_t* row = color + (size_t)y * colorWidth * 3;
+      for (int x = step / 2; x < colorWidth; x += step)
+      {
+        const uint8_t* p = row + x * 3;
+        _luma_sample.push_back ((uint8_t)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8));
+      }
+    }
+  }
+
+  // a new size (or stream set) is a new scene
+  bool keep = !_has_reference
+    || _depth_sample.size () != _depth_reference.size ()
+    || _luma_sample.size () != _luma_reference.size ()
+    || (_settings.keepAliveMs > 0 && timestampMs - _last_kept_ms >= _settings.keepAliveMs);
+
+  _depth_score = 0;
+  _luma_score = 0;
+
+  if (!keep)
+  {
+    if (!_depth_sample.empty ())
+    {
+      int valid, changed;
+      compare_depth (_depth_sample.data (), _depth_reference.data (), _depth_sample.size (), _settings.depthDelta, valid, changed);
+      _depth_score = valid > 0 ? (float)changed / valid : 0.0f;
+    }
+
+    if (!_luma_sample.empty ())
+      _luma_score = (float)((double)luma_sad (_luma_sample.data (), _luma_reference.data (), _luma_sample.size ()) / _luma_sample.size ());
+
+    keep = (!_depth_sample.empty () && _depth_score > _settings.depthThreshold)
+      || (!_luma_sample.empty () && _luma_score > _settings.lumaThreshold)
+      || (_depth_sample.empty () && _luma_sample.empty ());
+  }
+
+  if (!keep)
+  {
+    _skipped++;
+    return false;
+  }
+
+  _depth_reference.swap (_depth_sample);
+  _luma_reference.swap (_luma_sample);
+  _has_reference = true;
+  _last_kept_ms = timestampMs;
+  _kept++;
+
+  return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace RS
+{
+  // off by default, a frame is kept when either score is over its threshold or the keep alive is due
+  struct ChangeSettings
+  {
+    ChangeSettings ()
+      : enabled (false)
+      , downsample (4)
+      , depthDelta (30)
+      , depthThreshold (0.02f)
+      , luma (false)
+      , lumaThreshold (3.0f)
+      , keepAliveMs (10000)
+    {  }
+    bool enabled;
+    int downsample;        // every n-th pixel of every n-th row is compared, 1 to 16
+    int depthDelta;        // depth units a pixel has to move to count as changed
+    float depthThreshold;  // fraction of the compared pixels with depth in either frame that changed, 0 to 1
+    bool luma;             // also compare the color stream's luma
+    float lumaThreshold;   // mean absolute luma difference, 0 to 255
+    int keepAliveMs;       // a frame is kept at least this often even when nothing changed, 0 keeps changes only
+  };
+
+  // Compares downsampled depth, and optionally luma, with the last kept frame so near duplicate
+  // frames of a static scene can be skipped before they are copied, queued and encoded. The
+  // reference only moves on kept frames, so a slow drift still adds up to a kept frame.
+  class ChangeDetector
+  {
+  public:
+    ChangeDetector ();
+
+    void Configure (const ChangeSettings& settings);
+    const ChangeSettings& Settings () { return _settings; }
+    bool IsEnabled () { return _settings.enabled; }
+
+    // true when the frame is to be kept, it then becomes the reference. Either image may be null,
+    // color is RGB8 and timestampMs is the frame's capture time.
+    bool Check (const uint16_t* depth, int depthWidth, int depthHeight, const uint8_t* color, int colorWidth, int colorHeight, double timestampMs);
+    // the next frame is kept whatever it looks like
+    void Reset ();
+
+    float GetDepthScore () { return _depth_score; }
+    float GetLumaScore () { return _luma_score; }
+    int GetFramesKept () { return _kept; }
+    int GetFramesSkipped () { return _skipped; }
+
+  private:
+    ChangeSettings _settings;
+    std::vector<uint16_t> _depth_reference;
+    std::vector<uint16_t> _depth_sample;
+    std::vector<uint8_t> _luma_reference;
+    std::vector<uint8_t> _luma_sample;
+    bool _has_reference;
+    double _last_kept_ms;
+    float _depth_score;
+    float _luma_score;
+    int _kept;
+    int _skipped;
+  };
+}
@@ -0,0 +1,531 @@
+#include "DatasetReader.h"
+#include "EncodeFrames.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
+
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+DatasetReader::DecodeState::DecodeState ()
+  : shared ( nullptr )
+  , sharedMutex ( nullptr )
+  , keep ( 0 )
+{
+  for (int i = 0; i < RS::StreamCount; i++)
+    lastFrame[i] = -1;
+}
+
+DatasetReader::DatasetReader ()
+  : _has_index ( false )
+  , _level ( 0 )
+  , _read_state ( nullptr )
+  , _read_mutex ( nullptr )
+  , _video ( nullptr )
+  , _video_mutex ( nullptr )
+  , _chain_state ( nullptr )
+  , _chain_mutex ( nullptr )
+  , _mutex ( nullptr )
+  , _cv ( nullptr )
+  , _depth ( 0 )
+  , _next_decode ( 0 )
+  , _next_read ( 0 )
+  , _stopping ( false )
+{
+  memset ( &_header, 0, sizeof ( _header ) );
+}
+
+DatasetReader::~DatasetReader ()
+{
+  Close ();
+}
+
+bool DatasetReader::Open ( const std::string& folder, int level ) try
+{
+  Close ();
+
+  _folder = folder;
+  _level = level;
+  fs::path path = folder;
+
+  _read_state = new DecodeState ();
+  _read_mutex = new std::mutex ();
+
+  std::vector<IndexHeader> calibrations;
+  _has_index = ReadFrameIndex ( (path / kIndexFilename).string (), _header, _records, &calibrations );
+
+  if (_has_index)
+  {
+    _layout = IndexLayout ( _header );
+
+    for (size_t i = 0; i < _records.size (); i++)
+    {
+      _frames.push_back ( _records[i].frame );
+
+      // the same records ReadFrameIndex starts a session at
+      if (i > 0 && !(_records[i].flags & kIndexSessionStart))
+        continue;
+
+      Session session;
+      session.firstFrame = _records[i].frame;
+      session.calibration = calibrations[_sessions.size ()];
+
+      for (int s = 0; s < RS::StreamCount; s++)
+      {
+        uint8_t codec = session.calibration.codecs[s];
+        if (codec == kIndexVideo)
+          session.extensions[s] = ".mkv";
+        else if (codec != kIndexNoFiles)
+          session.extensions[s] = CodecExtension ( (CodecType)codec );
+      }
+
+      _sessions.push_back ( session );
+    }
+  }
+  else if (level > 0)
+  {
+    DebugOut ( "DatasetReader::Open %s has no index to tell its pyramid levels", folder.c_str () );
+    return false;
+  }
+  else
+  {
+    // older captures have no index, list the folders and take the frame numbers from the names.
+    // They were never sharded, only the width of the numbers is taken from the names.
+    std::set<int> frames;
+    _layout = FrameLayout ();
+    _layout.digits = 6;
+
+    Session session;
+    session.firstFrame = 0;
+    session.calibration = _header;
+
+    for (int i = 0; i < RS::StreamCount; i++)
+    {
+      fs::path streamPath = path / StreamFolder ( (RS::StreamType)i );
+      if (!fs::is_directory ( streamPath ))
+        continue;
+
+      for (auto& entry : fs::directory_iterator ( streamPath ))
+      {
+        auto stem = entry.path ().stem ().string ();
+        if (stem.empty () || !isdigit ( (unsigned char)stem[0] ))
+          continue;
+
+        frames.insert ( atoi ( stem.c_str () ) );
+        _layout.digits = (int)stem.size ();
+        session.extensions[i] = entry.path ().extension ().string ();
+      }
+    }
+
+    _frames.assign ( frames.begin (), frames.end () );
+
+    if (fs::exists ( path / "rgb.mkv" ))
+      session.extensions[RS::StreamColor] = ".mkv";
+
+    _sessions.push_back ( session );
+  }
+
+  if (level > 0)
+  {
+    int levels = 0;
+    for (auto& session : _sessions)
+      levels = std::max ( levels, (int)session.calibration.pyramidLevels );
+
+    if (level > levels)
+    {
+      DebugOut ( "DatasetReader::Open %s has %d pyramid levels, not %d", folder.c_str (), levels, level );
+      return false;
+    }
+
+    for (auto& session : _sessions)
+    {
+      for (int i = 0; i < RS::StreamCount; i++)
+      {
+        // the video has no levels, sessions saved with fewer have none of the files
+        if (level > session.calibration.pyramidLevels || session.extensions[i] == ".mkv")
+          session.extensions[i].clear ();
+      }
+    }
+  }
+
+  bool video = false;
+  for (auto& session : _sessions)
+    video = video || session.extensions[RS::StreamColor] == ".mkv";
+
+  if (video)
+  {
+    _video = new VideoReader ();
+    _video_mutex = new std::mutex ();
+
+    if (!_video->Open ( (path / "rgb.mkv").string () ))
+    {
+      for (auto& session : _sessions)
+      {
+        if (session.extensions[RS::StreamColor] == ".mkv")
+          session.extensions[RS::StreamColor].clear ();
+      }
+    }
+  }
+
+  for (int i = 0; i < RS::StreamCount; i++)
+  {
+    for (auto& session : _sessions)
+    {
+      if (_extensions[i].empty ())
+        _extensions[i] = session.extensions[i];
+    }
+  }
+
+  if (_frames.empty ())
+  {
+    DebugOut ( "DatasetReader::Open no frames in %s", folder.c_str () );
+    return false;
+  }
+
+  return true;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "DatasetReader::Open exp: %s", e.what () );
+  return false;
+}
+
+void DatasetReader::Close ()
+{
+  StopPrefetch ();
+
+  DEL ( _video );
+  DEL ( _video_mutex );
+  DEL ( _read_state );
+  DEL ( _read_mutex );
+
+  _has_index = false;
+  memset ( &_header, 0, sizeof ( _header ) );
+  _records.clear ();
+  _frames.clear ();
+  _sessions.clear ();
+  _layout = FrameLayout ();
+  _level = 0;
+
+  for (int i = 0; i < RS::StreamCount; i++)
+    _extensions[i].clear ();
+}
+
+const DatasetReader::Session& DatasetReader::FrameSession ( int frame )
+{
+  // frame numbers go up from one session to the next
+  auto it = std::upper_bound ( _sessions.begin (), _sessions.end (), frame, [] ( int f, const Session& session ) { return f < session.firstFrame; } );
+  return it == _sessions.begin () ? _sessions.front () : *(it - 1);
+}
+
+std::string DatasetReader::FramePath ( RS::StreamType stream, int frame )
+{
+  return (fs::path ( _folder ) / EF::FramePath ( _layout, stream, frame, FrameSession ( frame ).extensions[stream].c_str (), _level )).string ();
+}
+
+const IndexHeader& DatasetReader::SessionCalibration ( int index )
+{
+  if (_sessions.empty () || index < 0 || index >= (int)_frames.size ())
+    return _header;
+
+  return FrameSession ( _frames[index] ).calibration;
+}
+
+std::vector<int> DatasetReader::SessionStarts ()
+{
+  std::vector<int> starts;
+
+  for (size_t i = 0; i < _frames.size (); i++)
+  {
+    if (i == 0 || (i < _records.size () && (_records[i].flags & kIndexSessionStart)))
+      starts.push_back ( (int)i );
+  }
+
+  return starts;
+}
+
+bool DatasetReader::ReadFrame ( int index, DatasetFrame& frame )
+{
+  if (!_read_mutex)
+    return false;
+
+  std::lock_guard<std::mutex> guard ( *_read_mutex );
+
+  return DecodeFrame ( index, frame, *_read_state );
+}
+
+bool DatasetReader::DecodeStream ( RS::StreamType stream, int frame, FrameImage& image, DecodeState& state )
+{
+  auto path = FramePath ( stream, frame );
+  auto& codec = state.codecs[stream];
+
+  // one codec per stream and thread so zstd and jpeg keep their contexts, until a session saved the stream with another
+  if (!codec || FrameSession ( frame ).extensions[stream] != codec->Extension ())
+    codec.reset ( CreateCodecForFile ( path ) );
+
+  if (codec && codec->IsTemporal () && state.shared)
+  {
+    std::lock_guard<std::mutex> guard ( *state.sharedMutex );
+    return DecodeStream ( stream, frame, image, *state.shared );
+  }
+
+  auto& recent = state.recent[stream];
+  auto cached = recent.find ( frame );
+  if (cached != recent.end ())
+  {
+    image = cached->second;
+    return true;
+  }
+
+  MappedFile file;
+  if (!codec || !file.Open ( path ))
+    return false;
+
+  if (!codec->IsTemporal ())
+    return codec->Decode ( file.Data (), file.Size (), image );
+
+  int distance = codec->KeyframeDistance ( file.Data (), file.Size () );
+
+  // the latest frame decoded before this one is the closest start, workers claim frames in order but finish them in any
+  auto closest = recent.lower_bound ( frame );
+  if (distance > 0 && closest != recent.begin () && (--closest)->first >= frame - distance && closest->first != state.lastFrame[stream])
+  {
+    state.last[stream] = closest->second;
+    state.lastFrame[stream] = closest->first;
+  }
+
+  if (distance > 0 && state.lastFrame[stream] != frame - 1)
+  {
+    // walk forward from the keyframe, or from the frame held when it lies in between
+    int held = state.lastFrame[stream];
+    int start = held >= frame - distance && held < frame ? held + 1 : frame - distance;
+
+    for (int f = start; f < frame; f++)
+    {
+      FrameImage previous;
+      if (!DecodeStream ( stream, f, previous, state ))
+      {
+        state.lastFrame[stream] = -1;
+        return false;
+      }
+    }
+  }
+
+  if (!codec->DecodeDelta ( file.Data (), file.Size (), distance > 0 ? &state.last[stream] : nullptr, image ))
+  {
+    state.lastFrame[stream] = -1;
+    return false;
+  }
+
+  state.last[stream] = image;
+  state.lastFrame[stream] = frame;
+
+  if (state.keep > 0)
+  {
+    recent[frame] = image;
+    while (recent.size () > state.keep)
+      recent.erase ( recent.begin () );
+  }
+
+  return true;
+}
+
+bool DatasetReader::DecodeFrame ( int index, DatasetFrame& frame, DecodeState& state )
+{
+  if (index < 0 || index >= (int)_frames.size ())
+    return false;
+
+  frame.index = index;
+  frame.frame = _frames[index];
+
+  if (_has_index)
+    frame.record = _records[index];
+  else
+    memset ( &frame.record, 0, sizeof ( frame.record ) );
+
+  bool ret = true;
+
+  for (int i = 0; i < RS::StreamCount; i++)
+  {
+    auto stream = (RS::StreamType)i;
+    auto& image = frame.images[i];
+
+    image.width = 0;
+    image.height = 0;
+    image.data.clear ();
+
+    const std::string& extension = FrameSession ( frame.frame ).extensions[i];
+    if (extension.empty ())
+      continue;
+
+    bool decoded = false;
+
+    if (extension == ".mkv")
+    {
+      std::lock_guard<std::mutex> guard ( *_video_mutex );
+
+      decoded = _video->ReadFrame ( frame.frame, image );
+    }
+    else
+    {
+      decoded = DecodeStream ( stream, frame.frame, image, state );
+    }
+
+    if (!decoded)
+    {
+      DebugOut ( "DatasetReader failed to decode %s of frame %d", StreamFolder ( stream ), frame.frame );
+      image.data.clear ();
+      ret = false;
+    }
+  }
+
+  return ret;
+}
+
+void DatasetReader::StartPrefetch ( const std::vector<int>& order, int threads, int depth )
+{
+  StopPrefetch ();
+
+  _order = order;
+  if (_order.empty ())
+  {
+    _order.resize ( _frames.size () );
+    for (size_t i = 0; i < _order.size (); i++)
+      _order[i] = (int)i;
+  }
+
+  if (threads <= 0)
+    threads = (int)std::thread::hardware_concurrency ();
+
+  _depth = std::max ( 1, depth );
+  _next_decode = 0;
+  _next_read = 0;
+  _stopping = false;
+
+  _mutex = new std::mutex ();
+  _cv = new std::condition_variable ();
+
+  // a worker is at most one claim per other worker behind the newest frame decoded, a single worker keeps its own chain
+  if (threads > 1)
+  {
+    _chain_state = new DecodeState ();
+    _chain_state->keep = 2 * threads;
+    _chain_mutex = new std::mutex ();
+  }
+
+  for (int i = 0; i < std::max ( 1, threads ); i++)
+  {
+    _workers.push_back ( new std::thread ( [&]()
+    {
+      WorkerRun ();
+    } ) );
+  }
+}
+
+void DatasetReader::WorkerRun ()
+{
+  DecodeState state;
+  state.shared = _chain_state;
+  state.sharedMutex = _chain_mutex;
+
+  for (;;)
+  {
+    int position;
+
+    {
+      std::unique_lock<std::mutex> lock ( *_mutex );
+
+      // stay at most depth frames ahead of the consumer
+      _cv->wait ( lock, [&] { return _stopping || _next_decode >= (int)_order.size () || _next_decode < _next_read + _depth; } );
+
+      if (_stopping || _next_decode >= (int)_order.size ())
+        return;
+
+      position = _next_decode++;
+    }
+
+    DatasetFrame frame;
+    DecodeFrame ( _order[position], frame, state );
+
+    {
+      std::lock_guard<std::mutex> guard ( *_mutex );
+
+      _ready[position] = std::move ( frame );
+    }
+
+    _cv->notify_all ();
+  }
+}
+
+bool DatasetReader::Next ( DatasetFrame& frame )
+{
+  if (!_mutex)
+    return false;
+
+  {
+    std::unique_lock<std::mutex> lock ( *_mutex );
+
+    if (_next_read >= (int)_order.size ())
+      return false;
+
+    _cv->wait ( lock, [&] { return _stopping || _ready.count ( _next_read ) > 0; } );
+
+    if (_stopping)
+      return false;
+
+    auto it = _ready.find ( _next_read );
+    frame = std::move ( it->second );
+    _ready.erase ( it );
+
+    _next_read++;
+  }
+
+  // a slot is free again
+  _cv->notify_all ();
+
+  return true;
+}
+
+int DatasetReader::PrefetchRemaining ()
+{
+  if (!_mutex)
+    return 0;
+
+  std::lock_guard<std::mutex> guard ( *_mutex );
+  return (int)_order.size () - _next_read;
+}
+
+void DatasetReader::StopPrefetch ()
+{
+  if (_mutex)
+  {
+    {
+      std::lock_guard<std::mutex> guard ( *_mutex );
+      _stopping = true;
+    }
+
+    _cv->notify_all ();
+  }
+
+  for (auto worker : _workers)
+  {
+    worker->join ();
+    delete worker;
+  }
+
+  _workers.clear ();
+  _ready.clear ();
+  _order.clear ();
+
+  DEL ( _cv );
+  DEL ( _mutex );
+  DEL ( _chain_state );
+  DEL ( _chain_mutex );
+}
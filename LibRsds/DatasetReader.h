@@ -0,0 +1,127 @@
+#pragma once
+
+#include "FrameCodec.h"
+#include "FrameIndex.h"
+#include "VideoSink.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace std
+{
+  class thread;
+  class mutex;
+  class condition_variable;
+}
+
+namespace EF
+{
+  struct DatasetFrame
+  {
+    int index;                             // position in the dataset
+    int frame;                             // capture frame number, the one in the file names
+    IndexRecord record;                    // zeroed for captures without an index
+    FrameImage images[RS::StreamCount];    // empty for streams the capture does not have, depth is native (little endian)
+  };
+
+  // Reads a capture folder back: frame list and calibration from index.bin (older captures
+  // without one are listed from the folders), frames decoded from memory mapped files.
+  // Next () serves frames in a given order through a bounded queue that a pool of threads
+  // keeps decoded ahead of the consumer.
+  class DatasetReader
+  {
+  public:
+    DatasetReader ();
+    ~DatasetReader ();
+
+    // level > 0 reads a pyramid level's files instead, for captures whose index records it. Streams
+    // without level files (color saved as video) are left out, the calibration is of level 0.
+    bool Open ( const std::string& folder, int level = 0 );
+    void Close ();
+
+    int FrameCount () { return (int)_frames.size (); }
+    bool HasCalibration () { return _has_index; }
+    // of the first session
+    const IndexHeader& Calibration () { return _header; }
+    // codecs and calibration the frame at index was saved with, appended sessions may differ from the first
+    const IndexHeader& SessionCalibration ( int index );
+    // true when any session saved the stream
+    bool HasStream ( RS::StreamType stream ) { return !_extensions[stream].empty (); }
+    // dataset positions where an appended capture session starts, always holds 0 for a non empty dataset
+    std::vector<int> SessionStarts ();
+
+    // random access, decoded on the calling thread. Temporal codecs decode forward from the
+    // keyframe before the frame, or from the last frame read when that is closer.
+    bool ReadFrame ( int index, DatasetFrame& frame );
+
+    // order holds dataset positions in the order Next returns them, empty reads all of them in order.
+    // threads 0 picks one per core, depth is how many frames may be decoded ahead of Next.
+    void StartPrefetch ( const std::vector<int>& order = std::vector<int> (), int threads = 0, int depth = 8 );
+    // false once the order is exhausted, streams that failed to decode come back empty
+    bool Next ( DatasetFrame& frame );
+    void StopPrefetch ();
+    // frames Next has yet to return, 0 without a prefetch
+    int PrefetchRemaining ();
+
+  private:
+    // one per decoding thread, codecs keep their contexts and temporal streams their last decoded frame
+    struct DecodeState
+    {
+      DecodeState ();
+      std::unique_ptr<FrameCodec> codecs[RS::StreamCount];
+      int lastFrame[RS::StreamCount];  // frame number held in last, -1 for none
+      FrameImage last[RS::StreamCount];
+      // prefetch workers decode temporal streams through one shared state under its mutex,
+      // so a delta chain is walked once for all of them instead of once per worker
+      DecodeState* shared;
+      std::mutex* sharedMutex;
+      // frames the shared state decoded lately, a worker that fell behind finds its frame or a closer start here
+      std::map<int, FrameImage> recent[RS::StreamCount];
+      size_t keep;
+    };
+
+    struct Session
+    {
+      int firstFrame;
+      IndexHeader calibration;
+      std::string extensions[RS::StreamCount];  // empty for streams the session has no files of at the level read
+    };
+
+    std::string _folder;
+    bool _has_index;
+    IndexHeader _header;
+    std::vector<IndexRecord> _records;
+    std::vector<int> _frames;
+    std::vector<Session> _sessions;
+    std::string _extensions[RS::StreamCount];  // of the first session that has the stream
+    FrameLayout _layout;
+    int _level;
+
+    DecodeState* _read_state;  // ReadFrame's
+    std::mutex* _read_mutex;
+
+    // the color video decodes sequentially, workers take turns on it
+    VideoReader* _video;
+    std::mutex* _video_mutex;
+
+    std::vector<std::thread*> _workers;
+    DecodeState* _chain_state;
+    std::mutex* _chain_mutex;
+    std::mutex* _mutex;
+    std::condition_variable* _cv;
+    std::vector<int> _order;
+    std::map<int, DatasetFrame> _ready;
+    int _depth;
+    int _next_decode;
+    int _next_read;
+    bool _stopping;
+
+    const Session& FrameSession ( int frame );
+    std::string FramePath ( RS::StreamType stream, int frame );
+    bool DecodeFrame ( int index, DatasetFrame& frame, DecodeState& state );
+    bool DecodeStream ( RS::StreamType stream, int frame, FrameImage& image, DecodeState& state );
+    void WorkerRun ();
+  };
+}
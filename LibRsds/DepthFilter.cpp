@@ -0,0 +1,638 @@
+#define NOMINMAX
+#include "DepthFilter.h"
+#include "Helpers.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <emmintrin.h>
+
+using namespace RS;
+
+namespace
+{
+  // rows per band, small enough to balance the threads and large enough to keep a band in cache
+  const int kBandRows = 16;
+
+  inline int to_q15 ( float weight )
+  {
+    return (int)(std::min ( std::max ( weight, 0.0f ), 1.0f ) * 32767.0f + 0.5f);
+  }
+
+  // cur moved towards prev by alpha when both have depth and are closer than delta, otherwise cur.
+  // (diff * 2 * alpha) >> 16 is what _mm_mulhi_epi16 computes, so the scalar and SSE2 paths agree.
+  inline uint16_t blend ( uint16_t cur, uint16_t prev, int alpha, int delta )
+  {
+    if (!cur || !prev)
+      return cur;
+
+    int diff = (int)prev - (int)cur;
+    if (std::abs ( diff ) >= delta)
+      return cur;
+
+    return (uint16_t)(cur + ((diff * 2 * alpha) >> 16));
+  }
+
+  inline __m128i blend8 ( __m128i cur, __m128i prev, __m128i alpha, __m128i delta )
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+
+    __m128i hole = _mm_or_si128 ( _mm_cmpeq_epi16 ( cur, zero ), _mm_cmpeq_epi16 ( prev, zero ) );
+    __m128i absdiff = _mm_or_si128 ( _mm_subs_epu16 ( cur, prev ), _mm_subs_epu16 ( prev, cur ) );
+    // delta holds delta - 1, so this is absdiff < delta
+    __m128i close = _mm_cmpeq_epi16 ( _mm_subs_epu16 ( absdiff, delta ), zero );
+    __m128i mask = _mm_andnot_si128 ( hole, close );
+
+    // differences that overflow 16 bits are never close
+    __m128i diff = _mm_sub_epi16 ( prev, cur );
+    __m128i blended = _mm_add_epi16 ( cur, _mm_mulhi_epi16 ( _mm_add_epi16 ( diff, diff ), alpha ) );
+
+    return _mm_or_si128 ( _mm_and_si128 ( mask, blended ), _mm_andnot_si128 ( mask, cur ) );
+  }
+
+  // unsigned 16 bit min and max, SSE2 only has the signed ones
+  inline __m128i min_epu16 ( __m128i a, __m128i b )
+  {
+    const __m128i bias = _mm_set1_epi16 ( (short)0x8000 );
+    return _mm_xor_si128 ( _mm_min_epi16 ( _mm_xor_si128 ( a, bias ), _mm_xor_si128 ( b, bias ) ), bias );
+  }
+
+  inline __m128i max_epu16 ( __m128i a, __m128i b )
+  {
+    const __m128i bias = _mm_set1_epi16 ( (short)0x8000 );
+    return _mm_xor_si128 ( _mm_max_epi16 ( _mm_xor_si128 ( a, bias ), _mm_xor_si128 ( b, bias ) ), bias );
+  }
+
+  // with holes turned into 65535 by subtracting one the minimum skips them, adding one turns them back
+  inline __m128i nearest8 ( __m128i a, __m128i b, __m128i c, __m128i d )
+  {
+    const __m128i one = _mm_set1_epi16 ( 1 );
+    __m128i m = min_epu16 ( min_epu16 ( _mm_sub_epi16 ( a, one ), _mm_sub_epi16 ( b, one ) ),
+                            min_epu16 ( _mm_sub_epi16 ( c, one ), _mm_sub_epi16 ( d, one ) ) );
+    return _mm_add_epi16 ( m, one );
+  }
+
+  // the four pixels of eight 2 x 2 blocks from two rows of sixteen, biased to signed (0 becomes -32768)
+  inline void split2x2 ( const uint16_t* row0, const uint16_t* row1, __m128i& a, __m128i& b, __m128i& c, __m128i& d )
+  {
+    const __m128i bias = _mm_set1_epi16 ( (short)0x8000 );
+
+    __m128i r0a = _mm_xor_si128 ( _mm_loadu_si128 ( (const __m128i*)row0 ), bias );
+    __m128i r0b = _mm_xor_si128 ( _mm_loadu_si128 ( (const __m128i*)(row0 + 8) ), bias );
+    __m128i r1a = _mm_xor_si128 ( _mm_loadu_si128 ( (const __m128i*)row1 ), bias );
+    __m128i r1b = _mm_xor_si128 ( _mm_loadu_si128 ( (const __m128i*)(row1 + 8) ), bias );
+
+    // biased values are signed, so the even and odd pixels split apart with sign extending shifts
+    a = _mm_packs_epi32 ( _mm_srai_epi32 ( _mm_slli_epi32 ( r0a, 16 ), 16 ), _mm_srai_epi32 ( _mm_slli_epi32 ( r0b, 16 ), 16 ) );
+    b = _mm_packs_epi32 ( _mm_srai_epi32 ( r0a, 16 ), _mm_srai_epi32 ( r0b, 16 ) );
+    c = _mm_packs_epi32 ( _mm_srai_epi32 ( _mm_slli_epi32 ( r1a, 16 ), 16 ), _mm_srai_epi32 ( _mm_slli_epi32 ( r1b, 16 ), 16 ) );
+    d = _mm_packs_epi32 ( _mm_srai_epi32 ( r1a, 16 ), _mm_srai_epi32 ( r1b, 16 ) );
+  }
+
+  // eight 2 x 2 blocks from two rows of sixteen pixels. Sorted, the holes come first, so with at
+  // least three pixels with depth the median is the third value and with fewer it is the largest.
+  inline __m128i median2x2 ( const uint16_t* row0, const uint16_t* row1 )
+  {
+    const __m128i bias = _mm_set1_epi16 ( (short)0x8000 );
+
+    __m128i a, b, c, d;
+    split2x2 ( row0, row1, a, b, c, d );
+
+    // sorting network for four
+    __m128i t;
+    t = _mm_min_epi16 ( a, b ); b = _mm_max_epi16 ( a, b ); a = t;
+    t = _mm_min_epi16 ( c, d ); d = _mm_max_epi16 ( c, d ); c = t;
+    t = _mm_min_epi16 ( a, c ); c = _mm_max_epi16 ( a, c ); a = t;
+    t = _mm_min_epi16 ( b, d ); d = _mm_max_epi16 ( b, d ); b = t;
+    t = _mm_min_epi16 ( b, c ); c = _mm_max_epi16 ( b, c ); b = t;
+
+    __m128i few = _mm_cmpeq_epi16 ( b, bias );
+    return _mm_xor_si128 ( _mm_or_si128 ( _mm_and_si128 ( few, d ), _mm_andnot_si128 ( few, c ) ), bias );
+  }
+
+  // the nearest of each block's pixels with depth, a hole only when all four are. Biased minus one
+  // a hole wraps around to the largest value, like nearest8.
+  inline __m128i nearest2x2 ( const uint16_t* row0, const uint16_t* row1 )
+  {
+    const __m128i bias = _mm_set1_epi16 ( (short)0x8000 );
+    const __m128i one = _mm_set1_epi16 ( 1 );
+
+    __m128i a, b, c, d;
+    split2x2 ( row0, row1, a, b, c, d );
+
+    __m128i m = _mm_min_epi16 ( _mm_min_epi16 ( _mm_sub_epi16 ( a, one ), _mm_sub_epi16 ( b, one ) ),
+                                _mm_min_epi16 ( _mm_sub_epi16 ( c, one ), _mm_sub_epi16 ( d, one ) ) );
+    return _mm_xor_si128 ( _mm_add_epi16 ( m, one ), bias );
+  }
+
+  inline uint16_t nearest ( uint16_t a, uint16_t b, uint16_t c, uint16_t d )
+  {
+    return (uint16_t)(std::min ( std::min ( (uint16_t)(a - 1), (uint16_t)(b - 1) ), std::min ( (uint16_t)(c - 1), (uint16_t)(d - 1) ) ) + 1);
+  }
+
+  inline uint16_t farthest ( uint16_t a, uint16_t b, uint16_t c, uint16_t d )
+  {
+    return std::max ( std::max ( a, b ), std::max ( c, d ) );
+  }
+}
+
+DepthFilter::DepthFilter ()
+  : _pool ( nullptr )
+  , _history_width ( 0 )
+  , _history_height ( 0 )
+{
+  Configure ( _settings );
+}
+
+DepthFilter::~DepthFilter ()
+{
+  DEL ( _pool );
+}
+
+void DepthFilter::Configure ( const DepthFilterSettings& settings )
+{
+  int threads = _pool ? _pool->Threads () : 0;
+
+  _settings = settings;
+  _settings.decimation = std::min ( std::max ( settings.decimation, 1 ), 8 );
+  _settings.spatialDelta = std::min ( std::max ( settings.spatialDelta, 1 ), 16383 );
+  _settings.spatialIterations = std::min ( std::max ( settings.spatialIterations, 1 ), 5 );
+  _settings.temporalDelta = std::min ( std::max ( settings.temporalDelta, 1 ), 16383 );
+  _settings.temporalPersistence = std::min ( std::max ( settings.temporalPersistence, 0 ), 254 );
+  _settings.threads = settings.threads > 0 ? settings.threads : std::max ( 1, (int)std::thread::hardware_concurrency () );
+
+  // the workers start with the first frame, a filter that is never used costs no threads
+  if (threads != _settings.threads)
+  {
+    DEL ( _pool );
+  }
+
+  ResetHistory ();
+}
+
+void DepthFilter::ResetHistory ()
+{
+  _history_width = 0;
+  _history_height = 0;
+}
+
+template<typename Fn>
+void DepthFilter::ParallelFor ( int count, Fn fn )
+{
+  if (!_pool)
+    _pool = new WorkerPool ( _settings.threads );
+
+  _pool->For ( count, fn );
+}
+
+int DepthFilter::Bands ( int rows )
+{
+  return (rows + kBandRows - 1) / kBandRows;
+}
+
+void DepthFilter::Process ( uint16_t* depth, int width, int height )
+{
+  if (_settings.decimation > 1)
+  {
+    Decimate ( depth, width, height );
+    width = OutputWidth ( width );
+    height = OutputHeight ( height );
+  }
+
+  if (_settings.spatial)
+    Spatial ( depth, width, height );
+
+  if (_settings.temporal)
+    Temporal ( depth, width, height );
+
+  if (_settings.holeFill != HoleFill::None)
+    FillHoles ( depth, width, height );
+}
+
+void DepthFilter::Decimate ( uint16_t* depth, int width, int height )
+{
+  int f = _settings.decimation;
+  int outWidth = width / f;
+  int outHeight = height / f;
+
+  if (f <= 1 || outWidth == 0 || outHeight == 0)
+    return;
+
+  _scratch.resize ( (size_t)outWidth * outHeight );
+  uint16_t* out = _scratch.data ();
+
+  ParallelFor ( Bands ( outHeight ), [&]( int band )
+  {
+    uint16_t values[64];
+    int end = std::min ( (band + 1) * kBandRows, outHeight );
+
+    for (int oy = band * kBandRows; oy < end; oy++)
+    {
+      int ox = 0;
+
+      if (f == 2)
+      {
+        const uint16_t* row0 = depth + (size_t)oy * 2 * width;
+        const uint16_t* row1 = row0 + width;
+
+        for (; ox + 8 <= outWidth; ox += 8)
+          _mm_storeu_si128 ( (__m128i*)(out + (size_t)oy * outWidth + ox), median2x2 ( row0 + ox * 2, row1 + ox * 2 ) );
+      }
+
+      for (; ox < outWidth; ox++)
+      {
+        int n = 0;
+        for (int y = 0; y < f; y++)
+        {
+          const uint16_t* row = depth + (size_t)(oy * f + y) * width + ox * f;
+          for (int x = 0; x < f; x++)
+          {
+            if (row[x])
+              values[n++] = row[x];
+          }
+        }
+
+        // a block is a hole only when all of it is, otherwise the median of its pixels with depth
+        // for blocks up to 3 x 3 and their mean above that like librealsense does
+        uint16_t value = 0;
+        if (n > 0 && f <= 3)
+        {
+          for (int i = 1; i < n; i++)
+          {
+            uint16_t v = values[i];
+            int j = i;
+            for (; j > 0 && values[j - 1] > v; j--)
+              values[j] = values[j - 1];
+            values[j] = v;
+          }
+          value = values[n / 2];
+        }
+        else if (n > 0)
+        {
+          int sum = 0;
+          for (int i = 0; i < n; i++)
+            sum += values[i];
+          value = (uint16_t)((sum + n / 2) / n);
+        }
+
+        out[(size_t)oy * outWidth + ox] = value;
+      }
+    }
+  } );
+
+  memcpy ( depth, out, (size_t)outWidth * outHeight * sizeof ( uint16_t ) );
+}
+
+void DepthFilter::Halve ( const uint16_t* depth, int width, int height, uint16_t* out, bool nearestDepth )
+{
+  int outWidth = width / 2;
+  int outHeight = height / 2;
+
+  for (int oy = 0; oy < outHeight; oy++)
+  {
+    const uint16_t* row0 = depth + (size_t)oy * 2 * width;
+    const uint16_t* row1 = row0 + width;
+    uint16_t* dst = out + (size_t)oy * outWidth;
+    int ox = 0;
+
+    for (; ox + 8 <= outWidth; ox += 8)
+      _mm_storeu_si128 ( (__m128i*)(dst + ox), nearestDepth ? nearest2x2 ( row0 + ox * 2, row1 + ox * 2 ) : median2x2 ( row0 + ox * 2, row1 + ox * 2 ) );
+
+    for (; ox < outWidth; ox++)
+    {
+      uint16_t a = row0[ox * 2], b = row0[ox * 2 + 1], c = row1[ox * 2], d = row1[ox * 2 + 1];
+
+      if (nearestDepth)
+      {
+        dst[ox] = nearest ( a, b, c, d );
+        continue;
+      }
+
+      // median2x2's pick: the third of the sorted four, the largest with fewer than three holes filled
+      uint16_t v[4] = { a, b, c, d };
+      std::sort ( v, v + 4 );
+      dst[ox] = v[1] ? v[2] : v[3];
+    }
+  }
+}
+
+void DepthFilter::Spatial ( uint16_t* depth, int width, int height )
+{
+  int alpha = to_q15 ( _settings.spatialAlpha );
+  int delta = _settings.spatialDelta;
+
+  // the recursion along a row has to visit its pixels one after another, down a column eight
+  // neighbouring columns take the same steps, so rows are smoothed as the columns of the transposed frame
+  _scratch.resize ( (size_t)width * height );
+  uint16_t* transposed = _scratch.data ();
+
+  for (int iteration = 0; iteration < _settings.spatialIterations; iteration++)
+  {
+    Transpose ( depth, width, height, transposed );
+    SmoothColumns ( transposed, height, width, alpha, delta );
+    Transpose ( transposed, height, width, depth );
+    SmoothColumns ( depth, width, height, alpha, delta );
+  }
+}
+
+void DepthFilter::SmoothColumns ( uint16_t* depth, int width, int height, int alpha, int delta )
+{
+  __m128i alpha8 = _mm_set1_epi16 ( (short)alpha );
+  __m128i delta8 = _mm_set1_epi16 ( (short)(delta - 1) );
+
+  // strips of whole cache lines, a few per thread
+  int vectors = width / 8;
+  int stripVectors = std::max ( 4, ((vectors + _settings.threads * 4 - 1) / (_settings.threads * 4) + 3) / 4 * 4 );
+  int strips = (vectors + stripVectors - 1) / stripVectors;
+
+  ParallelFor ( strips + 1, [&]( int strip )
+  {
+    // the columns past the last whole vector
+    if (strip == strips)
+    {
+      for (int x = vectors * 8; x < width; x++)
+      {
+        for (int y = 1; y < height; y++)
+          depth[(size_t)y * width + x] = blend ( depth[(size_t)y * width + x], depth[(size_t)(y - 1) * width + x], alpha, delta );
+
+        for (int y = height - 2; y >= 0; y--)
+          depth[(size_t)y * width + x] = blend ( depth[(size_t)y * width + x], depth[(size_t)(y + 1) * width + x], alpha, delta );
+      }
+      return;
+    }
+
+    int end = std::min ( (strip + 1) * stripVectors, vectors );
+
+    // four vectors cover a cache line of every row and keep four independent recursions in flight
+    for (int v = strip * stripVectors; v < end; v += 4)
+    {
+      int n = std::min ( 4, end - v );
+      uint16_t* column = depth + v * 8;
+
+      __m128i prev[4];
+      for (int k = 0; k < n; k++)
+        prev[k] = _mm_loadu_si128 ( (const __m128i*)(column + k * 8) );
+
+      for (int y = 1; y < height; y++)
+      {
+        __m128i* p = (__m128i*)(column + (size_t)y * width);
+        for (int k = 0; k < n; k++)
+        {
+          prev[k] = blend8 ( _mm_loadu_si128 ( p + k ), prev[k], alpha8, delta8 );
+          _mm_storeu_si128 ( p + k, prev[k] );
+        }
+      }
+
+      for (int y = height - 2; y >= 0; y--)
+      {
+        __m128i* p = (__m128i*)(column + (size_t)y * width);
+        for (int k = 0; k < n; k++)
+        {
+          prev[k] = blend8 ( _mm_loadu_si128 ( p + k ), prev[k], alpha8, delta8 );
+          _mm_storeu_si128 ( p + k, prev[k] );
+        }
+      }
+    }
+  } );
+}
+
+void DepthFilter::Transpose ( const uint16_t* src, int width, int height, uint16_t* dst )
+{
+  int blockRows = height / 8;
+
+  ParallelFor ( blockRows + 1, [&]( int block )
+  {
+    // the rows past the last whole block
+    if (block == blockRows)
+    {
+      for (int y = blockRows * 8; y < height; y++)
+      {
+        for (int x = 0; x < width; x++)
+          dst[(size_t)x * height + y] = src[(size_t)y * width + x];
+      }
+      return;
+    }
+
+    int y = block * 8;
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8)
+    {
+      const uint16_t* s = src + (size_t)y * width + x;
+
+      __m128i r0 = _mm_loadu_si128 ( (const __m128i*)(s) );
+      __m128i r1 = _mm_loadu_si128 ( (const __m128i*)(s + width) );
+      __m128i r2 = _mm_loadu_si128 ( (const __m128i*)(s + 2 * (size_t)width) );
+      __m128i r3 = _mm_loadu_si128 ( (const __m128i*)(s + 3 * (size_t)width) );
+      __m128i r4 = _mm_loadu_si128 ( (const __m128i*)(s + 4 * (size_t)width) );
+      __m128i r5 = _mm_loadu_si128 ( (const __m128i*)(s + 5 * (size_t)width) );
+      __m128i r6 = _mm_loadu_si128 ( (const __m128i*)(s + 6 * (size_t)width) );
+      __m128i r7 = _mm_loadu_si128 ( (const __m128i*)(s + 7 * (size_t)width) );
+
+      __m128i a0 = _mm_unpacklo_epi16 ( r0, r1 );
+      __m128i a1 = _mm_unpackhi_epi16 ( r0, r1 );
+      __m128i a2 = _mm_unpacklo_epi16 ( r2, r3 );
+      __m128i a3 = _mm_unpackhi_epi16 ( r2, r3 );
+      __m128i a4 = _mm_unpacklo_epi16 ( r4, r5 );
+      __m128i a5 = _mm_unpackhi_epi16 ( r4, r5 );
+      __m128i a6 = _mm_unpacklo_epi16 ( r6, r7 );
+      __m128i a7 = _mm_unpackhi_epi16 ( r6, r7 );
+
+      __m128i b0 = _mm_unpacklo_epi32 ( a0, a2 );
+      __m128i b1 = _mm_unpackhi_epi32 ( a0, a2 );
+      __m128i b2 = _mm_unpacklo_epi32 ( a1, a3 );
+      __m128i b3 = _mm_unpackhi_epi32 ( a1, a3 );
+      __m128i b4 = _mm_unpacklo_epi32 ( a4, a6 );
+      __m128i b5 = _mm_unpackhi_epi32 ( a4, a6 );
+      __m128i b6 = _mm_unpacklo_epi32 ( a5, a7 );
+      __m128i b7 = _mm_unpackhi_epi32 ( a5, a7 );
+
+      uint16_t* d = dst + (size_t)x * height + y;
+
+      _mm_storeu_si128 ( (__m128i*)(d), _mm_unpacklo_epi64 ( b0, b4 ) );
+      _mm_storeu_si128 ( (__m128i*)(d + height), _mm_unpackhi_epi64 ( b0, b4 ) );
+      _mm_storeu_si128 ( (__m128i*)(d + 2 * (size_t)height), _mm_unpacklo_epi64 ( b1, b5 ) );
+      _mm_storeu_si128 ( (__m128i*)(d + 3 * (size_t)height), _mm_unpackhi_epi64 ( b1, b5 ) );
+      _mm_storeu_si128 ( (__m128i*)(d + 4 * (size_t)height), _mm_unpacklo_epi64 ( b2, b6 ) );
+      _mm_storeu_si128 ( (__m128i*)(d + 5 * (size_t)height), _mm_unpackhi_epi64 ( b2, b6 ) );
+      _mm_storeu_si128 ( (__m128i*)(d + 6 * (size_t)height), _mm_unpacklo_epi64 ( b3, b7 ) );
+      _mm_storeu_si128 ( (__m128i*)(d + 7 * (size_t)height), _mm_unpackhi_epi64 ( b3, b7 ) );
+    }
+
+    for (; x < width; x++)
+    {
+      for (int k = 0; k < 8; k++)
+        dst[(size_t)x * height + y + k] = src[(size_t)(y + k) * width + x];
+    }
+  } );
+}
+
+void DepthFilter::Temporal ( uint16_t* depth, int width, int height )
+{
+  size_t pixels = (size_t)width * height;
+
+  // a new size or the first frame starts the history over
+  if (_history_width != width || _history_height != height)
+  {
+    _previous.assign ( depth, depth + pixels );
+    _age.assign ( pixels, 0 );
+    _history_width = width;
+    _history_height = height;
+    return;
+  }
+
+  int alpha = to_q15 ( _settings.temporalAlpha );
+  int delta = _settings.temporalDelta;
+  int persistence = _settings.temporalPersistence;
+
+  __m128i alpha8 = _mm_set1_epi16 ( (short)alpha );
+  __m128i delta8 = _mm_set1_epi16 ( (short)(delta - 1) );
+  __m128i keep8 = _mm_set1_epi16 ( (short)(persistence + 1) );
+
+  uint16_t* previous = _previous.data ();
+  uint8_t* age = _age.data ();
+
+  ParallelFor ( Bands ( height ), [&]( int band )
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i one = _mm_set1_epi8 ( 1 );
+
+    size_t begin = (size_t)band * kBandRows * width;
+    size_t end = std::min ( (size_t)(band + 1) * kBandRows, (size_t)height ) * width;
+    size_t i = begin;
+
+    for (; i + 8 <= end; i += 8)
+    {
+      __m128i cur = _mm_loadu_si128 ( (const __m128i*)(depth + i) );
+      __m128i prev = _mm_loadu_si128 ( (const __m128i*)(previous + i) );
+      __m128i old = _mm_loadl_epi64 ( (const __m128i*)(age + i) );
+
+      __m128i valid = _mm_andnot_si128 ( _mm_cmpeq_epi16 ( cur, zero ), _mm_set1_epi16 ( -1 ) );
+
+      // the history moves towards the new value by alpha, unless either is a hole or they are too far apart
+      __m128i smoothed = blend8 ( prev, cur, alpha8, delta8 );
+      __m128i close = _mm_cmpeq_epi16 ( _mm_subs_epu16 ( _mm_or_si128 ( _mm_subs_epu16 ( cur, prev ), _mm_subs_epu16 ( prev, cur ) ), delta8 ), zero );
+      close = _mm_andnot_si128 ( _mm_cmpeq_epi16 ( prev, zero ), close );
+      __m128i seen = _mm_or_si128 ( _mm_and_si128 ( close, smoothed ), _mm_andnot_si128 ( close, cur ) );
+
+      // a hole counts up its age and shows the history while it is young enough
+      __m128i aged = _mm_andnot_si128 ( _mm_packs_epi16 ( valid, valid ), _mm_adds_epu8 ( old, one ) );
+      __m128i young = _mm_cmplt_epi16 ( _mm_unpacklo_epi8 ( aged, zero ), keep8 );
+      __m128i held = _mm_and_si128 ( young, prev );
+
+      __m128i out = _mm_or_si128 ( _mm_and_si128 ( valid, seen ), _mm_andnot_si128 ( valid, held ) );
+      __m128i history = _mm_or_si128 ( _mm_and_si128 ( valid, seen ), _mm_andnot_si128 ( valid, prev ) );
+
+      _mm_storeu_si128 ( (__m128i*)(depth + i), out );
+      _mm_storeu_si128 ( (__m128i*)(previous + i), history );
+      _mm_storel_epi64 ( (__m128i*)(age + i), aged );
+    }
+
+    for (; i < end; i++)
+    {
+      uint16_t cur = depth[i];
+      uint16_t prev = previous[i];
+
+      if (cur)
+      {
+        uint16_t seen = prev && std::abs ( (int)cur - (int)prev ) < delta ? blend ( prev, cur, alpha, delta ) : cur;
+        depth[i] = seen;
+        previous[i] = seen;
+        age[i] = 0;
+      }
+      else
+      {
+        age[i] = (uint8_t)std::min ( age[i] + 1, 255 );
+        depth[i] = age[i] <= persistence ? prev : 0;
+      }
+    }
+  } );
+}
+
+void DepthFilter::FillHoles ( uint16_t* depth, int width, int height )
+{
+  auto mode = _settings.holeFill;
+
+  if (mode == HoleFill::None)
+    return;
+
+  if (mode == HoleFill::FromLeft)
+  {
+    ParallelFor ( Bands ( height ), [&]( int band )
+    {
+      int end = std::min ( (band + 1) * kBandRows, height );
+
+      for (int y = band * kBandRows; y < end; y++)
+      {
+        uint16_t* row = depth + (size_t)y * width;
+        uint16_t last = 0;
+
+        for (int x = 0; x < width; x++)
+        {
+          if (row[x])
+            last = row[x];
+          else
+            row[x] = last;
+        }
+      }
+    } );
+    return;
+  }
+
+  // the neighbours come from the unfilled frame, so a hole only takes depth that was measured
+  size_t pixels = (size_t)width * height;
+  _scratch.resize ( pixels );
+  uint16_t* out = _scratch.data ();
+  bool closest = mode == HoleFill::Nearest;
+
+  ParallelFor ( Bands ( height ), [&]( int band )
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    int end = std::min ( (band + 1) * kBandRows, height );
+
+    for (int y = band * kBandRows; y < end; y++)
+    {
+      const uint16_t* row = depth + (size_t)y * width;
+      const uint16_t* up = y > 0 ? row - width : nullptr;
+      const uint16_t* down = y + 1 < height ? row + width : nullptr;
+      uint16_t* dst = out + (size_t)y * width;
+
+      auto fill = [&]( int x )
+      {
+        uint16_t a = x > 0 ? row[x - 1] : 0;
+        uint16_t b = x + 1 < width ? row[x + 1] : 0;
+        uint16_t c = up ? up[x] : 0;
+        uint16_t d = down ? down[x] : 0;
+        dst[x] = row[x] ? row[x] : closest ? nearest ( a, b, c, d ) : farthest ( a, b, c, d );
+      };
+
+      int x = 0;
+      fill ( x++ );
+
+      if (up && down)
+      {
+        for (; x + 9 <= width; x += 8)
+        {
+          __m128i cur = _mm_loadu_si128 ( (const __m128i*)(row + x) );
+          __m128i a = _mm_loadu_si128 ( (const __m128i*)(row + x - 1) );
+          __m128i b = _mm_loadu_si128 ( (const __m128i*)(row + x + 1) );
+          __m128i c = _mm_loadu_si128 ( (const __m128i*)(up + x) );
+          __m128i d = _mm_loadu_si128 ( (const __m128i*)(down + x) );
+
+          __m128i filled = closest ? nearest8 ( a, b, c, d ) : max_epu16 ( max_epu16 ( a, b ), max_epu16 ( c, d ) );
+          __m128i hole = _mm_cmpeq_epi16 ( cur, zero );
+
+          _mm_storeu_si128 ( (__m128i*)(dst + x), _mm_or_si128 ( _mm_and_si128 ( hole, filled ), cur ) );
+        }
+      }
+
+      for (; x < width; x++)
+        fill ( x );
+    }
+  } );
+
+  memcpy ( depth, out, pixels * sizeof ( uint16_t ) );
+}
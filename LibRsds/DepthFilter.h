@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+namespace RS
+{
+  // values are mirrored by RsDsController::HoleFill, keep them in step
+  enum class HoleFill : int
+  {
+    None,
+    FromLeft,  // the nearest valid pixel to the left on the same row
+    Farthest,  // the farthest of the four neighbours with depth
+    Nearest,   // the nearest of the four neighbours with depth
+  };
+
+  // every filter is off by default, depth is in sensor units and 0 is no depth
+  struct DepthFilterSettings
+  {
+    DepthFilterSettings ()
+      : decimation (1)
+      , spatial (false)
+      , spatialAlpha (0.5f)
+      , spatialDelta (20)
+      , spatialIterations (2)
+      , temporal (false)
+      , temporalAlpha (0.4f)
+      , temporalDelta (20)
+      , temporalPersistence (3)
+      , holeFill (HoleFill::None)
+      , threads (0)
+    {  }
+    int decimation;           // block size from 1 (off) to 8, a block becomes the median (mean above 3) of its pixels with depth
+    bool spatial;             // edge preserving smoothing along rows and columns
+    float spatialAlpha;       // weight of the neighbour, 0 to 1
+    int spatialDelta;         // neighbours further apart than this are across an edge and left alone
+    int spatialIterations;
+    bool temporal;            // exponential smoothing with the previous frames
+    float temporalAlpha;      // weight of the new frame, 0 to 1
+    int temporalDelta;        // larger changes are motion and replace the history
+    int temporalPersistence;  // frames a pixel that lost its depth keeps showing its last value, 0 is never
+    HoleFill holeFill;        // runs last
+    int threads;              // 0 picks one per core
+
+    bool IsEnabled () const { return decimation > 1 || spatial || temporal || holeFill != HoleFill::None; }
+  };
+
+  // SSE2 (every x64 CPU has it) and multithreaded versions of the librealsense decimation, spatial,
+  // temporal and hole filling filters. They run in place on the caller's Z16 buffer and keep their
+  // scratch and history buffers from frame to frame, so nothing is allocated once the size is known.
+  class DepthFilter
+  {
+  public:
+    DepthFilter ();
+    ~DepthFilter ();
+
+    void Configure (const DepthFilterSettings& settings);
+    const DepthFilterSettings& Settings () { return _settings; }
+    bool IsEnabled () { return _settings.IsEnabled (); }
+
+    int OutputWidth (int width) { return width / _settings.decimation; }
+    int OutputHeight (int height) { return height / _settings.decimation; }
+
+    // all enabled filters in order, after decimation the OutputWidth x OutputHeight result is at the start of depth
+    void Process (uint16_t* depth, int width, int height);
+
+    // single filters, Process runs these
+    void Decimate (uint16_t* depth, int width, int height);
+    void Spatial (uint16_t* depth, int width, int height);
+    void Temporal (uint16_t* depth, int width, int height);
+    void FillHoles (uint16_t* depth, int width, int height);
+    void ResetHistory ();
+
+    // 2 x 2 blocks of depth into the width / 2 x height / 2 out, the median of the pixels with depth
+    // like decimation by 2 or the nearest of them. Depth is never averaged with holes.
+    static void Halve (const uint16_t* depth, int width, int height, uint16_t* out, bool nearestDepth);
+
+  private:
+    DepthFilterSettings _settings;
+    WorkerPool* _pool;
+    std::vector<uint16_t> _scratch;
+    std::vector<uint16_t> _previous;  // temporal history
+    std::vector<uint8_t> _age;        // frames since each pixel last had depth
+    int _history_width;
+    int _history_height;
+
+    // runs fn (0) to fn (count - 1) on the pool and the calling thread
+    template<typename Fn>
+    void ParallelFor (int count, Fn fn);
+    int Bands (int rows);
+    void SmoothColumns (uint16_t* depth, int width, int height, int alpha, int delta);
+    void Transpose (const uint16_t* src, int width, int height, uint16_t* dst);
+  };
+}
@@ -1,21 +1,105 @@
 #include "EncodeFrames.h"
+#include "FrameIndex.h"
 #include "Helpers.h"
-#include "pngio.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <map>
 #include <mutex>
+#include <thread>
 
-using namespace common;
 using namespace EF;
 
 namespace fs = std::experimental::filesystem;
 
+namespace
+{
+  double steady_ms ()
+  {
+    return std::chrono::duration<double, std::milli> ( std::chrono::steady_clock::now ().time_since_epoch () ).count ();
+  }
+}
+
+const char* EF::StreamFolder ( StreamType stream )
+{
+  switch (stream)
+  {
+  case StreamColor:
+    return "rgb";
+  case StreamDepth:
+    return "depth";
+  case StreamInfraredLeft:
+    return "ir";
+  case StreamInfraredRight:
+    return "ir_right";
+  default:
+    return "";
+  }
+}
+
+std::string EF::LevelFolder ( StreamType stream, int level )
+{
+  if (level <= 0)
+    return StreamFolder ( stream );
+
+  return Format ( "%s_%d", StreamFolder ( stream ), 1 << level );
+}
+
+struct EF::EncodeTarget
+{
+  RealsenseController* realsense;
+  std::string path;
+  int firstFrame;  // the new session's first frame, starts the session in the index
+  int nextFrame;   // number of the next queued frame, guarded by the queue mutex
+  FrameLayout layout;  // the options' unless an appended capture already named its frames otherwise
+
+  std::atomic<int> shardsReady;  // shard folders below this one exist for every stream with files
+
+  // touched by the queueing thread only
+  bool temporal[StreamCount];
+  int keyframeInterval[StreamCount];
+  unsigned char* last[StreamCount];  // copy of the last queued image of temporal streams
+  int lastSize[StreamCount];
+  int sinceKeyframe[StreamCount];
+  std::atomic<bool> restart[StreamCount];  // an encoder lost a temporal frame, the next one queued is a keyframe
+
+  std::mutex mutex;  // guards everything below
+  int nextCommit;    // the index and the video wait for this frame
+  std::map<int, std::pair<EFrame, IndexRecord>> done;  // encoded ahead of nextCommit
+  FrameIndexWriter index;
+  VideoSink video;
+  std::atomic<bool> videoEnabled;  // also read by the encoders, off for good once the video fails
+  uint8_t indexCodecs[StreamCount];
+  bool chained[StreamCount];  // every temporal frame since the last keyframe was written
+  int saved;
+  long long bytes;
+};
+
+PixelFormat EF::StreamPixelFormat ( StreamType stream )
+{
+  switch (stream)
+  {
+  case StreamColor:
+    return PixelFormat::RGB8;
+  case StreamDepth:
+    return PixelFormat::Z16;
+  default:
+    return PixelFormat::Y8;
+  }
+}
+
 EncodeFrames::EncodeFrames ()
-  : _thread(nullptr)
-  , _mutex(nullptr)
-  , _realsense(nullptr)
+  : _mutex(nullptr)
+  , _queued(nullptr)
   , _is_thread_running(false)
   , _is_running (false)
+  , _pending(0)
+  , _shard_thread(nullptr)
+  , _shard_wake(nullptr)
+  , _shedder(new LoadShedder ())
 {
 }
 
@@ -23,25 +107,166 @@ EncodeFrames::EncodeFrames ()
 EncodeFrames::~EncodeFrames ()
 {
   Stop ();
+  DEL ( _shedder );
 }
 
-void EncodeFrames::Run ( RS::RealsenseController * realsense, std::string path ) try
+void EncodeFrames::Run ( RS::RealsenseController * realsense, std::string path, const EncodeOptions& options )
+{
+  // a single thread keeps the original one frame at a time behaviour
+  Run ( std::vector<RealsenseController*> { realsense }, std::vector<std::string> { path }, options, 1 );
+}
+
+void EncodeFrames::Run ( const std::vector<RealsenseController*>& realsense, const std::vector<std::string>& paths, const EncodeOptions& options, int threads ) try
 {
   Stop ();
 
-  _is_running = false;  
-  _path = path;
-  _realsense = realsense;
+  _is_running = false;
+  _options = options;
+  _pending = 0;
+
+  // six is the width captures always had, an int never needs more than ten
+  _options.layout.digits = std::min ( std::max ( options.layout.digits, 6 ), 10 );
+  _options.layout.framesPerShard = std::max ( options.layout.framesPerShard, 0 );
+
+  // a codec that can not take a stream's pixels would fail on every frame, png takes them all
+  CodecSettings* streamSettings[StreamCount] = { &_options.color, &_options.depth, &_options.infrared, &_options.infrared };
+  for (int i = 0; i < StreamCount; i++)
+  {
+    if (CodecSupports ( streamSettings[i]->codec, StreamPixelFormat ( (StreamType)i ) ))
+      continue;
+
+    DebugOut ( "EncodeFrames::Run %s can not encode %s, saving it as png", CodecExtension ( streamSettings[i]->codec ), StreamFolder ( (StreamType)i ) );
+    streamSettings[i]->codec = CodecType::Png;
+  }
 
   _mutex = new std::mutex ();
+  _queued = new std::condition_variable ();
+
+  for (size_t t = 0; t < realsense.size () && t < paths.size (); t++)
+  {
+    EncodeTarget* target = new EncodeTarget ();
+    target->realsense = realsense[t];
+    target->path = paths[t];
+    target->layout = _options.layout;
+    // reads the end of the index only, so appending to a large capture starts as fast as a new one.
+    // The new frames are named like the ones already there, whatever the options ask for.
+    target->firstFrame = _options.append ? NextFrameNumber ( target->path, &target->layout ) : 0;
+    target->nextFrame = target->firstFrame;
+    target->nextCommit = target->firstFrame;
+    target->shardsReady = target->layout.framesPerShard > 0 ? target->firstFrame / target->layout.framesPerShard : 0;
+
+    if (target->layout.digits != _options.layout.digits || target->layout.framesPerShard != _options.layout.framesPerShard)
+      DebugOut ( "EncodeFrames::Run %s keeps its %d digits and %d frames per shard", target->path.c_str (), target->layout.digits, target->layout.framesPerShard );
+    target->saved = 0;
+    target->bytes = 0;
+    target->videoEnabled = _options.video.enabled;
+
+    // the video can not be appended to, the new session's color goes to the rgb folder
+    if (target->videoEnabled && target->firstFrame > 0 && fs::exists ( fs::path ( target->path ) / "rgb.mkv" ))
+    {
+      DebugOut ( "EncodeFrames::Run %s already has a video, appending color frames as files", target->path.c_str () );
+      target->videoEnabled = false;
+    }
+
+    if (target->videoEnabled)
+    {
+      target->realsense->SetEvenColorCrop ( true );
+
+      auto videoFilename = (fs::path ( target->path ) / "rgb.mkv").string ();
+      if (!target->video.Open ( videoFilename, target->realsense->GetStreamWidth ( StreamColor ), target->realsense->GetStreamHeight ( StreamColor ), _options.video ))
+      {
+        DebugOut ( "EncodeFrames::Run falling back to per frame color output in %s", target->path.c_str () );
+        target->videoEnabled = false;
+        target->realsense->SetEvenColorCrop ( false );
+      }
+    }
+
+    CodecSettings settings[StreamCount] = { _options.color, _options.depth, _options.infrared, _options.infrared };
+
+    for (int i = 0; i < StreamCount; i++)
+    {
+      target->temporal[i] = false;
+      target->keyframeInterval[i] = std::max ( 1, settings[i].keyframeInterval );
+      target->last[i] = nullptr;
+      target->lastSize[i] = 0;
+      target->sinceKeyframe[i] = 0;
+      target->restart[i] = false;
+      target->chained[i] = false;
+
+      if (!target->realsense->IsStreamEnabled ( (StreamType)i ))
+        target->indexCodecs[i] = kIndexNoFiles;
+      else if (i == StreamColor && target->videoEnabled)
+        target->indexCodecs[i] = kIndexVideo;
+      else
+      {
+        std::unique_ptr<FrameCodec> codec ( CreateCodec ( settings[i] ) );
+        target->indexCodecs[i] = (uint8_t)codec->Type ();
+        target->temporal[i] = codec->IsTemporal ();
+
+        // the callers make the stream folders, the level folders are made here
+        for (int level = 1; level <= std::min ( _options.pyramid.levels, kMaxPyramidLevels ); level++)
+        {
+          std::error_code error;
+          fs::create_directories ( fs::path ( target->path ) / LevelFolder ( (StreamType)i, level ), error );
+        }
+      }
+    }
+
+    _targets.push_back ( target );
+  }
+
+  // every camera of a Run saves the same streams at the same rate
+  if (!_targets.empty ())
+  {
+    CodecSettings codecs[StreamCount] = { _options.color, _options.depth, _options.infrared, _options.infrared };
+    int streams = _targets[0]->realsense->GetStreams ();
+    if (_options.video.enabled)
+      streams &= ~StreamFlagColor;
+
+    _shedder->Configure ( _options.shed, _targets[0]->realsense->GetSaveFps (), (int)_targets.size (), codecs, streams );
+    _shed_frames.assign ( _targets.size (), 0 );
+  }
+
+  if (threads <= 0)
+    threads = std::max ( 1, (int)std::thread::hardware_concurrency () );
+
+  // every encoder thread keeps codecs of its own for each target, level and stream. Left at a thread per
+  // core each, zstd would start that many workers per codec, so the encoders split the processors instead.
+  if (threads > 1)
+  {
+    int share = std::max ( 1, (int)std::thread::hardware_concurrency () / threads );
+    for (CodecSettings* settings : { &_options.color, &_options.depth, &_options.infrared })
+    {
+      if (settings->threads == 0)
+        settings->threads = share;
+    }
+  }
 
   _is_thread_running = true;
-  _currentFrame = 0;
+  _is_running = true;
+
+  for (int i = 0; i < threads; i++)
+  {
+    _threads.push_back ( new std::thread ( [this, i]()
+    {
+      ApplyThreadPlacement ( _placement, Format ( "rsds encode %d", i ) );
+      ThreadRun ();
+    } ) );
+  }
+
+  bool sharded = false;
+  for (auto target : _targets)
+    sharded = sharded || target->layout.framesPerShard > 0;
 
-  _thread = new std::thread ( [&]()
+  if (sharded)
   {
-    ThreadRun ();
-  } );
+    _shard_wake = new std::condition_variable ();
+    _shard_thread = new std::thread ( [this]()
+    {
+      ApplyThreadPlacement ( _placement, "rsds shards" );
+      ShardRun ();
+    } );
+  }
 }
 catch (const std::exception & e)
 {
@@ -51,40 +276,241 @@ catch (const std::exception & e)
 
 void EncodeFrames::Stop ()
 {
-  if (_thread)
+  if (!_threads.empty ())
   {
-    _is_running = false;
-    _is_thread_running = false;
+    {
+      std::lock_guard<std::mutex> guard ( *_mutex );
+
+      _is_running = false;
+      _is_thread_running = false;
+    }
+
+    _queued->notify_all ();
 
-    _thread->join ();
+    for (auto thread : _threads)
+    {
+      thread->join ();
+      DEL ( thread );
+    }
+
+    _threads.clear ();
+  }
 
-    DEL ( _thread );
+  if (_shard_thread)
+  {
+    _shard_wake->notify_all ();
+    _shard_thread->join ();
+    DEL ( _shard_thread );
   }
 
+  DEL ( _shard_wake );
+
   EmptyQueue ();
 
+  WriteShedDecisions ();
+
+  // every dequeued frame is committed before its thread exits, so nothing is left waiting here
+  for (auto target : _targets)
+  {
+    for (auto& done : target->done)
+    {
+      for (int i = 0; i < StreamCount; i++)
+      {
+        DEL_ARR ( done.second.first.images[i] );
+        DEL_ARR ( done.second.first.references[i] );
+      }
+    }
+
+    for (int i = 0; i < StreamCount; i++)
+      DEL_ARR ( target->last[i] );
+
+    // a lowered save rate must not outlast the capture that needed it
+    if (_shedder->SaveRateLimit () > 0)
+      target->realsense->SetSaveRateLimit ( 0 );
+    target->realsense->SetEvenColorCrop ( false );
+
+    DEL ( target );
+  }
+
+  _targets.clear ();
+
+  DEL ( _queued );
   DEL ( _mutex );
 }
 
-void EncodeFrames::QueueFrame ( unsigned char * colorImage, int colorSize, unsigned char * depthImage, int depthSize )
+void EncodeFrames::QueueFrame ( unsigned char * images[], const int sizes[], const frame_metadata* metadata, int target )
 {
-  if (!_mutex || !_is_running || !_is_thread_running || !colorImage || !depthImage)
+  if (!_mutex || !_is_running || !_is_thread_running || !images || !sizes || target < 0 || target >= (int)_targets.size ())
+    return;
+
+  EncodeTarget* output = _targets[target];
+  RealsenseController* realsense = output->realsense;
+
+  // before the copy, a frame that is shed costs nothing
+  int effort = 0;
+  if (ShedFrame ( target, effort ))
+  {
+    realsense->CountDrop ( DropShed );
     return;
+  }
 
   EFrame frame;
+  frame.target = target;
+  frame.effort = effort;
+
+  for (int i = 0; i < StreamCount; i++)
+  {
+    frame.images[i] = nullptr;
+    frame.sizes[i] = 0;
+    frame.widths[i] = realsense->GetStreamWidth ( (StreamType)i );
+    frame.heights[i] = realsense->GetStreamHeight ( (StreamType)i );
+    frame.references[i] = nullptr;
+    frame.keyframeDistance[i] = 0;
 
-  frame.colorImage = new unsigned char[colorSize];
-  frame.colorSize = colorSize;
-  memcpy ( frame.colorImage, colorImage, colorSize );
+    bool captured = images[i] && realsense->IsStreamEnabled ( (StreamType)i );
 
-  frame.depthImage = new unsigned char[depthSize];
-  frame.depthSize = depthSize;
-  memcpy ( frame.depthImage, depthImage, depthSize );
+    // copied before a mode or crop change the image no longer has the stream's size
+    if (captured && frame.widths[i] * frame.heights[i] * realsense->GetStreamBytesPerPixel ( (StreamType)i ) != sizes[i])
+    {
+      realsense->CountDrop ( DropEncode );
+      captured = false;
+    }
+
+    // readers walk back by frame number, a number without an image or one an encoder lost breaks the chain
+    if (output->temporal[i] && (!captured || output->restart[i].exchange ( false )))
+    {
+      DEL_ARR ( output->last[i] );
+      output->sinceKeyframe[i] = 0;
+    }
+
+    if (!captured)
+      continue;
+
+    frame.images[i] = new unsigned char[sizes[i]];
+    frame.sizes[i] = sizes[i];
+    memcpy ( frame.images[i], images[i], sizes[i] );
+
+    if (!output->temporal[i])
+      continue;
+
+    // the previous image goes along with the frame, so any encoder thread can code the difference.
+    // A new size or the interval running out starts over with a keyframe.
+    if (output->last[i] && output->lastSize[i] == sizes[i] && output->sinceKeyframe[i] < output->keyframeInterval[i])
+    {
+      frame.references[i] = output->last[i];
+      frame.keyframeDistance[i] = output->sinceKeyframe[i];
+    }
+    else
+    {
+      DEL_ARR ( output->last[i] );
+      output->sinceKeyframe[i] = 0;
+    }
+
+    output->last[i] = new unsigned char[sizes[i]];
+    output->lastSize[i] = sizes[i];
+    memcpy ( output->last[i], images[i], sizes[i] );
+    output->sinceKeyframe[i]++;
+  }
+
+  if (metadata)
+    frame.metadata = *metadata;
+  else
+  {
+    memset ( &frame.metadata, 0, sizeof ( frame.metadata ) );
+    for (int i = 0; i < StreamCount; i++)
+      frame.metadata.exposure[i] = -1;
+  }
 
   {   
     std::lock_guard<std::mutex> guard ( *_mutex );
 
+    // numbers follow the queue order, the encoders may finish them in any order
+    frame.number = _targets[target]->nextFrame++;
+    frame.queuedMs = steady_ms ();
+
     _queuedItems.push_back ( frame );
+    _pending++;
+  }
+
+  _queued->notify_one ();
+
+  // a new shard was started, the next one is made ready before it is needed
+  int perShard = _targets[target]->layout.framesPerShard;
+  if (_shard_wake && perShard > 0 && frame.number % perShard == 0)
+    _shard_wake->notify_one ();
+}
+
+// steps the load shedding on the queue as it is, true when the frame is not to be queued
+bool EncodeFrames::ShedFrame ( int target, int& effort )
+{
+  // only Run configures it, before any frame is queued
+  if (!_shedder->Enabled ())
+    return false;
+
+  bool changed, drop;
+  float limit;
+
+  {
+    std::lock_guard<std::mutex> guard ( *_mutex );
+
+    for (size_t t = 0; t < _targets.size (); t++)
+      _shed_frames[t] = _targets[t]->nextFrame;
+
+    changed = _shedder->Update ( _pending, steady_ms (), _shed_frames );
+    drop = _shedder->Drops ( _pending, target );
+    effort = _shedder->EffortStep ();
+    limit = _shedder->SaveRateLimit ();
+  }
+
+  // the capture threads keep to the new rate from their next frameset
+  if (changed)
+  {
+    for (auto output : _targets)
+      output->realsense->SetSaveRateLimit ( limit );
+  }
+
+  return drop;
+}
+
+std::vector<ShedDecision> EncodeFrames::ShedDecisions ()
+{
+  if (!_mutex)
+    return _shedder->Decisions ();
+
+  std::lock_guard<std::mutex> guard ( *_mutex );
+
+  return _shedder->Decisions ();
+}
+
+// next to the index, so a reader knows which frame ranges were saved at a lower effort or rate
+void EncodeFrames::WriteShedDecisions ()
+{
+  auto& decisions = _shedder->Decisions ();
+  if (decisions.empty ())
+    return;
+
+  for (size_t t = 0; t < _targets.size (); t++)
+  {
+    auto filename = fs::path ( _targets[t]->path ) / "loadshed.csv";
+    bool exists = fs::exists ( filename );
+
+    FILE* file = fopen ( filename.string ().c_str (), "a" );
+    if (!file)
+    {
+      DebugOut ( "EncodeFrames::WriteShedDecisions failed to open %s", filename.string ().c_str () );
+      continue;
+    }
+
+    if (!exists)
+      fprintf ( file, "frame,step,queued,latency_ms,description\n" );
+
+    for (auto& decision : decisions)
+    {
+      int frame = t < decision.firstFrames.size () ? decision.firstFrames[t] : 0;
+      fprintf ( file, "%d,%d,%d,%.0f,\"%s\"\n", frame, decision.to, decision.queued, decision.latencyMs, _shedder->Describe ( decision.to ).c_str () );
+    }
+
+    fclose ( file );
   }
 }
 
@@ -95,52 +521,341 @@ int EncodeFrames::QueueCount ()
   return _queuedItems.size (); 
 }
 
+int EncodeFrames::PendingCount ()
+{
+  if (!_mutex)
+    return 0;
+
+  std::lock_guard<std::mutex> guard ( *_mutex );
+
+  return _pending;
+}
+
+int EncodeFrames::FramesSaved ( int target )
+{
+  if (target < 0 || target >= (int)_targets.size ())
+    return 0;
+
+  std::lock_guard<std::mutex> guard ( _targets[target]->mutex );
+
+  return _targets[target]->saved;
+}
+
+int EncodeFrames::FirstFrame ( int target )
+{
+  if (target < 0 || target >= (int)_targets.size ())
+    return 0;
+
+  return _targets[target]->firstFrame;
+}
+
+long long EncodeFrames::BytesSaved ( int target )
+{
+  if (target < 0 || target >= (int)_targets.size ())
+    return 0;
+
+  std::lock_guard<std::mutex> guard ( _targets[target]->mutex );
+
+  return _targets[target]->bytes;
+}
+
 void EncodeFrames::ThreadRun ()
 {
-  EFrame item;
+  // codecs keep their contexts between frames, so every thread has its own for each camera, pyramid level
+  // and stream, a png codec handed another size rebuilds its stripes. Load shedding only changes their
+  // levels, the codec types and the index stay as they are.
+  typedef std::array<std::array<std::unique_ptr<FrameCodec>, StreamCount>, kMaxPyramidLevels + 1> TargetCodecs;
+  std::vector<TargetCodecs> codecs ( _targets.size () );
+  std::vector<int> efforts ( _targets.size (), 0 );
+  int levels = std::min ( _options.pyramid.levels, kMaxPyramidLevels );
+
+  auto create_codecs = [this, levels] ( TargetCodecs& target, int effort )
+  {
+    for (int level = 0; level <= levels; level++)
+    {
+      target[level][StreamColor].reset ( CreateCodec ( LoadShedder::EffortSettings ( _options.color, effort ) ) );
+      target[level][StreamDepth].reset ( CreateCodec ( LoadShedder::EffortSettings ( _options.depth, effort ) ) );
+      target[level][StreamInfraredLeft].reset ( CreateCodec ( LoadShedder::EffortSettings ( _options.infrared, effort ) ) );
+      target[level][StreamInfraredRight].reset ( CreateCodec ( LoadShedder::EffortSettings ( _options.infrared, effort ) ) );
+    }
+  };
 
-  _is_running = true;
+  for (auto& target : codecs)
+    create_codecs ( target, 0 );
+
+  std::vector<unsigned char> buffer;
+  Pyramid pyramid;
 
   while (_is_thread_running)
   {
-    while (_is_running)
+    EFrame item;
+
     {
+      std::unique_lock<std::mutex> lock ( *_mutex );
+
+      _queued->wait ( lock, [this]() { return !_is_thread_running || !_queuedItems.empty (); } );
+
+      if (!_is_thread_running)
+        break;
+
+      item = _queuedItems[0];
+
+      _queuedItems.pop_front ();
+
+      Log ( LogLevel::Trace, "Saving %d with %d queuedItems remaining", item.number, _queuedItems.size () );
+    }
+
+    EncodeTarget* target = _targets[item.target];
+    fs::path path = target->path;
+
+    if (item.effort != efforts[item.target])
+    {
+      create_codecs ( codecs[item.target], item.effort );
+      efforts[item.target] = item.effort;
+    }
+
+    IndexRecord record;
+    memset ( &record, 0, sizeof ( record ) );
+    record.frame = item.number;
+
+    for (int i = 0; i < StreamCount; i++)
+    {
+      StreamType stream = (StreamType)i;
+
+      record.timestamp[i] = item.metadata.timestamp[i];
+      record.frameNumber[i] = item.metadata.frame_number[i];
+      record.exposure[i] = (int32_t)item.metadata.exposure[i];
+
+      // video frames go out in order with the commit
+      if (stream == StreamColor)
+        item.video = item.images[i] && target->videoEnabled;
+      if (!item.images[i] || (stream == StreamColor && item.video))
+        continue;
+
+      auto& codec = codecs[item.target][0][i];
+      fs::path filename = path / FramePath ( target->layout, stream, item.number, codec->Extension () );
+
+      // only when the shard thread fell behind
+      if (target->layout.framesPerShard > 0 && item.number / target->layout.framesPerShard >= target->shardsReady)
       {
-        std::lock_guard<std::mutex> guard ( *_mutex );
+        std::error_code error;
+        fs::create_directories ( filename.parent_path (), error );
+      }
 
-        if (_queuedItems.size () == 0)
-          continue;
+      int width = item.widths[i];
+      int height = item.heights[i];
+
+      bool encoded = codec->IsTemporal ()
+        ? codec->EncodeDelta ( item.images[i], item.references[i], item.keyframeDistance[i], width, height, StreamPixelFormat ( stream ), buffer )
+        : codec->Encode ( item.images[i], width, height, StreamPixelFormat ( stream ), buffer );
 
-        item = _queuedItems[0];
+      if (encoded && WriteBuffer ( filename.string (), buffer ))
+        record.size[i] = (uint32_t)buffer.size ();
+      else if (codec->IsTemporal ())
+        target->restart[i] = true;
 
-        _queuedItems.pop_front ();
+      // made from the frame while it is still in cache, every level is a keyframe of its own
+      if (levels > 0)
+      {
+        FrameCodec* levelCodecs[kMaxPyramidLevels + 1];
+        for (int level = 0; level <= levels; level++)
+          levelCodecs[level] = codecs[item.target][level][i].get ();
 
-        DebugOut ( "Saving %d with %d queuedItems remaining", _currentFrame, _queuedItems.size () );
+        SaveLevels ( target, item, stream, levelCodecs, pyramid, buffer );
       }
 
-      fs::path path = _path;
-      fs::path colorFilename = path / Format ( "rgb\\%06d.png", _currentFrame );
-      fs::path depthFilename = path / Format ( "depth\\%06d.png", _currentFrame );
+      DEL_ARR ( item.references[i] );
+    }
+
+    Commit ( target, item, record );
+  }
+}
+
+void EncodeFrames::SaveLevels ( EncodeTarget* target, const EFrame& item, StreamType stream, FrameCodec* const* codecs, Pyramid& pyramid, std::vector<unsigned char>& buffer )
+{
+  int i = (int)stream;
+  PixelFormat format = StreamPixelFormat ( stream );
+
+  pyramid.Build ( item.images[i], item.widths[i], item.heights[i], format, _options.pyramid );
+
+  for (int level = 1; level <= pyramid.Levels (); level++)
+  {
+    auto codec = codecs[level];
+    fs::path filename = fs::path ( target->path ) / FramePath ( target->layout, stream, item.number, codec->Extension (), level );
+
+    if (target->layout.framesPerShard > 0 && item.number / target->layout.framesPerShard >= target->shardsReady)
+    {
+      std::error_code error;
+      fs::create_directories ( filename.parent_path (), error );
+    }
+
+    bool encoded = codec->IsTemporal ()
+      ? codec->EncodeDelta ( pyramid.Data ( level ), nullptr, 0, pyramid.Width ( level ), pyramid.Height ( level ), format, buffer )
+      : codec->Encode ( pyramid.Data ( level ), pyramid.Width ( level ), pyramid.Height ( level ), format, buffer );
+
+    if (!encoded || !WriteBuffer ( filename.string (), buffer ))
+      DebugOut ( "EncodeFrames::SaveLevels failed to save %s", filename.string ().c_str () );
+  }
+}
+
+void EncodeFrames::ShardRun ()
+{
+  const int kShardsAhead = 2;
+
+  std::unique_lock<std::mutex> lock ( *_mutex );
+
+  while (_is_thread_running)
+  {
+    for (auto target : _targets)
+    {
+      int perShard = target->layout.framesPerShard;
+      if (perShard <= 0)
+        continue;
 
-      _currentFrame++;      
+      int ready = target->shardsReady;
+      int wanted = target->nextFrame / perShard + kShardsAhead;
+      if (ready >= wanted)
+        continue;
 
-      pngio pngColor ( _realsense->GetColorWidth (), _realsense->GetColorHeight (), png_color_type::RGB );
-      pngColor.WriteBlockAt ( 0, 0, _realsense->GetColorWidth (), _realsense->GetColorHeight (), item.colorImage );
-      pngColor.Save ( colorFilename.string ().c_str () );
+      // no frame waits on this, the encoders make a missing shard themselves
+      lock.unlock ();
 
-      pngio pngDepth ( _realsense->GetDepthWidth (), _realsense->GetDepthHeight (), png_color_type::GRAY );
-      pngDepth.WriteBlockAt ( 0, 0, _realsense->GetDepthWidth (), _realsense->GetDepthHeight (), item.depthImage );
-      pngDepth.Save ( depthFilename.string ().c_str () );
+      for (int shard = ready; shard < wanted; shard++)
+      {
+        for (int i = 0; i < StreamCount; i++)
+        {
+          if (target->indexCodecs[i] == kIndexNoFiles || target->indexCodecs[i] == kIndexVideo)
+            continue;
+
+          for (int level = 0; level <= std::min ( _options.pyramid.levels, kMaxPyramidLevels ); level++)
+          {
+            std::error_code error;
+            fs::create_directories ( fs::path ( target->path ) / ShardPath ( target->layout, (StreamType)i, shard, level ), error );
+            if (error)
+              DebugOut ( "EncodeFrames::ShardRun failed to create shard %d in %s: %s", shard, target->path.c_str (), error.message ().c_str () );
+          }
+        }
+
+        target->shardsReady = shard + 1;
+      }
 
-      DEL ( item.colorImage );
-      DEL ( item.depthImage );
+      lock.lock ();
     }
 
-    if (_is_thread_running)
-      std::this_thread::sleep_for ( std::chrono::milliseconds ( 500 ) );
+    _shard_wake->wait_for ( lock, std::chrono::milliseconds ( 500 ) );
   }
 }
 
+void EncodeFrames::Commit ( EncodeTarget* target, EFrame& item, const IndexRecord& record )
+{
+  int committed = 0;
+  double latency = 0;
+
+  {
+    std::lock_guard<std::mutex> guard ( target->mutex );
+
+    target->done[item.number] = std::make_pair ( item, record );
+
+    // readers expect the index in frame order and the video only takes frames in order
+    for (auto it = target->done.find ( target->nextCommit ); it != target->done.end (); it = target->done.find ( target->nextCommit ))
+    {
+      EFrame& frame = it->second.first;
+      IndexRecord& frameRecord = it->second.second;
+
+      // the calibration is only final once the pipeline runs in its capture mode, which it does by the first frame
+      if (!target->index.IsOpen ())
+      {
+        // so is a volume crop, the video opened before it settled starts over at the frame's size
+        int width = frame.widths[StreamColor];
+        int height = frame.heights[StreamColor];
+        if (frame.video && (width != target->video.Width () || height != target->video.Height ()))
+        {
+          auto videoFilename = (fs::path ( target->path ) / "rgb.mkv").string ();
+          target->video.Close ();
+          if (!target->video.Open ( videoFilename, width, height, _options.video ))
+          {
+            // the frames after this one are saved as files like when the video never opened, the index says so
+            DebugOut ( "EncodeFrames::Commit could not reopen %s at %dx%d, falling back to per frame color output", videoFilename.c_str (), width, height );
+            target->videoEnabled = false;
+            target->realsense->SetEvenColorCrop ( false );
+
+            std::unique_ptr<FrameCodec> codec ( CreateCodec ( _options.color ) );
+            target->indexCodecs[StreamColor] = (uint8_t)codec->Type ();
+
+            for (int level = 1; level <= std::min ( _options.pyramid.levels, kMaxPyramidLevels ); level++)
+            {
+              std::error_code error;
+              fs::create_directories ( fs::path ( target->path ) / LevelFolder ( StreamColor, level ), error );
+            }
+          }
+        }
+
+        target->index.Open ( (fs::path ( target->path ) / kIndexFilename).string (), MakeIndexHeader ( target->realsense, target->indexCodecs, target->layout, _options.pyramid.levels ), _options.append );
+      }
+
+      if (frame.video)
+      {
+        // the video's size is fixed when it opens, a frame of another crop can not go in. The sidecar has no row
+        // for a frame that never reached the file, it is counted like any other lost frame.
+        if (!target->videoEnabled || frame.widths[StreamColor] != target->video.Width () || frame.heights[StreamColor] != target->video.Height ()
+          || !target->video.Write ( frame.images[StreamColor], frame.number, frame.metadata.timestamp[StreamColor] ))
+          target->realsense->CountDrop ( DropVideo );
+      }
+
+      for (int i = 0; i < StreamCount; i++)
+      {
+        if (!frame.images[i] || (i == StreamColor && frame.video))
+          continue;
+
+        // deltas queued before the encoders asked for a keyframe lead back to the lost frame, kept they
+        // would not decode or decode against the wrong image
+        if (target->temporal[i] && frameRecord.size[i] > 0)
+        {
+          if (frame.keyframeDistance[i] == 0)
+            target->chained[i] = true;
+          else if (!target->chained[i])
+          {
+            std::error_code error;
+            fs::remove ( fs::path ( target->path ) / FramePath ( target->layout, (StreamType)i, frame.number, CodecExtension ( (CodecType)target->indexCodecs[i] ) ), error );
+            frameRecord.size[i] = 0;
+          }
+        }
+
+        if (frameRecord.size[i] == 0)
+        {
+          target->chained[i] = false;
+          target->realsense->CountDrop ( DropEncode );
+        }
+      }
+
+      if (frame.number == target->firstFrame)
+        frameRecord.flags |= kIndexSessionStart;
+
+      target->index.Append ( frameRecord );
+
+      target->saved++;
+      for (int i = 0; i < StreamCount; i++)
+        target->bytes += frameRecord.size[i];
+
+      for (int i = 0; i < StreamCount; i++)
+        DEL_ARR ( frame.images[i] );
+
+      latency = steady_ms () - frame.queuedMs;
+
+      target->done.erase ( it );
+      target->nextCommit++;
+      committed++;
+    }
+  }
+
+  // frames still held for an earlier one count as pending until they are written
+  std::lock_guard<std::mutex> guard ( *_mutex );
+  _pending -= committed;
+
+  if (committed)
+    _shedder->Committed ( latency );
+}
+
 void EncodeFrames::EmptyQueue ()
 {
   if (!_mutex)
@@ -153,11 +868,15 @@ void EncodeFrames::EmptyQueue ()
     {
       auto item = _queuedItems[0];
 
-      DEL ( item.colorImage );
-      DEL ( item.depthImage );
+      for (int i = 0; i < StreamCount; i++)
+      {
+        DEL_ARR ( item.images[i] );
+        DEL_ARR ( item.references[i] );
+      }
 
       _queuedItems.pop_front ();
     }
 
+    _pending = 0;
   }
 }
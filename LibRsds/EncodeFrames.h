@@ -1,46 +1,118 @@
 #pragma once
 
 #include "RealsenseController.h"
+#include "FrameCodec.h"
+#include "VideoSink.h"
+#include "FrameIndex.h"
+#include "LoadShedder.h"
+#include "Pyramid.h"
 
 #include <string>
 #include <deque>
+#include <vector>
+
+namespace std
+{
+  class condition_variable;
+}
 
 using namespace RS;
 
 namespace EF
 {
+  // indexed by StreamType, streams that are not captured have no image
   struct EFrame
   {
-    unsigned char* colorImage;
-    int colorSize;
-    unsigned char* depthImage;
-    int depthSize;
+    int target;  // index of the camera in Run
+    int number;  // frame number in that camera's folder, given out in queue order
+    unsigned char* images[StreamCount];
+    int sizes[StreamCount];
+    int widths[StreamCount];   // the stream's size when the frame was queued, a later crop does not change it
+    int heights[StreamCount];
+    unsigned char* references[StreamCount];  // the stream's previous image for temporal codecs, null for a keyframe
+    int keyframeDistance[StreamCount];
+    int effort;      // load shedding effort step the frame is encoded at
+    bool video;      // the color was left to the video instead of saved as a file
+    double queuedMs;
+    frame_metadata metadata;
+  };
+
+  struct EncodeOptions
+  {
+    EncodeOptions ()
+      : append ( false )
+    {  }
+    CodecSettings color;
+    CodecSettings depth;
+    CodecSettings infrared;  // used for both imagers
+    VideoSettings video;     // when enabled the color stream goes to rgb.mkv instead of the rgb folder
+    bool append;             // number frames after the ones already in the folder and add to its index, see PrepareCaptureFolder
+    FrameLayout layout;      // file names and shard folders of the per frame files, recorded in the index
+    LoadShedSettings shed;   // decisions are logged and written to loadshed.csv in each folder
+    PyramidSettings pyramid; // smaller copies of every per frame file in LevelFolder, with the stream's codec
   };
 
+  // folder under the capture path each stream's frames are written to
+  const char* StreamFolder ( StreamType stream );
+  // the stream folder of a pyramid level: rgb_2 holds rgb at half the size, rgb_4 at a quarter. Level 0 is StreamFolder.
+  std::string LevelFolder ( StreamType stream, int level );
+  PixelFormat StreamPixelFormat ( StreamType stream );
+
+  // per camera output state, defined in EncodeFrames.cpp
+  struct EncodeTarget;
+
+  // A pool of encoder threads shared by every camera in Run. Frames of one camera are encoded in any
+  // order, but its index records and video frames are committed in frame order.
   class EncodeFrames
   {
   public:
     EncodeFrames ();
     ~EncodeFrames ();
 
-    void Run ( RealsenseController* realsense, std::string path );
+    void Run ( RealsenseController* realsense, std::string path, const EncodeOptions& options = EncodeOptions () );
+    // one folder per camera, threads 0 picks one per core
+    void Run ( const std::vector<RealsenseController*>& realsense, const std::vector<std::string>& paths, const EncodeOptions& options, int threads );
     void Stop ();
-    void QueueFrame ( unsigned char * colorImage, int colorSize, unsigned char * depthImage, int depthSize );
+    // picked up by the threads of the next Run
+    void SetThreadPlacement ( const ThreadPlacement& placement ) { _placement = placement; }
+    // a target's frames have to be queued from one thread, temporal codecs take the previous one as reference
+    void QueueFrame ( unsigned char * images[], const int sizes[], const frame_metadata* metadata = nullptr, int target = 0 );
     bool IsRunning () { return _is_running; }
     int QueueCount ();
+    // queued and not yet committed, zero once every queued frame is on disk
+    int PendingCount ();
+    int FramesSaved ( int target = 0 );
+    long long BytesSaved ( int target = 0 );
+    // number of the target's first frame in this Run, 0 unless appending
+    int FirstFrame ( int target = 0 );
+    // of this Run, or the last one once stopped
+    std::vector<ShedDecision> ShedDecisions ();
 
   private:
-    std::thread* _thread;
+    std::vector<std::thread*> _threads;
     std::mutex* _mutex;
-    std::string _path;
+    std::condition_variable* _queued;
     std::deque<EFrame> _queuedItems;
-    RealsenseController* _realsense;
+    std::vector<EncodeTarget*> _targets;
+    EncodeOptions _options;
+    ThreadPlacement _placement;
     bool _is_running;
     bool _is_thread_running;
-    int _currentFrame;
+    int _pending;
+    // shard folders are made ahead of the frames by a thread of their own
+    std::thread* _shard_thread;
+    std::condition_variable* _shard_wake;
+    LoadShedder* _shedder;          // guarded by _mutex
+    std::vector<int> _shed_frames;  // next frame of each target, for the decisions
 
     void ThreadRun ();
+    void ShardRun ();
+    void Commit ( EncodeTarget* target, EFrame& item, const IndexRecord& record );
+    // codecs holds one codec per level, each keeps the state for its own image size
+    void SaveLevels ( EncodeTarget* target, const EFrame& item, StreamType stream, FrameCodec* const* codecs, Pyramid& pyramid, std::vector<unsigned char>& buffer );
     void EmptyQueue ();
+    bool ShedFrame ( int target, int& effort );
+    void WriteShedDecisions ();
   };
 }
 
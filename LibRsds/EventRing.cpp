@@ -0,0 +1,162 @@
+#include "EventRing.h"
+#include "Helpers.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+using namespace RS;
+
+namespace
+{
+  double steady_ms ()
+  {
+    return std::chrono::duration<double, std::milli> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+  }
+
+  void copy_text (char* dst, size_t size, const char* src)
+  {
+    size_t n = src ? strlen (src) : 0;
+    if (n >= size)
+      n = size - 1;
+    memcpy (dst, src, n);
+    dst[n] = 0;
+  }
+}
+
+// A slot's sequence says whose turn it is: equal to a position the slot is free for the publisher
+// that claimed it, one past it the event is ready for the consumer (Vyukov's bounded queue).
+struct EventRing::Slots
+{
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    Event event;
+  };
+
+  explicit Slots (size_t capacity)
+    : slots (capacity)
+    , mask (capacity - 1)
+    , head (0)
+    , tail (0)
+    , dropped (0)
+  {
+    for (size_t i = 0; i < capacity; i++)
+      slots[i].sequence.store (i, std::memory_order_relaxed);
+  }
+
+  std::vector<Slot> slots;
+  size_t mask;
+  // a cache line apart so publishers and the consumer do not share one. Padded, new only aligns
+  // to 16 bytes before C++17, so alignas would not hold on the heap.
+  char pad0[64];
+  std::atomic<size_t> head;
+  char pad1[64 - sizeof (std::atomic<size_t>)];
+  std::atomic<size_t> tail;
+  char pad2[64 - sizeof (std::atomic<size_t>)];
+  std::atomic<long long> dropped;
+};
+
+EventRing::EventRing (int capacity)
+{
+  size_t size = 2;
+  while (size < (size_t)capacity)
+    size <<= 1;
+
+  _slots = new Slots (size);
+}
+
+EventRing::~EventRing ()
+{
+  DEL (_slots);
+}
+
+bool EventRing::Publish (const Event& event)
+{
+  size_t pos = _slots->tail.load (std::memory_order_relaxed);
+
+  for (;;)
+  {
+    auto& slot = _slots->slots[pos & _slots->mask];
+    size_t sequence = slot.sequence.load (std::memory_order_acquire);
+    auto diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+
+    if (diff == 0)
+    {
+      if (_slots->tail.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed))
+      {
+        slot.event = event;
+        slot.sequence.store (pos + 1, std::memory_order_release);
+        return true;
+      }
+    }
+    else if (diff < 0)
+    {
+      // the consumer has not freed the slot a lap ago
+      _slots->dropped.fetch_add (1, std::memory_order_relaxed);
+      return false;
+    }
+    else
+      pos = _slots->tail.load (std::memory_order_relaxed);
+  }
+}
+
+bool EventRing::PublishState (int state, int source, const char* name)
+{
+  Event event;
+  event.type = EventState;
+  event.code = state;
+  event.source = source;
+  event.value = 0;
+  event.timeMs = steady_ms ();
+  copy_text (event.text, sizeof (event.text), name);
+
+  return Publish (event);
+}
+
+bool EventRing::PublishStatus (int status, const char* text)
+{
+  Event event;
+  event.type = EventStatus;
+  event.code = status;
+  event.source = 0;
+  event.value = 0;
+  event.timeMs = steady_ms ();
+  copy_text (event.text, sizeof (event.text), text);
+
+  return Publish (event);
+}
+
+bool EventRing::PublishTelemetry (Telemetry telemetry, long long value, int source)
+{
+  Event event;
+  event.type = EventTelemetry;
+  event.code = telemetry;
+  event.source = source;
+  event.value = value;
+  event.timeMs = steady_ms ();
+  event.text[0] = 0;
+
+  return Publish (event);
+}
+
+bool EventRing::Poll (Event& event)
+{
+  size_t pos = _slots->head.load (std::memory_order_relaxed);
+  auto& slot = _slots->slots[pos & _slots->mask];
+
+  if (slot.sequence.load (std::memory_order_acquire) != pos + 1)
+    return false;
+
+  event = slot.event;
+  slot.sequence.store (pos + _slots->mask + 1, std::memory_order_release);
+  _slots->head.store (pos + 1, std::memory_order_relaxed);
+
+  return true;
+}
+
+long long EventRing::Dropped ()
+{
+  return _slots->dropped.load (std::memory_order_relaxed);
+}
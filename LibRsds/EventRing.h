@@ -0,0 +1,52 @@
+#pragma once
+
+namespace RS
+{
+  enum EventType
+  {
+    EventState,      // code is an RSState, text the source's name
+    EventStatus,     // code is the managed RsDsController::Status, text the description
+    EventTelemetry,  // code is a Telemetry, value its reading
+  };
+
+  // readings that only matter as their latest value, a consumer may keep the last of each and skip the rest
+  enum Telemetry
+  {
+    TelemetryQueueRemaining,  // frames still queued for the encoders while stopping
+    TelemetryStall,           // ms without a frameset from the source
+    TelemetryCount,
+  };
+
+  struct Event
+  {
+    EventType type;
+    int code;
+    int source;       // 0 the preview camera, 1 and up the sources of a multi capture
+    long long value;
+    double timeMs;    // steady clock, only for ordering and age
+    char text[256];   // truncated, always terminated
+  };
+
+  // Bounded queue many threads publish to and one thread drains, a slot per event so neither side
+  // allocates or takes a lock. A full ring drops the new event and counts it, publishers never wait.
+  class EventRing
+  {
+  public:
+    // capacity is rounded up to a power of two
+    explicit EventRing (int capacity = 256);
+    ~EventRing ();
+
+    bool Publish (const Event& event);
+    bool PublishState (int state, int source, const char* name);
+    bool PublishStatus (int status, const char* text);
+    bool PublishTelemetry (Telemetry telemetry, long long value, int source = 0);
+
+    // single consumer, false when empty
+    bool Poll (Event& event);
+    long long Dropped ();
+
+  private:
+    struct Slots;  // defined in EventRing.cpp, atomics cannot be seen from managed code
+    Slots* _slots;
+  };
+}
@@ -0,0 +1,743 @@
+#include "FrameCodec.h"
+#include "Helpers.h"
+#include "pngstripe.h"
+#include "qoi.h"
+
+#include <lz4.h>
+#include <lz4hc.h>
+#include <turbojpeg.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
+#include <emmintrin.h>
+
+using namespace common;
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  const char kHeaderMagic[4] = { 'R', 'S', 'D', 'F' };
+  const uint16_t kHeaderVersion = 1;
+
+  void write_header ( std::vector<unsigned char>& out, CodecType codec, int width, int height, PixelFormat format, uint32_t rawSize )
+  {
+    FrameHeader header;
+    memcpy ( header.magic, kHeaderMagic, sizeof ( header.magic ) );
+    header.version = kHeaderVersion;
+    header.codec = (uint16_t)codec;
+    header.width = width;
+    header.height = height;
+    header.format = (uint32_t)format;
+    header.rawSize = rawSize;
+
+    memcpy ( out.data (), &header, sizeof ( header ) );
+  }
+
+  bool read_header ( const unsigned char* data, size_t size, CodecType codec, FrameHeader& header )
+  {
+    if (!data || size < sizeof ( FrameHeader ))
+      return false;
+
+    memcpy ( &header, data, sizeof ( header ) );
+
+    if (memcmp ( header.magic, kHeaderMagic, sizeof ( header.magic ) ) != 0 || header.version != kHeaderVersion)
+    {
+      DebugOut ( "FrameCodec: bad frame header" );
+      return false;
+    }
+
+    if (header.codec != (uint16_t)codec)
+    {
+      DebugOut ( "FrameCodec: frame was written with codec %d", header.codec );
+      return false;
+    }
+
+    return header.rawSize == header.width * header.height * BytesPerPixel ( (PixelFormat)header.format );
+  }
+
+  struct png_read_source
+  {
+    const unsigned char* data;
+    size_t size;
+    size_t offset;
+  };
+
+  void png_read_memory ( png_structp png, png_bytep out, png_size_t length )
+  {
+    auto source = reinterpret_cast<png_read_source*>(png_get_io_ptr ( png ));
+    if (source->offset + length > source->size)
+      png_error ( png, "read past end of buffer" );
+
+    memcpy ( out, source->data + source->offset, length );
+    source->offset += length;
+  }
+
+  class PngCodec : public FrameCodec
+  {
+  public:
+    PngCodec ( const CodecSettings& settings )
+      : _settings ( settings )
+      , _width ( 0 )
+      , _height ( 0 )
+      , _format ( PixelFormat::RGB8 )
+    {  }
+
+    CodecType Type () override { return CodecType::Png; }
+    const char* Extension () override { return CodecExtension ( CodecType::Png ); }
+
+    bool Encode ( const unsigned char* data, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) override
+    {
+      if (!_png || _width != width || _height != height || _format != format)
+      {
+        auto color_type = format == PixelFormat::RGB8 ? png_color_type::RGB : png_color_type::GRAY;
+        _png.reset ( new pngstripe ( width, height, color_type, _settings.threads, format == PixelFormat::Y8 ? 8 : 16 ) );
+        _png->SetCompressionLevel ( _settings.level );
+        _width = width;
+        _height = height;
+        _format = format;
+      }
+
+      return _png->Encode ( data, out );
+    }
+
+    bool Decode ( const unsigned char* data, size_t size, FrameImage& image ) override
+    {
+      png_read_source source = { data, size, 0 };
+      std::vector<png_bytep> rows;
+
+      png_structp png = png_create_read_struct ( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+      if (!png)
+        return false;
+
+      png_infop info = png_create_info_struct ( png );
+      if (!info)
+      {
+        png_destroy_read_struct ( &png, NULL, NULL );
+        return false;
+      }
+
+      if (setjmp ( png_jmpbuf ( png ) ))
+      {
+        png_destroy_read_struct ( &png, &info, NULL );
+        return false;
+      }
+
+      png_set_read_fn ( png, &source, png_read_memory );
+      png_read_info ( png, info );
+
+      auto color_type = png_get_color_type ( png, info );
+      auto bit_depth = png_get_bit_depth ( png, info );
+
+      if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+      {
+        image.format = bit_depth == 16 ? PixelFormat::Z16 : PixelFormat::Y8;
+        if (bit_depth < 8)
+          png_set_expand_gray_1_2_4_to_8 ( png );
+      }
+      else
+      {
+        image.format = PixelFormat::RGB8;
+        if (color_type == PNG_COLOR_TYPE_PALETTE)
+          png_set_palette_to_rgb ( png );
+        if (bit_depth == 16)
+          png_set_strip_16 ( png );
+      }
+
+      if (color_type & PNG_COLOR_MASK_ALPHA)
+        png_set_strip_alpha ( png );
+
+      // undo the big endian samples, depth comes back the way the camera produced it
+      if (bit_depth == 16 && image.format == PixelFormat::Z16)
+        png_set_swap ( png );
+
+      png_read_update_info ( png, info );
+
+      image.width = png_get_image_width ( png, info );
+      image.height = png_get_image_height ( png, info );
+
+      auto row_bytes = png_get_rowbytes ( png, info );
+      image.data.resize ( row_bytes * image.height );
+
+      rows.resize ( image.height );
+      for (int y = 0; y < image.height; y++)
+        rows[y] = &image.data[y * row_bytes];
+
+      png_read_image ( png, rows.data () );
+      png_read_end ( png, NULL );
+
+      png_destroy_read_struct ( &png, &info, NULL );
+
+      return true;
+    }
+
+  private:
+    CodecSettings _settings;
+    std::unique_ptr<pngstripe> _png;
+    int _width;
+    int _height;
+    PixelFormat _format;
+  };
+
+  class Lz4Codec : public FrameCodec
+  {
+  public:
+    Lz4Codec ( const CodecSettings& settings )
+      : _settings ( settings )
+    {  }
+
+    CodecType Type () override { return CodecType::Lz4; }
+    const char* Extension () override { return CodecExtension ( CodecType::Lz4 ); }
+
+    bool Encode ( const unsigned char* data, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) override
+    {
+      int rawSize = width * height * BytesPerPixel ( format );
+      int bound = LZ4_compressBound ( rawSize );
+
+      out.resize ( sizeof ( FrameHeader ) + bound );
+      write_header ( out, CodecType::Lz4, width, height, format, rawSize );
+
+      auto src = reinterpret_cast<const char*>(data);
+      auto dst = reinterpret_cast<char*>(out.data () + sizeof ( FrameHeader ));
+
+      // the fast path is what lets us keep up at full rate, HC only when a level is asked for
+      int size = _settings.level >= LZ4HC_CLEVEL_MIN
+        ? LZ4_compress_HC ( src, dst, rawSize, bound, _settings.level )
+        : LZ4_compress_default ( src, dst, rawSize, bound );
+
+      if (size <= 0)
+      {
+        DebugOut ( "Lz4Codec::Encode failed" );
+        return false;
+      }
+
+      out.resize ( sizeof ( FrameHeader ) + size );
+      return true;
+    }
+
+    bool Decode ( const unsigned char* data, size_t size, FrameImage& image ) override
+    {
+      FrameHeader header;
+      if (!read_header ( data, size, CodecType::Lz4, header ))
+        return false;
+
+      image.width = header.width;
+      image.height = header.height;
+      image.format = (PixelFormat)header.format;
+      image.data.resize ( header.rawSize );
+
+      int decoded = LZ4_decompress_safe (
+        reinterpret_cast<const char*>(data + sizeof ( FrameHeader )),
+        reinterpret_cast<char*>(image.data.data ()),
+        (int)(size - sizeof ( FrameHeader )),
+        (int)header.rawSize );
+
+      return decoded == (int)header.rawSize;
+    }
+
+  private:
+    CodecSettings _settings;
+  };
+
+  class ZstdCodec : public FrameCodec
+  {
+  public:
+    ZstdCodec ( const CodecSettings& settings )
+      : _cctx ( ZSTD_createCCtx () )
+      , _dctx ( ZSTD_createDCtx () )
+    {
+      int level = settings.level < 0 ? ZSTD_CLEVEL_DEFAULT : settings.level;
+      int workers = settings.threads == 0 ? (int)std::thread::hardware_concurrency () : settings.threads;
+
+      ZSTD_CCtx_setParameter ( _cctx, ZSTD_c_compressionLevel, level );
+
+      // zstd runs single threaded with 0 workers, any other count is that many helper threads
+      if (workers > 1)
+        ZSTD_CCtx_setParameter ( _cctx, ZSTD_c_nbWorkers, workers );
+    }
+
+    ~ZstdCodec ()
+    {
+      ZSTD_freeCCtx ( _cctx );
+      ZSTD_freeDCtx ( _dctx );
+    }
+
+    CodecType Type () override { return CodecType::Zstd; }
+    const char* Extension () override { return CodecExtension ( CodecType::Zstd ); }
+
+    bool Encode ( const unsigned char* data, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) override
+    {
+      size_t rawSize = (size_t)width * height * BytesPerPixel ( format );
+      size_t bound = ZSTD_compressBound ( rawSize );
+
+      out.resize ( sizeof ( FrameHeader ) + bound );
+      write_header ( out, CodecType::Zstd, width, height, format, (uint32_t)rawSize );
+
+      size_t size = ZSTD_compress2 ( _cctx, out.data () + sizeof ( FrameHeader ), bound, data, rawSize );
+      if (ZSTD_isError ( size ))
+      {
+        DebugOut ( "ZstdCodec::Encode failed: %s", ZSTD_getErrorName ( size ) );
+        return false;
+      }
+
+      out.resize ( sizeof ( FrameHeader ) + size );
+      return true;
+    }
+
+    bool Decode ( const unsigned char* data, size_t size, FrameImage& image ) override
+    {
+      FrameHeader header;
+      if (!read_header ( data, size, CodecType::Zstd, header ))
+        return false;
+
+      image.width = header.width;
+      image.height = header.height;
+      image.format = (PixelFormat)header.format;
+      image.data.resize ( header.rawSize );
+
+      size_t decoded = ZSTD_decompressDCtx ( _dctx, image.data.data (), header.rawSize, data + sizeof ( FrameHeader ), size - sizeof ( FrameHeader ) );
+
+      return !ZSTD_isError ( decoded ) && decoded == header.rawSize;
+    }
+
+  private:
+    ZSTD_CCtx* _cctx;
+    ZSTD_DCtx* _dctx;
+  };
+
+  // color only, QOI has no 16 bit mode
+  class QoiCodec : public FrameCodec
+  {
+  public:
+    CodecType Type () override { return CodecType::Qoi; }
+    const char* Extension () override { return CodecExtension ( CodecType::Qoi ); }
+
+    bool Encode ( const unsigned char* data, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) override
+    {
+      if (format != PixelFormat::RGB8)
+      {
+        DebugOut ( "QoiCodec::Encode only RGB8 is supported" );
+        return false;
+      }
+
+      return QoiEncode ( data, width, height, 3, out );
+    }
+
+    bool Decode ( const unsigned char* data, size_t size, FrameImage& image ) override
+    {
+      int channels;
+      if (!QoiDecode ( data, size, image.width, image.height, channels, image.data ) || channels != 3)
+        return false;
+
+      image.format = PixelFormat::RGB8;
+      return true;
+    }
+  };
+
+  // lossy, RGB8 color or Y8 infrared. The turbojpeg handles live as long as the codec,
+  // which is one per stream per encoder thread, so nothing is set up per frame
+  class JpegCodec : public FrameCodec
+  {
+  public:
+    JpegCodec ( const CodecSettings& settings )
+      : _compressor ( tjInitCompress () )
+      , _decompressor ( tjInitDecompress () )
+      , _quality ( settings.level < 0 ? 95 : std::min ( std::max ( settings.level, 1 ), 100 ) )
+      , _flags ( settings.fastDct ? TJFLAG_FASTDCT : TJFLAG_ACCURATEDCT )
+    {
+      switch (settings.subsampling)
+      {
+      case ChromaSubsampling::S444: _subsampling = TJSAMP_444; break;
+      case ChromaSubsampling::S422: _subsampling = TJSAMP_422; break;
+      default: _subsampling = TJSAMP_420; break;
+      }
+    }
+
+    ~JpegCodec ()
+    {
+      if (_compressor)
+        tjDestroy ( _compressor );
+      if (_decompressor)
+        tjDestroy ( _decompressor );
+    }
+
+    CodecType Type () override { return CodecType::Jpeg; }
+    const char* Extension () override { return CodecExtension ( CodecType::Jpeg ); }
+
+    bool Encode ( const unsigned char* data, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) override
+    {
+      if (!_compressor || format == PixelFormat::Z16)
+      {
+        DebugOut ( "JpegCodec::Encode only RGB8 and Y8 are supported" );
+        return false;
+      }
+
+      int pixelFormat = format == PixelFormat::Y8 ? TJPF_GRAY : TJPF_RGB;
+      int subsampling = format == PixelFormat::Y8 ? TJSAMP_GRAY : _subsampling;
+
+      // compress straight into the output buffer, sized for the worst case so turbojpeg never reallocates it
+      out.resize ( tjBufSize ( width, height, subsampling ) );
+      unsigned char* jpeg = out.data ();
+      unsigned long size = (unsigned long)out.size ();
+
+      if (tjCompress2 ( _compressor, data, width, 0, height, pixelFormat, &jpeg, &size, subsampling, _quality, _flags | TJFLAG_NOREALLOC ) != 0)
+      {
+        DebugOut ( "JpegCodec::Encode failed: %s", tjGetErrorStr2 ( _compressor ) );
+        return false;
+      }
+
+      out.resize ( size );
+      return true;
+    }
+
+    bool Decode ( const unsigned char* data, size_t size, FrameImage& image ) override
+    {
+      int subsampling, colorspace;
+      if (!_decompressor || tjDecompressHeader3 ( _decompressor, data, (unsigned long)size, &image.width, &image.height, &subsampling, &colorspace ) != 0)
+        return false;
+
+      image.format = subsampling == TJSAMP_GRAY ? PixelFormat::Y8 : PixelFormat::RGB8;
+      image.data.resize ( (size_t)image.width * image.height * BytesPerPixel ( image.format ) );
+
+      int pixelFormat = image.format == PixelFormat::Y8 ? TJPF_GRAY : TJPF_RGB;
+
+      return tjDecompress2 ( _decompressor, data, (unsigned long)size, image.data.data (), image.width, 0, image.height, pixelFormat, _flags ) == 0;
+    }
+
+  private:
+    tjhandle _compressor;
+    tjhandle _decompressor;
+    int _quality;
+    int _subsampling;
+    int _flags;
+  };
+
+  // zig-zag puts small residuals of either sign into small codes: 0, -1, 1, -2 ... become 0, 1, 2, 3 ...
+  inline __m128i zigzag8 ( __m128i d )
+  {
+    return _mm_xor_si128 ( _mm_slli_epi16 ( d, 1 ), _mm_srai_epi16 ( d, 15 ) );
+  }
+
+  inline __m128i unzigzag8 ( __m128i z )
+  {
+    return _mm_xor_si128 ( _mm_srli_epi16 ( z, 1 ), _mm_sub_epi16 ( _mm_setzero_si128 (), _mm_and_si128 ( z, _mm_set1_epi16 ( 1 ) ) ) );
+  }
+
+  inline uint16_t zigzag ( uint16_t d )
+  {
+    return (uint16_t)((d << 1) ^ (uint16_t)((int16_t)d >> 15));
+  }
+
+  inline uint16_t unzigzag ( uint16_t z )
+  {
+    return (uint16_t)((z >> 1) ^ (uint16_t)(0 - (z & 1)));
+  }
+
+  // Z16 only. A keyframe is coded as the difference to the pixel on its left (the first column to the
+  // pixel above), any other frame as the difference to the same pixel of the frame before. The zig-zag
+  // residuals are split into a plane of low and a plane of high bytes, the high plane is nearly all
+  // zeros, and both go through zstd, whose entropy stage does the rest.
+  class DepthDeltaCodec : public FrameCodec
+  {
+  public:
+    DepthDeltaCodec ( const CodecSettings& settings )
+      : _cctx ( ZSTD_createCCtx () )
+      , _dctx ( ZSTD_createDCtx () )
+    {
+      // the residuals are cheap to compress, a low level keeps the encoder well ahead of deflate
+      int level = settings.level < 0 ? 1 : settings.level;
+      int workers = settings.threads == 0 ? (int)std::thread::hardware_concurrency () : settings.threads;
+
+      ZSTD_CCtx_setParameter ( _cctx, ZSTD_c_compressionLevel, level );
+
+      if (workers > 1)
+        ZSTD_CCtx_setParameter ( _cctx, ZSTD_c_nbWorkers, workers );
+    }
+
+    ~DepthDeltaCodec ()
+    {
+      ZSTD_freeCCtx ( _cctx );
+      ZSTD_freeDCtx ( _dctx );
+    }
+
+    CodecType Type () override { return CodecType::DepthDelta; }
+    const char* Extension () override { return CodecExtension ( CodecType::DepthDelta ); }
+    bool IsTemporal () override { return true; }
+
+    bool Encode ( const unsigned char* data, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) override
+    {
+      return EncodeDelta ( data, nullptr, 0, width, height, format, out );
+    }
+
+    bool Decode ( const unsigned char* data, size_t size, FrameImage& image ) override
+    {
+      return DecodeDelta ( data, size, nullptr, image );
+    }
+
+    bool EncodeDelta ( const unsigned char* data, const unsigned char* reference, int keyframeDistance, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) override
+    {
+      if (format != PixelFormat::Z16)
+      {
+        DebugOut ( "DepthDeltaCodec::Encode only Z16 is supported" );
+        return false;
+      }
+
+      if (!reference)
+        keyframeDistance = 0;
+
+      size_t pixels = (size_t)width * height;
+      _planes.resize ( pixels * 2 );
+
+      auto src = reinterpret_cast<const uint16_t*>(data);
+      unsigned char* low = _planes.data ();
+      unsigned char* high = low + pixels;
+
+      if (keyframeDistance == 0)
+      {
+        for (int y = 0; y < height; y++)
+        {
+          const uint16_t* row = src + (size_t)y * width;
+          size_t offset = (size_t)y * width;
+
+          // the first pixel of a row is predicted from above, the rest from the left
+          uint16_t first = zigzag ( (uint16_t)(row[0] - (y > 0 ? row[-width] : 0)) );
+          low[offset] = (unsigned char)first;
+          high[offset] = (unsigned char)(first >> 8);
+
+          ResidualPlanes ( row + 1, row, width - 1, low + offset + 1, high + offset + 1 );
+        }
+      }
+      else
+      {
+        ResidualPlanes ( src, reinterpret_cast<const uint16_t*>(reference), pixels, low, high );
+      }
+
+      size_t bound = ZSTD_compressBound ( _planes.size () );
+      size_t headers = sizeof ( FrameHeader ) + sizeof ( DeltaHeader );
+
+      out.resize ( headers + bound );
+      write_header ( out, CodecType::DepthDelta, width, height, format, (uint32_t)(pixels * 2) );
+
+      DeltaHeader delta = { (uint32_t)keyframeDistance, 0 };
+      memcpy ( out.data () + sizeof ( FrameHeader ), &delta, sizeof ( delta ) );
+
+      size_t size = ZSTD_compress2 ( _cctx, out.data () + headers, bound, _planes.data (), _planes.size () );
+      if (ZSTD_isError ( size ))
+      {
+        DebugOut ( "DepthDeltaCodec::Encode failed: %s", ZSTD_getErrorName ( size ) );
+        return false;
+      }
+
+      out.resize ( headers + size );
+      return true;
+    }
+
+    bool DecodeDelta ( const unsigned char* data, size_t size, const FrameImage* reference, FrameImage& image ) override
+    {
+      FrameHeader header;
+      if (!read_header ( data, size, CodecType::DepthDelta, header ) || size < sizeof ( FrameHeader ) + sizeof ( DeltaHeader ))
+        return false;
+
+      int distance = KeyframeDistance ( data, size );
+      size_t pixels = (size_t)header.width * header.height;
+
+      if (distance > 0 && (!reference || reference->width != (int)header.width || reference->height != (int)header.height
+        || reference->format != PixelFormat::Z16 || reference->data.size () != pixels * 2))
+      {
+        DebugOut ( "DepthDeltaCodec::Decode needs the frame before, %d frames after a keyframe", distance );
+        return false;
+      }
+
+      size_t headers = sizeof ( FrameHeader ) + sizeof ( DeltaHeader );
+      _planes.resize ( pixels * 2 );
+
+      size_t decoded = ZSTD_decompressDCtx ( _dctx, _planes.data (), _planes.size (), data + headers, size - headers );
+      if (ZSTD_isError ( decoded ) || decoded != _planes.size ())
+        return false;
+
+      image.width = header.width;
+      image.height = header.height;
+      image.format = PixelFormat::Z16;
+      image.data.resize ( pixels * 2 );
+
+      const unsigned char* low = _planes.data ();
+      const unsigned char* high = low + pixels;
+      auto dst = reinterpret_cast<uint16_t*>(image.data.data ());
+
+      if (distance > 0)
+      {
+        ApplyPlanes ( low, high, reinterpret_cast<const uint16_t*>(reference->data.data ()), pixels, dst );
+        return true;
+      }
+
+      // the prediction runs along the rows, so a keyframe decodes one pixel after another
+      int width = header.width;
+      for (int y = 0; y < (int)header.height; y++)
+      {
+        size_t offset = (size_t)y * width;
+        uint16_t prev = y > 0 ? dst[offset - width] : 0;
+
+        for (int x = 0; x < width; x++)
+        {
+          prev = (uint16_t)(prev + unzigzag ( (uint16_t)(low[offset + x] | (high[offset + x] << 8)) ));
+          dst[offset + x] = prev;
+        }
+      }
+
+      return true;
+    }
+
+    int KeyframeDistance ( const unsigned char* data, size_t size ) override
+    {
+      if (!data || size < sizeof ( FrameHeader ) + sizeof ( DeltaHeader ))
+        return 0;
+
+      DeltaHeader delta;
+      memcpy ( &delta, data + sizeof ( FrameHeader ), sizeof ( delta ) );
+
+      return (int)delta.keyframeDistance;
+    }
+
+  private:
+    ZSTD_CCtx* _cctx;
+    ZSTD_DCtx* _dctx;
+    std::vector<unsigned char> _planes;  // low bytes then high bytes, kept between frames
+
+    // zig-zag of cur - pred split into byte planes, sixteen pixels at a time
+    static void ResidualPlanes ( const uint16_t* cur, const uint16_t* pred, size_t count, unsigned char* low, unsigned char* high )
+    {
+      const __m128i mask = _mm_set1_epi16 ( 0xFF );
+
+      size_t i = 0;
+      for (; i + 16 <= count; i += 16)
+      {
+        __m128i a = zigzag8 ( _mm_sub_epi16 ( _mm_loadu_si128 ( (const __m128i*)(cur + i) ), _mm_loadu_si128 ( (const __m128i*)(pred + i) ) ) );
+        __m128i b = zigzag8 ( _mm_sub_epi16 ( _mm_loadu_si128 ( (const __m128i*)(cur + i + 8) ), _mm_loadu_si128 ( (const __m128i*)(pred + i + 8) ) ) );
+
+        _mm_storeu_si128 ( (__m128i*)(low + i), _mm_packus_epi16 ( _mm_and_si128 ( a, mask ), _mm_and_si128 ( b, mask ) ) );
+        _mm_storeu_si128 ( (__m128i*)(high + i), _mm_packus_epi16 ( _mm_srli_epi16 ( a, 8 ), _mm_srli_epi16 ( b, 8 ) ) );
+      }
+
+      for (; i < count; i++)
+      {
+        uint16_t z = zigzag ( (uint16_t)(cur[i] - pred[i]) );
+        low[i] = (unsigned char)z;
+        high[i] = (unsigned char)(z >> 8);
+      }
+    }
+
+    static void ApplyPlanes ( const unsigned char* low, const unsigned char* high, const uint16_t* pred, size_t count, uint16_t* out )
+    {
+      size_t i = 0;
+      for (; i + 16 <= count; i += 16)
+      {
+        __m128i l = _mm_loadu_si128 ( (const __m128i*)(low + i) );
+        __m128i h = _mm_loadu_si128 ( (const __m128i*)(high + i) );
+
+        __m128i a = _mm_add_epi16 ( _mm_loadu_si128 ( (const __m128i*)(pred + i) ), unzigzag8 ( _mm_unpacklo_epi8 ( l, h ) ) );
+        __m128i b = _mm_add_epi16 ( _mm_loadu_si128 ( (const __m128i*)(pred + i + 8) ), unzigzag8 ( _mm_unpackhi_epi8 ( l, h ) ) );
+
+        _mm_storeu_si128 ( (__m128i*)(out + i), a );
+        _mm_storeu_si128 ( (__m128i*)(out + i + 8), b );
+      }
+
+      for (; i < count; i++)
+        out[i] = (uint16_t)(pred[i] + unzigzag ( (uint16_t)(low[i] | (high[i] << 8)) ));
+    }
+  };
+}
+
+int EF::BytesPerPixel ( PixelFormat format )
+{
+  switch (format)
+  {
+  case PixelFormat::RGB8: return 3;
+  case PixelFormat::Z16: return 2;
+  case PixelFormat::Y8: return 1;
+  }
+  return 0;
+}
+
+const char* EF::CodecExtension ( CodecType type )
+{
+  switch (type)
+  {
+  case CodecType::Png: return ".png";
+  case CodecType::Lz4: return ".lz4";
+  case CodecType::Zstd: return ".zst";
+  case CodecType::Qoi: return ".qoi";
+  case CodecType::Jpeg: return ".jpg";
+  case CodecType::DepthDelta: return ".zdd";
+  }
+  return "";
+}
+
+bool EF::CodecSupports ( CodecType type, PixelFormat format )
+{
+  switch (type)
+  {
+  case CodecType::Qoi: return format == PixelFormat::RGB8;
+  case CodecType::Jpeg: return format != PixelFormat::Z16;
+  case CodecType::DepthDelta: return format == PixelFormat::Z16;
+  default: return true;
+  }
+}
+
+FrameCodec* EF::CreateCodec ( const CodecSettings& settings )
+{
+  switch (settings.codec)
+  {
+  case CodecType::Png: return new PngCodec ( settings );
+  case CodecType::Lz4: return new Lz4Codec ( settings );
+  case CodecType::Zstd: return new ZstdCodec ( settings );
+  case CodecType::Qoi: return new QoiCodec ();
+  case CodecType::Jpeg: return new JpegCodec ( settings );
+  case CodecType::DepthDelta: return new DepthDeltaCodec ( settings );
+  }
+  return nullptr;
+}
+
+FrameCodec* EF::CreateCodecForFile ( const std::string& filename )
+{
+  auto extension = fs::path ( filename ).extension ().string ();
+
+  for (auto type : { CodecType::Png, CodecType::Lz4, CodecType::Zstd, CodecType::Qoi, CodecType::Jpeg, CodecType::DepthDelta })
+  {
+    if (extension != CodecExtension ( type ))
+      continue;
+
+    CodecSettings settings;
+    settings.codec = type;
+    settings.threads = 1;
+
+    return CreateCodec ( settings );
+  }
+
+  return nullptr;
+}
+
+bool EF::DecodeFrameFile ( const std::string& filename, FrameImage& image ) try
+{
+  std::unique_ptr<FrameCodec> codec ( CreateCodecForFile ( filename ) );
+  if (!codec)
+  {
+    DebugOut ( "DecodeFrameFile: no codec for %s", filename.c_str () );
+    return false;
+  }
+
+  std::vector<unsigned char> buffer;
+  if (!ReadBuffer ( filename, buffer ))
+    return false;
+
+  return codec->Decode ( buffer.data (), buffer.size (), image );
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "DecodeFrameFile exp: %s", e.what () );
+  return false;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace EF
+{
+  // values are mirrored by RsDsController::Codec, keep them in step
+  enum class CodecType : int
+  {
+    Png,
+    Lz4,
+    Zstd,
+    Qoi,
+    Jpeg,
+    DepthDelta,
+  };
+
+  enum class PixelFormat : int
+  {
+    RGB8,
+    Z16,
+    Y8,
+  };
+
+  int BytesPerPixel ( PixelFormat format );
+  const char* CodecExtension ( CodecType type );
+  // false for pairs the codec's Encode refuses, qoi only takes rgb, jpeg has no 16 bit mode and depth delta is depth only
+  bool CodecSupports ( CodecType type, PixelFormat format );
+
+  enum class ChromaSubsampling : int
+  {
+    S444,
+    S422,
+    S420,
+  };
+
+  struct CodecSettings
+  {
+    CodecSettings ()
+      : codec ( CodecType::Png )
+      , level ( -1 )
+      , threads ( 0 )
+      , subsampling ( ChromaSubsampling::S420 )
+      , fastDct ( false )
+      , keyframeInterval ( 30 )
+    {  }
+    CodecType codec;
+    int level;    // -1 picks the codec's own default, for jpeg this is the quality
+    int threads;  // 0 picks one per core, 1 disables threading
+    ChromaSubsampling subsampling;  // jpeg only
+    bool fastDct;                   // jpeg only
+    int keyframeInterval;           // temporal codecs only, frames from one keyframe to the next
+  };
+
+  // written in front of every raw (lz4, zstd) frame so readers can decode without guessing
+#pragma pack(push, 1)
+  struct FrameHeader
+  {
+    char magic[4];
+    uint16_t version;
+    uint16_t codec;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t rawSize;
+  };
+
+  // follows the FrameHeader of a depth delta frame
+  struct DeltaHeader
+  {
+    uint32_t keyframeDistance;  // frames back to the keyframe, 0 for a keyframe
+    uint32_t reserved;
+  };
+#pragma pack(pop)
+
+  struct FrameImage
+  {
+    int width;
+    int height;
+    PixelFormat format;
+    std::vector<unsigned char> data;
+  };
+
+  class FrameCodec
+  {
+  public:
+    virtual ~FrameCodec () {}
+
+    virtual CodecType Type () = 0;
+    virtual const char* Extension () = 0;
+
+    // data is tightly packed, Z16 is little endian like the realsense frames
+    virtual bool Encode ( const unsigned char* data, int width, int height, PixelFormat format, std::vector<unsigned char>& out ) = 0;
+    virtual bool Decode ( const unsigned char* data, size_t size, FrameImage& image ) = 0;
+
+    // Temporal codecs code a frame against reference, the frame before it in the stream, except for
+    // keyframes (keyframeDistance 0) which decode on their own. Decoding a frame that is not a keyframe
+    // needs the decoded frame before it, reaching it means decoding forward from the keyframe.
+    virtual bool IsTemporal () { return false; }
+    virtual bool EncodeDelta ( const unsigned char* data, const unsigned char* reference, int keyframeDistance, int width, int height, PixelFormat format, std::vector<unsigned char>& out )
+    {
+      return Encode ( data, width, height, format, out );
+    }
+    virtual bool DecodeDelta ( const unsigned char* data, size_t size, const FrameImage* reference, FrameImage& image )
+    {
+      return Decode ( data, size, image );
+    }
+    // frames back to the keyframe the frame in data depends on
+    virtual int KeyframeDistance ( const unsigned char* data, size_t size ) { return 0; }
+  };
+
+  FrameCodec* CreateCodec ( const CodecSettings& settings );
+  FrameCodec* CreateCodecForFile ( const std::string& filename );
+
+  bool DecodeFrameFile ( const std::string& filename, FrameImage& image );
+}
@@ -0,0 +1,476 @@
+#include "FrameIndex.h"
+#include "EncodeFrames.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  const char kIndexMagic[4] = { 'R', 'S', 'D', 'I' };
+  const uint16_t kIndexVersion = 1;
+
+  IndexIntrinsics to_index ( const rs_intrinsics& intrinsics )
+  {
+    IndexIntrinsics out;
+    out.width = intrinsics.width;
+    out.height = intrinsics.height;
+    out.ppx = intrinsics.ppx;
+    out.ppy = intrinsics.ppy;
+    out.fx = intrinsics.fx;
+    out.fy = intrinsics.fy;
+    return out;
+  }
+
+  IndexCrop to_index ( const RS::crop_rect& rect, int width, int height )
+  {
+    IndexCrop out;
+    memset ( &out, 0, sizeof ( out ) );
+
+    // the whole image stays zero, an index without a crop matches one from before crops
+    if (rect.x == 0 && rect.y == 0 && rect.width == width && rect.height == height)
+      return out;
+
+    out.x = rect.x;
+    out.y = rect.y;
+    out.width = rect.width;
+    out.height = rect.height;
+    return out;
+  }
+
+  IndexSession to_session ( const IndexHeader& header )
+  {
+    IndexSession session;
+    memset ( &session, 0, sizeof ( session ) );
+
+    session.flags = kIndexSessionCalibration;
+    memcpy ( session.codecs, header.codecs, sizeof ( session.codecs ) );
+    session.depthScale = header.depthScale;
+    session.depthIntrinsics = header.depthIntrinsics;
+    session.colorIntrinsics = header.colorIntrinsics;
+    memcpy ( session.rotation, header.rotation, sizeof ( session.rotation ) );
+    memcpy ( session.translation, header.translation, sizeof ( session.translation ) );
+
+    const IndexCrop* crops[2] = { &header.depthCrop, &header.colorCrop };
+    uint16_t* out[2] = { session.depthCrop, session.colorCrop };
+    for (int i = 0; i < 2; i++)
+    {
+      out[i][0] = (uint16_t)crops[i]->x;
+      out[i][1] = (uint16_t)crops[i]->y;
+      out[i][2] = (uint16_t)crops[i]->width;
+      out[i][3] = (uint16_t)crops[i]->height;
+    }
+
+    session.pyramidLevels = header.pyramidLevels;
+    return session;
+  }
+
+  // the header a session's frames were saved with, everything but the calibration comes from the file's
+  IndexHeader apply_session ( const IndexHeader& header, const IndexSession& session )
+  {
+    IndexHeader out = header;
+
+    memcpy ( out.codecs, session.codecs, sizeof ( out.codecs ) );
+    out.depthScale = session.depthScale;
+    out.depthIntrinsics = session.depthIntrinsics;
+    out.colorIntrinsics = session.colorIntrinsics;
+    memcpy ( out.rotation, session.rotation, sizeof ( out.rotation ) );
+    memcpy ( out.translation, session.translation, sizeof ( out.translation ) );
+
+    IndexCrop* crops[2] = { &out.depthCrop, &out.colorCrop };
+    const uint16_t* in[2] = { session.depthCrop, session.colorCrop };
+    for (int i = 0; i < 2; i++)
+    {
+      crops[i]->x = in[i][0];
+      crops[i]->y = in[i][1];
+      crops[i]->width = in[i][2];
+      crops[i]->height = in[i][3];
+    }
+
+    out.pyramidLevels = session.pyramidLevels;
+    return out;
+  }
+
+  // what the records depend on, an index that agrees on it can take records of another session
+  bool same_records ( const IndexHeader& existing, const IndexHeader& header )
+  {
+    return existing.recordSize == header.recordSize
+      && existing.streams == header.streams
+      && existing.framesPerShard == header.framesPerShard
+      && IndexLayout ( existing ).digits == IndexLayout ( header ).digits;
+  }
+
+  // indexes from before the frame layout was recorded end their header here
+  const size_t kMinHeaderSize = offsetof ( IndexHeader, framesPerShard );
+
+  bool parse_header ( const unsigned char* data, size_t size, IndexHeader& header )
+  {
+    if (size < kMinHeaderSize)
+      return false;
+
+    memset ( &header, 0, sizeof ( header ) );
+    memcpy ( &header, data, std::min ( size, sizeof ( header ) ) );
+
+    if (memcmp ( header.magic, kIndexMagic, sizeof ( header.magic ) ) != 0 || header.version != kIndexVersion
+      || header.headerSize < kMinHeaderSize || header.recordSize < sizeof ( IndexRecord ))
+      return false;
+
+    // what an older writer's header does not have stays zero
+    if (header.headerSize < sizeof ( header ))
+      memset ( (char*)&header + header.headerSize, 0, sizeof ( header ) - header.headerSize );
+
+    return true;
+  }
+
+  bool read_header ( FILE* file, IndexHeader& header )
+  {
+    unsigned char data[sizeof ( IndexHeader )];
+    return parse_header ( data, fread ( data, 1, sizeof ( data ), file ), header );
+  }
+}
+
+std::string EF::FramePath ( const FrameLayout& layout, RS::StreamType stream, int frame, const char* extension, int level )
+{
+  auto name = Format ( "%0*d%s", layout.digits, frame, extension );
+
+  if (layout.framesPerShard <= 0)
+    return (fs::path ( LevelFolder ( stream, level ) ) / name).string ();
+
+  return (fs::path ( ShardPath ( layout, stream, frame / layout.framesPerShard, level ) ) / name).string ();
+}
+
+std::string EF::ShardPath ( const FrameLayout& layout, RS::StreamType stream, int shard, int level )
+{
+  if (layout.framesPerShard <= 0)
+    return LevelFolder ( stream, level );
+
+  // as wide as the frame numbers less the digits a shard counts through, 1000 per shard drops three
+  int width = layout.digits - (int)Format ( "%d", layout.framesPerShard - 1 ).size ();
+
+  return (fs::path ( LevelFolder ( stream, level ) ) / Format ( "%0*d", std::max ( width, 1 ), shard )).string ();
+}
+
+FrameLayout EF::IndexLayout ( const IndexHeader& header )
+{
+  FrameLayout layout;
+  layout.framesPerShard = (int)header.framesPerShard;
+  layout.digits = header.frameDigits ? header.frameDigits : 6;
+  return layout;
+}
+
+IndexHeader EF::MakeIndexHeader ( RS::RealsenseController* realsense, const uint8_t codecs[], const FrameLayout& layout, int pyramidLevels )
+{
+  IndexHeader header;
+  memset ( &header, 0, sizeof ( header ) );
+
+  memcpy ( header.magic, kIndexMagic, sizeof ( header.magic ) );
+  header.version = kIndexVersion;
+  header.headerSize = sizeof ( IndexHeader );
+  header.recordSize = sizeof ( IndexRecord );
+  header.streams = realsense->GetStreams ();
+
+  for (int i = 0; i < RS::StreamCount; i++)
+    header.codecs[i] = codecs[i];
+
+  header.depthScale = realsense->GetDepthScale ();
+  header.depthIntrinsics = to_index ( realsense->GetDepthIntrinsics () );
+  header.colorIntrinsics = to_index ( realsense->GetColorIntrinsics () );
+
+  header.depthCrop = to_index ( realsense->GetCropRect ( RS::StreamDepth ), realsense->GetDepthWidth (), realsense->GetDepthHeight () );
+  header.colorCrop = to_index ( realsense->GetCropRect ( RS::StreamColor ), realsense->GetColorWidth (), realsense->GetColorHeight () );
+
+  auto extrinsics = realsense->GetExtrinsics ();
+  memcpy ( header.rotation, extrinsics.rotation, sizeof ( header.rotation ) );
+  memcpy ( header.translation, extrinsics.translation, sizeof ( header.translation ) );
+
+  header.framesPerShard = (uint32_t)std::max ( layout.framesPerShard, 0 );
+  header.frameDigits = (uint8_t)layout.digits;
+  header.pyramidLevels = (uint8_t)std::min ( std::max ( pyramidLevels, 0 ), kMaxPyramidLevels );
+
+  return header;
+}
+
+FrameIndexWriter::FrameIndexWriter ()
+  : _file ( nullptr )
+  , _session_pending ( false )
+{
+}
+
+FrameIndexWriter::~FrameIndexWriter ()
+{
+  Close ();
+}
+
+bool FrameIndexWriter::Open ( const std::string& filename, const IndexHeader& header, bool append ) try
+{
+  Close ();
+
+  if (append && fs::exists ( filename ))
+  {
+    IndexHeader existing;
+    bool matches = false;
+
+    if (FILE* file = fopen ( filename.c_str (), "rb" ))
+    {
+      matches = read_header ( file, existing ) && same_records ( existing, header );
+      fclose ( file );
+    }
+
+    if (matches)
+    {
+      // a partial record left by a crash would shift every record appended after it. The records start
+      // where the existing header ends, an older writer's is shorter than this one.
+      auto size = fs::file_size ( filename );
+      if (size > existing.headerSize)
+        fs::resize_file ( filename, existing.headerSize + (size - existing.headerSize) / existing.recordSize * existing.recordSize );
+
+      _file = fopen ( filename.c_str (), "ab" );
+      if (!_file)
+      {
+        DebugOut ( "FrameIndexWriter::Open failed to append to %s", filename.c_str () );
+        return false;
+      }
+
+      // a session saved like the header needs nothing more, one with other codecs or calibration records its own
+      _session = to_session ( header );
+      IndexSession previous = to_session ( existing );
+      _session_pending = memcmp ( &_session, &previous, sizeof ( _session ) ) != 0;
+
+      return true;
+    }
+
+    fs::path aside;
+    for (int n = 1; fs::exists ( aside = fs::path ( filename ).replace_extension ( Format ( ".%d.bin", n ) ) ); n++);
+
+    DebugOut ( "FrameIndexWriter::Open %s does not match this capture, moved to %s", filename.c_str (), aside.string ().c_str () );
+    fs::rename ( filename, aside );
+  }
+
+  _file = fopen ( filename.c_str (), "wb" );
+  if (!_file)
+  {
+    DebugOut ( "FrameIndexWriter::Open failed to create %s", filename.c_str () );
+    return false;
+  }
+
+  if (fwrite ( &header, sizeof ( header ), 1, _file ) != 1)
+  {
+    Close ();
+    return false;
+  }
+
+  fflush ( _file );
+  return true;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "FrameIndexWriter::Open exp: %s", e.what () );
+  return false;
+}
+
+bool FrameIndexWriter::Append ( const IndexRecord& record )
+{
+  if (!_file)
+    return false;
+
+  if (_session_pending)
+  {
+    _session.frame = record.frame;
+    _session_pending = false;
+
+    if (fwrite ( &_session, sizeof ( _session ), 1, _file ) != 1)
+    {
+      DebugOut ( "FrameIndexWriter::Append failed to write the session of frame %u", record.frame );
+      return false;
+    }
+  }
+
+  if (fwrite ( &record, sizeof ( record ), 1, _file ) != 1)
+  {
+    DebugOut ( "FrameIndexWriter::Append failed to write frame %u", record.frame );
+    return false;
+  }
+
+  fflush ( _file );
+  return true;
+}
+
+void FrameIndexWriter::Close ()
+{
+  if (_file)
+  {
+    fclose ( _file );
+    _file = nullptr;
+  }
+
+  _session_pending = false;
+}
+
+bool EF::ReadFrameIndex ( const std::string& filename, IndexHeader& header, std::vector<IndexRecord>& records, std::vector<IndexHeader>* sessions )
+{
+  std::vector<unsigned char> buffer;
+  if (!ReadBuffer ( filename, buffer ))
+    return false;
+
+  if (!parse_header ( buffer.data (), buffer.size (), header ))
+  {
+    DebugOut ( "ReadFrameIndex: %s is not a frame index", filename.c_str () );
+    return false;
+  }
+
+  if (header.headerSize > buffer.size ())
+    return false;
+
+  // newer writers may grow the records, the known prefix is still valid
+  size_t count = (buffer.size () - header.headerSize) / header.recordSize;
+
+  records.clear ();
+  records.reserve ( count );
+
+  if (sessions)
+    sessions->clear ();
+
+  IndexHeader session = header;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    const unsigned char* data = buffer.data () + header.headerSize + i * header.recordSize;
+
+    IndexRecord record;
+    memcpy ( &record, data, sizeof ( record ) );
+
+    if (record.flags & kIndexSessionCalibration)
+    {
+      IndexSession calibration;
+      memcpy ( &calibration, data, sizeof ( calibration ) );
+      session = apply_session ( header, calibration );
+      continue;
+    }
+
+    // the first record starts a session even in indexes from before the flag
+    if (sessions && (records.empty () || (record.flags & kIndexSessionStart)))
+    {
+      sessions->push_back ( session );
+      session = header;
+    }
+
+    records.push_back ( record );
+  }
+
+  return true;
+}
+
+bool EF::ReadLastIndexRecord ( const std::string& filename, IndexHeader& header, IndexRecord& record )
+{
+  FILE* file = fopen ( filename.c_str (), "rb" );
+  if (!file)
+    return false;
+
+  bool ret = false;
+
+  if (read_header ( file, header ))
+  {
+    fseek ( file, 0, SEEK_END );
+    long size = ftell ( file );
+
+    // a trailing partial record is dropped like ReadFrameIndex does
+    long count = size > header.headerSize ? (size - header.headerSize) / header.recordSize : 0;
+
+    // the last frame, a session written just before a crash is not one
+    for (; count > 0; count--)
+    {
+      ret = fseek ( file, header.headerSize + (count - 1) * header.recordSize, SEEK_SET ) == 0
+        && fread ( &record, sizeof ( record ), 1, file ) == 1;
+
+      if (!ret || !(record.flags & kIndexSessionCalibration))
+        break;
+
+      ret = false;
+    }
+  }
+
+  fclose ( file );
+  return ret;
+}
+
+int EF::NextFrameNumber ( const std::string& folder, FrameLayout* layout ) try
+{
+  fs::path path ( folder );
+  auto filename = (path / kIndexFilename).string ();
+
+  IndexHeader header;
+  IndexRecord record;
+  if (ReadLastIndexRecord ( filename, header, record ))
+  {
+    if (layout)
+      *layout = IndexLayout ( header );
+    return (int)record.frame + 1;
+  }
+
+  // an index without records still tells the layout
+  if (FILE* file = fopen ( filename.c_str (), "rb" ))
+  {
+    if (read_header ( file, header ) && layout)
+      *layout = IndexLayout ( header );
+    fclose ( file );
+  }
+
+  // captures from before the index have to be listed, frames are saved in every stream so one folder
+  // with files will do (rgb stays empty when color went to the video)
+  int next = 0;
+  int digits = 0;
+
+  // numbered folders are shards, the frame numbers are in the names of the files inside
+  std::vector<fs::path> shards;
+
+  auto list = [&] ( const fs::path& folderPath )
+  {
+    for (auto& entry : fs::directory_iterator ( folderPath ))
+    {
+      auto stem = entry.path ().stem ().string ();
+      if (stem.empty () || !isdigit ( (unsigned char)stem[0] ))
+        continue;
+
+      if (fs::is_directory ( entry.path () ))
+      {
+        shards.push_back ( entry.path () );
+        continue;
+      }
+
+      next = std::max ( next, atoi ( stem.c_str () ) + 1 );
+      digits = (int)stem.size ();
+    }
+  };
+
+  for (int i = 0; i < RS::StreamCount; i++)
+  {
+    fs::path streamPath = path / StreamFolder ( (RS::StreamType)i );
+    if (!fs::is_directory ( streamPath ))
+      continue;
+
+    shards.clear ();
+    list ( streamPath );
+
+    for (auto& shard : std::vector<fs::path> ( shards ))
+      list ( shard );
+
+    if (next > 0)
+      break;
+  }
+
+  if (layout && digits > 0)
+    layout->digits = digits;
+
+  return next;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "NextFrameNumber exp: %s", e.what () );
+  return 0;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "RealsenseController.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace EF
+{
+  // codec byte of a stream in the index header when it has no per frame files
+  const uint8_t kIndexVideo = 0xFE;    // color went to rgb.mkv
+  const uint8_t kIndexNoFiles = 0xFF;  // stream not captured
+
+  // IndexRecord::flags
+  const uint32_t kIndexSessionStart = 1;        // first frame of a capture session, appended sessions continue the numbering
+  const uint32_t kIndexSessionCalibration = 2;  // not a frame but an IndexSession, see there
+
+#pragma pack(push, 1)
+  struct IndexIntrinsics
+  {
+    int32_t width;
+    int32_t height;
+    float ppx;
+    float ppy;
+    float fx;
+    float fy;
+  };
+
+  // part of the sensor's image that was saved, in sensor pixels before any decimation
+  struct IndexCrop
+  {
+    int32_t x;
+    int32_t y;
+    int32_t width;   // 0 when the whole image was saved
+    int32_t height;
+  };
+
+  // start of index.bin, the calibration every frame of the capture shares
+  struct IndexHeader
+  {
+    char magic[4];                     // "RSDI"
+    uint16_t version;
+    uint16_t headerSize;               // records start here
+    uint32_t recordSize;
+    uint32_t streams;                  // RS::StreamFlags
+    uint8_t codecs[RS::StreamCount];   // CodecType of each stream's files, or kIndexVideo / kIndexNoFiles
+    float depthScale;                  // meters per depth unit
+    IndexIntrinsics depthIntrinsics;   // the infrared intrinsics too, unless the depth is decimated. Of the crop.
+    IndexIntrinsics colorIntrinsics;
+    float rotation[9];                 // depth to color, column major like rs_extrinsics
+    float translation[3];              // meters
+    uint32_t framesPerShard;           // FrameLayout, zero in indexes from before it was recorded
+    uint8_t frameDigits;
+    uint8_t pyramidLevels;             // smaller copies of the per frame files, see LevelFolder. Zero before they were recorded
+    uint8_t reserved[2];
+    IndexCrop depthCrop;               // depth and infrared, zero in indexes from before crops were recorded
+    IndexCrop colorCrop;
+  };
+
+  // one per saved frame, record i sits at headerSize + i * recordSize
+  struct IndexRecord
+  {
+    uint32_t frame;                          // number in the file names, see FrameLayout
+    uint32_t flags;                          // kIndexSessionStart, also keeps the 64 bit fields aligned
+    double timestamp[RS::StreamCount];       // sensor timestamps in milliseconds
+    uint64_t frameNumber[RS::StreamCount];   // sensor frame counters
+    uint64_t offset[RS::StreamCount];        // byte offset of the frame in its file, 0 for one file per frame
+    uint32_t size[RS::StreamCount];          // encoded bytes, 0 when the frame has no file for the stream
+    int32_t exposure[RS::StreamCount];       // actual exposure in microseconds, -1 when not reported
+  };
+
+  // Takes a record's place in front of the first record of an appended session whose codecs or calibration
+  // differ from the header's, the session's frames use it instead. Readers skip it as a frame.
+  struct IndexSession
+  {
+    uint32_t frame;                    // the session's first frame
+    uint32_t flags;                    // kIndexSessionCalibration
+    uint8_t codecs[RS::StreamCount];
+    float depthScale;
+    IndexIntrinsics depthIntrinsics;
+    IndexIntrinsics colorIntrinsics;
+    float rotation[9];
+    float translation[3];
+    uint16_t depthCrop[4];             // x, y, width, height like IndexCrop
+    uint16_t colorCrop[4];
+    uint8_t pyramidLevels;
+    uint8_t reserved[7];
+  };
+#pragma pack(pop)
+
+  static_assert ( sizeof ( IndexSession ) == sizeof ( IndexRecord ), "an IndexSession fills one record" );
+
+  const char* const kIndexFilename = "index.bin";
+
+  // How frame files are named under their stream folder. Sharding keeps every folder to framesPerShard
+  // files, e.g. rgb\00012\00012345.png with 1000 per shard, the shard being the frame number without its
+  // last digits. Zero padded numbers list in frame order as long as they fit in digits.
+  struct FrameLayout
+  {
+    FrameLayout ()
+      : framesPerShard ( 0 )
+      , digits ( 8 )
+    {  }
+    int framesPerShard;  // 0 keeps every frame directly in the stream folder
+    int digits;          // 6 in captures from before the layout was recorded
+  };
+
+  // relative to the capture folder, level picks a pyramid level's folder
+  std::string FramePath ( const FrameLayout& layout, RS::StreamType stream, int frame, const char* extension, int level = 0 );
+  // relative to the capture folder, the stream folder itself for a flat layout
+  std::string ShardPath ( const FrameLayout& layout, RS::StreamType stream, int shard, int level = 0 );
+  FrameLayout IndexLayout ( const IndexHeader& header );
+
+  IndexHeader MakeIndexHeader ( RS::RealsenseController* realsense, const uint8_t codecs[], const FrameLayout& layout = FrameLayout (), int pyramidLevels = 0 );
+
+  // Appends fixed size records and flushes each one, so after a crash the file holds every
+  // frame that was written before it (readers drop a trailing partial record).
+  class FrameIndexWriter
+  {
+  public:
+    FrameIndexWriter ();
+    ~FrameIndexWriter ();
+
+    // append keeps the records of an existing index with the same record size, streams and layout, codecs
+    // or calibration that differ from its header go in an IndexSession in front of the first new record.
+    // One that does not match is moved aside to index.<n>.bin
+    bool Open ( const std::string& filename, const IndexHeader& header, bool append = false );
+    bool Append ( const IndexRecord& record );
+    void Close ();
+    bool IsOpen () { return _file != nullptr; }
+
+  private:
+    FILE* _file;
+    bool _session_pending;  // written by the next Append
+    IndexSession _session;
+  };
+
+  // records holds the frames only. sessions, when given, gets the header each session was saved with,
+  // one per kIndexSessionStart record and in their order.
+  bool ReadFrameIndex ( const std::string& filename, IndexHeader& header, std::vector<IndexRecord>& records, std::vector<IndexHeader>* sessions = nullptr );
+  // reads the header and the last complete record only, false when the index has no records
+  bool ReadLastIndexRecord ( const std::string& filename, IndexHeader& header, IndexRecord& record );
+
+  // number after the highest frame saved in folder: from the last index record, or for captures
+  // without an index from the file names in the stream folders and their shards. 0 for an empty folder.
+  // layout, when given, gets the layout the frames already there were named with, so appended ones match
+  // them. It is left alone for an empty folder, and without an index only the digits are known.
+  int NextFrameNumber ( const std::string& folder, FrameLayout* layout = nullptr );
+}
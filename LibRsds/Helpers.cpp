@@ -15,6 +15,107 @@ std::wstring s2ws (const std::string& s)
   return r;
 }
 
+bool ReadBuffer (const std::string& filename, std::vector<unsigned char>& buffer)
+{
+  FILE *fp = fopen (filename.c_str (), "rb");
+  if (!fp)
+  {
+    DebugOut ("Failed to open %s for reading", filename.c_str ());
+    return false;
+  }
+
+  fseek (fp, 0, SEEK_END);
+  long size = ftell (fp);
+  fseek (fp, 0, SEEK_SET);
+
+  buffer.resize (size > 0 ? size : 0);
+  bool ret = size >= 0 && fread (buffer.data (), 1, buffer.size (), fp) == buffer.size ();
+
+  fclose (fp);
+
+  return ret;
+}
+
+bool WriteBuffer (const std::string& filename, const std::vector<unsigned char>& buffer)
+{
+  FILE *fp = fopen (filename.c_str (), "wb");
+  if (!fp)
+  {
+    DebugOut ("Failed to open %s for writing", filename.c_str ());
+    return false;
+  }
+
+  bool ret = fwrite (buffer.data (), 1, buffer.size (), fp) == buffer.size ();
+
+  fclose (fp);
+
+  return ret;
+}
+
+MappedFile::MappedFile ()
+  : _file (INVALID_HANDLE_VALUE)
+  , _mapping (NULL)
+  , _data (nullptr)
+  , _size (0)
+{
+}
+
+MappedFile::~MappedFile ()
+{
+  Close ();
+}
+
+bool MappedFile::Open (const std::string& filename)
+{
+  Close ();
+
+  _file = CreateFileA (filename.c_str (), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (_file == INVALID_HANDLE_VALUE)
+  {
+    DebugOut ("Failed to open %s for reading", filename.c_str ());
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx (_file, &size) || size.QuadPart == 0)
+  {
+    // an empty file cannot be mapped
+    Close ();
+    return false;
+  }
+
+  _mapping = CreateFileMappingA (_file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (_mapping)
+    _data = reinterpret_cast<const unsigned char*>(MapViewOfFile (_mapping, FILE_MAP_READ, 0, 0, 0));
+
+  if (!_data)
+  {
+    DebugOut ("Failed to map %s", filename.c_str ());
+    Close ();
+    return false;
+  }
+
+  _size = (size_t)size.QuadPart;
+  return true;
+}
+
+void MappedFile::Close ()
+{
+  if (_data)
+    UnmapViewOfFile (_data);
+
+  if (_mapping)
+    CloseHandle (_mapping);
+
+  if (_file != INVALID_HANDLE_VALUE)
+    CloseHandle (_file);
+
+  _file = INVALID_HANDLE_VALUE;
+  _mapping = NULL;
+  _data = nullptr;
+  _size = 0;
+}
+
 
 
 //void DebugOut (const std::string fmt, ...)
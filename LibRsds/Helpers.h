@@ -5,6 +5,9 @@
 #include <string>
 #include <sstream>
 #include <cstdio>
+#include <vector>
+
+#include "Log.h"
 
 
 #define NOMINMAX
@@ -26,6 +29,30 @@ if (ptr)              \
 
 std::wstring s2ws (const std::string& s);
 
+// whole file in one read / one write, the encoders hand over complete buffers
+bool ReadBuffer (const std::string& filename, std::vector<unsigned char>& buffer);
+bool WriteBuffer (const std::string& filename, const std::vector<unsigned char>& buffer);
+
+// read only view of a whole file, decoders read it straight from the page cache
+class MappedFile
+{
+public:
+  MappedFile ();
+  ~MappedFile ();
+
+  bool Open (const std::string& filename);
+  void Close ();
+
+  const unsigned char* Data () { return _data; }
+  size_t Size () { return _size; }
+
+private:
+  HANDLE _file;
+  HANDLE _mapping;
+  const unsigned char* _data;
+  size_t _size;
+};
+
 template<typename ... Args>
 std::string Format (const std::string fmt, Args ... args)
 {
@@ -36,16 +63,24 @@ std::string Format (const std::string fmt, Args ... args)
   return std::string (buf.get (), buf.get () + size - 1); // We don't want the '\0' inside
 }
 
+// a format built at run time is formatted by the caller, only literals are deferred to the logger thread
 template<typename ... Args>
-void DebugOut (const std::string fmt, Args ... args)
+void Log (LogLevel level, const std::string& fmt, Args ... args)
 {
-#if _DEBUG  
-  auto output = Format (fmt, args ...);
+  if (LogEnabled (level))
+    SubmitLogText (level, Format (fmt, args ...));
+}
 
-  output = output.append ("\r\n");
+template<size_t N, typename ... Args>
+void DebugOut (const char (&fmt)[N], Args ... args)
+{
+  Log (LogLevel::Debug, fmt, args ...);
+}
 
-  OutputDebugString ((LPCWSTR)s2ws (output).c_str ());
-#endif
+template<typename ... Args>
+void DebugOut (const std::string& fmt, Args ... args)
+{
+  Log (LogLevel::Debug, fmt, args ...);
 }
 
 
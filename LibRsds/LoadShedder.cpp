@@ -0,0 +1,255 @@
+#include "LoadShedder.h"
+#include "EncodeFrames.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace EF;
+
+static_assert (kShedStreams == StreamCount, "LoadShedder streams out of step with RS::StreamCount");
+
+namespace
+{
+  const int kLz4HcMin = 3;  // LZ4HC_CLEVEL_MIN, lower levels take lz4's fast path
+
+  const char* codec_name ( CodecType codec )
+  {
+    switch (codec)
+    {
+    case CodecType::Png: return "png";
+    case CodecType::Lz4: return "lz4";
+    case CodecType::Zstd: return "zstd";
+    case CodecType::Qoi: return "qoi";
+    case CodecType::Jpeg: return "jpeg";
+    case CodecType::DepthDelta: return "depth delta";
+    default: return "";
+    }
+  }
+
+  // the level a codec runs at for level -1 and its fastest lossless one, false for codecs without levels to give
+  bool effort_range ( const CodecSettings& settings, int& configured, int& fastest )
+  {
+    switch (settings.codec)
+    {
+    case CodecType::Png:
+      configured = settings.level < 0 ? 6 : settings.level;
+      fastest = 1;
+      break;
+    case CodecType::Zstd:
+      configured = settings.level < 0 ? 3 : settings.level;
+      fastest = 1;
+      break;
+    case CodecType::DepthDelta:
+      configured = settings.level < 0 ? 1 : settings.level;
+      fastest = 1;
+      break;
+    case CodecType::Lz4:
+      configured = settings.level < kLz4HcMin ? -1 : settings.level;
+      fastest = -1;
+      break;
+    default:
+      // jpeg's level is its quality and qoi has none, neither gets faster without losing more
+      return false;
+    }
+
+    return configured > fastest;
+  }
+
+  std::string level_name ( const CodecSettings& settings )
+  {
+    return settings.codec == CodecType::Lz4 && settings.level < kLz4HcMin ? "fast" : Format ( "level %d", settings.level );
+  }
+}
+
+LoadShedder::LoadShedder ()
+  : _streams ( 0 )
+  , _save_fps ( 30 )
+  , _high ( 0 )
+  , _low ( 0 )
+  , _effort_steps ( 0 )
+  , _rate_steps ( 0 )
+  , _drop_steps ( 0 )
+  , _step ( 0 )
+  , _last_change_ms ( 0 )
+  , _calm_since_ms ( -1 )
+  , _latency_ms ( 0 )
+{
+}
+
+void LoadShedder::Configure ( const LoadShedSettings& settings, float saveFps, int targets, const CodecSettings codecs[kShedStreams], int streams )
+{
+  _settings = settings;
+  _streams = streams;
+  _save_fps = saveFps > 0 ? saveFps : 30;
+  targets = std::max ( targets, 1 );
+
+  for (int i = 0; i < kShedStreams; i++)
+    _codecs[i] = codecs[i];
+
+  _high = settings.highQueue > 0 ? settings.highQueue : std::max ( 4, (int)std::ceil ( _save_fps ) * targets );
+  _low = std::max ( 1, _high / 4 );
+
+  _effort_steps = 0;
+  if (settings.effort)
+  {
+    for (int i = 0; i < kShedStreams; i++)
+    {
+      int configured, fastest;
+      if ((streams & (1 << i)) && effort_range ( codecs[i], configured, fastest ))
+        _effort_steps = kEffortSteps;
+    }
+  }
+
+  // halving until the next half would go under the minimum, which is then the last step
+  _rate_steps = 0;
+  if (settings.minSaveFps > 0 && settings.minSaveFps < _save_fps)
+  {
+    for (float fps = _save_fps; fps > settings.minSaveFps; fps /= 2)
+      _rate_steps++;
+  }
+
+  _drop_steps = settings.drop == ShedDrop::Never ? 0 : 1;
+
+  _step = 0;
+  _last_change_ms = 0;
+  _calm_since_ms = -1;
+  _latency_ms = 0;
+  _alternate.assign ( targets, 0 );
+  _decisions.clear ();
+}
+
+bool LoadShedder::Update ( int queued, double nowMs, const std::vector<int>& firstFrames )
+{
+  if (!_settings.enabled || Steps () == 0)
+    return false;
+
+  bool over = queued > _high || (_settings.maxLatencyMs > 0 && _latency_ms > _settings.maxLatencyMs);
+  bool calm = queued <= _low && (_settings.maxLatencyMs <= 0 || _latency_ms < _settings.maxLatencyMs / 2);
+  bool held = nowMs - _last_change_ms >= _settings.holdMs;
+
+  int step = _step;
+
+  if (over)
+  {
+    _calm_since_ms = -1;
+    if (held && _step < Steps ())
+      step = _step + 1;
+  }
+  else if (calm)
+  {
+    if (_calm_since_ms < 0)
+      _calm_since_ms = nowMs;
+
+    if (held && _step > 0 && nowMs - _calm_since_ms >= 3.0 * _settings.holdMs)
+    {
+      step = _step - 1;
+      _calm_since_ms = nowMs;
+    }
+  }
+  else
+    _calm_since_ms = -1;
+
+  if (step == _step)
+    return false;
+
+  ShedDecision decision;
+  decision.timeMs = nowMs;
+  decision.from = _step;
+  decision.to = step;
+  decision.queued = queued;
+  decision.latencyMs = _latency_ms;
+  decision.firstFrames = firstFrames;
+  decision.text = Format ( "load shedding step %d -> %d with %d queued and %.0f ms latency: %s", _step, step, queued, _latency_ms, Describe ( step ).c_str () );
+
+  std::string frames;
+  for (size_t t = 0; t < firstFrames.size (); t++)
+    frames += Format ( "%s%d", t ? ", " : "", firstFrames[t] );
+  decision.text += Format ( ", from frame %s", frames.c_str () );
+
+  Log ( LogLevel::Info, "LoadShedder %s", decision.text.c_str () );
+
+  _decisions.push_back ( decision );
+  _step = step;
+  _last_change_ms = nowMs;
+
+  return true;
+}
+
+void LoadShedder::Committed ( double latencyMs )
+{
+  // smoothed over the last few frames, one slow write is no overload
+  _latency_ms = _latency_ms > 0 ? (float)(0.8 * _latency_ms + 0.2 * latencyMs) : (float)latencyMs;
+}
+
+float LoadShedder::SaveRateLimitAt ( int step )
+{
+  int halvings = std::min ( std::max ( step - _effort_steps, 0 ), _rate_steps );
+  if (halvings == 0)
+    return 0;
+
+  return std::max ( _settings.minSaveFps, _save_fps / (float)(1 << halvings) );
+}
+
+bool LoadShedder::Drops ( int queued, int target )
+{
+  if (_drop_steps == 0 || _step < Steps ())
+    return false;
+
+  if (_settings.drop == ShedDrop::Newest)
+    return queued >= _high;
+
+  if (target < 0 || target >= (int)_alternate.size ())
+    return false;
+
+  return (_alternate[target]++ & 1) != 0;
+}
+
+CodecSettings LoadShedder::EffortSettings ( const CodecSettings& settings, int effort )
+{
+  int configured, fastest;
+  if (effort <= 0 || !effort_range ( settings, configured, fastest ))
+    return settings;
+
+  CodecSettings faster = settings;
+
+  if (effort >= kEffortSteps)
+    faster.level = fastest;
+  else if (settings.codec == CodecType::Lz4)
+    faster.level = std::max ( kLz4HcMin, configured - (configured - kLz4HcMin) * effort / kEffortSteps );
+  else
+    faster.level = configured - (configured - fastest) * effort / kEffortSteps;
+
+  return faster;
+}
+
+std::string LoadShedder::Describe ( int step )
+{
+  if (step <= 0)
+    return "full effort and rate";
+
+  if (step <= _effort_steps)
+  {
+    std::string text;
+    for (int i = 0; i < kShedStreams; i++)
+    {
+      if (!(_streams & (1 << i)))
+        continue;
+
+      auto faster = EffortSettings ( _codecs[i], step );
+      if (faster.level == _codecs[i].level)
+        continue;
+
+      text += Format ( "%s%s %s %s", text.empty () ? "" : ", ", StreamFolder ( (StreamType)i ), codec_name ( faster.codec ), level_name ( faster ).c_str () );
+    }
+    return text;
+  }
+
+  if (step <= _effort_steps + _rate_steps)
+    return Format ( "saving at %.1f fps", SaveRateLimitAt ( step ) );
+
+  if (_settings.drop == ShedDrop::Newest)
+    return Format ( "dropping frames over %d queued", _high );
+
+  return "dropping every other frame";
+}
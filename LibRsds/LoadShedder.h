@@ -0,0 +1,102 @@
+#pragma once
+
+#include "FrameCodec.h"
+
+#include <string>
+#include <vector>
+
+namespace EF
+{
+  const int kShedStreams = 4;  // RS::StreamCount
+
+  // what the last step does once the effort and the save rate are as low as they may go
+  enum class ShedDrop : int
+  {
+    Never,      // the queue grows, as without shedding
+    Newest,     // frames arriving while the queue is over the high mark are not queued
+    Alternate,  // every other frame of each camera is not queued
+  };
+
+  struct LoadShedSettings
+  {
+    LoadShedSettings ()
+      : enabled ( false )
+      , effort ( true )
+      , minSaveFps ( 0 )
+      , drop ( ShedDrop::Never )
+      , highQueue ( 0 )
+      , maxLatencyMs ( 1000 )
+      , holdMs ( 1000 )
+    {  }
+    bool enabled;
+    bool effort;         // png, zstd, lz4 and depth delta levels may be lowered towards the codec's fastest
+    float minSaveFps;    // the save rate is halved down to this, 0 keeps it
+    ShedDrop drop;
+    int highQueue;       // queued frames over this are overload, under a quarter of it calm. 0 is a second's worth
+    float maxLatencyMs;  // queue to disk latency over this is overload too
+    int holdMs;          // between two steps, calm has to last three times as long before stepping back
+  };
+
+  struct ShedDecision
+  {
+    double timeMs;
+    int from;
+    int to;
+    int queued;
+    float latencyMs;
+    std::vector<int> firstFrames;  // per camera, the first frame queued under the new step
+    std::string text;
+  };
+
+  // Feedback from the encoder queue to what is queued: when the queue or the latency run over their
+  // marks the controller steps down the compression effort, then halves the save rate, then drops
+  // frames, one step per hold time and each within the settings. Calm steps it back the same way.
+  // Not thread safe, EncodeFrames calls it under its queue mutex.
+  class LoadShedder
+  {
+  public:
+    static const int kEffortSteps = 2;
+
+    LoadShedder ();
+
+    // codecs and streams (StreamFlags) only word the decisions, EncodeFrames applies EffortSettings itself
+    void Configure ( const LoadShedSettings& settings, float saveFps, int targets, const CodecSettings codecs[kShedStreams], int streams );
+
+    // on every queued frame, firstFrames is the number each camera's next frame gets. True when the step changed.
+    bool Update ( int queued, double nowMs, const std::vector<int>& firstFrames );
+    // on every committed frame
+    void Committed ( double latencyMs );
+
+    bool Enabled () { return _settings.enabled; }
+    int Step () { return _step; }
+    int Steps () { return _effort_steps + _rate_steps + _drop_steps; }
+    int EffortStep () { return _step < _effort_steps ? _step : _effort_steps; }
+    float SaveRateLimit () { return SaveRateLimitAt ( _step ); }  // 0 for none
+    bool Drops ( int queued, int target );
+
+    // a stream's codec settings at an effort step, unchanged for codecs without a faster level
+    static CodecSettings EffortSettings ( const CodecSettings& settings, int effort );
+
+    const std::vector<ShedDecision>& Decisions () { return _decisions; }
+    std::string Describe ( int step );
+
+  private:
+    LoadShedSettings _settings;
+    CodecSettings _codecs[kShedStreams];
+    int _streams;
+    float _save_fps;
+    int _high;
+    int _low;
+    int _effort_steps;
+    int _rate_steps;
+    int _drop_steps;
+    int _step;
+    double _last_change_ms;
+    double _calm_since_ms;  // -1 while not calm
+    float _latency_ms;      // smoothed
+    std::vector<int> _alternate;
+    std::vector<ShedDecision> _decisions;
+
+    float SaveRateLimitAt ( int step );
+  };
+}
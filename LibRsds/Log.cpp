@@ -0,0 +1,386 @@
+#include "Log.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  const size_t kBufferRecords = 512;  // per thread, a power of two
+
+  std::atomic<int> g_level ((int)LogLevel::Debug);
+  std::atomic<long long> g_dropped (0);
+
+  // Written by its thread only and read by the logger thread only, so head and tail are all the
+  // synchronization it needs. Outlives its thread until the logger has drained it.
+  struct ThreadBuffer
+  {
+    ThreadBuffer ()
+      : records (kBufferRecords)
+      , head (0)
+      , tail (0)
+      , retired (false)
+      , thread (GetCurrentThreadId ())
+    {  }
+
+    std::vector<LogRecord> records;
+    // a cache line apart, padded like the event ring's counters since new does not honour alignas here
+    char pad0[64];
+    std::atomic<size_t> head;
+    char pad1[64 - sizeof (std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char pad2[64 - sizeof (std::atomic<size_t>)];
+    std::atomic<bool> retired;
+    uint32_t thread;
+
+    bool Push (const LogRecord& record)
+    {
+      size_t t = tail.load (std::memory_order_relaxed);
+      if (t - head.load (std::memory_order_acquire) >= kBufferRecords)
+        return false;
+
+      records[t & (kBufferRecords - 1)] = record;
+      tail.store (t + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool Pop (LogRecord& record)
+    {
+      size_t h = head.load (std::memory_order_relaxed);
+      if (h == tail.load (std::memory_order_acquire))
+        return false;
+
+      record = records[h & (kBufferRecords - 1)];
+      head.store (h + 1, std::memory_order_release);
+      return true;
+    }
+  };
+
+  struct BufferOwner
+  {
+    BufferOwner () : buffer (nullptr) {  }
+    ~BufferOwner ()
+    {
+      if (buffer)
+        buffer->retired.store (true, std::memory_order_release);
+    }
+    ThreadBuffer* buffer;
+  };
+
+  thread_local BufferOwner t_owner;
+
+  double steady_ms ()
+  {
+    return std::chrono::duration<double, std::milli> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+  }
+
+  // printf's conversions, rewritten to the width the argument was stored with
+  void format_arg (std::string& out, std::string spec, char conversion, const LogRecord& record, int& arg)
+  {
+    if (arg >= record.count)
+    {
+      out += "(missing)";
+      return;
+    }
+
+    int i = arg++;
+    uint64_t raw = record.args[i];
+    int type = record.types[i];
+    char buffer[512];
+
+    double d;
+    memcpy (&d, &raw, sizeof (d));
+    long long s = type == LogArgDouble ? (long long)d : (long long)raw;
+    unsigned long long u = type == LogArgDouble ? (unsigned long long)d : type == LogArgInt ? (uint32_t)raw : raw;
+
+    switch (conversion)
+    {
+    case 'd': case 'i':
+      snprintf (buffer, sizeof (buffer), (spec + "lld").c_str (), s);
+      break;
+    case 'u': case 'o': case 'x': case 'X':
+      snprintf (buffer, sizeof (buffer), (spec + "ll" + conversion).c_str (), u);
+      break;
+    case 'c':
+      snprintf (buffer, sizeof (buffer), (spec + "c").c_str (), (int)s);
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      snprintf (buffer, sizeof (buffer), (spec + conversion).c_str (), type == LogArgDouble ? d : (double)s);
+      break;
+    case 's':
+      snprintf (buffer, sizeof (buffer), (spec + "s").c_str (), type == LogArgString ? record.text + raw : "(?)");
+      break;
+    case 'p':
+      snprintf (buffer, sizeof (buffer), (spec + "p").c_str (), (void*)(uintptr_t)raw);
+      break;
+    default:
+      buffer[0] = 0;
+      break;
+    }
+
+    out += buffer;
+  }
+
+  std::string format_record (const LogRecord& record)
+  {
+    if (!record.format)
+      return record.text;
+
+    std::string out;
+    int arg = 0;
+
+    for (const char* p = record.format; *p; p++)
+    {
+      if (*p != '%')
+      {
+        out += *p;
+        continue;
+      }
+
+      if (*++p == '%')
+      {
+        out += '%';
+        continue;
+      }
+
+      std::string spec = "%";
+      while (*p && strchr ("-+ #0", *p))
+        spec += *p++;
+
+      // a * width or precision takes an argument of its own
+      for (int part = 0; part < 2; part++)
+      {
+        if (part == 1)
+        {
+          if (*p != '.')
+            break;
+          spec += *p++;
+        }
+
+        if (*p == '*')
+        {
+          spec += arg < record.count ? std::to_string ((long long)record.args[arg++]) : "0";
+          p++;
+        }
+        else
+        {
+          while (*p >= '0' && *p <= '9')
+            spec += *p++;
+        }
+      }
+
+      // the stored width replaces the length modifier
+      while (*p && strchr ("hlLqjztI", *p))
+      {
+        if (*p == 'I' && (p[1] == '6' || p[1] == '3'))
+          p += 2;
+        p++;
+      }
+
+      if (!*p)
+        break;
+
+      format_arg (out, spec, *p, record, arg);
+    }
+
+    return out;
+  }
+
+  const char kLevelNames[] = "TDIWE";
+
+  class Logger
+  {
+  public:
+    Logger ()
+      : _file (nullptr)
+      , _flush_requested (0)
+      , _flush_done (0)
+      , _start_ms (steady_ms ())
+    {
+      // never joined: the logger lives as long as the process, a join at dll unload would deadlock
+      std::thread ([this] () { Run (); }).detach ();
+    }
+
+    ThreadBuffer* Register ()
+    {
+      auto buffer = new ThreadBuffer ();
+      std::lock_guard<std::mutex> guard (_mutex);
+      _buffers.push_back (buffer);
+      return buffer;
+    }
+
+    double StartMs () { return _start_ms; }
+
+    bool SetFile (const std::string& filename)
+    {
+      std::lock_guard<std::mutex> guard (_file_mutex);
+
+      if (_file)
+        fclose (_file);
+      _file = filename.empty () ? nullptr : fopen (filename.c_str (), "ab");
+
+      return filename.empty () || _file;
+    }
+
+    void Flush ()
+    {
+      std::unique_lock<std::mutex> lock (_mutex);
+      long long target = ++_flush_requested;
+      _wake.notify_one ();
+      _flushed.wait (lock, [&] () { return _flush_done >= target; });
+    }
+
+  private:
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _flushed;
+    std::vector<ThreadBuffer*> _buffers;
+    std::mutex _file_mutex;
+    FILE* _file;
+    long long _flush_requested;
+    long long _flush_done;
+    double _start_ms;
+
+    void Run ()
+    {
+      std::vector<LogRecord> batch;
+      std::vector<ThreadBuffer*> buffers;
+
+      for (;;)
+      {
+        long long requested;
+        {
+          // call sites never notify, the buffers are collected a few times a second
+          std::unique_lock<std::mutex> lock (_mutex);
+          _wake.wait_for (lock, std::chrono::milliseconds (50), [&] () { return _flush_requested > _flush_done; });
+          requested = _flush_requested;
+
+          // a retired buffer is dropped once it is drained, nothing writes to it any more
+          for (size_t i = 0; i < _buffers.size ();)
+          {
+            auto buffer = _buffers[i];
+            if (buffer->retired.load (std::memory_order_acquire) && buffer->head.load () == buffer->tail.load ())
+            {
+              DEL (buffer);
+              _buffers.erase (_buffers.begin () + i);
+            }
+            else
+              i++;
+          }
+          buffers = _buffers;
+        }
+
+        batch.clear ();
+        LogRecord record;
+        for (auto buffer : buffers)
+        {
+          while (buffer->Pop (record))
+            batch.push_back (record);
+        }
+
+        // threads are merged by time, each buffer is in order already
+        std::stable_sort (batch.begin (), batch.end (), [] (const LogRecord& a, const LogRecord& b) { return a.timeMs < b.timeMs; });
+
+        if (!batch.empty ())
+          Write (batch);
+
+        std::lock_guard<std::mutex> guard (_mutex);
+        _flush_done = requested;
+        _flushed.notify_all ();
+      }
+    }
+
+    void Write (const std::vector<LogRecord>& batch)
+    {
+      std::string lines;
+      for (auto& record : batch)
+      {
+        char prefix[64];
+        snprintf (prefix, sizeof (prefix), "%10.3f %c %5u ", record.timeMs / 1000.0, kLevelNames[std::min<int> (record.level, 4)], record.thread);
+        auto line = prefix + format_record (record) + "\r\n";
+
+        OutputDebugStringA (line.c_str ());
+        lines += line;
+      }
+
+      std::lock_guard<std::mutex> guard (_file_mutex);
+      if (_file)
+      {
+        fwrite (lines.data (), 1, lines.size (), _file);
+        fflush (_file);
+      }
+    }
+  };
+
+  Logger& logger ()
+  {
+    // deliberately leaked, see Logger ()
+    static Logger* instance = new Logger ();
+    return *instance;
+  }
+}
+
+void SetLogLevel (LogLevel level)
+{
+  g_level.store ((int)level, std::memory_order_relaxed);
+}
+
+LogLevel GetLogLevel ()
+{
+  return (LogLevel)g_level.load (std::memory_order_relaxed);
+}
+
+bool LogEnabled (LogLevel level)
+{
+  return (int)level >= g_level.load (std::memory_order_relaxed);
+}
+
+bool SetLogFile (const std::string& filename)
+{
+  return logger ().SetFile (filename);
+}
+
+void FlushLog ()
+{
+  logger ().Flush ();
+}
+
+long long LogDropped ()
+{
+  return g_dropped.load (std::memory_order_relaxed);
+}
+
+void SubmitLog (LogRecord& record)
+{
+  auto& log = logger ();
+
+  if (!t_owner.buffer)
+    t_owner.buffer = log.Register ();
+
+  record.timeMs = steady_ms () - log.StartMs ();
+  record.thread = t_owner.buffer->thread;
+
+  if (!t_owner.buffer->Push (record))
+    g_dropped.fetch_add (1, std::memory_order_relaxed);
+}
+
+void SubmitLogText (LogLevel level, const std::string& message)
+{
+  LogRecord record;
+  record.format = nullptr;
+  record.level = (uint8_t)level;
+  record.count = 0;
+  record.textSize = 0;
+
+  size_t size = std::min (message.size (), (size_t)kLogMaxText - 1);
+  memcpy (record.text, message.c_str (), size);
+  record.text[size] = 0;
+
+  SubmitLog (record);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// records below the level are dropped at the call site, Debug by default in every build
+enum class LogLevel : int
+{
+  Trace,    // per frame chatter
+  Debug,
+  Info,
+  Warning,
+  Error,
+  Off,
+};
+
+void SetLogLevel (LogLevel level);
+LogLevel GetLogLevel ();
+bool LogEnabled (LogLevel level);
+
+// records go to the debugger output and, when a file is set, appended to it ("" closes it)
+bool SetLogFile (const std::string& filename);
+// returns once everything logged before the call is written
+void FlushLog ();
+// records lost to a full thread buffer
+long long LogDropped ();
+
+const int kLogMaxArgs = 8;
+const int kLogMaxText = 256;  // bytes for the string arguments of one record, longer ones are cut
+
+enum LogArgType : uint8_t
+{
+  LogArgInt,      // 32 bits or less, sign extended
+  LogArgInt64,
+  LogArgUInt,
+  LogArgUInt64,
+  LogArgDouble,
+  LogArgString,   // value is the offset into text
+  LogArgPointer,
+};
+
+// What a call site hands to its thread's buffer: the format's address stands for the format, which
+// has to be a string literal, and the arguments are kept raw. The logger thread formats it later.
+// A record with no format holds an already formatted message in text.
+struct LogRecord
+{
+  const char* format;
+  double timeMs;
+  uint32_t thread;
+  uint8_t level;
+  uint8_t count;
+  uint8_t types[kLogMaxArgs];
+  uint16_t textSize;
+  uint64_t args[kLogMaxArgs];
+  char text[kLogMaxText];
+};
+
+// stamps time and thread and copies the record to the calling thread's buffer, never blocks
+void SubmitLog (LogRecord& record);
+void SubmitLogText (LogLevel level, const std::string& message);
+
+inline void LogPackString (LogRecord& record, const char* s, size_t size)
+{
+  record.types[record.count] = LogArgString;
+
+  // out of room the argument still takes its place, as the empty string at the end
+  size_t room = record.textSize < kLogMaxText ? kLogMaxText - record.textSize - 1 : 0;
+  if (room == 0)
+  {
+    record.args[record.count++] = kLogMaxText - 1;
+    return;
+  }
+
+  if (size > room)
+    size = room;
+
+  record.args[record.count++] = record.textSize;
+  memcpy (record.text + record.textSize, s, size);
+  record.text[record.textSize + size] = 0;
+  record.textSize = (uint16_t)(record.textSize + size + 1);
+}
+
+inline void LogPack (LogRecord& record, const char* s) { LogPackString (record, s ? s : "(null)", s ? strlen (s) : 6); }
+inline void LogPack (LogRecord& record, char* s) { LogPack (record, (const char*)s); }
+inline void LogPack (LogRecord& record, const std::string& s) { LogPackString (record, s.c_str (), s.size ()); }
+
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value>::type LogPack (LogRecord& record, T value)
+{
+  double d = value;
+  record.types[record.count] = LogArgDouble;
+  memcpy (&record.args[record.count++], &d, sizeof (d));
+}
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type LogPack (LogRecord& record, T value)
+{
+  bool is_signed = std::is_signed<T>::value || std::is_enum<T>::value;
+  if (is_signed)
+    record.types[record.count] = sizeof (T) > 4 ? LogArgInt64 : LogArgInt;
+  else
+    record.types[record.count] = sizeof (T) > 4 ? LogArgUInt64 : LogArgUInt;
+  record.args[record.count++] = is_signed ? (uint64_t)(long long)value : (uint64_t)value;
+}
+
+template<typename T>
+void LogPack (LogRecord& record, T* value)
+{
+  record.types[record.count] = LogArgPointer;
+  record.args[record.count++] = (uint64_t)(uintptr_t)value;
+}
+
+// A string literal format is packed as is, formatting happens on the logger thread.
+template<size_t N, typename ... Args>
+void Log (LogLevel level, const char (&format)[N], Args ... args)
+{
+  static_assert (sizeof ... (Args) <= kLogMaxArgs, "too many log arguments");
+
+  if (!LogEnabled (level))
+    return;
+
+  LogRecord record;
+  record.format = format;
+  record.level = (uint8_t)level;
+  record.count = 0;
+  record.textSize = 0;
+  record.text[kLogMaxText - 1] = 0;
+
+  int unused[] = { 0, (LogPack (record, args), 0) ... };
+  (void)unused;
+
+  SubmitLog (record);
+}
@@ -0,0 +1,411 @@
+#include "MultiCapture.h"
+#include "FrameIndex.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
+
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  struct timed_frame
+  {
+    double timestamp;
+    int frame;
+  };
+
+  // the first captured stream of a record, all streams of a frameset share a capture time
+  bool record_timestamp ( const IndexHeader& header, const IndexRecord& record, double& timestamp )
+  {
+    for (int i = 0; i < StreamCount; i++)
+    {
+      if (header.codecs[i] != kIndexNoFiles)
+      {
+        timestamp = record.timestamp[i];
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  std::vector<timed_frame> load_timed_frames ( const std::string& folder )
+  {
+    std::vector<timed_frame> frames;
+
+    IndexHeader header;
+    std::vector<IndexRecord> records;
+    if (!ReadFrameIndex ( (fs::path ( folder ) / kIndexFilename).string (), header, records ))
+    {
+      DebugOut ( "WriteAlignmentReport no index in %s", folder.c_str () );
+      return frames;
+    }
+
+    for (auto& record : records)
+    {
+      timed_frame frame = { 0, (int)record.frame };
+      if (record_timestamp ( header, record, frame.timestamp ))
+        frames.push_back ( frame );
+    }
+
+    std::sort ( frames.begin (), frames.end (), [] ( const timed_frame& a, const timed_frame& b ) { return a.timestamp < b.timestamp; } );
+
+    return frames;
+  }
+
+  const timed_frame* find_closest ( const std::vector<timed_frame>& frames, double timestamp )
+  {
+    if (frames.empty ())
+      return nullptr;
+
+    auto it = std::lower_bound ( frames.begin (), frames.end (), timestamp, [] ( const timed_frame& f, double t ) { return f.timestamp < t; } );
+
+    if (it == frames.end ())
+      return &frames.back ();
+
+    if (it != frames.begin () && timestamp - (it - 1)->timestamp < it->timestamp - timestamp)
+      --it;
+
+    return &*it;
+  }
+}
+
+std::string EF::SourceFolder ( const CaptureSource& source, int index )
+{
+  switch (source.type)
+  {
+  case SourcePlayback:
+    return fs::path ( source.name ).stem ().string ();
+  case SourceSynthetic:
+    return Format ( "synthetic_%d", index );
+  default:
+    return source.name.empty () ? Format ( "camera_%d", index ) : source.name;
+  }
+}
+
+std::vector<AlignmentStats> EF::WriteAlignmentReport ( const std::string& path, const std::vector<std::string>& folders, double toleranceMs ) try
+{
+  std::vector<AlignmentStats> results;
+  if (folders.empty ())
+    return results;
+
+  std::vector<std::vector<timed_frame>> frames;
+  for (auto& folder : folders)
+  {
+    frames.push_back ( load_timed_frames ( folder ) );
+
+    AlignmentStats stats = { fs::path ( folder ).filename ().string (), (int)frames.back ().size (), 0, 0, 0, 0 };
+    results.push_back ( stats );
+  }
+
+  FILE* csv = fopen ( (fs::path ( path ) / "alignment.csv").string ().c_str (), "w" );
+  if (csv)
+  {
+    fprintf ( csv, "frame,timestamp" );
+    for (size_t k = 1; k < folders.size (); k++)
+      fprintf ( csv, ",%s_frame,%s_offset_ms", results[k].folder.c_str (), results[k].folder.c_str () );
+    fprintf ( csv, "\n" );
+  }
+
+  // the reference is matched with itself
+  results[0].matched = results[0].frames;
+
+  for (auto& reference : frames[0])
+  {
+    if (csv)
+      fprintf ( csv, "%d,%.3f", reference.frame, reference.timestamp );
+
+    for (size_t k = 1; k < folders.size (); k++)
+    {
+      const timed_frame* closest = find_closest ( frames[k], reference.timestamp );
+      double offset = closest ? closest->timestamp - reference.timestamp : 0;
+
+      if (!closest || std::fabs ( offset ) > toleranceMs)
+      {
+        if (csv)
+          fprintf ( csv, ",," );
+        continue;
+      }
+
+      auto& stats = results[k];
+      stats.matched++;
+      stats.meanMs += std::fabs ( offset );
+      stats.offsetMs += offset;
+      stats.maxMs = std::max ( stats.maxMs, std::fabs ( offset ) );
+
+      if (csv)
+        fprintf ( csv, ",%d,%.3f", closest->frame, offset );
+    }
+
+    if (csv)
+      fprintf ( csv, "\n" );
+  }
+
+  if (csv)
+    fclose ( csv );
+
+  for (auto& stats : results)
+  {
+    if (stats.matched > 0)
+    {
+      stats.meanMs /= stats.matched;
+      stats.offsetMs /= stats.matched;
+    }
+  }
+
+  return results;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "WriteAlignmentReport exp: %s", e.what () );
+  return std::vector<AlignmentStats> ();
+}
+
+std::string EF::FormatAlignment ( const AlignmentStats& stats )
+{
+  return Format ( "%-20s %6d frames  %6d matched  mean %7.2f ms  max %7.2f ms  offset %+7.2f ms",
+    stats.folder.c_str (),
+    stats.frames,
+    stats.matched,
+    stats.meanMs,
+    stats.maxMs,
+    stats.offsetMs );
+}
+
+MultiCapture::MultiCapture ()
+  : _encode ( nullptr )
+  , _thread ( nullptr )
+  , _counts_mutex ( new std::mutex () )
+  , _save_fps ( 30 )
+  , _max_queued ( 60 )
+  , _is_running ( false )
+{
+}
+
+MultiCapture::~MultiCapture ()
+{
+  Stop ();
+
+  for (auto device : _devices)
+    DEL ( device );
+
+  DEL ( _counts_mutex );
+}
+
+bool MultiCapture::Start ( const std::vector<CaptureSource>& sources, const std::string& path, const MultiCaptureSettings& settings ) try
+{
+  Stop ();
+
+  for (auto device : _devices)
+    DEL ( device );
+
+  _devices.clear ();
+  _folders.clear ();
+  {
+    std::lock_guard<std::mutex> guard ( *_counts_mutex );
+    _queued.clear ();
+    _dropped.clear ();
+  }
+  _saved.clear ();
+  _bytes.clear ();
+  _alignment.clear ();
+
+  if (sources.empty ())
+    return false;
+
+  _path = path;
+  _save_fps = settings.saveFps;
+  _max_queued = settings.maxQueued > 0 ? settings.maxQueued : std::max ( 1, (int)std::ceil ( settings.saveFps * 2 ) );
+
+  fs::create_directories ( path );
+
+  std::set<std::string> used;
+
+  for (size_t i = 0; i < sources.size (); i++)
+  {
+    // the same recording played twice still needs two folders
+    auto name = SourceFolder ( sources[i], (int)i );
+    if (!used.insert ( name ).second)
+      name = Format ( "%s_%d", name.c_str (), (int)i );
+
+    fs::path folder = fs::path ( path ) / name;
+
+    auto device = new RealsenseController ();
+    device->SetThreadPlacement ( settings.acquisitionPlacement );
+    device->SetSource ( sources[i].type, sources[i].name );
+    device->SetStreams ( settings.streams );
+    device->SetDepthFilters ( settings.depthFilters );
+    device->SetChangeDetection ( settings.changeDetection );
+    device->SetVolume ( settings.volume );
+    device->SetCrop ( settings.crop );
+    device->SetStallTimeout ( settings.stallTimeoutMs );
+    device->SetEventRing ( settings.events, (int)i + 1 );
+
+    if (!device->SetCaptureRequest ( settings.saveFps, settings.colorWidth, settings.colorHeight, settings.depthWidth, settings.depthHeight ))
+      DebugOut ( "MultiCapture::Start no mode of %s covers the request, keeping %d fps", name.c_str (), device->GetSensorFps () );
+
+    fs::create_directory ( folder );
+
+    for (int s = 0; s < StreamCount; s++)
+    {
+      if (device->IsStreamEnabled ( (StreamType)s ))
+        fs::create_directory ( folder / StreamFolder ( (StreamType)s ) );
+    }
+
+    _devices.push_back ( device );
+    _folders.push_back ( folder.string () );
+    {
+      std::lock_guard<std::mutex> guard ( *_counts_mutex );
+      _queued.push_back ( 0 );
+      _dropped.push_back ( 0 );
+    }
+    _saved.push_back ( 0 );
+    _bytes.push_back ( 0 );
+  }
+
+  _encode = new EncodeFrames ();
+  _encode->SetThreadPlacement ( settings.encodePlacement );
+  _encode->Run ( _devices, _folders, settings.encode, settings.threads );
+
+  for (auto device : _devices)
+    device->Start ();
+
+  _is_running = true;
+  _pump_placement = settings.acquisitionPlacement;
+
+  _thread = new std::thread ( [&]()
+  {
+    ApplyThreadPlacement ( _pump_placement, "rsds pump" );
+    ThreadRun ();
+  } );
+
+  return true;
+}
+catch (const std::exception & e)
+{
+  DebugOut ( "MultiCapture::Start exp: %s", e.what () );
+  return false;
+}
+
+void MultiCapture::Stop ()
+{
+  if (!_thread)
+    return;
+
+  _is_running = false;
+
+  _thread->join ();
+  DEL ( _thread );
+
+  for (auto device : _devices)
+    device->Stop ( true );
+
+  // everything that made it into the queue is saved
+  while (_encode->PendingCount () > 0)
+    std::this_thread::sleep_for ( std::chrono::milliseconds ( 10 ) );
+
+  for (size_t i = 0; i < _devices.size (); i++)
+  {
+    _saved[i] = _encode->FramesSaved ( (int)i );
+    _bytes[i] = _encode->BytesSaved ( (int)i );
+  }
+
+  _encode->Stop ();
+  _shed_decisions = _encode->ShedDecisions ();
+  DEL ( _encode );
+
+  // frames of one moment are half a save interval apart at most when the sources keep the same rate
+  _alignment = WriteAlignmentReport ( _path, _folders, 500.0 / _save_fps );
+
+  for (auto& stats : _alignment)
+    DebugOut ( "MultiCapture::Stop %s", FormatAlignment ( stats ).c_str () );
+}
+
+int MultiCapture::FramesQueued ( int index )
+{
+  std::lock_guard<std::mutex> guard ( *_counts_mutex );
+  return _queued[index];
+}
+
+int MultiCapture::FramesDropped ( int index )
+{
+  std::lock_guard<std::mutex> guard ( *_counts_mutex );
+  return _dropped[index];
+}
+
+int MultiCapture::FramesSaved ( int index )
+{
+  return _encode ? _encode->FramesSaved ( index ) : _saved[index];
+}
+
+long long MultiCapture::BytesSaved ( int index )
+{
+  return _encode ? _encode->BytesSaved ( index ) : _bytes[index];
+}
+
+void MultiCapture::ThreadRun ()
+{
+  // one set of buffers per source, EncodeFrame fills them and QueueFrame copies them out
+  std::vector<std::vector<unsigned char>> buffers ( _devices.size () * StreamCount );
+
+  while (_is_running)
+  {
+    bool polled = false;
+
+    for (size_t d = 0; d < _devices.size (); d++)
+    {
+      auto device = _devices[d];
+
+      unsigned char* images[StreamCount];
+      int sizes[StreamCount];
+
+      for (int i = 0; i < StreamCount; i++)
+      {
+        auto stream = (StreamType)i;
+        auto& buffer = buffers[d * StreamCount + i];
+
+        sizes[i] = device->GetStreamSize ( stream );
+        images[i] = nullptr;
+
+        if (!device->IsStreamEnabled ( stream ))
+          continue;
+
+        buffer.resize ( sizes[i] );
+        images[i] = buffer.data ();
+      }
+
+      frame_metadata metadata;
+      if (!device->EncodeFrame ( images, sizes, &metadata ))
+        continue;
+
+      polled = true;
+
+      // a full queue means the encoders or the disk fell behind, dropping here keeps memory bounded
+      if (_encode->PendingCount () >= _max_queued * (int)_devices.size ())
+      {
+        {
+          std::lock_guard<std::mutex> guard ( *_counts_mutex );
+          _dropped[d]++;
+        }
+        device->CountDrop ( DropQueue );
+        continue;
+      }
+
+      _encode->QueueFrame ( images, sizes, &metadata, (int)d );
+      std::lock_guard<std::mutex> guard ( *_counts_mutex );
+      _queued[d]++;
+    }
+
+    // framesets only arrive at the save rate
+    if (!polled)
+      std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+  }
+}
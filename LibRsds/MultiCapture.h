@@ -0,0 +1,113 @@
+#pragma once
+
+#include "EncodeFrames.h"
+
+#include <string>
+#include <vector>
+
+namespace EF
+{
+  struct CaptureSource
+  {
+    SourceType type;
+    std::string name;  // serial number for a camera (empty picks any), the .bag file for a playback
+  };
+
+  struct MultiCaptureSettings
+  {
+    MultiCaptureSettings ()
+      : streams ( StreamFlagColor | StreamFlagDepth )
+      , saveFps ( 30 )
+      , colorWidth ( 1280 )
+      , colorHeight ( 720 )
+      , depthWidth ( 1280 )
+      , depthHeight ( 720 )
+      , threads ( 0 )
+      , maxQueued ( 0 )
+      , stallTimeoutMs ( 2000 )
+      , events ( nullptr )
+    {  }
+    int streams;     // StreamFlags, the same for every source
+    float saveFps;
+    int colorWidth;
+    int colorHeight;
+    int depthWidth;
+    int depthHeight;
+    EncodeOptions encode;
+    int threads;     // encoder threads shared by all sources, 0 picks one per core
+    int maxQueued;   // frames per source the queue may hold before new ones are dropped, 0 is two seconds worth
+    int stallTimeoutMs;  // a source without a frameset for this long counts a stall, see CaptureStats
+    ThreadPlacement acquisitionPlacement;  // every source's acquisition thread and the pump
+    ThreadPlacement encodePlacement;       // the encoder pool
+    DepthFilterSettings depthFilters;      // run by the pump on each source's depth before it is queued
+    ChangeSettings changeDetection;        // per source, skipped framesets are never queued
+    CropSettings crop;                     // a volume crop is projected with each source's own calibration
+    volume_bounds volume;
+    EventRing* events;                     // state changes and stalls of source i go here as source i + 1, not owned
+  };
+
+  struct AlignmentStats
+  {
+    std::string folder;
+    int frames;
+    int matched;      // reference frames with a frame of this source within the tolerance
+    double meanMs;    // mean absolute offset to the matched reference frames
+    double maxMs;
+    double offsetMs;  // mean signed offset, a fixed clock offset between sources shows up here
+  };
+
+  // folder of a source under the capture path: the serial number, the recording's name or synthetic_<n>
+  std::string SourceFolder ( const CaptureSource& source, int index );
+
+  // Pairs every frame of the first folder with the frame of each other folder closest in time, using the
+  // first captured stream's timestamp from each index.bin. Writes alignment.csv to path with a row per
+  // reference frame: its frame and timestamp, then each source's frame and offset in ms, left empty past the tolerance.
+  std::vector<AlignmentStats> WriteAlignmentReport ( const std::string& path, const std::vector<std::string>& folders, double toleranceMs );
+  std::string FormatAlignment ( const AlignmentStats& stats );
+
+  // Captures from several sources at once. Every source has its own RealsenseController and with it its
+  // own acquisition thread, one pump thread moves their kept framesets into a single EncodeFrames pool
+  // and each source is saved to path\<SourceFolder> with its own numbering and index.
+  class MultiCapture
+  {
+  public:
+    MultiCapture ();
+    ~MultiCapture ();
+
+    bool Start ( const std::vector<CaptureSource>& sources, const std::string& path, const MultiCaptureSettings& settings );
+    // stops acquisition, waits for every queued frame to reach the disk and writes the alignment report
+    void Stop ();
+    bool IsRunning () { return _is_running; }
+
+    int DeviceCount () { return (int)_devices.size (); }
+    RealsenseController* Device ( int index ) { return _devices[index]; }
+    const std::string& DeviceFolder ( int index ) { return _folders[index]; }
+    int FramesQueued ( int index );
+    int FramesDropped ( int index );
+    int FramesSaved ( int index );
+    long long BytesSaved ( int index );
+    const std::vector<AlignmentStats>& Alignment () { return _alignment; }
+    std::vector<ShedDecision> ShedDecisions () { return _encode ? _encode->ShedDecisions () : _shed_decisions; }
+
+  private:
+    std::vector<RealsenseController*> _devices;
+    std::vector<std::string> _folders;
+    std::vector<int> _queued;
+    std::vector<int> _dropped;
+    std::vector<int> _saved;
+    std::vector<long long> _bytes;
+    std::vector<AlignmentStats> _alignment;
+    std::vector<ShedDecision> _shed_decisions;
+    EncodeFrames* _encode;
+    std::thread* _thread;
+    // guards _queued and _dropped, the pump thread counts while the UI reads
+    std::mutex* _counts_mutex;
+    std::string _path;
+    float _save_fps;
+    ThreadPlacement _pump_placement;
+    int _max_queued;
+    bool _is_running;
+
+    void ThreadRun ();
+  };
+}
@@ -0,0 +1,152 @@
+#define NOMINMAX
+#include "Pyramid.h"
+#include "DepthFilter.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <emmintrin.h>
+
+using namespace EF;
+
+namespace
+{
+  // (a + b + c + d + 2) / 4 of sixteen bytes each, widened so nothing is lost before the rounding
+  inline __m128i box4 ( __m128i a, __m128i b, __m128i c, __m128i d )
+  {
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i two = _mm_set1_epi16 ( 2 );
+
+    __m128i lo = _mm_add_epi16 ( _mm_add_epi16 ( _mm_unpacklo_epi8 ( a, zero ), _mm_unpacklo_epi8 ( b, zero ) ),
+                                 _mm_add_epi16 ( _mm_unpacklo_epi8 ( c, zero ), _mm_unpacklo_epi8 ( d, zero ) ) );
+    __m128i hi = _mm_add_epi16 ( _mm_add_epi16 ( _mm_unpackhi_epi8 ( a, zero ), _mm_unpackhi_epi8 ( b, zero ) ),
+                                 _mm_add_epi16 ( _mm_unpackhi_epi8 ( c, zero ), _mm_unpackhi_epi8 ( d, zero ) ) );
+
+    return _mm_packus_epi16 ( _mm_srli_epi16 ( _mm_add_epi16 ( lo, two ), 2 ), _mm_srli_epi16 ( _mm_add_epi16 ( hi, two ), 2 ) );
+  }
+
+  // eight Y8 pixels from two rows of sixteen: the even and odd pixels are the low and high bytes of each word
+  inline __m128i gray2x2 ( const uint8_t* row0, const uint8_t* row1 )
+  {
+    const __m128i mask = _mm_set1_epi16 ( 0xFF );
+    const __m128i two = _mm_set1_epi16 ( 2 );
+
+    __m128i r0 = _mm_loadu_si128 ( (const __m128i*)row0 );
+    __m128i r1 = _mm_loadu_si128 ( (const __m128i*)row1 );
+
+    __m128i sum = _mm_add_epi16 ( _mm_add_epi16 ( _mm_and_si128 ( r0, mask ), _mm_srli_epi16 ( r0, 8 ) ),
+                                  _mm_add_epi16 ( _mm_and_si128 ( r1, mask ), _mm_srli_epi16 ( r1, 8 ) ) );
+
+    return _mm_srli_epi16 ( _mm_add_epi16 ( sum, two ), 2 );
+  }
+
+  void halve_gray ( const uint8_t* src, int width, int height, uint8_t* dst )
+  {
+    int outWidth = width / 2;
+
+    for (int oy = 0; oy < height / 2; oy++)
+    {
+      const uint8_t* row0 = src + (size_t)oy * 2 * width;
+      const uint8_t* row1 = row0 + width;
+      uint8_t* out = dst + (size_t)oy * outWidth;
+      int ox = 0;
+
+      for (; ox + 16 <= outWidth; ox += 16)
+      {
+        __m128i a = gray2x2 ( row0 + ox * 2, row1 + ox * 2 );
+        __m128i b = gray2x2 ( row0 + ox * 2 + 16, row1 + ox * 2 + 16 );
+        _mm_storeu_si128 ( (__m128i*)(out + ox), _mm_packus_epi16 ( a, b ) );
+      }
+
+      for (; ox < outWidth; ox++)
+        out[ox] = (uint8_t)((row0[ox * 2] + row0[ox * 2 + 1] + row1[ox * 2] + row1[ox * 2 + 1] + 2) >> 2);
+    }
+  }
+
+  // Every byte of a row averaged with the one a pixel to the right and the two below it is the box of
+  // the pixel pair starting there, for the bytes that start a pair. Sixteen of them hold three pairs
+  // (bytes 0-2, 6-8 and 12-14), SSE2 has no byte shuffle so they are picked out of the two halves.
+  void halve_rgb ( const uint8_t* src, int width, int height, uint8_t* dst )
+  {
+    int outWidth = width / 2;
+    int stride = width * 3;
+
+    for (int oy = 0; oy < height / 2; oy++)
+    {
+      const uint8_t* row0 = src + (size_t)oy * 2 * stride;
+      const uint8_t* row1 = row0 + stride;
+      uint8_t* out = dst + (size_t)oy * outWidth * 3;
+      int ox = 0;
+
+      // the loads a pixel to the right read 19 bytes from the first pair
+      for (; ox + 3 <= outWidth && ox * 6 + 19 <= stride; ox += 3)
+      {
+        const uint8_t* p0 = row0 + ox * 6;
+        const uint8_t* p1 = row1 + ox * 6;
+
+        __m128i box = box4 ( _mm_loadu_si128 ( (const __m128i*)p0 ), _mm_loadu_si128 ( (const __m128i*)(p0 + 3) ),
+                             _mm_loadu_si128 ( (const __m128i*)p1 ), _mm_loadu_si128 ( (const __m128i*)(p1 + 3) ) );
+
+        uint64_t lo = (uint64_t)_mm_cvtsi128_si64 ( box );
+        uint64_t hi = (uint64_t)_mm_cvtsi128_si64 ( _mm_srli_si128 ( box, 8 ) );
+
+        uint64_t packed = (lo & 0xFFFFFF) | ((lo >> 48) << 24) | ((hi & 0xFF) << 40) | (((hi >> 32) & 0xFFFF) << 48);
+        memcpy ( out + ox * 3, &packed, 8 );
+        out[ox * 3 + 8] = (uint8_t)(hi >> 48);
+      }
+
+      for (; ox < outWidth; ox++)
+      {
+        for (int c = 0; c < 3; c++)
+          out[ox * 3 + c] = (uint8_t)((row0[ox * 6 + c] + row0[ox * 6 + 3 + c] + row1[ox * 6 + c] + row1[ox * 6 + 3 + c] + 2) >> 2);
+      }
+    }
+  }
+}
+
+void EF::HalveImage ( const uint8_t* src, int width, int height, int channels, uint8_t* dst )
+{
+  if (channels == 3)
+    halve_rgb ( src, width, height, dst );
+  else
+    halve_gray ( src, width, height, dst );
+}
+
+Pyramid::Pyramid ()
+  : _levels ( 0 )
+{
+  for (int i = 0; i < kMaxPyramidLevels; i++)
+    _widths[i] = _heights[i] = 0;
+}
+
+void Pyramid::Build ( const unsigned char* image, int width, int height, PixelFormat format, const PyramidSettings& settings )
+{
+  _levels = 0;
+
+  int levels = std::min ( settings.levels, kMaxPyramidLevels );
+  const unsigned char* src = image;
+
+  for (int level = 1; level <= levels; level++)
+  {
+    int outWidth = width / 2;
+    int outHeight = height / 2;
+    if (outWidth == 0 || outHeight == 0)
+      break;
+
+    auto& data = _data[level - 1];
+    data.resize ( (size_t)outWidth * outHeight * BytesPerPixel ( format ) );
+
+    if (format == PixelFormat::Z16)
+      RS::DepthFilter::Halve ( reinterpret_cast<const uint16_t*>(src), width, height, reinterpret_cast<uint16_t*>(data.data ()), settings.depth == PyramidDepth::Nearest );
+    else
+      HalveImage ( src, width, height, format == PixelFormat::RGB8 ? 3 : 1, data.data () );
+
+    _widths[level - 1] = outWidth;
+    _heights[level - 1] = outHeight;
+    _levels = level;
+
+    src = data.data ();
+    width = outWidth;
+    height = outHeight;
+  }
+}
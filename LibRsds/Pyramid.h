@@ -0,0 +1,53 @@
+#pragma once
+
+#include "FrameCodec.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace EF
+{
+  const int kMaxPyramidLevels = 4;
+
+  // how a depth level picks one value for each 2 x 2 block of the level above, holes never count
+  enum class PyramidDepth : int
+  {
+    Median,   // of the pixels with depth, like decimation by 2
+    Nearest,  // the smallest depth, thin foreground stays in the smaller levels
+  };
+
+  struct PyramidSettings
+  {
+    PyramidSettings ()
+      : levels ( 0 )
+      , depth ( PyramidDepth::Median )
+    {  }
+    int levels;          // below the saved resolution, 1 adds half, 2 quarter too, up to kMaxPyramidLevels. 0 is off
+    PyramidDepth depth;
+  };
+
+  // 2 x 2 box filter, rounded, of an 8 bit image with 1 (Y8) or 3 (RGB8) channels into width / 2 x height / 2
+  void HalveImage ( const uint8_t* src, int width, int height, int channels, uint8_t* dst );
+
+  // Halves an image level after level, each from the one above, into buffers kept from frame to frame.
+  // Level 0 is the image itself and is never copied.
+  class Pyramid
+  {
+  public:
+    Pyramid ();
+
+    void Build ( const unsigned char* image, int width, int height, PixelFormat format, const PyramidSettings& settings );
+
+    // built below level 0, fewer than asked for once a level would be empty
+    int Levels () { return _levels; }
+    const unsigned char* Data ( int level ) { return _data[level - 1].data (); }
+    int Width ( int level ) { return _widths[level - 1]; }
+    int Height ( int level ) { return _heights[level - 1]; }
+
+  private:
+    std::vector<unsigned char> _data[kMaxPyramidLevels];
+    int _widths[kMaxPyramidLevels];
+    int _heights[kMaxPyramidLevels];
+    int _levels;
+  };
+}
@@ -2,13 +2,74 @@
 #define NOMINMAX
 #include "RealsenseController.h"
 #include "Helpers.h"
+#include "SyntheticSource.h"
 
 #include <librealsense2/rs.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <set>
+
 using namespace RS;
 
+static_assert (kStatsStreams == StreamCount, "DropMonitor tracks every stream");
+
+
+struct stream_mode
+{
+  int width;
+  int height;
+  int fps;
+};
+
+std::vector<std::string> RS::ListDeviceSerials () try
+{
+  std::vector<std::string> serials;
+
+  rs2::context ctx;
+  auto devices = ctx.query_devices ();
+  for (size_t i = 0; i < devices.size (); i++)
+  {
+    if (devices[i].supports (RS2_CAMERA_INFO_SERIAL_NUMBER))
+      serials.push_back (devices[i].get_info (RS2_CAMERA_INFO_SERIAL_NUMBER));
+  }
+
+  return serials;
+}
+catch (const rs2::error & e)
+{
+  DebugOut ("ListDeviceSerials realsense exp: %s", e.what ());
+  return std::vector<std::string> ();
+}
+
+// SetThreadPlacement is called from the UI while the capture thread applies it
+struct RealsenseController::Placement
+{
+  Placement ()
+    : changed (false)
+  {  }
+  std::mutex mutex;
+  ThreadPlacement placement;  // guarded by mutex
+  std::atomic<bool> changed;
+};
+
+// The crop is set from the UI and projected on the capture thread while the encoders and the pump read
+// it. Before Start there is no mutex and no other thread.
+static std::unique_lock<std::mutex> lock_crop (std::mutex* mutex)
+{
+  return mutex ? std::unique_lock<std::mutex> (*mutex) : std::unique_lock<std::mutex> ();
+}
 
 float get_depth_scale (rs2::device dev);
+std::vector<stream_mode> get_stream_modes (const rs2::device& dev, rs2_stream stream, int index, rs2_format format);
+bool find_mode (const std::vector<stream_mode>& modes, int fps, int width, int height, stream_mode& mode);
+bool has_mode (const std::vector<stream_mode>& modes, const stream_mode& mode);
+double now_ms ();
+void get_intrinsics (const rs2::stream_profile& profile, rs_intrinsics& intrinsics);
+rs2::frame get_stream_frame (const rs2::frameset& frameset, StreamType stream);
 rs2_stream find_stream_to_align (const std::vector<rs2::stream_profile>& streams);
 bool profile_changed (const std::vector<rs2::stream_profile>& current, const std::vector<rs2::stream_profile>& prev);
 
@@ -18,28 +79,56 @@ RealsenseController::RealsenseController ()
   , _color_width (1280)
   , _color_height (720)
   , _target_fps (30)
+  , _save_fps (30)
+  , _save_limit (0)
+  , _request_color_width (1280)
+  , _request_color_height (720)
+  , _request_depth_width (1280)
+  , _request_depth_height (720)
+  , _streams (StreamFlagColor | StreamFlagDepth)
+  , _source (SourceDevice)
   , _is_running (false)
   , _is_thread_running (false)
+  , _restart_pipeline (false)
+  , _placement (new Placement ())
   , _thread (nullptr)
   , _mutex (nullptr)
   , _frame_aquired_count (0)
+  , _frame_kept_count (0)
   , _frame_encoded_count (0)
-  , _color_frame_queue (nullptr)
-  , _depth_frame_queue (nullptr)
-  , _color_frame (nullptr)
-  , _depth_frame (nullptr)
+  , _frameset_queue (nullptr)
+  , _frameset (nullptr)
   , _colorizer(nullptr)
   , _pc (nullptr)
   , StateCallback(nullptr)
   , _deviceType (DeviceType::Unknown)
+  , _depth_filter (new DepthFilter ())
+  , _change_detector (new ChangeDetector ())
+  , _drop_monitor (new DropMonitor ())
+  , _frameset_unpolled (false)
+  , _events (nullptr)
+  , _event_source (0)
+  , _even_color_crop (false)
 {
-
+  for (int i = 0; i < StreamCount; i++)
+    _frames[i] = nullptr;
+
+  // nothing to project with until a pipeline has run
+  _depth_intrinsics = rs_intrinsics ();
+  _color_intrinsics = rs_intrinsics ();
+  _extrinsics = rs_extrinsics ();
+  _extrinsics.rotation[0] = _extrinsics.rotation[4] = _extrinsics.rotation[8] = 1;
+  _volume_crop[0] = _volume_crop[1] = crop_rect ();
 }
 
 RealsenseController::~RealsenseController ()
 {
   StateCallback = nullptr;
   Stop (true);
+  DEL (_depth_filter);
+  DEL (_change_detector);
+  DEL (_drop_monitor);
+  DEL (_placement);
 }
 
 bool RealsenseController::Start () try
@@ -59,17 +148,23 @@ bool RealsenseController::Start () try
   }
 
   _mutex = new std::mutex ();
-  _color_frame_queue = new rs2::frame_queue ();
-  _depth_frame_queue = new rs2::frame_queue ();
-  _color_frame = new rs2::frame ();
-  _depth_frame = new rs2::frame ();
+  _frameset_queue = new rs2::frame_queue ();
+  _frameset = new rs2::frameset ();
+  for (int i = 0; i < StreamCount; i++)
+    _frames[i] = new rs2::frame ();
   _colorizer = new rs2::colorizer ();  
   _pc = new rs2::pointcloud ();
 
   _frame_aquired_count = 0;
+  _frame_kept_count = 0;
   _frame_encoded_count = 0;
+  _change_detector->Reset ();
+  _drop_monitor->Reset (now_ms ());
+  _frameset_unpolled = false;
 
   _is_thread_running = true;  
+  _restart_pipeline = false;
+  _placement->changed = true;
 
   _thread = new std::thread ([&]()
   {
@@ -89,91 +184,674 @@ catch (const std::exception & e)
   return false;
 }
 
-void RealsenseController::ThreadRun () try
+void RealsenseController::SetSource (SourceType type, const std::string& name)
 {
-  rs2::config cfg;
-  rs2::colorizer colorizer;
+  _source = type;
+  _source_name = name;
+
+  // a different camera or recording offers different modes
+  SelectProfile ();
+  RestartPipeline ();
+}
+
+void RealsenseController::SetThreadPlacement (const ThreadPlacement& placement)
+{
+  std::lock_guard<std::mutex> guard (_placement->mutex);
+  _placement->placement = placement;
+  _placement->changed = true;
+}
+
+void RealsenseController::SetDepthFilters (const DepthFilterSettings& settings)
+{
+  _depth_filter->Configure (settings);
+}
+
+void RealsenseController::SetChangeDetection (const ChangeSettings& settings)
+{
+  _change_detector->Configure (settings);
+}
+
+rs_intrinsics RealsenseController::GetColorIntrinsics ()
+{
+  rs_intrinsics intrinsics = _color_intrinsics;
+
+  crop_rect rect = GetCropRect (StreamColor);
+  intrinsics.width = rect.width;
+  intrinsics.height = rect.height;
+  intrinsics.ppx -= rect.x;
+  intrinsics.ppy -= rect.y;
+
+  return intrinsics;
+}
+
+rs_intrinsics RealsenseController::GetDepthIntrinsics ()
+{
+  rs_intrinsics intrinsics = _depth_intrinsics;
+
+  crop_rect rect = GetCropRect (StreamDepth);
+  intrinsics.width = rect.width;
+  intrinsics.height = rect.height;
+  intrinsics.ppx -= rect.x;
+  intrinsics.ppy -= rect.y;
+
+  // a decimated pixel covers a block of sensor pixels, whose centre is the pixel's centre. The same
+  // scaling librealsense's decimation filter reports.
+  int f = _depth_filter->Settings ().decimation;
+  if (f > 1)
+  {
+    intrinsics.width /= f;
+    intrinsics.height /= f;
+    intrinsics.ppx = (intrinsics.ppx + 0.5f) / f - 0.5f;
+    intrinsics.ppy = (intrinsics.ppy + 0.5f) / f - 0.5f;
+    intrinsics.fx /= f;
+    intrinsics.fy /= f;
+  }
+
+  return intrinsics;
+}
+
+void RealsenseController::SetVolume (volume_bounds volume)
+{
+  {
+    auto lock = lock_crop (_mutex);
+    _volume = volume;
+  }
+  ProjectVolume ();
+}
+
+void RealsenseController::SetCrop (const CropSettings& settings)
+{
+  {
+    auto lock = lock_crop (_mutex);
+    _crop = settings;
+  }
+  ProjectVolume ();
+}
+
+void RealsenseController::SetEvenColorCrop (bool even)
+{
+  auto lock = lock_crop (_mutex);
+  _even_color_crop = even;
+}
+
+crop_rect RealsenseController::GetCropRect (StreamType stream)
+{
+  int width = stream == StreamColor ? _color_width : _depth_width;
+  int height = stream == StreamColor ? _color_height : _depth_height;
+
+  crop_rect rect = { 0, 0, width, height };
+  crop_rect wanted;
+  bool even;
+  {
+    auto lock = lock_crop (_mutex);
+    if (_crop.mode == CropNone)
+      return rect;
+
+    wanted = _crop.mode == CropVolume ? _volume_crop[stream == StreamColor ? 0 : 1] : stream == StreamColor ? _crop.color : _crop.depth;
+    even = _even_color_crop && stream == StreamColor;
+  }
+
+  if (wanted.width <= 0 || wanted.height <= 0)
+    return rect;
 
-  cfg.enable_stream (RS2_STREAM_COLOR, _color_width, _color_height, RS2_FORMAT_RGB8, _target_fps);
-  cfg.enable_stream (RS2_STREAM_DEPTH, _depth_width, _depth_height, RS2_FORMAT_Z16, _target_fps);
-  cfg.enable_stream (RS2_STREAM_INFRARED, _depth_width, _depth_height, RS2_FORMAT_Y8, _target_fps);
+  // always inside the current mode, a crop set for another one shrinks to what is left of it
+  rect.x = std::min (std::max (wanted.x, 0), width - 1);
+  rect.y = std::min (std::max (wanted.y, 0), height - 1);
+  rect.width = std::max (std::min (wanted.x + wanted.width, width) - rect.x, 1);
+  rect.height = std::max (std::min (wanted.y + wanted.height, height) - rect.y, 1);
 
-  rs2::pipeline pipe;
+  // grown by a pixel where the image has room, moved back where it does not
+  if (even)
+  {
+    auto make_even = [] (int& pos, int& size, int limit)
+    {
+      if (!(size & 1))
+        return;
+      if (pos + size < limit)
+        size++;
+      else if (pos > 0)
+        pos--, size++;
+      else
+        size--;
+    };
+
+    make_even (rect.x, rect.width, width);
+    make_even (rect.y, rect.height, height);
+  }
+
+  return rect;
+}
+
+void RealsenseController::ProjectVolume ()
+{
+  CropSettings crop;
+  volume_bounds volume;
+  {
+    auto lock = lock_crop (_mutex);
+    crop = _crop;
+    volume = _volume;
+  }
+
+  // projected aside and published whole, a reader never sees half of it
+  crop_rect projected[2] = { crop_rect (), crop_rect () };
+  auto publish = [this, &projected] ()
+  {
+    auto lock = lock_crop (_mutex);
+    _volume_crop[0] = projected[0];
+    _volume_crop[1] = projected[1];
+  };
+
+  if (crop.mode != CropVolume)
+  {
+    publish ();
+    return;
+  }
+
+  // the box's corners in meters, the depth camera looking down z
+  float corners[8][3];
+  for (int i = 0; i < 8; i++)
+  {
+    corners[i][0] = (i & 1 ? 0.5f : -0.5f) * volume.width / 1000;
+    corners[i][1] = (i & 2 ? 0.5f : -0.5f) * volume.height / 1000;
+    corners[i][2] = (volume.z_translate + (i & 4 ? 0.5f : -0.5f) * volume.depth) / 1000;
+  }
+
+  const rs_intrinsics* intrinsics[2] = { &_color_intrinsics, &_depth_intrinsics };
+
+  for (int c = 0; c < 2; c++)
+  {
+    auto& in = *intrinsics[c];
+    if (in.width <= 0 || in.fx <= 0)
+      continue;
 
-  auto profile = pipe.start (cfg);
+    float left = 1e9f, top = 1e9f, right = -1e9f, bottom = -1e9f;
+    bool behind = false;
 
-  auto intrinsics = profile.get_stream (RS2_STREAM_DEPTH).as<rs2::video_stream_profile> ().get_intrinsics ();
-  _depth_intrinsics.fx = intrinsics.fx;
-  _depth_intrinsics.fy = intrinsics.fy;
-  _depth_intrinsics.height = intrinsics.height;
-  _depth_intrinsics.width = intrinsics.width;
-  _depth_intrinsics.ppx = intrinsics.ppx;
-  _depth_intrinsics.ppy = intrinsics.ppy;
+    for (auto& p : corners)
+    {
+      float x = p[0], y = p[1], z = p[2];
+
+      // into the color camera's frame, rs2_transform_point_to_point
+      if (c == 0)
+      {
+        auto& e = _extrinsics;
+        x = e.rotation[0] * p[0] + e.rotation[3] * p[1] + e.rotation[6] * p[2] + e.translation[0];
+        y = e.rotation[1] * p[0] + e.rotation[4] * p[1] + e.rotation[7] * p[2] + e.translation[1];
+        z = e.rotation[2] * p[0] + e.rotation[5] * p[1] + e.rotation[8] * p[2] + e.translation[2];
+      }
+
+      // a corner at or behind the camera projects nowhere sensible, the image is all there is
+      if (z < 0.01f)
+      {
+        behind = true;
+        break;
+      }
+
+      // distortion is left to the margin
+      float u = x / z * in.fx + in.ppx;
+      float v = y / z * in.fy + in.ppy;
+      left = std::min (left, u);
+      right = std::max (right, u);
+      top = std::min (top, v);
+      bottom = std::max (bottom, v);
+    }
+
+    if (behind)
+      continue;
+
+    // projected in the intrinsics' mode, which the sensor mode can be ahead of until the next pipeline start
+    int width = c == 0 ? _color_width : _depth_width;
+    int height = c == 0 ? _color_height : _depth_height;
+    float sx = (float)width / in.width, sy = (float)height / in.height;
+
+    int x0 = std::max ((int)std::floor (left * sx) - crop.margin, 0);
+    int y0 = std::max ((int)std::floor (top * sy) - crop.margin, 0);
+    int x1 = std::min ((int)std::ceil (right * sx) + crop.margin, width);
+    int y1 = std::min ((int)std::ceil (bottom * sy) + crop.margin, height);
+
+    // out of view the crop would be empty, keeping the whole image at least shows why
+    if (x1 <= x0 || y1 <= y0)
+      continue;
+
+    projected[c] = { x0, y0, x1 - x0, y1 - y0 };
+  }
+
+  publish ();
+
+  Log (LogLevel::Info, "RealsenseController::ProjectVolume color %d,%d %dx%d depth %d,%d %dx%d",
+    projected[0].x, projected[0].y, projected[0].width, projected[0].height,
+    projected[1].x, projected[1].y, projected[1].width, projected[1].height);
+}
+
+void RealsenseController::SetStreams (int streams)
+{
+  if (streams == 0)
+  {
+    DebugOut ("RealsenseController::SetStreams at least one stream is needed");
+    return;
+  }
+
+  if (streams == _streams)
+    return;
+
+  _streams = streams;
+
+  // depth and infrared have to agree on a mode, the set decides what is available
+  SelectProfile ();
+
+  // the stream set is part of the pipeline config, a running pipeline has to be restarted
+  RestartPipeline ();
+}
+
+bool RealsenseController::SetCaptureRequest (float saveFps, int colorWidth, int colorHeight, int depthWidth, int depthHeight)
+{
+  if (saveFps <= 0)
+  {
+    DebugOut ("RealsenseController::SetCaptureRequest invalid save rate %.2f", saveFps);
+    return false;
+  }
+
+  int fps = _target_fps;
+  int color_width = _color_width, color_height = _color_height;
+  int depth_width = _depth_width, depth_height = _depth_height;
+
+  _save_fps = saveFps;
+  _request_color_width = colorWidth;
+  _request_color_height = colorHeight;
+  _request_depth_width = depthWidth;
+  _request_depth_height = depthHeight;
+
+  if (!SelectProfile ())
+    return false;
+
+  if (fps != _target_fps || color_width != _color_width || color_height != _color_height || depth_width != _depth_width || depth_height != _depth_height)
+    RestartPipeline ();
+
+  return true;
+}
+
+void RealsenseController::RestartPipeline ()
+{
+  if (!_is_thread_running || !_mutex)
+    return;
+
+  // framesets of the old mode must not reach buffers sized for the new one
+  std::lock_guard<std::mutex> guard ( *_mutex );
+
+  _restart_pipeline = true;
+
+  rs2::frame stale;
+  while (_frameset_queue->poll_for_frame ( &stale ))
+    ;
+}
+
+bool RealsenseController::SelectProfile () try
+{
+  // the generator produces whatever is asked for
+  if (_source == SourceSynthetic)
+  {
+    _target_fps = std::max (1, (int)std::ceil (_save_fps));
+    _color_width = _request_color_width;
+    _color_height = _request_color_height;
+    _depth_width = _request_depth_width;
+    _depth_height = _request_depth_height;
+    return true;
+  }
+
+  rs2::context ctx;
+  rs2::device dev;
+
+  if (_source == SourcePlayback)
+  {
+    dev = ctx.load_device (_source_name);
+  }
+  else
+  {
+    auto devices = ctx.query_devices ();
+    for (size_t i = 0; i < devices.size () && !dev; i++)
+    {
+      if (_source_name.empty () || _source_name == devices[i].get_info (RS2_CAMERA_INFO_SERIAL_NUMBER))
+        dev = devices[i];
+    }
+  }
+
+  if (!dev)
+    return false;
+
+  std::vector<stream_mode> modes[StreamCount];
+  if (IsStreamEnabled (StreamColor))
+    modes[StreamColor] = get_stream_modes (dev, RS2_STREAM_COLOR, 0, RS2_FORMAT_RGB8);
+  if (IsStreamEnabled (StreamDepth))
+    modes[StreamDepth] = get_stream_modes (dev, RS2_STREAM_DEPTH, 0, RS2_FORMAT_Z16);
+  if (IsStreamEnabled (StreamInfraredLeft))
+    modes[StreamInfraredLeft] = get_stream_modes (dev, RS2_STREAM_INFRARED, 1, RS2_FORMAT_Y8);
+  if (IsStreamEnabled (StreamInfraredRight))
+    modes[StreamInfraredRight] = get_stream_modes (dev, RS2_STREAM_INFRARED, 2, RS2_FORMAT_Y8);
+
+  std::set<int> rates;
+  for (int i = 0; i < StreamCount; i++)
+  {
+    for (auto& mode : modes[i])
+      rates.insert (mode.fps);
+  }
+
+  // slowest rate that keeps up with the save rate first, then the fastest ones when none does
+  std::vector<int> candidates;
+  for (int fps : rates)
+  {
+    if (fps >= _save_fps)
+      candidates.push_back (fps);
+  }
+  for (auto it = rates.rbegin (); it != rates.rend (); ++it)
+  {
+    if (*it < _save_fps)
+      candidates.push_back (*it);
+  }
+
+  // the depth sensor runs depth and both imagers in one mode
+  StreamType depth_streams[] = { StreamDepth, StreamInfraredLeft, StreamInfraredRight };
+
+  for (int fps : candidates)
+  {
+    stream_mode color = { _color_width, _color_height, fps };
+    if (IsStreamEnabled (StreamColor) && !find_mode (modes[StreamColor], fps, _request_color_width, _request_color_height, color))
+      continue;
+
+    stream_mode depth = { _depth_width, _depth_height, fps };
+    bool found = true;
+
+    for (auto stream : depth_streams)
+    {
+      if (!IsStreamEnabled (stream))
+        continue;
+
+      // smallest mode of the first enabled stream, the others have to offer the same one
+      if (!find_mode (modes[stream], fps, _request_depth_width, _request_depth_height, depth))
+        found = false;
+
+      for (auto other : depth_streams)
+      {
+        if (other != stream && IsStreamEnabled (other) && !has_mode (modes[other], depth))
+          found = false;
+      }
 
-  intrinsics = profile.get_stream (RS2_STREAM_COLOR).as<rs2::video_stream_profile> ().get_intrinsics ();
-  _color_intrinsics.fx = intrinsics.fx;
-  _color_intrinsics.fy = intrinsics.fy;
-  _color_intrinsics.height = intrinsics.height;
-  _color_intrinsics.width = intrinsics.width;
-  _color_intrinsics.ppx = intrinsics.ppx;
-  _color_intrinsics.ppy = intrinsics.ppy;
+      break;
+    }
 
-  auto depth_stream = profile.get_stream (RS2_STREAM_DEPTH);
-  auto color_stream = profile.get_stream (RS2_STREAM_COLOR);
-  auto ext = depth_stream.get_extrinsics_to (color_stream);
+    if (!found)
+      continue;
 
-  for (int i = 0; i < 9; i++)
-    _extrinsics.rotation[i] = ext.rotation[i];
+    _target_fps = fps;
+    _color_width = color.width;
+    _color_height = color.height;
+    _depth_width = depth.width;
+    _depth_height = depth.height;
 
-  for (int i = 0; i < 3; i++)
-    _extrinsics.translation[i] = ext.translation[i];
+    DebugOut ("RealsenseController::SelectProfile %d fps, color %dx%d, depth %dx%d for %.1f fps saved",
+      _target_fps, _color_width, _color_height, _depth_width, _depth_height, _save_fps);
 
-  // Each depth camera might have different units for depth pixels, so we get it here
-  // Using the pipeline's profile, we can retrieve the device that the pipeline uses
-  _depth_scale = get_depth_scale (profile.get_device ());
+    return true;
+  }
 
-  // figure out the device type (D435, D415)
-  _deviceType = GetDeviceType ( profile.get_device () );
+  DebugOut ("RealsenseController::SelectProfile no supported mode covers color %dx%d and depth %dx%d",
+    _request_color_width, _request_color_height, _request_depth_width, _request_depth_height);
 
-  //Pipeline could choose a device that does not have a color stream
-  //If there is no color stream, choose to align depth to another stream
-  auto align_to = find_stream_to_align (profile.get_streams ());
+  return false;
+}
+catch (const rs2::error & e)
+{
+  DebugOut ("RealsenseController::SelectProfile realsense exp: %s", e.what ());
+  return false;
+}
 
-  // Create a rs2::align object.
-  // rs2::align allows us to perform alignment of depth frames to others frames
-  //The "align_to" is the stream type to which we plan to align depth frames.
-  auto align = rs2::align (align_to);
+int RealsenseController::GetStreamBytesPerPixel (StreamType stream)
+{
+  switch (stream)
+  {
+  case StreamColor:
+    return 3;
+  case StreamDepth:
+    return 2;
+  default:
+    return 1;
+  }
+}
 
-  InvokeState (RSState::Started);
+void RealsenseController::ThreadRun () try
+{
+  rs2::colorizer colorizer;
+  bool started = false;
 
   while (_is_thread_running)
   {
-    while (_is_running)
+    rs2::config cfg;
+
+    // streams that are not saved are not requested either, they only cost usb bandwidth
+    if (IsStreamEnabled (StreamColor))
+      cfg.enable_stream (RS2_STREAM_COLOR, _color_width, _color_height, RS2_FORMAT_RGB8, _target_fps);
+    if (IsStreamEnabled (StreamDepth))
+      cfg.enable_stream (RS2_STREAM_DEPTH, _depth_width, _depth_height, RS2_FORMAT_Z16, _target_fps);
+    if (IsStreamEnabled (StreamInfraredLeft))
+      cfg.enable_stream (RS2_STREAM_INFRARED, 1, _depth_width, _depth_height, RS2_FORMAT_Y8, _target_fps);
+    if (IsStreamEnabled (StreamInfraredRight))
+      cfg.enable_stream (RS2_STREAM_INFRARED, 2, _depth_width, _depth_height, RS2_FORMAT_Y8, _target_fps);
+
+    rs2::pipeline pipe;
+    std::unique_ptr<SyntheticSource> synthetic;
+    rs2::stream_profile profiles[StreamCount];
+
+    _restart_pipeline = false;
+
+    // sensor time of the next frameset to keep, framesets up to half a sensor frame early still count
+    double next_keep = 0;
+    double keep_interval = 1000.0 / _save_fps;
+    double keep_tolerance = 500.0 / _target_fps;
+
+    if (_source == SourceSynthetic)
     {
-      // Using the align object, we block the application until a frameset is available
-      rs2::frameset frameset = pipe.wait_for_frames ();
+      synthetic.reset (new SyntheticSource ());
+      if (!synthetic->Start (_streams, _color_width, _color_height, _depth_width, _depth_height, _target_fps))
+        throw std::runtime_error ("synthetic source did not start");
 
-      // synchronise so both queues are in step
+      for (int i = 0; i < StreamCount; i++)
+      {
+        if (IsStreamEnabled ((StreamType)i))
+          profiles[i] = synthetic->GetProfile ((StreamType)i);
+      }
+
+      _depth_scale = 10000 * synthetic->GetDepthScale ();
+      _deviceType = DeviceType::Unknown;
+    }
+    else
+    {
+      if (_source == SourcePlayback)
+        cfg.enable_device_from_file (_source_name, true);
+      else if (!_source_name.empty ())
+        cfg.enable_device (_source_name);
+
+      auto profile = pipe.start (cfg);
+
+      if (IsStreamEnabled (StreamColor))
+        profiles[StreamColor] = profile.get_stream (RS2_STREAM_COLOR);
+      if (IsStreamEnabled (StreamDepth))
+        profiles[StreamDepth] = profile.get_stream (RS2_STREAM_DEPTH);
+      if (IsStreamEnabled (StreamInfraredLeft))
+        profiles[StreamInfraredLeft] = profile.get_stream (RS2_STREAM_INFRARED, 1);
+      if (IsStreamEnabled (StreamInfraredRight))
+        profiles[StreamInfraredRight] = profile.get_stream (RS2_STREAM_INFRARED, 2);
+
+      // Each depth camera might have different units for depth pixels, so we get it here
+      // Using the pipeline's profile, we can retrieve the device that the pipeline uses
+      _depth_scale = get_depth_scale (profile.get_device ());
+
+      // figure out the device type (D435, D415)
+      _deviceType = GetDeviceType ( profile.get_device () );
+
+      // timestamps of several cameras are only comparable on the host clock
+      if (_source == SourceDevice)
       {
-        std::lock_guard<std::mutex> guard ( *_mutex );
+        for (auto& sensor : profile.get_device ().query_sensors ())
+        {
+          if (sensor.supports (RS2_OPTION_GLOBAL_TIME_ENABLED))
+            sensor.set_option (RS2_OPTION_GLOBAL_TIME_ENABLED, 1);
+        }
+      }
+    }
 
-        auto color_frame = frameset.get_color_frame ();
-        auto depth_frame = frameset.get_depth_frame ();
+    // the left imager is the depth reference, so infrared shares the depth intrinsics
+    if (IsStreamEnabled (StreamDepth))
+      get_intrinsics (profiles[StreamDepth], _depth_intrinsics);
+    else if (IsStreamEnabled (StreamInfraredLeft))
+      get_intrinsics (profiles[StreamInfraredLeft], _depth_intrinsics);
+
+    if (IsStreamEnabled (StreamColor))
+      get_intrinsics (profiles[StreamColor], _color_intrinsics);
+
+    if (IsStreamEnabled (StreamDepth) && IsStreamEnabled (StreamColor))
+    {
+      auto ext = profiles[StreamDepth].get_extrinsics_to (profiles[StreamColor]);
 
-        _color_frame_queue->enqueue ( color_frame );
-        _depth_frame_queue->enqueue ( depth_frame );
+      for (int i = 0; i < 9; i++)
+        _extrinsics.rotation[i] = ext.rotation[i];
+
+      for (int i = 0; i < 3; i++)
+        _extrinsics.translation[i] = ext.translation[i];
+    }
+
+    // before any frameset of the new pipeline is handed out, the stream sizes follow the crop
+    ProjectVolume ();
+
+    // framesets of the previous stream set would not pair up with the new one
+    {
+      std::lock_guard<std::mutex> guard ( *_mutex );
+
+      rs2::frame stale;
+      while (_frameset_queue->poll_for_frame ( &stale ))
+        ;
+
+      _frameset_unpolled = false;
+      _drop_monitor->Resync ();
+    }
+
+    if (!started)
+    {
+      InvokeState (RSState::Started);
+      started = true;
+    }
+
+    while (_is_thread_running && !_restart_pipeline)
+    {
+      while (_is_running && !_restart_pipeline)
+      {
+        // a busy encoder must not push the acquisition off its core, or librealsense drops frames
+        if (_placement->changed.exchange (false))
+        {
+          ThreadPlacement placement;
+          {
+            std::lock_guard<std::mutex> guard (_placement->mutex);
+            placement = _placement->placement;
+          }
+
+          ApplyThreadPlacement (placement, Format ("rsds capture %s", _source_name.c_str ()));
+        }
+
+        rs2::frameset frameset;
+        int stall_timeout = GetStallTimeout ();
+
+        if (synthetic)
+          frameset = synthetic->WaitForFrames ();
+        else if (!pipe.try_wait_for_frames (&frameset, stall_timeout > 0 ? stall_timeout : RS2_DEFAULT_TIMEOUT))
+        {
+          double since = 0;
+          {
+            std::lock_guard<std::mutex> guard ( *_mutex );
+            if (stall_timeout > 0)
+              _drop_monitor->Stalled ();
+            since = _drop_monitor->Stats (now_ms ()).msSinceFrameset;
+          }
+
+          DebugOut ("RealsenseController::ThreadRun %s stalled, no frameset for %.0f ms", _source_name.c_str (), since);
+          if (_events && stall_timeout > 0)
+            _events->PublishTelemetry (TelemetryStall, (long long)since, _event_source);
+
+          // as long as wait_for_frames would wait before giving up on the camera
+          if (stall_timeout <= 0 || since >= RS2_DEFAULT_TIMEOUT)
+            throw std::runtime_error ("no frames from the camera");
+
+          continue;
+        }
 
         _frame_aquired_count++;
-      }      
+
+        // sensor frame numbers show what was lost before the frameset got here
+        unsigned long long numbers[StreamCount] = {};
+        bool complete = true;
+
+        for (int i = 0; i < StreamCount; i++)
+        {
+          if (!IsStreamEnabled ((StreamType)i))
+            continue;
+
+          auto frame = get_stream_frame (frameset, (StreamType)i);
+          if (frame)
+            numbers[i] = frame.get_frame_number ();
+          else
+            complete = false;
+        }
+
+        // decimate to the save rate here so the dropped framesets are never queued or copied
+        double timestamp = frameset.get_timestamp ();
+        double interval = keep_interval;
+        {
+          std::lock_guard<std::mutex> guard ( *_mutex );
+          if (_save_limit > 0 && _save_limit < _save_fps)
+            interval = 1000.0 / _save_limit;
+        }
+
+        bool throttled = timestamp < next_keep - keep_tolerance;
+
+        // only whole framesets are queued, so every saved frame has all of its streams
+        if (!throttled && complete)
+        {
+          // stay on the save rate grid unless we fell more than a frame behind it
+          next_keep += interval;
+          if (next_keep < timestamp)
+            next_keep = timestamp + interval;
+        }
+
+        {
+          std::lock_guard<std::mutex> guard ( *_mutex );
+
+          double now = now_ms ();
+          _drop_monitor->Acquired (numbers, now);
+
+          if (throttled)
+            _drop_monitor->Dropped (DropThrottle, 1, now);
+          else if (!complete)
+            _drop_monitor->Dropped (DropPairing, 1, now);
+          else if (!_restart_pipeline)
+          {
+            if (_frameset_unpolled)
+              _drop_monitor->Dropped (DropQueue, 1, now);
+
+            _frameset_queue->enqueue ( frameset );
+            _frameset_unpolled = true;
+
+            _frame_kept_count++;
+            _drop_monitor->Kept (now);
+          }
+        }
+      }
+
+      if (_is_thread_running && !_restart_pipeline)
+        std::this_thread::sleep_for ( std::chrono::milliseconds ( 500 ) );
     }
 
-    if (_is_thread_running)
-      std::this_thread::sleep_for ( std::chrono::milliseconds ( 500 ) );
+    if (synthetic)
+      synthetic->Stop ();
+    else
+      pipe.stop ();
   }
-  
-
-  pipe.stop ();
-  cfg.disable_all_streams ();
 
   InvokeState (RSState::Stopped);
 }
@@ -213,32 +891,20 @@ void RealsenseController::Stop (bool fullStop)
   _thread = nullptr;
 
   DEL (_mutex);
-  DEL (_color_frame_queue);
-  DEL (_depth_frame_queue);
-  DEL (_color_frame);
-  DEL (_depth_frame);
+  DEL (_frameset_queue);
+  DEL (_frameset);
+  for (int i = 0; i < StreamCount; i++)
+    DEL (_frames[i]);
   DEL (_colorizer);
   DEL (_pc);
 }
 
 bool RealsenseController::ProcessFrame () try
 {
-  if (!_is_running || !_color_frame_queue || !_depth_frame_queue || !_thread || !_mutex)
+  if (!_is_running || !_frameset_queue || !_thread || !_mutex)
     return false;
 
-  bool ret = false;
-
-  {
-    std::lock_guard<std::mutex> guard (*_mutex);
-
-    if (_color_frame_queue->poll_for_frame (_color_frame) && _depth_frame_queue->poll_for_frame(_depth_frame))
-    {
-      ret = true;
-    }
-  }
-
-  return ret;
-
+  return PollFrameset ();
 }
 catch (const rs2::error & e)
 {
@@ -251,25 +917,110 @@ catch (const std::exception & e)
   return false;
 }
 
-void RealsenseController::FillColorBitmap (unsigned char* pImage)
+bool RealsenseController::PollFrameset ()
+{
+  std::lock_guard<std::mutex> guard ( *_mutex );
+
+  if (!_frameset_queue->poll_for_frame ( _frameset ))
+    return false;
+
+  _frameset_unpolled = false;
+
+  for (int i = 0; i < StreamCount; i++)
+    *_frames[i] = IsStreamEnabled ((StreamType)i) ? get_stream_frame (*_frameset, (StreamType)i) : rs2::frame ();
+
+  return true;
+}
+
+CaptureStats RealsenseController::GetCaptureStats ()
+{
+  if (!_mutex)
+    return _drop_monitor->Stats (now_ms ());
+
+  std::lock_guard<std::mutex> guard ( *_mutex );
+  return _drop_monitor->Stats (now_ms ());
+}
+
+void RealsenseController::SetSaveRateLimit (float fps)
 {
-  if (!pImage || !_color_frame)
+  if (!_mutex)
+  {
+    _save_limit = fps;
     return;
+  }
 
-  rs2::video_frame* vf = reinterpret_cast<rs2::video_frame*>(_color_frame);
+  std::lock_guard<std::mutex> guard ( *_mutex );
+  _save_limit = fps;
+}
 
-  unsigned char* pColorFrame = reinterpret_cast<unsigned char*>(const_cast<void*>(vf->get_data ()));
+void RealsenseController::CountDrop (DropCause cause, int count)
+{
+  if (!_mutex)
+    return;
 
-  int size = vf->get_bytes_per_pixel () * vf->get_width () * vf->get_height ();
+  std::lock_guard<std::mutex> guard ( *_mutex );
+  _drop_monitor->Dropped (cause, count, now_ms ());
+}
+
+bool RealsenseController::FillStreamImage (StreamType stream, unsigned char* pImage, int size)
+{
+  if (!pImage || !_frames[stream] || !*_frames[stream])
+    return false;
+
+  rs2::video_frame* vf = reinterpret_cast<rs2::video_frame*>(_frames[stream]);
+
+  // a frame from before a mode change does not fit the caller's buffer
+  crop_rect rect = GetCropRect (stream);
+  int width = stream == StreamColor ? _color_width : _depth_width;
+  int height = stream == StreamColor ? _color_height : _depth_height;
+  if (vf->get_width () != width || vf->get_height () != height)
+    return false;
+
+  const unsigned char* pFrame = reinterpret_cast<const unsigned char*>(vf->get_data ());
+  int bpp = vf->get_bytes_per_pixel ();
+
+  // nor does a crop that settled after the caller asked for the stream's size
+  if ((size_t)rect.width * rect.height * bpp != (size_t)size)
+    return false;
 
-  memcpy (pImage, pColorFrame, size);
+  if (rect.width == width)
+  {
+    memcpy (pImage, pFrame + (size_t)rect.y * width * bpp, (size_t)rect.height * width * bpp);
+    return true;
+  }
+
+  // row by row, the cut is all the copy does
+  size_t row = (size_t)rect.width * bpp;
+  for (int y = 0; y < rect.height; y++)
+    memcpy (pImage + y * row, pFrame + ((size_t)(rect.y + y) * width + rect.x) * bpp, row);
+
+  return true;
+}
+
+void RealsenseController::FillColorBitmap (unsigned char* pImage)
+{
+  if (!pImage || !_frames[StreamColor] || !*_frames[StreamColor])
+    return;
+
+  // the preview shows the whole image, crop or not
+  rs2::video_frame* vf = reinterpret_cast<rs2::video_frame*>(_frames[StreamColor]);
+  if (vf->get_width () != _color_width || vf->get_height () != _color_height)
+    return;
+
+  memcpy (pImage, vf->get_data (), (size_t)vf->get_bytes_per_pixel () * vf->get_width () * vf->get_height ());
 }
 
 bool RealsenseController::FillDepthBitmap (unsigned char* pImage, bool colorize)
 {
-  if (!pImage || !_depth_frame)
+  rs2::frame* _depth_frame = _frames[StreamDepth];
+
+  if (!pImage || !_depth_frame || !*_depth_frame)
     return true;  
 
+  auto df = reinterpret_cast<rs2::video_frame*>(_depth_frame);
+  if (df->get_width () != _depth_width || df->get_height () != _depth_height)
+    return false;
+
   bool validDepth = true;
   
 
@@ -298,35 +1049,109 @@ bool RealsenseController::FillDepthBitmap (unsigned char* pImage, bool colorize)
   return validDepth;
 }
 
-bool RealsenseController::EncodeFrame ( unsigned char* pColor, unsigned char* pDepth)
+bool RealsenseController::EncodeFrame ( unsigned char* pImages[], const int sizes[], frame_metadata* pMetadata )
 {
-  if (!_is_running || !_color_frame_queue || !_depth_frame_queue || !_thread || !_mutex)
+  if (!_is_running || !_frameset_queue || !_thread || !_mutex)
+    return false;
+
+  if (!PollFrameset ())
+    return false;
+
+  // a skipped frameset never gets copied, the caller sees it as no frame yet
+  if (_change_detector->IsEnabled () && !IsChanged ())
     return false;
 
-  bool ret = false;
+  _frame_encoded_count++;
 
+  for (int i = 0; i < StreamCount; i++)
   {
-    std::lock_guard<std::mutex> guard ( *_mutex );
+    StreamType stream = (StreamType)i;
 
-    if (_color_frame_queue->poll_for_frame ( _color_frame ) && _depth_frame_queue->poll_for_frame ( _depth_frame ))
+    bool filled = stream == StreamDepth
+      ? EncodeDepth ( pImages[i], sizes[i] )
+      : FillStreamImage ( stream, pImages[i], sizes[i] );
+
+    // what the buffer holds is not this frame's image, the caller must not save it
+    if (!filled)
+      pImages[i] = nullptr;
+
+    if (pMetadata)
     {
-      _frame_encoded_count++;
-      ret = true;
+      bool valid = static_cast<bool> ( *_frames[i] );
+      pMetadata->timestamp[i] = valid ? _frames[i]->get_timestamp () : 0;
+      pMetadata->frame_number[i] = valid ? _frames[i]->get_frame_number () : 0;
+      pMetadata->exposure[i] = valid && _frames[i]->supports_frame_metadata ( RS2_FRAME_METADATA_ACTUAL_EXPOSURE )
+        ? _frames[i]->get_frame_metadata ( RS2_FRAME_METADATA_ACTUAL_EXPOSURE ) : -1;
     }
   }
 
-  if(!ret)
+  return true;
+}
+
+bool RealsenseController::IsChanged ()
+{
+  const uint16_t* depth = nullptr;
+  const uint8_t* color = nullptr;
+  int depthWidth = 0, depthHeight = 0, colorWidth = 0, colorHeight = 0;
+  double timestamp = 0;
+
+  // the sensor's frames are compared where they are, before any copy or filter
+  if (*_frames[StreamDepth])
+  {
+    auto vf = reinterpret_cast<rs2::video_frame*>(_frames[StreamDepth]);
+    depth = reinterpret_cast<const uint16_t*>(vf->get_data ());
+    depthWidth = vf->get_width ();
+    depthHeight = vf->get_height ();
+    timestamp = vf->get_timestamp ();
+  }
+
+  if (*_frames[StreamColor])
+  {
+    auto vf = reinterpret_cast<rs2::video_frame*>(_frames[StreamColor]);
+    color = reinterpret_cast<const uint8_t*>(vf->get_data ());
+    colorWidth = vf->get_width ();
+    colorHeight = vf->get_height ();
+    if (!depth)
+      timestamp = vf->get_timestamp ();
+  }
+
+  return _change_detector->Check (depth, depthWidth, depthHeight, color, colorWidth, colorHeight, timestamp);
+}
+
+bool RealsenseController::EncodeDepth (unsigned char* pImage, int size)
+{
+  if (!pImage || !_depth_filter->IsEnabled ())
+    return FillStreamImage (StreamDepth, pImage, size);
+
+  // decimation reads the whole crop and leaves a smaller one than the caller's buffer holds
+  crop_rect rect = GetCropRect (StreamDepth);
+  int rawSize = rect.width * rect.height * 2;
+  if (_depth_filter->OutputWidth (rect.width) * _depth_filter->OutputHeight (rect.height) * 2 != size)
+    return false;
+
+  bool decimate = _depth_filter->Settings ().decimation > 1;
+  if (decimate)
+    _raw_depth.resize (rawSize);
+
+  unsigned char* depth = decimate ? _raw_depth.data () : pImage;
+
+  // refused when the crop moved since rect was read
+  if (!FillStreamImage (StreamDepth, depth, rawSize))
     return false;
 
-  FillColorBitmap ( pColor );
-  FillDepthBitmap ( pDepth, false );
+  _depth_filter->Process (reinterpret_cast<uint16_t*>(depth), rect.width, rect.height);
+
+  if (decimate)
+    memcpy (pImage, depth, size);
 
   return true;
 }
 
 void RealsenseController::InvokeState (RSState state)
 {
-  if (StateCallback)
+  if (_events)
+    _events->PublishState (state, _event_source, _source_name.c_str ());
+  else if (StateCallback)
     StateCallback (state);
 }
 
@@ -366,6 +1191,94 @@ float get_depth_scale (rs2::device dev)
   throw std::runtime_error ("Device does not have a depth sensor");
 }
 
+void get_intrinsics (const rs2::stream_profile& profile, rs_intrinsics& intrinsics)
+{
+  auto i = profile.as<rs2::video_stream_profile> ().get_intrinsics ();
+  intrinsics.fx = i.fx;
+  intrinsics.fy = i.fy;
+  intrinsics.height = i.height;
+  intrinsics.width = i.width;
+  intrinsics.ppx = i.ppx;
+  intrinsics.ppy = i.ppy;
+}
+
+std::vector<stream_mode> get_stream_modes (const rs2::device& dev, rs2_stream stream, int index, rs2_format format)
+{
+  std::vector<stream_mode> modes;
+
+  for (auto& sensor : dev.query_sensors ())
+  {
+    for (auto& profile : sensor.get_stream_profiles ())
+    {
+      if (profile.stream_type () != stream || profile.format () != format)
+        continue;
+
+      if (index > 0 && profile.stream_index () != index)
+        continue;
+
+      auto video = profile.as<rs2::video_stream_profile> ();
+      if (!video)
+        continue;
+
+      modes.push_back ({ video.width (), video.height (), profile.fps () });
+    }
+  }
+
+  return modes;
+}
+
+bool find_mode (const std::vector<stream_mode>& modes, int fps, int width, int height, stream_mode& mode)
+{
+  // smallest resolution at this rate that is at least the requested size
+  bool found = false;
+
+  for (auto& m : modes)
+  {
+    if (m.fps != fps || m.width < width || m.height < height)
+      continue;
+
+    if (!found || m.width * m.height < mode.width * mode.height)
+      mode = m;
+
+    found = true;
+  }
+
+  return found;
+}
+
+bool has_mode (const std::vector<stream_mode>& modes, const stream_mode& mode)
+{
+  for (auto& m : modes)
+  {
+    if (m.fps == mode.fps && m.width == mode.width && m.height == mode.height)
+      return true;
+  }
+
+  return false;
+}
+
+double now_ms ()
+{
+  return std::chrono::duration<double, std::milli> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+rs2::frame get_stream_frame (const rs2::frameset& frameset, StreamType stream)
+{
+  switch (stream)
+  {
+  case StreamColor:
+    return frameset.first_or_default (RS2_STREAM_COLOR);
+  case StreamDepth:
+    return frameset.first_or_default (RS2_STREAM_DEPTH);
+  case StreamInfraredLeft:
+    return frameset.get_infrared_frame (1);
+  case StreamInfraredRight:
+    return frameset.get_infrared_frame (2);
+  default:
+    return rs2::frame ();
+  }
+}
+
 rs2_stream find_stream_to_align (const std::vector<rs2::stream_profile>& streams)
 {
   //Given a vector of streams, we try to find a depth stream and another stream to align depth with.
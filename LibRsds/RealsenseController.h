@@ -1,16 +1,27 @@
 #pragma once
 
+#include "CaptureStats.h"
+#include "ChangeDetector.h"
+#include "DepthFilter.h"
+#include "EventRing.h"
+#include "ThreadPlacement.h"
+
+#include <string>
+#include <vector>
+
 namespace rs2
 {
   class pipeline;
   class align;
   class pipeline_profile;
   class frame;
+  class frameset;
   class frame_queue;
   class colorizer;  
   class pointcloud;
   class points;
   class device;
+  class stream_profile;
 }
 
 namespace std
@@ -38,6 +49,8 @@ struct rs_extrinsics
 
 enum rs2_stream : int;
 
+// the working volume, a box in the depth camera's frame in millimeters: centered on the optical
+// axis, width across x, height across y and depth along z around z_translate
 struct volume_bounds
 {
   volume_bounds ()
@@ -62,6 +75,61 @@ namespace RS
     ErrorUnplugged,
   };
 
+  // every enabled stream is captured, paired and saved together
+  enum StreamType
+  {
+    StreamColor,
+    StreamDepth,
+    StreamInfraredLeft,
+    StreamInfraredRight,
+    StreamCount,
+  };
+
+  enum StreamFlags
+  {
+    StreamFlagColor = 1 << StreamColor,
+    StreamFlagDepth = 1 << StreamDepth,
+    StreamFlagInfraredLeft = 1 << StreamInfraredLeft,
+    StreamFlagInfraredRight = 1 << StreamInfraredRight,
+  };
+
+  // in sensor pixels, the depth one cuts infrared too
+  struct crop_rect
+  {
+    int x;
+    int y;
+    int width;   // 0 for the whole image
+    int height;
+  };
+
+  enum CropMode
+  {
+    CropNone,
+    CropRectangle,  // the rectangles as given
+    CropVolume,     // the volume_bounds box projected into each image, grown by margin
+  };
+
+  struct CropSettings
+  {
+    CropSettings ()
+      : mode (CropNone)
+      , color ()
+      , depth ()
+      , margin (16)
+    {  }
+    CropMode mode;
+    crop_rect color;
+    crop_rect depth;
+    int margin;  // pixels around the projected volume
+  };
+
+  struct frame_metadata
+  {
+    double timestamp[StreamCount];                 /**< Sensor timestamp of each stream's frame in milliseconds */
+    unsigned long long frame_number[StreamCount];
+    long long exposure[StreamCount];               /**< Actual exposure in microseconds, -1 when the frame has no metadata for it */
+  };
+
   enum DeviceType
   {
     D435,
@@ -69,6 +137,17 @@ namespace RS
     Unknown,
   };
 
+  // where the framesets come from, everything after the acquisition is the same for all of them
+  enum SourceType
+  {
+    SourceDevice,     // a camera, the one with the given serial number or the first one found
+    SourcePlayback,   // a .bag recording, replayed in real time and looped
+    SourceSynthetic,  // generated test patterns, for running without a camera
+  };
+
+  // serial numbers of the connected cameras
+  std::vector<std::string> ListDeviceSerials ();
+
   class RealsenseController
   {
   public:      
@@ -76,36 +155,109 @@ namespace RS
 
     typedef void (*StateCallbackFn)(RSState);
 
-    StateCallbackFn StateCallback;
+    StateCallbackFn StateCallback;  // called on the capture thread, only when no event ring is set
+
+    // state changes and stalls are published here instead, for a consumer to drain at its own pace
+    void SetEventRing (EventRing* events, int source = 0) { _events = events; _event_source = source; }
 
     RealsenseController ();
     ~RealsenseController ();
 
     bool Start ();
+
+    // picked up by the next pipeline start, so set it before Start
+    void SetSource (SourceType type, const std::string& name = std::string ());
+    SourceType GetSourceType () { return _source; }
+    const std::string& GetSourceName () { return _source_name; }
+
+    // applied by the acquisition thread itself, also while it runs
+    void SetThreadPlacement (const ThreadPlacement& placement);
+
+    void SetStreams (int streams);
+    int GetStreams () { return _streams; }
+    bool IsStreamEnabled (StreamType stream) { return (_streams & (1 << stream)) != 0; }
+
+    // the sensors run at the lowest supported rate and resolution that cover the request, framesets
+    // beyond the save rate are dropped in the capture thread before they are queued
+    bool SetCaptureRequest (float saveFps, int colorWidth, int colorHeight, int depthWidth, int depthHeight);
+    int GetSensorFps () { return _target_fps; }
+    float GetSaveFps () { return _save_fps; }
+    // keeps framesets at no more than fps below the save rate while capturing, 0 lifts it. Unlike
+    // SetCaptureRequest it leaves the sensor mode alone, load shedding changes it on the fly.
+    void SetSaveRateLimit (float fps);
     void Stop ( bool fullStop = false);
     bool ProcessFrame ();
 
-    rs_intrinsics GetColorIntrinsics () { return _color_intrinsics; }
+    // of the saved color, shifted to the crop
+    rs_intrinsics GetColorIntrinsics ();
     int GetColorWidth () { return _color_width; }
     int GetColorHeight () { return _color_height; }
     void FillColorBitmap (unsigned char* pImage);
 
-    void SetVolume (volume_bounds volume) { _volume = volume; }
+    void SetVolume (volume_bounds volume);
     volume_bounds GetVolume () { return _volume; }
 
-    rs_intrinsics GetDepthIntrinsics () { return _depth_intrinsics; }
+    // Saved images are cut to the crop before anyone copies them, the preview stays whole. A volume
+    // crop is projected with the intrinsics of the running pipeline, so set it before Start like the
+    // capture request: the stream sizes follow it.
+    void SetCrop (const CropSettings& settings);
+    const CropSettings& GetCrop () { return _crop; }
+    // a 4:2:0 video only takes even sizes, the encoder asks for them while it writes one
+    void SetEvenColorCrop (bool even);
+    // what is cut out of the sensor's image, all of it without a crop
+    crop_rect GetCropRect (StreamType stream);
+
+    // of the saved depth, shifted to the crop and scaled down when the depth is decimated
+    rs_intrinsics GetDepthIntrinsics ();
     rs_extrinsics GetExtrinsics () { return _extrinsics; }
+    float GetDepthScale () { return _depth_scale / 10000.0f; }  // meters per depth unit
     int GetDepthWidth () { return _depth_width; }
     int GetDepthHeight () { return _depth_height; }
     bool FillDepthBitmap (unsigned char* pImage, bool colorize);
 
-    bool EncodeFrame ( unsigned char* pColor, unsigned char* pDepth );
+    // post-processing of the depth handed out by EncodeFrame, the preview shows the sensor's depth
+    void SetDepthFilters (const DepthFilterSettings& settings);
+    const DepthFilterSettings& GetDepthFilters () { return _depth_filter->Settings (); }
+
+    // when enabled EncodeFrame skips framesets that barely differ from the last one it handed out
+    void SetChangeDetection (const ChangeSettings& settings);
+    const ChangeSettings& GetChangeDetection () { return _change_detector->Settings (); }
+
+    // the saved size: infrared is always captured at the depth resolution, all are cut to the crop and
+    // depth shrinks when it is decimated
+    int GetStreamWidth (StreamType stream) { int width = GetCropRect (stream).width; return stream == StreamDepth ? _depth_filter->OutputWidth (width) : width; }
+    int GetStreamHeight (StreamType stream) { int height = GetCropRect (stream).height; return stream == StreamDepth ? _depth_filter->OutputHeight (height) : height; }
+    int GetStreamBytesPerPixel (StreamType stream);
+    int GetStreamSize (StreamType stream) { return GetStreamWidth (stream) * GetStreamHeight (stream) * GetStreamBytesPerPixel (stream); }
+    // the sensor's image cut to the crop, false when there is none, it is from before a mode change or the
+    // crop changed since the caller sized its buffer of size bytes
+    bool FillStreamImage (StreamType stream, unsigned char* pImage, int size);
+
+    // pImages and sizes are indexed by StreamType, streams that are disabled or null are skipped. An image
+    // that could not be filled, like one sized for the crop before a new one, is set to null.
+    bool EncodeFrame ( unsigned char* pImages[], const int sizes[], frame_metadata* pMetadata = nullptr );
     int GetFramesAcquired () { return _frame_aquired_count; }
+    int GetFramesKept () { return _frame_kept_count; }
     int GetFramesEncoded () { return _frame_encoded_count; }
+    int GetFramesSkipped () { return _change_detector->GetFramesSkipped (); }
+
+    // drops by cause since Start, with rates over the last seconds
+    CaptureStats GetCaptureStats ();
+    // frames lost after EncodeFrame handed them out, like a full encoder queue
+    void CountDrop (DropCause cause, int count = 1);
+    // a wait for the sensor longer than this counts as a stall, 0 turns the watchdog off
+    void SetStallTimeout (int ms) { _drop_monitor->SetStallTimeout (ms); }
+    int GetStallTimeout () { return _drop_monitor->GetStallTimeout (); }
 
   protected:
     void ThreadRun ();
     void InvokeState (RSState state);
+    bool PollFrameset ();
+    bool EncodeDepth (unsigned char* pImage, int size);
+    bool IsChanged ();
+    bool SelectProfile ();
+    void ProjectVolume ();
+    void RestartPipeline ();
     DeviceType GetDeviceType (const rs2::device& dev );
 
   private:
@@ -114,23 +266,45 @@ namespace RS
     int _color_width;
     int _color_height;
     int _target_fps;
+    float _save_fps;
+    float _save_limit;  // guarded by _mutex
+    int _request_color_width;
+    int _request_color_height;
+    int _request_depth_width;
+    int _request_depth_height;
+    int _streams;
+    SourceType _source;
+    std::string _source_name;
     bool _is_running;
     bool _is_thread_running;
+    bool _restart_pipeline;
+    struct Placement;  // defined in RealsenseController.cpp, atomics cannot be seen from managed code
+    Placement* _placement;
     float _depth_scale;
     bool _controls_set;
     volume_bounds _volume;
+    CropSettings _crop;         // the crop fields are guarded by _mutex once started
+    crop_rect _volume_crop[2];  // color and depth, from ProjectVolume
+    bool _even_color_crop;
+    DepthFilter* _depth_filter;
+    ChangeDetector* _change_detector;
+    DropMonitor* _drop_monitor;  // guarded by _mutex
+    bool _frameset_unpolled;     // the frameset queue holds one, the next enqueue overwrites it
+    EventRing* _events;          // not owned
+    int _event_source;
+    std::vector<unsigned char> _raw_depth;  // the sensor's depth before decimation
 
     std::thread* _thread;
     std::mutex* _mutex;
 
-    rs2::frame_queue* _color_frame_queue;
-    rs2::frame_queue* _depth_frame_queue;
+    rs2::frame_queue* _frameset_queue;
 
     int _frame_aquired_count;
+    int _frame_kept_count;
     int _frame_encoded_count;
 
-    rs2::frame* _color_frame;
-    rs2::frame* _depth_frame;
+    rs2::frameset* _frameset;
+    rs2::frame* _frames[StreamCount];
     rs2::colorizer* _colorizer;
     rs2::pointcloud* _pc;
 
@@ -0,0 +1,239 @@
+#define NOMINMAX
+#include "SyntheticSource.h"
+#include "Helpers.h"
+
+#include <cstring>
+#include <thread>
+
+using namespace RS;
+
+namespace
+{
+  // rows the window moves per frame, enough that consecutive frames never encode alike
+  const int kRowsPerFrame = 4;
+
+  unsigned int next_noise ( unsigned int& state )
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+}
+
+SyntheticSource::SyntheticSource ()
+  : _streams ( 0 )
+  , _fps ( 30 )
+  , _frame_number ( 0 )
+{
+  for (int i = 0; i < StreamCount; i++)
+  {
+    _widths[i] = 0;
+    _heights[i] = 0;
+    _bpp[i] = 0;
+    _sensor_index[i] = -1;
+  }
+}
+
+SyntheticSource::~SyntheticSource ()
+{
+  Stop ();
+}
+
+bool SyntheticSource::Start ( int streams, int colorWidth, int colorHeight, int depthWidth, int depthHeight, int fps ) try
+{
+  if (!_sensors.empty () || streams == 0 || fps <= 0)
+    return false;
+
+  _streams = streams;
+  _fps = fps;
+  _frame_number = 0;
+
+  // same split as a D400, depth and both imagers on one sensor and color on its own
+  rs2::software_sensor stereo = _device.add_sensor ( "Stereo Module" );
+  rs2::software_sensor rgb = _device.add_sensor ( "RGB Camera" );
+  stereo.add_read_only_option ( RS2_OPTION_DEPTH_UNITS, GetDepthScale () );
+
+  std::vector<rs2::stream_profile> stereoProfiles;
+  std::vector<rs2::stream_profile> rgbProfiles;
+
+  for (int i = 0; i < StreamCount; i++)
+  {
+    if ((streams & (1 << i)) == 0)
+      continue;
+
+    StreamType stream = (StreamType)i;
+
+    _widths[i] = stream == StreamColor ? colorWidth : depthWidth;
+    _heights[i] = stream == StreamColor ? colorHeight : depthHeight;
+    _bpp[i] = stream == StreamColor ? 3 : stream == StreamDepth ? 2 : 1;
+
+    rs2_video_stream video;
+    memset ( &video, 0, sizeof ( video ) );
+    video.type = stream == StreamColor ? RS2_STREAM_COLOR : stream == StreamDepth ? RS2_STREAM_DEPTH : RS2_STREAM_INFRARED;
+    video.index = stream == StreamInfraredLeft ? 1 : stream == StreamInfraredRight ? 2 : 0;
+    video.uid = i + 1;
+    video.width = _widths[i];
+    video.height = _heights[i];
+    video.fps = fps;
+    video.bpp = _bpp[i];
+    video.fmt = stream == StreamColor ? RS2_FORMAT_RGB8 : stream == StreamDepth ? RS2_FORMAT_Z16 : RS2_FORMAT_Y8;
+    video.intrinsics.width = _widths[i];
+    video.intrinsics.height = _heights[i];
+    video.intrinsics.ppx = _widths[i] / 2.0f;
+    video.intrinsics.ppy = _heights[i] / 2.0f;
+    video.intrinsics.fx = _widths[i] * 0.7f;
+    video.intrinsics.fy = _widths[i] * 0.7f;
+
+    if (stream == StreamColor)
+    {
+      _profiles[i] = rgb.add_video_stream ( video );
+      rgbProfiles.push_back ( _profiles[i] );
+    }
+    else
+    {
+      _profiles[i] = stereo.add_video_stream ( video );
+      stereoProfiles.push_back ( _profiles[i] );
+    }
+
+    MakePattern ( stream );
+  }
+
+  // color sits next to the left imager like on a D435
+  if ((streams & StreamFlagDepth) && (streams & StreamFlagColor))
+  {
+    rs2_extrinsics extrinsics = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0.015f, 0, 0 } };
+    _profiles[StreamDepth].register_extrinsics_to ( _profiles[StreamColor], extrinsics );
+  }
+
+  // frames of one set share a timestamp, so the timestamp matcher pairs them whatever the stream set
+  _device.create_matcher ( RS2_MATCHER_DEFAULT );
+
+  if (!stereoProfiles.empty ())
+  {
+    stereo.open ( stereoProfiles );
+    stereo.start ( _syncer );
+    _sensors.push_back ( stereo );
+  }
+
+  if (!rgbProfiles.empty ())
+  {
+    rgb.open ( rgbProfiles );
+    rgb.start ( _syncer );
+    _sensors.push_back ( rgb );
+  }
+
+  for (int i = 0; i < StreamCount; i++)
+  {
+    if (_streams & (1 << i))
+      _sensor_index[i] = i == StreamColor ? (int)_sensors.size () - 1 : 0;
+  }
+
+  _next_frame = std::chrono::steady_clock::now ();
+
+  return true;
+}
+catch (const rs2::error & e)
+{
+  DebugOut ( "SyntheticSource::Start realsense exp: %s", e.what () );
+  return false;
+}
+
+void SyntheticSource::Stop ()
+{
+  for (auto& sensor : _sensors)
+  {
+    sensor.stop ();
+    sensor.close ();
+  }
+
+  _sensors.clear ();
+}
+
+rs2::frameset SyntheticSource::WaitForFrames ()
+{
+  std::this_thread::sleep_until ( _next_frame );
+  _next_frame += std::chrono::microseconds ( 1000000 / _fps );
+
+  // a late frame does not have to be caught up on, a camera would have dropped it too
+  auto now = std::chrono::steady_clock::now ();
+  if (_next_frame < now)
+    _next_frame = now;
+
+  double timestamp = std::chrono::duration<double, std::milli> ( std::chrono::system_clock::now ().time_since_epoch () ).count ();
+
+  for (int i = 0; i < StreamCount; i++)
+  {
+    if (_sensor_index[i] < 0)
+      continue;
+
+    int stride = _widths[i] * _bpp[i];
+    int row = (_frame_number * kRowsPerFrame) % _heights[i];
+
+    // librealsense owns the pixels until the last reference to the frame is gone
+    unsigned char* pixels = new unsigned char[(size_t)stride * _heights[i]];
+    memcpy ( pixels, _patterns[i].data () + (size_t)row * stride, (size_t)stride * _heights[i] );
+
+    rs2_software_video_frame frame;
+    memset ( &frame, 0, sizeof ( frame ) );
+    frame.pixels = pixels;
+    frame.deleter = [] ( void* p ) { delete[] static_cast<unsigned char*>(p); };
+    frame.stride = stride;
+    frame.bpp = _bpp[i];
+    frame.timestamp = timestamp;
+    frame.domain = RS2_TIMESTAMP_DOMAIN_GLOBAL_TIME;
+    frame.frame_number = _frame_number;
+    frame.profile = _profiles[i].get ();
+
+    _sensors[_sensor_index[i]].on_video_frame ( frame );
+  }
+
+  _frame_number++;
+
+  return _syncer.wait_for_frames ();
+}
+
+void SyntheticSource::MakePattern ( StreamType stream )
+{
+  int width = _widths[stream];
+  int height = _heights[stream];
+  int bpp = _bpp[stream];
+
+  auto& pattern = _patterns[stream];
+  pattern.resize ( (size_t)width * height * 2 * bpp );
+
+  // some noise on every stream so the codecs see texture rather than flat gradients
+  unsigned int noise = 0x9E3779B9u + stream;
+
+  for (int y = 0; y < height * 2; y++)
+  {
+    int py = y % height;
+    unsigned char* row = pattern.data () + (size_t)y * width * bpp;
+
+    for (int x = 0; x < width; x++)
+    {
+      unsigned int n = next_noise ( noise );
+
+      switch (stream)
+      {
+      case StreamColor:
+        row[x * 3 + 0] = (unsigned char)(x * 255 / width);
+        row[x * 3 + 1] = (unsigned char)(py * 255 / height);
+        row[x * 3 + 2] = (unsigned char)((((x / 32) + (py / 32)) & 1) * 128 + (n & 31));
+        break;
+      case StreamDepth:
+      {
+        // a floor sloping away from 0.6 m to 3 m with a few holes where a camera would have no depth
+        unsigned short depth = (unsigned short)(600 + py * 2400 / height + (n & 7));
+        if (((x / 40) * 7 + (py / 40) * 13) % 29 == 0)
+          depth = 0;
+        memcpy ( row + x * 2, &depth, 2 );
+        break;
+      }
+      default:
+        row[x] = (unsigned char)(64 + (n & 127));
+        break;
+      }
+    }
+  }
+}
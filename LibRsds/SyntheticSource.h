@@ -0,0 +1,48 @@
+#pragma once
+
+#include "RealsenseController.h"
+
+#include <librealsense2/rs.hpp>
+
+#include <chrono>
+#include <vector>
+
+namespace RS
+{
+  // A librealsense software device that plays moving test patterns on every enabled stream and hands
+  // them out as matched framesets, so the capture path can be run and measured without a camera.
+  class SyntheticSource
+  {
+  public:
+    SyntheticSource ();
+    ~SyntheticSource ();
+
+    bool Start ( int streams, int colorWidth, int colorHeight, int depthWidth, int depthHeight, int fps );
+    void Stop ();
+
+    rs2::stream_profile GetProfile ( StreamType stream ) { return _profiles[stream]; }
+    float GetDepthScale () { return 0.001f; }
+
+    // paced to the source rate, timestamps are host milliseconds like global time on a camera
+    rs2::frameset WaitForFrames ();
+
+  private:
+    rs2::software_device _device;
+    std::vector<rs2::software_sensor> _sensors;
+    rs2::syncer _syncer;
+    rs2::stream_profile _profiles[StreamCount];
+
+    // each pattern is two frames high, the frame is a window into it that moves down a few rows per frame
+    std::vector<unsigned char> _patterns[StreamCount];
+    int _widths[StreamCount];
+    int _heights[StreamCount];
+    int _bpp[StreamCount];
+    int _sensor_index[StreamCount];  // into _sensors, -1 for streams that are not generated
+    int _streams;
+    int _fps;
+    int _frame_number;
+    std::chrono::steady_clock::time_point _next_frame;
+
+    void MakePattern ( StreamType stream );
+  };
+}
@@ -0,0 +1,79 @@
+#include "ThreadPlacement.h"
+#include "Helpers.h"
+
+#define NOMINMAX
+#include <windows.h>
+
+#include <algorithm>
+#include <thread>
+
+namespace
+{
+  // SetThreadDescription only exists from Windows 10 1607 on
+  typedef HRESULT (WINAPI *SetThreadDescriptionFn)(HANDLE, PCWSTR);
+}
+
+bool ApplyThreadPlacement (const ThreadPlacement& placement, const std::string& name)
+{
+  HANDLE thread = GetCurrentThread ();
+  bool placed = true;
+
+  static auto setDescription = (SetThreadDescriptionFn)GetProcAddress (GetModuleHandleW (L"kernel32.dll"), "SetThreadDescription");
+  if (setDescription && !name.empty ())
+    setDescription (thread, s2ws (name).c_str ());
+
+  if (placement.numaNode >= 0)
+  {
+    // the node decides the processor group, the affinity only narrows it down
+    GROUP_AFFINITY node;
+    ZeroMemory (&node, sizeof (node));
+
+    if (GetNumaNodeProcessorMaskEx ((USHORT)placement.numaNode, &node))
+    {
+      if (placement.affinity)
+        node.Mask &= (KAFFINITY)placement.affinity;
+
+      placed = node.Mask != 0 && SetThreadGroupAffinity (thread, &node, nullptr);
+    }
+    else
+    {
+      placed = false;
+    }
+  }
+  else
+  {
+    // any processor means the process's own mask again, an earlier placement may have narrowed the thread
+    DWORD_PTR mask = (DWORD_PTR)placement.affinity;
+    DWORD_PTR system;
+    if (!mask && !GetProcessAffinityMask (GetCurrentProcess (), &mask, &system))
+      mask = 0;
+
+    placed = mask != 0 && SetThreadAffinityMask (thread, mask) != 0;
+  }
+
+  if (!SetThreadPriority (thread, (int)placement.priority))
+    placed = false;
+
+  if (!placed)
+    DebugOut ("ApplyThreadPlacement %s: node %d affinity %llx priority %d not applied", name.c_str (), placement.numaNode, placement.affinity, (int)placement.priority);
+
+  return placed;
+}
+
+int ProcessorCount ()
+{
+  return std::max (1, (int)std::thread::hardware_concurrency ());
+}
+
+unsigned long long ProcessorMask (int first, int count)
+{
+  unsigned long long mask = 0;
+
+  for (int i = first; i < first + count && i < 64; i++)
+  {
+    if (i >= 0)
+      mask |= 1ull << i;
+  }
+
+  return mask;
+}
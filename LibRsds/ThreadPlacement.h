@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+
+// values are the THREAD_PRIORITY_* levels, mirrored by RsDsController::Priority
+enum class SchedulingPriority : int
+{
+  Idle = -15,
+  Lowest = -2,
+  BelowNormal = -1,
+  Normal = 0,
+  AboveNormal = 1,
+  Highest = 2,
+  TimeCritical = 15,
+};
+
+// Where a worker thread runs and how it is scheduled, the defaults leave the thread to the OS.
+struct ThreadPlacement
+{
+  ThreadPlacement ()
+    : affinity (0)
+    , numaNode (-1)
+    , priority (SchedulingPriority::Normal)
+  {  }
+  unsigned long long affinity;  // one bit per logical processor of the processor group, 0 is any the process may use
+  int numaNode;                 // restricts the thread to the node's processors (and affinity within them), -1 is any
+  SchedulingPriority priority;
+};
+
+// applies the placement to the calling thread and names it for debuggers and profilers
+bool ApplyThreadPlacement (const ThreadPlacement& placement, const std::string& name);
+
+int ProcessorCount ();
+
+// mask of count processors starting at first, limited to the 64 of one processor group
+unsigned long long ProcessorMask (int first, int count);
@@ -0,0 +1,483 @@
+#include "VideoSink.h"
+#include "Helpers.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+#include <cmath>
+#include <filesystem>
+
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  // pts are milliseconds since the first frame, the save rate is throttled so frames are not evenly spaced
+  const AVRational kTimeBase = { 1, 1000 };
+}
+
+VideoSink::VideoSink ()
+  : _format ( nullptr )
+  , _codec ( nullptr )
+  , _stream ( nullptr )
+  , _frame ( nullptr )
+  , _packet ( nullptr )
+  , _sws ( nullptr )
+  , _sidecar ( nullptr )
+  , _width ( 0 )
+  , _height ( 0 )
+  , _index ( 0 )
+  , _rows ( 0 )
+  , _first_timestamp ( 0 )
+  , _last_pts ( -1 )
+{
+}
+
+VideoSink::~VideoSink ()
+{
+  Close ();
+}
+
+std::string VideoSink::SidecarName ( const std::string& filename )
+{
+  return fs::path ( filename ).replace_extension ( ".csv" ).string ();
+}
+
+bool VideoSink::Open ( const std::string& filename, int width, int height, const VideoSettings& settings )
+{
+  Close ();
+
+  const char* encoderName = settings.codec == VideoCodecType::H265 ? "libx265" : "libx264";
+  const AVCodec* encoder = avcodec_find_encoder_by_name ( encoderName );
+  if (!encoder)
+  {
+    DebugOut ( "VideoSink::Open %s is not available", encoderName );
+    return false;
+  }
+
+  if (avformat_alloc_output_context2 ( &_format, nullptr, "matroska", filename.c_str () ) < 0)
+  {
+    DebugOut ( "VideoSink::Open failed to create %s", filename.c_str () );
+    return false;
+  }
+
+  _stream = avformat_new_stream ( _format, nullptr );
+  _codec = avcodec_alloc_context3 ( encoder );
+
+  _codec->width = width;
+  _codec->height = height;
+  _codec->time_base = kTimeBase;
+  _codec->gop_size = settings.gop;
+  _codec->pix_fmt = AV_PIX_FMT_YUV420P;
+  _codec->thread_count = 0;
+
+  if (_format->oformat->flags & AVFMT_GLOBALHEADER)
+    _codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  AVDictionary* options = nullptr;
+  av_dict_set ( &options, "preset", settings.preset.c_str (), 0 );
+  av_dict_set_int ( &options, "crf", settings.crf, 0 );
+
+  // keep x265 to the same keyframe interval, it reads its own parameter string
+  if (settings.codec == VideoCodecType::H265)
+    av_dict_set ( &options, "x265-params", Format ( "keyint=%d:log-level=error", settings.gop ).c_str (), 0 );
+
+  int ret = avcodec_open2 ( _codec, encoder, &options );
+  av_dict_free ( &options );
+
+  if (ret < 0)
+  {
+    DebugOut ( "VideoSink::Open failed to open %s", encoderName );
+    Close ();
+    return false;
+  }
+
+  avcodec_parameters_from_context ( _stream->codecpar, _codec );
+  _stream->time_base = kTimeBase;
+
+  if (avio_open ( &_format->pb, filename.c_str (), AVIO_FLAG_WRITE ) < 0 || avformat_write_header ( _format, nullptr ) < 0)
+  {
+    DebugOut ( "VideoSink::Open failed to write %s", filename.c_str () );
+
+    // no header means no trailer either
+    if (_format->pb)
+      avio_closep ( &_format->pb );
+
+    Close ();
+    return false;
+  }
+
+  _frame = av_frame_alloc ();
+  _frame->format = _codec->pix_fmt;
+  _frame->width = width;
+  _frame->height = height;
+  av_frame_get_buffer ( _frame, 0 );
+
+  _packet = av_packet_alloc ();
+
+  // colour conversion only, the size stays the same
+  _sws = sws_getContext ( width, height, AV_PIX_FMT_RGB24, width, height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr );
+
+  _sidecar = fopen ( SidecarName ( filename ).c_str (), "w" );
+  if (_sidecar)
+  {
+    fprintf ( _sidecar, "index,frame,timestamp,pts\n" );
+    fflush ( _sidecar );
+  }
+
+  _width = width;
+  _height = height;
+  _index = 0;
+  _rows = 0;
+  _last_pts = -1;
+
+  return true;
+}
+
+bool VideoSink::Write ( const unsigned char* rgb, int frame, double timestamp )
+{
+  if (!_codec || !_frame || !rgb)
+    return false;
+
+  if (_index == 0)
+    _first_timestamp = timestamp;
+
+  // sensor timestamps can repeat at ms resolution, pts must not
+  long long pts = std::llround ( timestamp - _first_timestamp );
+  if (pts <= _last_pts)
+    pts = _last_pts + 1;
+
+  if (av_frame_make_writable ( _frame ) < 0)
+    return false;
+
+  const uint8_t* src[1] = { rgb };
+  int stride[1] = { _width * 3 };
+  sws_scale ( _sws, src, stride, 0, _height, _frame->data, _frame->linesize );
+
+  _frame->pts = pts;
+
+  if (avcodec_send_frame ( _codec, _frame ) < 0)
+  {
+    DebugOut ( "VideoSink::Write failed to encode frame %d", frame );
+    return false;
+  }
+
+  _pending.push_back ( { { _index, frame, timestamp, pts }, false } );
+
+  _last_pts = pts;
+  _index++;
+
+  return Drain ( false );
+}
+
+bool VideoSink::Drain ( bool flush )
+{
+  if (flush)
+    avcodec_send_frame ( _codec, nullptr );
+
+  for (;;)
+  {
+    int ret = avcodec_receive_packet ( _codec, _packet );
+    if (ret == AVERROR ( EAGAIN ) || ret == AVERROR_EOF)
+      return true;
+    if (ret < 0)
+      return false;
+
+    long long pts = _packet->pts;
+
+    av_packet_rescale_ts ( _packet, _codec->time_base, _stream->time_base );
+    _packet->stream_index = _stream->index;
+
+    ret = av_interleaved_write_frame ( _format, _packet );
+    av_packet_unref ( _packet );
+
+    Muxed ( pts, ret >= 0 );
+
+    if (ret < 0)
+      return false;
+  }
+}
+
+void VideoSink::Muxed ( long long pts, bool written )
+{
+  for (auto it = _pending.begin (); it != _pending.end (); ++it)
+  {
+    if (it->first.pts != pts)
+      continue;
+
+    if (written)
+      it->second = true;
+    else
+      _pending.erase ( it );
+    break;
+  }
+
+  // b-frames leave the encoder out of order, rows go out in display order once everything before them is in the file
+  while (!_pending.empty () && _pending.front ().second)
+  {
+    auto entry = _pending.front ().first;
+    _pending.pop_front ();
+
+    if (_sidecar)
+    {
+      // flushed every frame so the index is complete for whatever made it into the file
+      fprintf ( _sidecar, "%d,%d,%.3f,%lld\n", _rows, entry.frame, entry.timestamp, entry.pts );
+      fflush ( _sidecar );
+    }
+
+    _rows++;
+  }
+}
+
+void VideoSink::Close ()
+{
+  if (_codec && _format && _format->pb)
+  {
+    Drain ( true );
+    av_write_trailer ( _format );
+  }
+
+  if (_format && _format->pb)
+    avio_closep ( &_format->pb );
+
+  if (_format)
+  {
+    avformat_free_context ( _format );
+    _format = nullptr;
+    _stream = nullptr;
+  }
+
+  if (_codec)
+    avcodec_free_context ( &_codec );
+
+  if (_frame)
+    av_frame_free ( &_frame );
+
+  if (_packet)
+    av_packet_free ( &_packet );
+
+  if (_sws)
+  {
+    sws_freeContext ( _sws );
+    _sws = nullptr;
+  }
+
+  if (_sidecar)
+  {
+    fclose ( _sidecar );
+    _sidecar = nullptr;
+  }
+
+  // a closed sink takes no frame
+  _width = 0;
+  _height = 0;
+
+  // whatever the encoder still held when it was flushed never made it into the file
+  _pending.clear ();
+}
+
+VideoReader::VideoReader ()
+  : _format ( nullptr )
+  , _codec ( nullptr )
+  , _frame ( nullptr )
+  , _packet ( nullptr )
+  , _sws ( nullptr )
+  , _stream_index ( -1 )
+  , _last_index ( -1 )
+{
+}
+
+VideoReader::~VideoReader ()
+{
+  Close ();
+}
+
+bool VideoReader::Open ( const std::string& filename )
+{
+  Close ();
+
+  FILE* sidecar = fopen ( VideoSink::SidecarName ( filename ).c_str (), "r" );
+  if (!sidecar)
+  {
+    DebugOut ( "VideoReader::Open no index for %s", filename.c_str () );
+    return false;
+  }
+
+  char line[256];
+  fgets ( line, sizeof ( line ), sidecar );
+
+  VideoIndexEntry entry;
+  while (fscanf ( sidecar, "%d,%d,%lf,%lld", &entry.index, &entry.frame, &entry.timestamp, &entry.pts ) == 4)
+    _entries.push_back ( entry );
+
+  fclose ( sidecar );
+
+  if (avformat_open_input ( &_format, filename.c_str (), nullptr, nullptr ) < 0 || avformat_find_stream_info ( _format, nullptr ) < 0)
+  {
+    DebugOut ( "VideoReader::Open failed to open %s", filename.c_str () );
+    Close ();
+    return false;
+  }
+
+  const AVCodec* decoder = nullptr;
+  _stream_index = av_find_best_stream ( _format, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0 );
+  if (_stream_index < 0 || !decoder)
+  {
+    Close ();
+    return false;
+  }
+
+  _codec = avcodec_alloc_context3 ( decoder );
+  avcodec_parameters_to_context ( _codec, _format->streams[_stream_index]->codecpar );
+  _codec->thread_count = 0;
+
+  if (avcodec_open2 ( _codec, decoder, nullptr ) < 0)
+  {
+    Close ();
+    return false;
+  }
+
+  _frame = av_frame_alloc ();
+  _packet = av_packet_alloc ();
+
+  return true;
+}
+
+void VideoReader::Close ()
+{
+  if (_codec)
+    avcodec_free_context ( &_codec );
+
+  if (_format)
+    avformat_close_input ( &_format );
+
+  if (_frame)
+    av_frame_free ( &_frame );
+
+  if (_packet)
+    av_packet_free ( &_packet );
+
+  if (_sws)
+  {
+    sws_freeContext ( _sws );
+    _sws = nullptr;
+  }
+
+  _entries.clear ();
+  _stream_index = -1;
+  _last_index = -1;
+}
+
+bool VideoReader::ReadFrame ( int frame, FrameImage& image )
+{
+  if (!_codec)
+    return false;
+
+  // frame numbers only ever increase, most of the time they match the index
+  int index = -1;
+  if (frame >= 0 && frame < (int)_entries.size () && _entries[frame].frame == frame)
+  {
+    index = frame;
+  }
+  else
+  {
+    for (size_t i = 0; i < _entries.size (); i++)
+    {
+      if (_entries[i].frame == frame)
+      {
+        index = (int)i;
+        break;
+      }
+    }
+  }
+
+  if (index < 0)
+    return false;
+
+  long long pts = _entries[index].pts;
+
+  // the decoder is already sitting on the previous frame, anything else means a seek
+  if (index != _last_index + 1)
+  {
+    auto stream = _format->streams[_stream_index];
+    auto target = av_rescale_q ( pts, kTimeBase, stream->time_base );
+
+    if (av_seek_frame ( _format, _stream_index, target, AVSEEK_FLAG_BACKWARD ) < 0)
+      return false;
+
+    avcodec_flush_buffers ( _codec );
+  }
+
+  if (!DecodeUntil ( pts, image ))
+  {
+    _last_index = -1;
+    return false;
+  }
+
+  _last_index = index;
+  return true;
+}
+
+bool VideoReader::DecodeUntil ( long long pts, FrameImage& image )
+{
+  auto stream = _format->streams[_stream_index];
+  bool draining = false;
+
+  for (;;)
+  {
+    int ret = avcodec_receive_frame ( _codec, _frame );
+
+    if (ret == 0)
+    {
+      long long framePts = av_rescale_q ( _frame->best_effort_timestamp, stream->time_base, kTimeBase );
+      if (framePts < pts)
+        continue;
+
+      image.width = _frame->width;
+      image.height = _frame->height;
+      image.format = PixelFormat::RGB8;
+      image.data.resize ( (size_t)image.width * image.height * 3 );
+
+      _sws = sws_getCachedContext ( _sws, _frame->width, _frame->height, (AVPixelFormat)_frame->format,
+        _frame->width, _frame->height, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr );
+
+      uint8_t* dst[1] = { image.data.data () };
+      int stride[1] = { image.width * 3 };
+      sws_scale ( _sws, _frame->data, _frame->linesize, 0, _frame->height, dst, stride );
+
+      return framePts == pts;
+    }
+
+    if (ret == AVERROR_EOF || (ret != AVERROR ( EAGAIN ) && ret < 0))
+      return false;
+
+    if (draining)
+      return false;
+
+    // feed the next packet of our stream, or flush the decoder at the end of the file
+    for (;;)
+    {
+      if (av_read_frame ( _format, _packet ) < 0)
+      {
+        avcodec_send_packet ( _codec, nullptr );
+        draining = true;
+        break;
+      }
+
+      bool ours = _packet->stream_index == _stream_index;
+      if (ours)
+        avcodec_send_packet ( _codec, _packet );
+
+      av_packet_unref ( _packet );
+
+      if (ours)
+        break;
+    }
+  }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "FrameCodec.h"
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct AVFormatContext;
+struct AVCodecContext;
+struct AVStream;
+struct AVFrame;
+struct AVPacket;
+struct SwsContext;
+
+namespace EF
+{
+  // values are mirrored by RsDsController::VideoCodec, keep them in step
+  enum class VideoCodecType : int
+  {
+    H264,
+    H265,
+  };
+
+  struct VideoSettings
+  {
+    VideoSettings ()
+      : enabled ( false )
+      , codec ( VideoCodecType::H264 )
+      , preset ( "veryfast" )
+      , crf ( 23 )
+      , gop ( 30 )
+    {  }
+    bool enabled;
+    VideoCodecType codec;
+    std::string preset;  // x264/x265 preset name
+    int crf;
+    int gop;             // frames between keyframes, bounds how far a seek has to decode
+  };
+
+  // one line per video frame in the sidecar next to the video
+  struct VideoIndexEntry
+  {
+    int index;         // position in the video
+    int frame;         // same number the depth file of that frame uses
+    double timestamp;  // sensor timestamp in milliseconds
+    long long pts;     // milliseconds since the first frame, the video time base
+  };
+
+  // Encodes the color stream into a single Matroska file on the CPU (libx264 / libx265)
+  // and writes a .csv sidecar mapping every video frame to its frame number and timestamp.
+  // Matroska keeps everything up to the last cluster readable if a capture dies.
+  class VideoSink
+  {
+  public:
+    VideoSink ();
+    ~VideoSink ();
+
+    bool Open ( const std::string& filename, int width, int height, const VideoSettings& settings );
+    // false when this frame or an earlier one still in the encoder could not be encoded or muxed
+    bool Write ( const unsigned char* rgb, int frame, double timestamp );
+    void Close ();
+    // of the rgb frames Write takes, 0 while closed
+    int Width () { return _width; }
+    int Height () { return _height; }
+
+    static std::string SidecarName ( const std::string& filename );
+
+  private:
+    AVFormatContext* _format;
+    AVCodecContext* _codec;
+    AVStream* _stream;
+    AVFrame* _frame;
+    AVPacket* _packet;
+    SwsContext* _sws;
+    FILE* _sidecar;
+    // frames sent to the encoder in pts order, a row goes to the sidecar once its packet is in the file
+    std::deque<std::pair<VideoIndexEntry, bool>> _pending;
+
+    int _width;
+    int _height;
+    int _index;
+    int _rows;  // sidecar rows written, the position of the next frame in the file
+    double _first_timestamp;
+    long long _last_pts;
+
+    bool Drain ( bool flush );
+    void Muxed ( long long pts, bool written );
+  };
+
+  // Frame accurate reads from a video written by VideoSink: seeks to the keyframe at or
+  // before the requested frame and decodes forward, sequential reads skip the seek.
+  class VideoReader
+  {
+  public:
+    VideoReader ();
+    ~VideoReader ();
+
+    bool Open ( const std::string& filename );
+    void Close ();
+
+    int FrameCount () { return (int)_entries.size (); }
+    const std::vector<VideoIndexEntry>& Entries () { return _entries; }
+
+    // frame is the capture frame number, not the position in the video
+    bool ReadFrame ( int frame, FrameImage& image );
+
+  private:
+    AVFormatContext* _format;
+    AVCodecContext* _codec;
+    AVFrame* _frame;
+    AVPacket* _packet;
+    SwsContext* _sws;
+    int _stream_index;
+    int _last_index;
+
+    std::vector<VideoIndexEntry> _entries;
+
+    bool DecodeUntil ( long long pts, FrameImage& image );
+  };
+}
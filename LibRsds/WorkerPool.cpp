@@ -0,0 +1,116 @@
+#include "WorkerPool.h"
+#include "Helpers.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  // one For call, the items are handed out one at a time to its caller and any idle worker
+  struct pool_job
+  {
+    const std::function<void (int)>* fn;
+    int count;
+    int next;       // next item nobody took yet
+    int remaining;  // items not finished yet
+  };
+}
+
+struct WorkerPool::State
+{
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::deque<pool_job*> jobs;  // with items left to take, guarded by mutex
+  bool stopping;
+
+  State ()
+    : stopping (false)
+  {  }
+
+  // with the lock held, returns it held
+  void RunItem (std::unique_lock<std::mutex>& lock, pool_job* job)
+  {
+    int item = job->next++;
+    if (job->next == job->count)
+      jobs.erase (std::find (jobs.begin (), jobs.end (), job));
+
+    lock.unlock ();
+    (*job->fn) (item);
+    lock.lock ();
+
+    if (--job->remaining == 0)
+      done.notify_all ();
+  }
+
+  void Run ()
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+
+    for (;;)
+    {
+      wake.wait (lock, [&]() { return stopping || !jobs.empty (); });
+      if (stopping)
+        return;
+
+      RunItem (lock, jobs.front ());
+    }
+  }
+};
+
+WorkerPool::WorkerPool (int threads)
+  : _state (new State ())
+  , _threads (std::max (threads, 1))
+{
+  // the calling thread is the last one
+  for (int i = 1; i < _threads; i++)
+    _state->workers.emplace_back ([this]() { _state->Run (); });
+}
+
+WorkerPool::~WorkerPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock (_state->mutex);
+    _state->stopping = true;
+  }
+
+  _state->wake.notify_all ();
+
+  for (auto& worker : _state->workers)
+    worker.join ();
+
+  DEL (_state);
+}
+
+void WorkerPool::For (int count, const std::function<void (int)>& fn)
+{
+  if (_state->workers.empty () || count <= 1)
+  {
+    for (int i = 0; i < count; i++)
+      fn (i);
+    return;
+  }
+
+  pool_job job = { &fn, count, 0, count };
+
+  std::unique_lock<std::mutex> lock (_state->mutex);
+  _state->jobs.push_back (&job);
+  _state->wake.notify_all ();
+
+  // the caller works on its own job, the workers help with whichever job is oldest
+  while (job.next < job.count)
+    _state->RunItem (lock, &job);
+
+  _state->done.wait (lock, [&]() { return job.remaining == 0; });
+}
+
+WorkerPool* WorkerPool::Shared ()
+{
+  static WorkerPool* pool = new WorkerPool ((int)std::thread::hardware_concurrency ());
+  return pool;
+}
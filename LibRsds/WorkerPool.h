@@ -0,0 +1,27 @@
+#pragma once
+
+#include <functional>
+
+// Threads that sleep between jobs, so a pass over a frame costs a wake up per thread instead of a thread
+// start. Any number of threads may run jobs on one pool at once, each also works on its own job.
+class WorkerPool
+{
+public:
+  // threads counts the caller too, a pool of 1 runs every job on the caller
+  explicit WorkerPool (int threads);
+  ~WorkerPool ();
+
+  int Threads () { return _threads; }
+  // runs fn (0) to fn (count - 1) and returns once all of them did
+  void For (int count, const std::function<void (int)>& fn);
+
+  // a thread per processor for the png stripes of every codec. Never destroyed, joining its threads
+  // while the process unloads the DLL would deadlock.
+  static WorkerPool* Shared ();
+
+private:
+  struct State;
+
+  State* _state;
+  int _threads;
+};
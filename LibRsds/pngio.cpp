@@ -1,33 +1,46 @@
 #include <stdlib.h>
+#include <string.h>
 #include <png.h>
 
 #include "Helpers.h"
 #include "pngio.h"
 
-common::pngio::pngio (const png_uint_16 width, const png_uint_16 height, png_color_type color_type) :
-  width_ (width), height_ (height), color_type_ (color_type), png_ (nullptr), png_info_ (nullptr), row_pointers_ (nullptr)
+common::pngio::pngio (const png_uint_16 width, const png_uint_16 height, png_color_type color_type, int bit_depth) :
+  png_ (nullptr), png_info_ (nullptr), width_ (width), height_ (height), level_ (-1), color_type_ (color_type), row_pointers_ (nullptr), last_size_ (0)
 {
-  allocate_memory ();
+  bit_depth_ = color_type_ == png_color_type::GRAY && bit_depth != 8 ? 16 : 8;
+
+  switch (color_type_)
+  {
+  case png_color_type::GRAY: row_bytes_ = width_ * bit_depth_ / 8; break;
+  case png_color_type::GRAY_A: row_bytes_ = width_ * 2; break;
+  case png_color_type::RGB_A: row_bytes_ = width_ * 4; break;
+  default: row_bytes_ = width_ * 3; break;
+  }
+
+  row_pointers_ = (png_bytep*)malloc (sizeof (png_bytep) * height_);
 }
 
 common::pngio::~pngio ()
 {
-  release_memory ();
+  if (png_)
+    png_destroy_write_struct (&png_, &png_info_);
+
+  free (row_pointers_);
+
+  for (auto& b : blocks_)
+    free (b.data);
 }
 
 bool common::pngio::Save (const char * filename)
 {
-  if (!png_)
-  {
-    DebugOut ("Save failed: png_ not initialized.");
-    return false;
-  }
+  return Save (filename, pixels ());
+}
 
-  if (!png_info_)
-  {
-    DebugOut ("Save failed: png_info_ not initialized.");
+bool common::pngio::Save (const char * filename, const unsigned char* data)
+{
+  if (!Encode (data, encoded_))
     return false;
-  }
 
   FILE *fp = fopen (filename, "wb");
   if (!fp)
@@ -36,34 +49,103 @@ bool common::pngio::Save (const char * filename)
     return false;
   }
 
-  if (setjmp (png_jmpbuf (png_)))
+  bool ret = fwrite (encoded_.data (), 1, encoded_.size (), fp) == encoded_.size ();
+
+  fclose (fp);
+
+  return ret;
+}
+
+bool common::pngio::Encode (const unsigned char* data, std::vector<unsigned char>& out)
+{
+  if (!row_pointers_ || !data)
   {
-    png_destroy_write_struct (&png_, &png_info_);
-    fclose (fp);
+    DebugOut ("Encode failed: no image.");
     return false;
   }
 
+  // libpng copies each row before transforming it, the caller's frame is only read
+  for (int y = 0; y < height_; y++)
+    row_pointers_[y] = (png_bytep)data + (size_t)y * row_bytes_;
+
+  // consecutive frames compress about the same, an eighth more covers most of them
+  out.clear ();
+  out.reserve (last_size_ + last_size_ / 8 + 1024);
+
+  png_ = png_create_write_struct_2 (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, this, pool_malloc, pool_free);
+  if (png_)
+    png_info_ = png_create_info_struct (png_);
+
+  bool ret = png_ && png_info_ && write_image (out);
+
+  if (png_)
+    png_destroy_write_struct (&png_, &png_info_);
+
+  if (ret)
+    last_size_ = out.size ();
+
+  return ret;
+}
+
+bool common::pngio::write_image (std::vector<unsigned char>& out)
+{
+  if (setjmp (png_jmpbuf (png_)))
+    return false;
+
   png_set_check_for_invalid_index (png_, 0);
 
-  png_init_io (png_, fp);
+  png_set_write_fn (png_, &out, write_data, flush_data);
 
-  png_write_info(png_, png_info_);
+  png_set_IHDR (
+    png_,
+    png_info_,
+    width_,
+    height_,
+    bit_depth_,
+    color_type_,
+    PNG_INTERLACE_NONE,
+    PNG_COMPRESSION_TYPE_DEFAULT,
+    PNG_FILTER_TYPE_DEFAULT);
+
+  if (level_ >= 0)
+    png_set_compression_level (png_, level_);
+
+  png_write_info (png_, png_info_);
+
+  // png samples are big endian, the swap happens on libpng's copy of the row
+  if (bit_depth_ == 16)
+    png_set_swap (png_);
 
   png_write_image (png_, row_pointers_);
   png_write_end (png_, NULL);
 
-  fclose (fp);
-
   return true;
 }
 
+void common::pngio::write_data (png_structp png, png_bytep data, png_size_t length)
+{
+  auto out = (std::vector<unsigned char>*)png_get_io_ptr (png);
+  out->insert (out->end (), data, data + length);
+}
+
+void common::pngio::flush_data (png_structp png)
+{
+}
+
+unsigned char* common::pngio::pixels ()
+{
+  if (pixels_.empty ())
+    pixels_.resize ((size_t)height_ * row_bytes_);
+
+  return pixels_.data ();
+}
+
 void common::pngio::WriteAt (const png_uint_16 x, const png_uint_16 y, const unsigned char R, const unsigned char G, const unsigned char B)
 {
   if (y >= height_ || x >= width_)
     return;
 
-  png_bytep row = row_pointers_[y];
-  png_bytep px = &(row[x * 3]);
+  png_bytep px = pixels () + (size_t)y * row_bytes_ + x * 3;
   px[0] = (png_byte)R;
   px[1] = (png_byte)G;
   px[2] = (png_byte)B;
@@ -77,116 +159,47 @@ void common::pngio::WriteBlockAt (const png_uint_16 x, const png_uint_16 y, int
     return;
   }
 
-  int idx;
+  // same layout as the image, 16 bit gray stays little endian until Save
+  int pixel_bytes = row_bytes_ / width_;
 
-  if (color_type_ == png_color_type::RGB)
-  {
-    for (int i = 0; i < blockHeight; i++)
-    {
-      png_bytep row = row_pointers_[y + i];
-      for (int j = 0; j < blockWidth; j++)
-      {
-        idx = 3 * (i * blockWidth + j);
-        // added i*j for debug black lines
-        auto r = data[idx];
-        auto g = data[idx + 1];
-        auto b = data[idx + 2];
-        //auto a = data[idx + 3];
-
-        png_bytep px = &(row[(x + j) * 3]);
-        px[0] = (png_byte)r;
-        px[1] = (png_byte)g;
-        px[2] = (png_byte)b;
-        //px[3] = (png_byte)a;
-      }
-    }
-  }
-  else if (color_type_ == png_color_type::RGB_A)
+  for (int i = 0; i < blockHeight; i++)
+    memcpy (pixels () + (size_t)(y + i) * row_bytes_ + x * pixel_bytes, data + (size_t)i * blockWidth * pixel_bytes, (size_t)blockWidth * pixel_bytes);
+}
+
+png_voidp common::pngio::pool_malloc (png_structp png, png_alloc_size_t size)
+{
+  auto self = (pngio*)png_get_mem_ptr (png);
+
+  // libpng and zlib ask for the same handful of sizes on every image
+  for (auto& b : self->blocks_)
   {
-    for (int i = 0; i < blockHeight; i++)
+    if (!b.used && b.size == size)
     {
-      png_bytep row = row_pointers_[y + i];
-      for (int j = 0; j < blockWidth; j++)
-      {
-        idx = 4 * (i * blockWidth + j);
-        // added i*j for debug black lines
-        auto r = data[idx];
-        auto g = data[idx + 1];
-        auto b = data[idx + 2];
-        auto a = data[idx + 3];
-
-        png_bytep px = &(row[(x + j) * 4]);
-        px[0] = (png_byte)r;
-        px[1] = (png_byte)g;
-        px[2] = (png_byte)b;
-        px[3] = (png_byte)a;
-      }
+      b.used = true;
+      return b.data;
     }
   }
-  else if (color_type_ == png_color_type::GRAY)
-  {
-    for (int i = 0; i < blockHeight; i++)
-    {
-      png_bytep row = row_pointers_[y + i];
-      for (int j = 0; j < blockWidth; j++)
-      {
-        idx = 2 * (i * blockWidth + j);
-        // added i*j for debug black lines
-        auto r = data[idx];
-        auto g = data[idx + 1];
-
-        png_bytep px = &(row[(x + j) * 2]);
 
-        // NOTE: I'm swaping order to make it work, blame the endiens
-        px[0] = (png_byte)g;
-        px[1] = (png_byte)r;
+  block b = { malloc (size), size, true };
+  if (!b.data)
+    return nullptr;
 
-      }
-    }
-  }
-  
+  self->blocks_.push_back (b);
+  return b.data;
 }
 
-void common::pngio::allocate_memory ()
+void common::pngio::pool_free (png_structp png, png_voidp ptr)
 {
-  png_ = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_)
-    return;
+  auto self = (pngio*)png_get_mem_ptr (png);
 
-  png_info_ = png_create_info_struct (png_);
-  if (!png_info_)
-    return;
-
-  bit_depth_ = color_type_ == png_color_type::GRAY ? 16 : 8;
-
-  png_set_IHDR (
-    png_,
-    png_info_,
-    width_,
-    height_,
-    bit_depth_,
-    color_type_,
-    PNG_INTERLACE_NONE,
-    PNG_COMPRESSION_TYPE_DEFAULT,
-    PNG_FILTER_TYPE_DEFAULT);
-
-  row_pointers_ = (png_bytep*)malloc (sizeof (png_bytep) * height_);
-
-  auto row_bytes = png_get_rowbytes (png_, png_info_);
-  for (int y = 0; y < height_; y++) {
-    row_pointers_[y] = (png_byte*)malloc (row_bytes);
+  for (auto& b : self->blocks_)
+  {
+    if (b.data == ptr)
+    {
+      b.used = false;
+      return;
+    }
   }
 
-}
-
-void common::pngio::release_memory ()
-{
-  if (!row_pointers_)
-    return;
-
-  for (int y = 0; y < height_; y++) {
-    if(row_pointers_[y])
-      free (row_pointers_[y]);
-  }
-  free (row_pointers_);
+  free (ptr);
 }
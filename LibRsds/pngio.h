@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <png.h>
 
+#include <vector>
+
 namespace common
 {
 
@@ -14,28 +16,61 @@ namespace common
     RGB_A = PNG_COLOR_TYPE_RGB_ALPHA
   } png_color_type;
 
+  // Writes PNGs of one size through libpng. Meant to be created once per thread: the row pointers are
+  // allocated once and aimed at the frame being saved, and the memory libpng and zlib ask for is kept
+  // between frames, so after the first frame a Save allocates nothing.
   class pngio
   {
   public:
-    pngio (const png_uint_16 width, const png_uint_16 height, png_color_type color_type);
+    // gray is 16 bit unless bit_depth 8 is asked for, everything else 8 bit
+    pngio (const png_uint_16 width, const png_uint_16 height, png_color_type color_type, int bit_depth = 0);
     ~pngio ();
 
+    void SetCompressionLevel (int level) { level_ = level; }
+
+    // data is tightly packed and read in place, 16 bit gray is little endian like the realsense Z16 frames.
+    // out is reused, it is reserved from the size of the previous image so it rarely has to grow.
+    bool Encode (const unsigned char* data, std::vector<unsigned char>& out);
+    // encodes to memory and writes the file in one go
+    bool Save (const char * filename, const unsigned char* data);
+    // saves what WriteAt / WriteBlockAt put in the image
     bool Save (const char * filename);
     void WriteAt (const png_uint_16 x, const png_uint_16 y, const unsigned char r, const unsigned char g, const unsigned char b);
     void WriteBlockAt(const png_uint_16 x, const png_uint_16 y, int width, int height, unsigned char* data);
 
   private:
+    struct block
+    {
+      void* data;
+      size_t size;
+      bool used;
+    };
+
+    // only alive during a Save, libpng can not rewind a write struct for the next image
     png_structp png_;
     png_infop png_info_;
 
     int width_;
     int height_;
+    int level_;
 
     png_byte color_type_;
     png_byte bit_depth_;
+    int row_bytes_;
     png_bytep *row_pointers_;
 
-    void allocate_memory ();
-    void release_memory ();
+    std::vector<unsigned char> pixels_;  // the WriteAt image, allocated on first use
+    std::vector<block> blocks_;          // handed to libpng and zlib, reused by the next Save
+    std::vector<unsigned char> encoded_; // Save's output
+    size_t last_size_;
+
+    unsigned char* pixels ();
+    bool write_image (std::vector<unsigned char>& out);
+
+    static void write_data (png_structp png, png_bytep data, png_size_t length);
+    static void flush_data (png_structp png);
+
+    static png_voidp pool_malloc (png_structp png, png_alloc_size_t size);
+    static void pool_free (png_structp png, png_voidp ptr);
   };
-}
\ No newline at end of file
+}
@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "Helpers.h"
+#include "WorkerPool.h"
+#include "pngstripe.h"
+
+using namespace common;
+
+struct common::pngstripe::stripe_state
+{
+  z_stream strm;
+  int level;  // the stream was set up with, -2 before the first frame
+  std::vector<unsigned char> cur;
+  std::vector<unsigned char> prev;
+  std::vector<unsigned char> candidates;
+};
+
+namespace
+{
+  // deflate needs a few rows to get going, smaller stripes just cost compression ratio
+  const int kMinStripeRows = 16;
+  const size_t kWindowSize = 32768;
+
+  inline unsigned char paeth (int a, int b, int c)
+  {
+    int p = a + b - c;
+    int pa = abs (p - a);
+    int pb = abs (p - b);
+    int pc = abs (p - c);
+
+    if (pa <= pb && pa <= pc)
+      return (unsigned char)a;
+    if (pb <= pc)
+      return (unsigned char)b;
+    return (unsigned char)c;
+  }
+
+  // same heuristic libpng uses: pick the filter with the smallest sum of absolute (signed) residuals
+  void filter_row (const unsigned char* row, const unsigned char* prev, int row_bytes, int bpp, unsigned char* candidates, unsigned char* out)
+  {
+    unsigned char* none = candidates;
+    unsigned char* sub = candidates + row_bytes;
+    unsigned char* up = candidates + 2 * row_bytes;
+    unsigned char* avg = candidates + 3 * row_bytes;
+    unsigned char* pth = candidates + 4 * row_bytes;
+
+    for (int i = 0; i < bpp; i++)
+    {
+      none[i] = row[i];
+      sub[i] = row[i];
+      up[i] = (unsigned char)(row[i] - prev[i]);
+      avg[i] = (unsigned char)(row[i] - (prev[i] >> 1));
+      pth[i] = (unsigned char)(row[i] - prev[i]);
+    }
+
+    for (int i = bpp; i < row_bytes; i++)
+    {
+      int a = row[i - bpp];
+      int b = prev[i];
+      int c = prev[i - bpp];
+
+      none[i] = row[i];
+      sub[i] = (unsigned char)(row[i] - a);
+      up[i] = (unsigned char)(row[i] - b);
+      avg[i] = (unsigned char)(row[i] - ((a + b) >> 1));
+      pth[i] = (unsigned char)(row[i] - paeth (a, b, c));
+    }
+
+    unsigned long best_sum = ~0ul;
+    int best = 0;
+
+    for (int filter = 0; filter < 5; filter++)
+    {
+      const unsigned char* dst = candidates + filter * row_bytes;
+      unsigned long sum = 0;
+
+      for (int i = 0; i < row_bytes; i++)
+        sum += dst[i] < 128 ? dst[i] : 256 - dst[i];
+
+      if (sum < best_sum)
+      {
+        best_sum = sum;
+        best = filter;
+      }
+    }
+
+    out[0] = (unsigned char)best;
+    memcpy (out + 1, candidates + best * row_bytes, row_bytes);
+  }
+
+  void append_u32 (std::vector<unsigned char>& out, unsigned long v)
+  {
+    out.push_back ((unsigned char)(v >> 24));
+    out.push_back ((unsigned char)(v >> 16));
+    out.push_back ((unsigned char)(v >> 8));
+    out.push_back ((unsigned char)v);
+  }
+
+  void append_chunk (std::vector<unsigned char>& out, const char* type, const unsigned char* data, size_t size)
+  {
+    append_u32 (out, (unsigned long)size);
+
+    size_t start = out.size ();
+    out.insert (out.end (), type, type + 4);
+    out.insert (out.end (), data, data + size);
+
+    append_u32 (out, crc32 (0, &out[start], (uInt)(size + 4)));
+  }
+
+  unsigned char zlib_flags (int level)
+  {
+    // FLEVEL is informational only but keep it honest, the pair is always a multiple of 31
+    if (level == 0 || level == 1)
+      return 0x01;
+    if (level >= 2 && level <= 5)
+      return 0x5E;
+    if (level >= 7)
+      return 0xDA;
+    return 0x9C;
+  }
+}
+
+common::pngstripe::pngstripe (const png_uint_16 width, const png_uint_16 height, png_color_type color_type, int stripes, int bit_depth) :
+  width_ (width), height_ (height), level_ (Z_DEFAULT_COMPRESSION), stripe_count_ (stripes), color_type_ (color_type)
+{
+  // same convention as pngio, gray is 16 bit depth and everything else 8 bit, unless 8 bit gray is asked for
+  bit_depth_ = color_type_ == png_color_type::GRAY && bit_depth != 8 ? 16 : 8;
+
+  switch (color_type_)
+  {
+  case png_color_type::GRAY: pixel_bytes_ = bit_depth_ / 8; break;
+  case png_color_type::RGB_A: pixel_bytes_ = 4; break;
+  default: pixel_bytes_ = 3; break;
+  }
+
+  row_bytes_ = width_ * pixel_bytes_;
+
+  if (stripe_count_ <= 0)
+    stripe_count_ = (int)std::thread::hardware_concurrency ();
+
+  stripe_count_ = std::max (1, std::min (stripe_count_, height_ / kMinStripeRows));
+
+  filtered_.resize ((size_t)height_ * (row_bytes_ + 1));
+  deflated_.resize (stripe_count_);
+  adlers_.resize (stripe_count_);
+
+  for (int i = 0; i < stripe_count_; i++)
+  {
+    auto state = new stripe_state ();
+    memset (&state->strm, 0, sizeof (state->strm));
+    state->level = -2;
+    state->cur.resize (row_bytes_);
+    state->prev.resize (row_bytes_);
+    state->candidates.resize (5 * row_bytes_);
+    states_.push_back (state);
+  }
+}
+
+common::pngstripe::~pngstripe ()
+{
+  for (auto state : states_)
+  {
+    if (state->level != -2)
+      deflateEnd (&state->strm);
+    DEL (state);
+  }
+}
+
+bool common::pngstripe::Encode (const unsigned char* data, std::vector<unsigned char>& out)
+{
+  if (!data || height_ == 0 || width_ == 0)
+    return false;
+
+  std::vector<char> ok (stripe_count_, 0);
+
+  // filtering a stripe needs the last raw row of the one above it, deflating needs the
+  // filtered tail of the one above it as the dictionary, so the two passes run separately.
+  // Every encoder shares one pool, a codec per thread, level and stream would otherwise keep a core's worth each.
+  WorkerPool* pool = WorkerPool::Shared ();
+  pool->For (stripe_count_, [&](int stripe) { filter_stripe (stripe, data); });
+  pool->For (stripe_count_, [&](int stripe) { ok[stripe] = deflate_stripe (stripe); });
+
+  if (std::find (ok.begin (), ok.end (), 0) != ok.end ())
+  {
+    DebugOut ("pngstripe::Encode deflate failed");
+    return false;
+  }
+
+  unsigned long adler = adlers_[0];
+  size_t idat_size = 2 + 4;
+
+  for (int i = 0; i < stripe_count_; i++)
+  {
+    if (i > 0)
+    {
+      auto length = (size_t)(stripe_first_row (i + 1) - stripe_first_row (i)) * (row_bytes_ + 1);
+      adler = adler32_combine (adler, adlers_[i], (z_off_t)length);
+    }
+    idat_size += deflated_[i].size ();
+  }
+
+  out.clear ();
+  out.reserve (idat_size + 64);
+
+  static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  out.insert (out.end (), signature, signature + 8);
+
+  unsigned char ihdr[13];
+  ihdr[0] = (unsigned char)(width_ >> 24);
+  ihdr[1] = (unsigned char)(width_ >> 16);
+  ihdr[2] = (unsigned char)(width_ >> 8);
+  ihdr[3] = (unsigned char)width_;
+  ihdr[4] = (unsigned char)(height_ >> 24);
+  ihdr[5] = (unsigned char)(height_ >> 16);
+  ihdr[6] = (unsigned char)(height_ >> 8);
+  ihdr[7] = (unsigned char)height_;
+  ihdr[8] = bit_depth_;
+  ihdr[9] = color_type_;
+  ihdr[10] = PNG_COMPRESSION_TYPE_DEFAULT;
+  ihdr[11] = PNG_FILTER_TYPE_DEFAULT;
+  ihdr[12] = PNG_INTERLACE_NONE;
+  append_chunk (out, "IHDR", ihdr, sizeof (ihdr));
+
+  // one IDAT holding the zlib header, every stripe and the adler32 of the whole filtered image
+  append_u32 (out, (unsigned long)idat_size);
+
+  size_t start = out.size ();
+  out.push_back ('I');
+  out.push_back ('D');
+  out.push_back ('A');
+  out.push_back ('T');
+  out.push_back (0x78);
+  out.push_back (zlib_flags (level_));
+
+  for (auto& stripe : deflated_)
+    out.insert (out.end (), stripe.begin (), stripe.end ());
+
+  append_u32 (out, adler);
+  append_u32 (out, crc32 (0, &out[start], (uInt)(out.size () - start)));
+
+  append_chunk (out, "IEND", nullptr, 0);
+
+  return true;
+}
+
+bool common::pngstripe::Save (const char * filename, const unsigned char* data)
+{
+  if (!Encode (data, encoded_))
+    return false;
+
+  FILE *fp = fopen (filename, "wb");
+  if (!fp)
+  {
+    DebugOut ("Failed to open %s for writing", filename);
+    return false;
+  }
+
+  bool ret = fwrite (encoded_.data (), 1, encoded_.size (), fp) == encoded_.size ();
+
+  fclose (fp);
+
+  return ret;
+}
+
+void common::pngstripe::filter_stripe (int stripe, const unsigned char* data)
+{
+  int first = stripe_first_row (stripe);
+  int last = stripe_first_row (stripe + 1);
+
+  auto& cur = states_[stripe]->cur;
+  auto& prev = states_[stripe]->prev;
+  auto& candidates = states_[stripe]->candidates;
+
+  if (first == 0)
+    std::fill (prev.begin (), prev.end (), (unsigned char)0);
+
+  bool swap = bit_depth_ == 16;
+
+  const unsigned char* prev_row = prev.data ();
+  if (first > 0 && swap)
+    load_row (data, first - 1, prev.data ());
+  else if (first > 0)
+    prev_row = data + (size_t)(first - 1) * row_bytes_;
+
+  for (int y = first; y < last; y++)
+  {
+    const unsigned char* row = data + (size_t)y * row_bytes_;
+    if (swap)
+    {
+      load_row (data, y, cur.data ());
+      row = cur.data ();
+    }
+
+    filter_row (row, prev_row, row_bytes_, pixel_bytes_, candidates.data (), &filtered_[(size_t)y * (row_bytes_ + 1)]);
+
+    if (swap)
+    {
+      std::swap (cur, prev);
+      prev_row = prev.data ();
+    }
+    else
+    {
+      prev_row = row;
+    }
+  }
+}
+
+bool common::pngstripe::deflate_stripe (int stripe)
+{
+  size_t offset = (size_t)stripe_first_row (stripe) * (row_bytes_ + 1);
+  size_t length = (size_t)stripe_first_row (stripe + 1) * (row_bytes_ + 1) - offset;
+
+  auto state = states_[stripe];
+  z_stream& strm = state->strm;
+
+  // a reset keeps the deflate state's buffers, only a new level sets the stream up again
+  if (state->level == level_)
+    deflateReset (&strm);
+  else
+  {
+    if (state->level != -2)
+      deflateEnd (&strm);
+
+    memset (&strm, 0, sizeof (strm));
+    state->level = -2;
+
+    // raw deflate, the zlib header and trailer are written once for the whole image
+    if (deflateInit2 (&strm, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+
+    state->level = level_;
+  }
+
+  // prime with the tail of the stripe above so the boundary costs next to nothing in ratio
+  if (offset > 0)
+  {
+    size_t dictionary = std::min (offset, kWindowSize);
+    deflateSetDictionary (&strm, &filtered_[offset - dictionary], (uInt)dictionary);
+  }
+
+  auto& out = deflated_[stripe];
+  out.resize (deflateBound (&strm, (uLong)length) + 16);
+
+  strm.next_in = &filtered_[offset];
+  strm.avail_in = (uInt)length;
+  strm.next_out = out.data ();
+  strm.avail_out = (uInt)out.size ();
+
+  // the full flush byte aligns the stream and resets the window so the next stripe can follow it
+  int flush = stripe == stripe_count_ - 1 ? Z_FINISH : Z_FULL_FLUSH;
+  int ret;
+
+  for (;;)
+  {
+    ret = deflate (&strm, flush);
+    if (ret == Z_STREAM_ERROR || strm.avail_out != 0)
+      break;
+
+    size_t used = out.size ();
+    out.resize (used * 2);
+    strm.next_out = out.data () + used;
+    strm.avail_out = (uInt)(out.size () - used);
+  }
+
+  out.resize (strm.total_out);
+  adlers_[stripe] = adler32 (adler32 (0, nullptr, 0), &filtered_[offset], (uInt)length);
+
+  return flush == Z_FINISH ? ret == Z_STREAM_END : ret != Z_STREAM_ERROR;
+}
+
+void common::pngstripe::load_row (const unsigned char* data, int y, unsigned char* row)
+{
+  const unsigned char* src = data + (size_t)y * row_bytes_;
+
+  if (bit_depth_ != 16)
+  {
+    memcpy (row, src, row_bytes_);
+    return;
+  }
+
+  // png wants big endian samples, swapped here as the row is copied
+  for (int i = 0; i < row_bytes_; i += 2)
+  {
+    row[i] = src[i + 1];
+    row[i + 1] = src[i];
+  }
+}
+
+int common::pngstripe::stripe_first_row (int stripe)
+{
+  return (int)((long long)height_ * stripe / stripe_count_);
+}
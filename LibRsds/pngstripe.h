@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "pngio.h"
+
+namespace common
+{
+  // Writes a standard PNG by splitting the image into horizontal stripes that are
+  // filtered and deflated on separate threads. Each stripe is a raw deflate stream
+  // ended with a full flush (the last one with Z_FINISH) so the stripes concatenate
+  // into a single zlib stream, the same way pigz joins its blocks.
+  class pngstripe
+  {
+  public:
+    pngstripe (const png_uint_16 width, const png_uint_16 height, png_color_type color_type, int stripes = 0, int bit_depth = 0);
+    ~pngstripe ();
+
+    void SetCompressionLevel (int level) { level_ = level; }
+    int GetStripeCount () { return stripe_count_; }
+
+    // data is tightly packed, 16 bit gray is little endian like the realsense Z16 frames,
+    // bit_depth 8 with GRAY writes 8 bit gray for the infrared Y8 frames
+    bool Encode (const unsigned char* data, std::vector<unsigned char>& out);
+    bool Save (const char * filename, const unsigned char* data);
+
+  private:
+    // per stripe deflate stream and row scratch, kept from one frame to the next
+    struct stripe_state;
+
+    int width_;
+    int height_;
+    int level_;
+    int stripe_count_;
+
+    png_byte color_type_;
+    png_byte bit_depth_;
+    int pixel_bytes_;
+    int row_bytes_;
+
+    std::vector<unsigned char> filtered_;
+    std::vector<std::vector<unsigned char>> deflated_;
+    std::vector<unsigned long> adlers_;
+    std::vector<unsigned char> encoded_;
+    std::vector<stripe_state*> states_;
+
+    void filter_stripe (int stripe, const unsigned char* data);
+    bool deflate_stripe (int stripe);
+    void load_row (const unsigned char* data, int y, unsigned char* row);
+    int stripe_first_row (int stripe);
+  };
+}
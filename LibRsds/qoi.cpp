@@ -0,0 +1,249 @@
+#include <cstring>
+
+#include "Helpers.h"
+#include "qoi.h"
+
+namespace
+{
+  const unsigned char QOI_OP_INDEX = 0x00;
+  const unsigned char QOI_OP_DIFF = 0x40;
+  const unsigned char QOI_OP_LUMA = 0x80;
+  const unsigned char QOI_OP_RUN = 0xc0;
+  const unsigned char QOI_OP_RGB = 0xfe;
+  const unsigned char QOI_OP_RGBA = 0xff;
+  const unsigned char QOI_MASK_2 = 0xc0;
+
+  const int kHeaderSize = 14;
+  const unsigned char kPadding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+  struct rgba
+  {
+    unsigned char r, g, b, a;
+  };
+
+  inline int hash (const rgba& px)
+  {
+    return (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) & 63;
+  }
+
+  inline bool equal (const rgba& x, const rgba& y)
+  {
+    return x.r == y.r && x.g == y.g && x.b == y.b && x.a == y.a;
+  }
+
+  inline void write_u32 (unsigned char* p, unsigned int v)
+  {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+  }
+
+  inline unsigned int read_u32 (const unsigned char* p)
+  {
+    return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3];
+  }
+}
+
+bool common::QoiEncode (const unsigned char* pixels, int width, int height, int channels, std::vector<unsigned char>& out)
+{
+  if (!pixels || width <= 0 || height <= 0 || (channels != 3 && channels != 4))
+    return false;
+
+  size_t count = (size_t)width * height;
+
+  // worst case every pixel is a full QOI_OP_RGBA
+  out.resize (kHeaderSize + count * (channels + 1) + sizeof (kPadding));
+  unsigned char* dst = out.data ();
+
+  memcpy (dst, "qoif", 4);
+  write_u32 (dst + 4, width);
+  write_u32 (dst + 8, height);
+  dst[12] = (unsigned char)channels;
+  dst[13] = 0; // sRGB with linear alpha
+  dst += kHeaderSize;
+
+  rgba index[64];
+  memset (index, 0, sizeof (index));
+
+  rgba prev = { 0, 0, 0, 255 };
+  rgba px = prev;
+  int run = 0;
+
+  const unsigned char* src = pixels;
+  const unsigned char* end = pixels + count * channels;
+
+  for (; src < end; src += channels)
+  {
+    px.r = src[0];
+    px.g = src[1];
+    px.b = src[2];
+    if (channels == 4)
+      px.a = src[3];
+
+    if (equal (px, prev))
+    {
+      run++;
+      if (run == 62 || src + channels == end)
+      {
+        *dst++ = QOI_OP_RUN | (unsigned char)(run - 1);
+        run = 0;
+      }
+      continue;
+    }
+
+    if (run > 0)
+    {
+      *dst++ = QOI_OP_RUN | (unsigned char)(run - 1);
+      run = 0;
+    }
+
+    int h = hash (px);
+
+    if (equal (index[h], px))
+    {
+      *dst++ = QOI_OP_INDEX | (unsigned char)h;
+    }
+    else
+    {
+      index[h] = px;
+
+      if (px.a == prev.a)
+      {
+        signed char vr = (signed char)(px.r - prev.r);
+        signed char vg = (signed char)(px.g - prev.g);
+        signed char vb = (signed char)(px.b - prev.b);
+        signed char vg_r = vr - vg;
+        signed char vg_b = vb - vg;
+
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+        {
+          *dst++ = QOI_OP_DIFF | (unsigned char)((vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+        }
+        else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+        {
+          *dst++ = QOI_OP_LUMA | (unsigned char)(vg + 32);
+          *dst++ = (unsigned char)((vg_r + 8) << 4 | (vg_b + 8));
+        }
+        else
+        {
+          *dst++ = QOI_OP_RGB;
+          *dst++ = px.r;
+          *dst++ = px.g;
+          *dst++ = px.b;
+        }
+      }
+      else
+      {
+        *dst++ = QOI_OP_RGBA;
+        *dst++ = px.r;
+        *dst++ = px.g;
+        *dst++ = px.b;
+        *dst++ = px.a;
+      }
+    }
+
+    prev = px;
+  }
+
+  memcpy (dst, kPadding, sizeof (kPadding));
+  dst += sizeof (kPadding);
+
+  out.resize (dst - out.data ());
+
+  return true;
+}
+
+bool common::QoiDecode (const unsigned char* data, size_t size, int& width, int& height, int& channels, std::vector<unsigned char>& pixels)
+{
+  if (!data || size < kHeaderSize + sizeof (kPadding) || memcmp (data, "qoif", 4) != 0)
+  {
+    DebugOut ("QoiDecode: not a qoi image");
+    return false;
+  }
+
+  width = (int)read_u32 (data + 4);
+  height = (int)read_u32 (data + 8);
+  channels = data[12];
+
+  if (width <= 0 || height <= 0 || (channels != 3 && channels != 4))
+    return false;
+
+  size_t count = (size_t)width * height;
+  pixels.resize (count * channels);
+
+  rgba index[64];
+  memset (index, 0, sizeof (index));
+
+  rgba px = { 0, 0, 0, 255 };
+  int run = 0;
+
+  const unsigned char* src = data + kHeaderSize;
+  const unsigned char* end = data + size - sizeof (kPadding);
+  unsigned char* dst = pixels.data ();
+
+  for (size_t i = 0; i < count; i++, dst += channels)
+  {
+    if (run > 0)
+    {
+      run--;
+    }
+    else if (src < end)
+    {
+      unsigned char b1 = *src++;
+
+      if (b1 == QOI_OP_RGB)
+      {
+        px.r = src[0];
+        px.g = src[1];
+        px.b = src[2];
+        src += 3;
+      }
+      else if (b1 == QOI_OP_RGBA)
+      {
+        px.r = src[0];
+        px.g = src[1];
+        px.b = src[2];
+        px.a = src[3];
+        src += 4;
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX)
+      {
+        px = index[b1];
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF)
+      {
+        px.r += ((b1 >> 4) & 0x03) - 2;
+        px.g += ((b1 >> 2) & 0x03) - 2;
+        px.b += (b1 & 0x03) - 2;
+      }
+      else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA)
+      {
+        unsigned char b2 = *src++;
+        int vg = (b1 & 0x3f) - 32;
+        px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+        px.g += vg;
+        px.b += vg - 8 + (b2 & 0x0f);
+      }
+      else
+      {
+        run = b1 & 0x3f;
+      }
+
+      index[hash (px)] = px;
+    }
+    else
+    {
+      DebugOut ("QoiDecode: truncated image");
+      return false;
+    }
+
+    dst[0] = px.r;
+    dst[1] = px.g;
+    dst[2] = px.b;
+    if (channels == 4)
+      dst[3] = px.a;
+  }
+
+  return true;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <vector>
+
+namespace common
+{
+  // QOI "Quite OK Image" format (https://qoiformat.org), a single pass lossless
+  // encoder for 8 bit RGB / RGBA that trades a little ratio for a lot of speed.
+  bool QoiEncode (const unsigned char* pixels, int width, int height, int channels, std::vector<unsigned char>& out);
+  bool QoiDecode (const unsigned char* data, size_t size, int& width, int& height, int& channels, std::vector<unsigned char>& pixels);
+}
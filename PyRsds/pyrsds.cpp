@@ -0,0 +1,346 @@
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "DatasetReader.h"
+#include "RealsenseController.h"
+#include "Helpers.h"
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+namespace py = pybind11;
+
+using namespace EF;
+
+namespace
+{
+  const char* kStreamNames[RS::StreamCount] = { "color", "depth", "ir_left", "ir_right" };
+
+  // numpy view of a decoded image, the frame object stays alive as the array's base so nothing is copied
+  py::object image_array ( const std::shared_ptr<DatasetFrame>& frame, py::handle owner, int stream )
+  {
+    auto& image = frame->images[stream];
+    if (image.data.empty ())
+      return py::none ();
+
+    switch (image.format)
+    {
+    case PixelFormat::RGB8:
+      return py::array_t<uint8_t> ( { image.height, image.width, 3 }, image.data.data (), owner );
+    case PixelFormat::Z16:
+      return py::array_t<uint16_t> ( { image.height, image.width }, reinterpret_cast<const uint16_t*>(image.data.data ()), owner );
+    default:
+      return py::array_t<uint8_t> ( { image.height, image.width }, image.data.data (), owner );
+    }
+  }
+
+  py::dict intrinsics_dict ( const IndexIntrinsics& intrinsics )
+  {
+    py::dict d;
+    d["width"] = intrinsics.width;
+    d["height"] = intrinsics.height;
+    d["ppx"] = intrinsics.ppx;
+    d["ppy"] = intrinsics.ppy;
+    d["fx"] = intrinsics.fx;
+    d["fy"] = intrinsics.fy;
+    return d;
+  }
+
+  // (x, y, width, height) in sensor pixels, None when the whole image was saved
+  py::object crop_tuple ( const IndexCrop& crop )
+  {
+    if (crop.width <= 0 || crop.height <= 0)
+      return py::none ();
+
+    return py::make_tuple ( crop.x, crop.y, crop.width, crop.height );
+  }
+
+  py::dict stats_dict ( const RS::CaptureStats& stats )
+  {
+    py::dict drops;
+    py::dict rates;
+    for (int c = 0; c < RS::DropCauseCount; c++)
+    {
+      drops[RS::DropCauseName ( (RS::DropCause)c )] = stats.drops[c];
+      rates[RS::DropCauseName ( (RS::DropCause)c )] = stats.dropRates[c];
+    }
+
+    py::dict d;
+    d["acquired"] = stats.acquired;
+    d["kept"] = stats.kept;
+    d["acquired_rate"] = stats.acquiredRate;
+    d["kept_rate"] = stats.keptRate;
+    d["drops"] = drops;
+    d["drop_rates"] = rates;
+    d["sensor_drops"] = std::vector<long long> ( stats.sensorDrops, stats.sensorDrops + RS::StreamCount );
+    d["stalls"] = stats.stalls;
+    d["stalled"] = stats.stalled;
+    d["ms_since_frameset"] = stats.msSinceFrameset;
+    return d;
+  }
+
+  py::dict calibration_dict ( const IndexHeader& header )
+  {
+    py::dict d;
+    d["depth_scale"] = header.depthScale;
+    d["depth_intrinsics"] = intrinsics_dict ( header.depthIntrinsics );
+    d["color_intrinsics"] = intrinsics_dict ( header.colorIntrinsics );
+    d["depth_crop"] = crop_tuple ( header.depthCrop );
+    d["color_crop"] = crop_tuple ( header.colorCrop );
+    d["pyramid_levels"] = header.pyramidLevels;
+
+    // rs_extrinsics rotation is column major
+    py::array_t<float> rotation ( { 3, 3 } );
+    auto r = rotation.mutable_unchecked<2> ();
+    for (int row = 0; row < 3; row++)
+    {
+      for (int col = 0; col < 3; col++)
+        r ( row, col ) = header.rotation[col * 3 + row];
+    }
+
+    d["rotation"] = rotation;
+    d["translation"] = py::array_t<float> ( 3, header.translation );
+    return d;
+  }
+
+  // Live frames from the camera, returned in the same Frame type the reader uses
+  class Camera
+  {
+  public:
+    Camera ( int streams, float fps, int colorWidth, int colorHeight, int depthWidth, int depthHeight )
+    {
+      _realsense.SetStreams ( streams );
+      _realsense.SetCaptureRequest ( fps, colorWidth, colorHeight, depthWidth, depthHeight );
+    }
+
+    ~Camera ()
+    {
+      _realsense.Stop ( true );
+    }
+
+    bool Start () { return _realsense.Start (); }
+    void Stop () { _realsense.Stop ( true ); }
+
+    IndexHeader Calibration ()
+    {
+      uint8_t codecs[RS::StreamCount] = { kIndexNoFiles, kIndexNoFiles, kIndexNoFiles, kIndexNoFiles };
+      return MakeIndexHeader ( &_realsense, codecs );
+    }
+
+    // waits for the next kept frameset, nullptr on timeout
+    std::shared_ptr<DatasetFrame> WaitFrame ( int timeoutMs )
+    {
+      auto frame = std::make_shared<DatasetFrame> ();
+      unsigned char* images[RS::StreamCount];
+      int sizes[RS::StreamCount];
+
+      for (int i = 0; i < RS::StreamCount; i++)
+      {
+        auto stream = (RS::StreamType)i;
+        auto& image = frame->images[i];
+
+        images[i] = nullptr;
+        sizes[i] = 0;
+        if (!_realsense.IsStreamEnabled ( stream ))
+          continue;
+
+        image.width = _realsense.GetStreamWidth ( stream );
+        image.height = _realsense.GetStreamHeight ( stream );
+        image.format = stream == RS::StreamColor ? PixelFormat::RGB8 : stream == RS::StreamDepth ? PixelFormat::Z16 : PixelFormat::Y8;
+        image.data.resize ( image.width * image.height * _realsense.GetStreamBytesPerPixel ( stream ) );
+        images[i] = image.data.data ();
+        sizes[i] = (int)image.data.size ();
+      }
+
+      RS::frame_metadata metadata;
+      auto deadline = std::chrono::steady_clock::now () + std::chrono::milliseconds ( timeoutMs );
+
+      {
+        py::gil_scoped_release release;
+
+        while (!_realsense.EncodeFrame ( images, sizes, &metadata ))
+        {
+          if (std::chrono::steady_clock::now () > deadline)
+            return nullptr;
+
+          std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+        }
+      }
+
+      // a crop that moved after the sizes were read leaves the stream without an image
+      for (int i = 0; i < RS::StreamCount; i++)
+      {
+        if (!images[i])
+          frame->images[i] = FrameImage ();
+      }
+
+      memset ( &frame->record, 0, sizeof ( frame->record ) );
+      frame->index = _realsense.GetFramesEncoded () - 1;
+      frame->frame = frame->index;
+      frame->record.frame = frame->frame;
+
+      for (int i = 0; i < RS::StreamCount; i++)
+      {
+        frame->record.timestamp[i] = metadata.timestamp[i];
+        frame->record.frameNumber[i] = metadata.frame_number[i];
+        frame->record.exposure[i] = (int32_t)metadata.exposure[i];
+      }
+
+      return frame;
+    }
+
+    int FramesAcquired () { return _realsense.GetFramesAcquired (); }
+    int FramesKept () { return _realsense.GetFramesKept (); }
+    RS::CaptureStats Stats () { return _realsense.GetCaptureStats (); }
+
+  private:
+    RS::RealsenseController _realsense;
+  };
+
+  std::shared_ptr<DatasetFrame> read_frame ( DatasetReader& reader, int index )
+  {
+    if (index < 0)
+      index += reader.FrameCount ();
+
+    if (index < 0 || index >= reader.FrameCount ())
+      throw py::index_error ();
+
+    auto frame = std::make_shared<DatasetFrame> ();
+    bool ok;
+
+    {
+      py::gil_scoped_release release;
+      ok = reader.ReadFrame ( index, *frame );
+    }
+
+    // a stream that did not decode would come back as an empty array, easy to take for a missing stream
+    if (!ok)
+      throw std::runtime_error ( Format ( "frame %d could not be decoded", index ) );
+
+    return frame;
+  }
+
+  std::shared_ptr<DatasetFrame> next_frame ( DatasetReader& reader )
+  {
+    auto frame = std::make_shared<DatasetFrame> ();
+    bool ok;
+
+    {
+      py::gil_scoped_release release;
+      ok = reader.Next ( *frame );
+    }
+
+    if (!ok)
+      throw py::stop_iteration ();
+
+    return frame;
+  }
+}
+
+PYBIND11_MODULE ( pyrsds, m )
+{
+  m.doc () = "Realsense dataset capture and reading";
+
+  py::enum_<RS::StreamFlags> ( m, "Stream", py::arithmetic () )
+    .value ( "COLOR", RS::StreamFlagColor )
+    .value ( "DEPTH", RS::StreamFlagDepth )
+    .value ( "IR_LEFT", RS::StreamFlagInfraredLeft )
+    .value ( "IR_RIGHT", RS::StreamFlagInfraredRight );
+
+  py::enum_<LogLevel> ( m, "LogLevel" )
+    .value ( "TRACE", LogLevel::Trace )
+    .value ( "DEBUG", LogLevel::Debug )
+    .value ( "INFO", LogLevel::Info )
+    .value ( "WARNING", LogLevel::Warning )
+    .value ( "ERROR", LogLevel::Error )
+    .value ( "OFF", LogLevel::Off );
+
+  m.def ( "set_log_level", &SetLogLevel, py::arg ( "level" ) );
+  m.def ( "set_log_file", &SetLogFile, py::arg ( "filename" ) );
+  m.def ( "flush_log", [] () {
+    py::gil_scoped_release release;
+    FlushLog ();
+  } );
+
+  py::class_<DatasetFrame, std::shared_ptr<DatasetFrame>> frame ( m, "Frame" );
+  frame
+    .def_readonly ( "index", &DatasetFrame::index )
+    .def_readonly ( "frame", &DatasetFrame::frame )
+    .def_property_readonly ( "timestamps", [] ( const DatasetFrame& f ) { return std::vector<double> ( f.record.timestamp, f.record.timestamp + RS::StreamCount ); } )
+    .def_property_readonly ( "frame_numbers", [] ( const DatasetFrame& f ) { return std::vector<uint64_t> ( f.record.frameNumber, f.record.frameNumber + RS::StreamCount ); } )
+    .def_property_readonly ( "exposures", [] ( const DatasetFrame& f ) { return std::vector<int32_t> ( f.record.exposure, f.record.exposure + RS::StreamCount ); } );
+
+  for (int i = 0; i < RS::StreamCount; i++)
+  {
+    frame.def_property_readonly ( kStreamNames[i], [i] ( py::object self ) {
+      return image_array ( self.cast<std::shared_ptr<DatasetFrame>> (), self, i );
+    } );
+  }
+
+  py::class_<DatasetReader> ( m, "Reader" )
+    .def ( py::init ( [] ( const std::string& folder, int level ) {
+      auto reader = std::unique_ptr<DatasetReader> ( new DatasetReader () );
+      if (!reader->Open ( folder, level ))
+        throw std::runtime_error ( level > 0 ? Format ( "no pyramid level %d in %s", level, folder.c_str () ) : "no frames in " + folder );
+      return reader;
+    } ), py::arg ( "folder" ), py::arg ( "level" ) = 0 )
+    .def ( "__len__", &DatasetReader::FrameCount )
+    .def ( "__getitem__", &read_frame )
+    .def ( "has_stream", [] ( DatasetReader& r, RS::StreamFlags stream ) {
+      for (int i = 0; i < RS::StreamCount; i++)
+      {
+        if (stream == (1 << i))
+          return r.HasStream ( (RS::StreamType)i );
+      }
+      return false;
+    } )
+    .def_property_readonly ( "calibration", [] ( DatasetReader& r ) -> py::object {
+      if (!r.HasCalibration ())
+        return py::none ();
+      return calibration_dict ( r.Calibration () );
+    } )
+    .def ( "session_calibration", [] ( DatasetReader& r, int index ) -> py::object {
+      if (!r.HasCalibration ())
+        return py::none ();
+      return calibration_dict ( r.SessionCalibration ( index ) );
+    }, py::arg ( "index" ) )
+    .def ( "prefetch", [] ( DatasetReader& r, const std::vector<int>& order, int threads, int depth ) {
+      py::gil_scoped_release release;
+      r.StartPrefetch ( order, threads, depth );
+    }, py::arg ( "order" ) = std::vector<int> (), py::arg ( "threads" ) = 0, py::arg ( "depth" ) = 8 )
+    .def ( "stop", [] ( DatasetReader& r ) {
+      py::gil_scoped_release release;
+      r.StopPrefetch ();
+    } )
+    .def ( "__iter__", [] ( py::object self ) {
+      // without a prefetch, or after one was used up, iterating reads every frame in order
+      auto& r = self.cast<DatasetReader&> ();
+      if (r.PrefetchRemaining () == 0)
+      {
+        py::gil_scoped_release release;
+        r.StartPrefetch ();
+      }
+      return self;
+    } )
+    .def ( "__next__", &next_frame );
+
+  py::class_<Camera> ( m, "Camera" )
+    .def ( py::init<int, float, int, int, int, int> (),
+      py::arg ( "streams" ) = (int)(RS::StreamFlagColor | RS::StreamFlagDepth),
+      py::arg ( "fps" ) = 30.0f,
+      py::arg ( "color_width" ) = 1280, py::arg ( "color_height" ) = 720,
+      py::arg ( "depth_width" ) = 1280, py::arg ( "depth_height" ) = 720 )
+    .def ( "start", &Camera::Start )
+    .def ( "stop", [] ( Camera& c ) {
+      py::gil_scoped_release release;
+      c.Stop ();
+    } )
+    .def ( "wait_frame", &Camera::WaitFrame, py::arg ( "timeout_ms" ) = 5000 )
+    .def_property_readonly ( "calibration", [] ( Camera& c ) { return calibration_dict ( c.Calibration () ); } )
+    .def_property_readonly ( "frames_acquired", &Camera::FramesAcquired )
+    .def_property_readonly ( "frames_kept", &Camera::FramesKept )
+    .def_property_readonly ( "stats", [] ( Camera& c ) { return stats_dict ( c.Stats () ); } );
+}
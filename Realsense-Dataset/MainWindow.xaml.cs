@@ -49,6 +49,11 @@ namespace Realsense_Dataset
             FolderName.Text = "testdata";
             TargetFPS.Text = "2.0";
 
+            // status events queue up natively until drained here, on the UI thread
+            var events = new DispatcherTimer { Interval = TimeSpan.FromMilliseconds(50) };
+            events.Tick += (s, args) => _rsds.DrainEvents();
+            events.Start();
+
             _rsds.Initialize(StatusCallback);
 
         }
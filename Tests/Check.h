@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+
+// A CHECK that fails prints where and what and counts towards the exit code, the test carries on so
+// one run lists every failure.
+#define CHECK(expression) Check ( (expression), #expression, __FILE__, __LINE__ )
+
+bool Check ( bool passed, const char* expression, const char* file, int line );
+
+// an empty folder under the temp folder, whatever an earlier run left there is removed
+std::string TestFolder ( const char* name );
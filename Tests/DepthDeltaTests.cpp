@@ -0,0 +1,177 @@
+#include "Check.h"
+#include "DatasetReader.h"
+#include "EncodeFrames.h"
+#include "FrameCodec.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <thread>
+
+using namespace EF;
+using namespace RS;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  // a floor that moves a little every frame with noise and holes, little endian like the sensor's
+  std::vector<unsigned char> depth_image ( int frame, int width, int height )
+  {
+    std::vector<unsigned char> image ( (size_t)width * height * 2 );
+    uint32_t seed = 12345u + frame;
+
+    for (int y = 0; y < height; y++)
+    {
+      for (int x = 0; x < width; x++)
+      {
+        seed = seed * 1664525u + 1013904223u;
+        int value = (seed >> 24) < 16 ? 0 : 500 + y * 40 + x * 3 + frame * 7 + (int)((seed >> 16) & 7);
+
+        size_t i = ((size_t)y * width + x) * 2;
+        image[i] = (unsigned char)value;
+        image[i + 1] = (unsigned char)(value >> 8);
+      }
+    }
+
+    return image;
+  }
+
+  void wait_for ( EncodeFrames& encoder )
+  {
+    while (encoder.PendingCount () > 0)
+      std::this_thread::sleep_for ( std::chrono::milliseconds ( 2 ) );
+  }
+
+  // every frame against the one before it, a keyframe every interval frames
+  void codec_round_trip ()
+  {
+    const int width = 37, height = 23, interval = 4;
+
+    CodecSettings settings;
+    settings.codec = CodecType::DepthDelta;
+    settings.keyframeInterval = interval;
+
+    std::unique_ptr<FrameCodec> codec ( CreateCodec ( settings ) );
+    if (!CHECK ( codec && codec->IsTemporal () ))
+      return;
+
+    std::vector<unsigned char> previous, encoded;
+    CHECK ( !codec->Encode ( depth_image ( 0, width, height ).data (), width, height, PixelFormat::RGB8, encoded ) );
+
+    FrameImage decoded = {};
+
+    for (int frame = 0; frame < 10; frame++)
+    {
+      auto image = depth_image ( frame, width, height );
+      int distance = frame % interval;
+
+      CHECK ( codec->EncodeDelta ( image.data (), distance ? previous.data () : nullptr, distance, width, height, PixelFormat::Z16, encoded ) );
+      CHECK ( codec->KeyframeDistance ( encoded.data (), encoded.size () ) == distance );
+
+      // a delta does not decode without the frame before it
+      FrameImage alone;
+      if (distance > 0)
+        CHECK ( !codec->DecodeDelta ( encoded.data (), encoded.size (), nullptr, alone ) );
+
+      FrameImage reference = decoded;
+      CHECK ( codec->DecodeDelta ( encoded.data (), encoded.size (), distance ? &reference : nullptr, decoded ) );
+      CHECK ( decoded.width == width && decoded.height == height && decoded.format == PixelFormat::Z16 );
+      CHECK ( decoded.data == image );
+
+      previous = image;
+    }
+  }
+
+  // Frames with no depth image, one the size of which changed and one whose file can not be written
+  // leave holes in the chain. The frame after each starts a new one, so every saved frame decodes.
+  void capture_with_gaps ()
+  {
+    const int frames = 20;
+    const int missing = 4, resized = 8, unwritten = 12;
+
+    std::string folder = TestFolder ( "depthdelta" );
+    fs::create_directories ( fs::path ( folder ) / StreamFolder ( StreamColor ) );
+    fs::create_directories ( fs::path ( folder ) / StreamFolder ( StreamDepth ) );
+
+    RealsenseController realsense;
+    CropSettings crop;
+    crop.mode = CropRectangle;
+    crop.color = { 0, 0, 32, 24 };
+    crop.depth = { 0, 0, 32, 24 };
+    realsense.SetCrop ( crop );
+
+    int width = realsense.GetStreamWidth ( StreamDepth );
+    int height = realsense.GetStreamHeight ( StreamDepth );
+
+    EncodeOptions options;
+    options.depth.codec = CodecType::DepthDelta;
+    options.depth.keyframeInterval = 100;
+
+    // a folder where the frame's file goes makes its write fail
+    fs::create_directories ( fs::path ( folder ) / FramePath ( options.layout, StreamDepth, unwritten, CodecExtension ( CodecType::DepthDelta ) ) );
+
+    EncodeFrames encoder;
+    encoder.Run ( std::vector<RealsenseController*> { &realsense }, std::vector<std::string> { folder }, options, 1 );
+
+    std::vector<unsigned char> color ( realsense.GetStreamSize ( StreamColor ), 7 );
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+      auto depth = depth_image ( frame, width, height );
+      if (frame == resized)
+        depth.resize ( depth.size () - 2 );
+
+      unsigned char* images[StreamCount] = { color.data (), frame == missing ? nullptr : depth.data () };
+      int sizes[StreamCount] = { (int)color.size (), (int)depth.size () };
+
+      frame_metadata metadata = {};
+      encoder.QueueFrame ( images, sizes, &metadata );
+
+      // one at a time, so the frame after a gap is encoded once the gap is known
+      wait_for ( encoder );
+    }
+
+    encoder.Stop ();
+
+    DatasetReader reader;
+    if (!CHECK ( reader.Open ( folder ) ) || !CHECK ( reader.FrameCount () == frames ))
+      return;
+
+    for (int i = 0; i < frames; i++)
+    {
+      DatasetFrame frame;
+      reader.ReadFrame ( i, frame );
+
+      bool gap = i == missing || i == resized || i == unwritten;
+      CHECK ( (frame.record.size[StreamDepth] == 0) == gap );
+      CHECK ( frame.images[StreamDepth].data.empty () == gap );
+
+      if (!gap)
+        CHECK ( frame.images[StreamDepth].data == depth_image ( i, width, height ) );
+    }
+
+    // the prefetch workers share the chain, every frame has to come out the same in order
+    reader.StartPrefetch ( std::vector<int> (), 2 );
+
+    DatasetFrame frame;
+    int read = 0;
+
+    for (; reader.Next ( frame ); read++)
+    {
+      CHECK ( frame.index == read );
+      if (frame.record.size[StreamDepth] > 0)
+        CHECK ( frame.images[StreamDepth].data == depth_image ( frame.index, width, height ) );
+    }
+
+    CHECK ( read == frames );
+    reader.StopPrefetch ();
+  }
+}
+
+void DepthDeltaTests ()
+{
+  codec_round_trip ();
+  capture_with_gaps ();
+}
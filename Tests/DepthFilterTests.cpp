@@ -0,0 +1,327 @@
+#include "Check.h"
+#include "DepthFilter.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+using namespace RS;
+
+namespace
+{
+  typedef std::vector<uint16_t> depth_image;
+
+  // Plain one pixel at a time versions of the filters, the SSE2 kernels have to match them exactly
+  // on any size, not just on the pixels the kernels' scalar tails cover.
+
+  int to_q15 ( float weight )
+  {
+    return (int)(std::min ( std::max ( weight, 0.0f ), 1.0f ) * 32767.0f + 0.5f);
+  }
+
+  uint16_t blend ( uint16_t cur, uint16_t prev, int alpha, int delta )
+  {
+    if (!cur || !prev)
+      return cur;
+
+    int diff = (int)prev - (int)cur;
+    if (std::abs ( diff ) >= delta)
+      return cur;
+
+    return (uint16_t)(cur + ((diff * 2 * alpha) >> 16));
+  }
+
+  uint16_t nearest ( uint16_t a, uint16_t b, uint16_t c, uint16_t d )
+  {
+    uint16_t values[4] = { a, b, c, d };
+    uint16_t best = 0;
+
+    for (uint16_t v : values)
+    {
+      if (v && (!best || v < best))
+        best = v;
+    }
+
+    return best;
+  }
+
+  depth_image decimate ( const depth_image& depth, int width, int height, int f )
+  {
+    int outWidth = width / f, outHeight = height / f;
+    depth_image out ( (size_t)outWidth * outHeight );
+
+    for (int oy = 0; oy < outHeight; oy++)
+    {
+      for (int ox = 0; ox < outWidth; ox++)
+      {
+        std::vector<uint16_t> values;
+        for (int y = oy * f; y < (oy + 1) * f; y++)
+        {
+          for (int x = ox * f; x < (ox + 1) * f; x++)
+          {
+            if (depth[(size_t)y * width + x])
+              values.push_back ( depth[(size_t)y * width + x] );
+          }
+        }
+
+        uint16_t value = 0;
+        if (!values.empty () && f <= 3)
+        {
+          std::sort ( values.begin (), values.end () );
+          value = values[values.size () / 2];
+        }
+        else if (!values.empty ())
+        {
+          int sum = 0;
+          for (uint16_t v : values)
+            sum += v;
+          value = (uint16_t)((sum + (int)values.size () / 2) / (int)values.size ());
+        }
+
+        out[(size_t)oy * outWidth + ox] = value;
+      }
+    }
+
+    return out;
+  }
+
+  depth_image halve ( const depth_image& depth, int width, int height, bool nearestDepth )
+  {
+    if (!nearestDepth)
+      return decimate ( depth, width, height, 2 );
+
+    depth_image out ( (size_t)(width / 2) * (height / 2) );
+
+    for (int oy = 0; oy < height / 2; oy++)
+    {
+      for (int ox = 0; ox < width / 2; ox++)
+      {
+        const uint16_t* p = depth.data () + (size_t)oy * 2 * width + ox * 2;
+        out[(size_t)oy * (width / 2) + ox] = nearest ( p[0], p[1], p[width], p[width + 1] );
+      }
+    }
+
+    return out;
+  }
+
+  void spatial ( depth_image& depth, int width, int height, const DepthFilterSettings& settings )
+  {
+    int alpha = to_q15 ( settings.spatialAlpha );
+    int delta = settings.spatialDelta;
+
+    auto at = [&]( int x, int y ) -> uint16_t& { return depth[(size_t)y * width + x]; };
+
+    for (int iteration = 0; iteration < settings.spatialIterations; iteration++)
+    {
+      for (int y = 0; y < height; y++)
+      {
+        for (int x = 1; x < width; x++)
+          at ( x, y ) = blend ( at ( x, y ), at ( x - 1, y ), alpha, delta );
+        for (int x = width - 2; x >= 0; x--)
+          at ( x, y ) = blend ( at ( x, y ), at ( x + 1, y ), alpha, delta );
+      }
+
+      for (int x = 0; x < width; x++)
+      {
+        for (int y = 1; y < height; y++)
+          at ( x, y ) = blend ( at ( x, y ), at ( x, y - 1 ), alpha, delta );
+        for (int y = height - 2; y >= 0; y--)
+          at ( x, y ) = blend ( at ( x, y ), at ( x, y + 1 ), alpha, delta );
+      }
+    }
+  }
+
+  struct temporal_history
+  {
+    depth_image previous;
+    std::vector<int> age;
+  };
+
+  void temporal ( depth_image& depth, temporal_history& history, const DepthFilterSettings& settings )
+  {
+    if (history.previous.size () != depth.size ())
+    {
+      history.previous = depth;
+      history.age.assign ( depth.size (), 0 );
+      return;
+    }
+
+    int alpha = to_q15 ( settings.temporalAlpha );
+
+    for (size_t i = 0; i < depth.size (); i++)
+    {
+      uint16_t cur = depth[i];
+      uint16_t prev = history.previous[i];
+
+      if (cur)
+      {
+        uint16_t seen = prev && std::abs ( (int)cur - (int)prev ) < settings.temporalDelta ? blend ( prev, cur, alpha, settings.temporalDelta ) : cur;
+        depth[i] = seen;
+        history.previous[i] = seen;
+        history.age[i] = 0;
+      }
+      else
+      {
+        history.age[i] = std::min ( history.age[i] + 1, 255 );
+        depth[i] = history.age[i] <= settings.temporalPersistence ? prev : 0;
+      }
+    }
+  }
+
+  void fill_holes ( depth_image& depth, int width, int height, HoleFill mode )
+  {
+    depth_image source = depth;
+    auto at = [&]( int x, int y ) -> uint16_t { return x < 0 || y < 0 || x >= width || y >= height ? 0 : source[(size_t)y * width + x]; };
+
+    for (int y = 0; y < height; y++)
+    {
+      uint16_t last = 0;
+
+      for (int x = 0; x < width; x++)
+      {
+        uint16_t& pixel = depth[(size_t)y * width + x];
+
+        if (pixel)
+        {
+          last = pixel;
+          continue;
+        }
+
+        uint16_t a = at ( x - 1, y ), b = at ( x + 1, y ), c = at ( x, y - 1 ), d = at ( x, y + 1 );
+
+        if (mode == HoleFill::FromLeft)
+          pixel = last;
+        else if (mode == HoleFill::Nearest)
+          pixel = nearest ( a, b, c, d );
+        else
+          pixel = std::max ( std::max ( a, b ), std::max ( c, d ) );
+      }
+    }
+  }
+
+  // Depth that the filters have something to do with: a slope with noise, so neighbours are mostly
+  // closer than the deltas, edges, holes and values far apart enough to overflow 16 bit differences.
+  depth_image make_depth ( int width, int height, uint32_t seed )
+  {
+    depth_image depth ( (size_t)width * height );
+
+    for (int y = 0; y < height; y++)
+    {
+      for (int x = 0; x < width; x++)
+      {
+        seed = seed * 1664525u + 1013904223u;
+        int r = seed >> 24;
+        int value = 800 + x * 5 + y * 3 + (x / 11 % 2) * 300 + (int)((seed >> 12) & 31);
+
+        if (r < 40)
+          value = 0;
+        else if (r < 44)
+          value = 40000 + (int)((seed >> 8) & 0x3fff);
+        else if (r < 46)
+          value = 65535;
+
+        depth[(size_t)y * width + x] = (uint16_t)value;
+      }
+    }
+
+    return depth;
+  }
+
+  struct image_size
+  {
+    int width;
+    int height;
+  };
+
+  // whole vectors and bands, tails of every length, single rows and columns
+  const image_size kSizes[] = { { 64, 48 }, { 37, 23 }, { 8, 8 }, { 17, 33 }, { 1, 9 }, { 9, 1 }, { 130, 70 } };
+}
+
+void DepthFilterTests ()
+{
+  for (int threads : { 1, 3 })
+  {
+    for (auto size : kSizes)
+    {
+      int width = size.width, height = size.height;
+      depth_image source = make_depth ( width, height, width * 131 + height );
+
+      for (int f = 2; f <= 5; f++)
+      {
+        DepthFilterSettings settings;
+        settings.decimation = f;
+        settings.threads = threads;
+
+        DepthFilter filter;
+        filter.Configure ( settings );
+
+        depth_image depth = source;
+        filter.Decimate ( depth.data (), width, height );
+        depth.resize ( (size_t)filter.OutputWidth ( width ) * filter.OutputHeight ( height ) );
+        CHECK ( depth == decimate ( source, width, height, f ) );
+      }
+
+      for (bool nearestDepth : { false, true })
+      {
+        depth_image out ( (size_t)(width / 2) * (height / 2) );
+        DepthFilter::Halve ( source.data (), width, height, out.data (), nearestDepth );
+        CHECK ( out == halve ( source, width, height, nearestDepth ) );
+      }
+
+      for (int delta : { 1, 20, 200, 16383 })
+      {
+        DepthFilterSettings settings;
+        settings.spatial = true;
+        settings.spatialAlpha = delta == 200 ? 1.0f : 0.45f;
+        settings.spatialDelta = delta;
+        settings.spatialIterations = delta == 20 ? 5 : 2;
+        settings.threads = threads;
+
+        DepthFilter filter;
+        filter.Configure ( settings );
+
+        depth_image depth = source, expected = source;
+        filter.Spatial ( depth.data (), width, height );
+        spatial ( expected, width, height, filter.Settings () );
+        CHECK ( depth == expected );
+      }
+
+      for (int persistence : { 0, 3 })
+      {
+        DepthFilterSettings settings;
+        settings.temporal = true;
+        settings.temporalPersistence = persistence;
+        settings.temporalDelta = 300;
+        settings.threads = threads;
+
+        DepthFilter filter;
+        filter.Configure ( settings );
+        temporal_history history;
+
+        // holes come and go from frame to frame, so pixels age and get their depth back
+        for (int frame = 0; frame < 8; frame++)
+        {
+          depth_image depth = make_depth ( width, height, frame * 7 + persistence ), expected = depth;
+          filter.Temporal ( depth.data (), width, height );
+          temporal ( expected, history, filter.Settings () );
+          CHECK ( depth == expected );
+        }
+      }
+
+      for (HoleFill mode : { HoleFill::FromLeft, HoleFill::Farthest, HoleFill::Nearest })
+      {
+        DepthFilterSettings settings;
+        settings.holeFill = mode;
+        settings.threads = threads;
+
+        DepthFilter filter;
+        filter.Configure ( settings );
+
+        depth_image depth = source, expected = source;
+        filter.FillHoles ( depth.data (), width, height );
+        fill_holes ( expected, width, height, mode );
+        CHECK ( depth == expected );
+      }
+    }
+  }
+}
@@ -0,0 +1,160 @@
+#include "Check.h"
+#include "FrameCodec.h"
+#include "FrameIndex.h"
+
+#include <cstring>
+#include <filesystem>
+
+using namespace EF;
+
+namespace fs = std::experimental::filesystem;
+
+namespace
+{
+  IndexRecord make_record ( uint32_t frame, uint32_t flags )
+  {
+    IndexRecord record;
+    memset ( &record, 0, sizeof ( record ) );
+
+    record.frame = frame;
+    record.flags = flags;
+
+    for (int i = 0; i < RS::StreamCount; i++)
+    {
+      record.timestamp[i] = frame * 33.3 + i;
+      record.frameNumber[i] = 1000 + frame;
+      record.size[i] = 100 + frame * 10 + i;
+      record.exposure[i] = -1;
+    }
+
+    return record;
+  }
+
+  bool same_record ( const IndexRecord& a, const IndexRecord& b )
+  {
+    return memcmp ( &a, &b, sizeof ( a ) ) == 0;
+  }
+
+  // count frames numbered from first, the first one starts the session
+  void write_session ( const std::string& filename, const IndexHeader& header, bool append, uint32_t first, int count )
+  {
+    FrameIndexWriter writer;
+    CHECK ( writer.Open ( filename, header, append ) );
+
+    for (int i = 0; i < count; i++)
+      CHECK ( writer.Append ( make_record ( first + i, i == 0 ? kIndexSessionStart : 0 ) ) );
+
+    writer.Close ();
+  }
+
+  // the records of frames 0 to count - 1 in order
+  void check_records ( const std::vector<IndexRecord>& records, int count )
+  {
+    if (!CHECK ( (int)records.size () == count ))
+      return;
+
+    for (int i = 0; i < count; i++)
+      CHECK ( same_record ( records[i], make_record ( i, records[i].flags ) ) );
+  }
+
+  uintmax_t index_size ( const IndexHeader& header, int records )
+  {
+    return header.headerSize + (uintmax_t)records * header.recordSize;
+  }
+}
+
+void FrameIndexTests ()
+{
+  fs::path folder = TestFolder ( "index" );
+  std::string filename = (folder / kIndexFilename).string ();
+
+  RS::RealsenseController realsense;
+
+  uint8_t codecs[RS::StreamCount];
+  memset ( codecs, (uint8_t)CodecType::Png, sizeof ( codecs ) );
+
+  FrameLayout layout;
+  layout.framesPerShard = 100;
+
+  IndexHeader written = MakeIndexHeader ( &realsense, codecs, layout );
+
+  IndexHeader header;
+  std::vector<IndexRecord> records;
+  std::vector<IndexHeader> sessions;
+
+  // a new index reads back as it was written
+  write_session ( filename, written, false, 0, 5 );
+
+  CHECK ( ReadFrameIndex ( filename, header, records, &sessions ) );
+  CHECK ( memcmp ( &header, &written, sizeof ( header ) ) == 0 );
+  check_records ( records, 5 );
+  CHECK ( sessions.size () == 1 );
+
+  // a session saved like the header appends its records only
+  write_session ( filename, written, true, 5, 3 );
+
+  CHECK ( fs::file_size ( filename ) == index_size ( written, 8 ) );
+  CHECK ( ReadFrameIndex ( filename, header, records, &sessions ) );
+  check_records ( records, 8 );
+  CHECK ( sessions.size () == 2 );
+
+  // one with another depth codec puts an IndexSession in front of its records
+  IndexHeader zstd = written;
+  zstd.codecs[RS::StreamDepth] = (uint8_t)CodecType::Zstd;
+  write_session ( filename, zstd, true, 8, 4 );
+
+  CHECK ( fs::file_size ( filename ) == index_size ( written, 13 ) );
+  CHECK ( ReadFrameIndex ( filename, header, records, &sessions ) );
+  CHECK ( memcmp ( &header, &written, sizeof ( header ) ) == 0 );
+  check_records ( records, 12 );
+
+  if (CHECK ( sessions.size () == 3 ))
+  {
+    CHECK ( sessions[1].codecs[RS::StreamDepth] == (uint8_t)CodecType::Png );
+    CHECK ( sessions[2].codecs[RS::StreamDepth] == (uint8_t)CodecType::Zstd );
+    CHECK ( sessions[2].codecs[RS::StreamColor] == (uint8_t)CodecType::Png );
+  }
+
+  IndexRecord last;
+  CHECK ( ReadLastIndexRecord ( filename, header, last ) && same_record ( last, make_record ( 11, 0 ) ) );
+
+  FrameLayout found;
+  CHECK ( NextFrameNumber ( folder.string (), &found ) == 12 );
+  CHECK ( found.framesPerShard == 100 && found.digits == layout.digits );
+
+  // half a record left by a crash is not read, and appending drops it instead of shifting the new records
+  if (FILE* file = fopen ( filename.c_str (), "ab" ))
+  {
+    IndexRecord partial = make_record ( 99, 0 );
+    fwrite ( &partial, sizeof ( partial ) / 2, 1, file );
+    fclose ( file );
+  }
+
+  CHECK ( ReadFrameIndex ( filename, header, records ) );
+  check_records ( records, 12 );
+  CHECK ( ReadLastIndexRecord ( filename, header, last ) && last.frame == 11 );
+
+  // back to the header's codecs, the session goes back to the header
+  write_session ( filename, written, true, 12, 2 );
+
+  CHECK ( fs::file_size ( filename ) == index_size ( written, 15 ) );
+  CHECK ( ReadFrameIndex ( filename, header, records, &sessions ) );
+  check_records ( records, 14 );
+
+  if (CHECK ( sessions.size () == 4 ))
+    CHECK ( sessions[3].codecs[RS::StreamDepth] == (uint8_t)CodecType::Png );
+
+  CHECK ( NextFrameNumber ( folder.string () ) == 14 );
+
+  // an index named another way can not take the records, it is moved aside and a new one started
+  IndexHeader flat = MakeIndexHeader ( &realsense, codecs, FrameLayout () );
+  write_session ( filename, flat, true, 14, 1 );
+
+  std::string aside = (folder / "index.1.bin").string ();
+  CHECK ( ReadFrameIndex ( aside, header, records ) );
+  check_records ( records, 14 );
+
+  CHECK ( ReadFrameIndex ( filename, header, records ) );
+  CHECK ( header.framesPerShard == 0 );
+  CHECK ( records.size () == 1 && same_record ( records[0], make_record ( 14, kIndexSessionStart ) ) );
+}
@@ -0,0 +1,62 @@
+#include "Check.h"
+#include "Log.h"
+
+#include <cstdio>
+#include <filesystem>
+
+namespace fs = std::experimental::filesystem;
+
+void FrameIndexTests ();
+void DepthDeltaTests ();
+void DepthFilterTests ();
+
+namespace
+{
+  int failures = 0;
+}
+
+bool Check ( bool passed, const char* expression, const char* file, int line )
+{
+  if (!passed)
+  {
+    printf ( "  %s(%d): failed %s\n", file, line, expression );
+    failures++;
+  }
+
+  return passed;
+}
+
+std::string TestFolder ( const char* name )
+{
+  fs::path path = fs::temp_directory_path () / "rsds-tests" / name;
+  fs::remove_all ( path );
+  fs::create_directories ( path );
+  return path.string ();
+}
+
+// Runs every test and exits with the number of failed checks, 0 when all passed.
+int main ()
+{
+  struct
+  {
+    const char* name;
+    void (*run) ();
+  } tests[] = {
+    { "frame index", FrameIndexTests },
+    { "depth delta", DepthDeltaTests },
+    { "depth filter", DepthFilterTests },
+  };
+
+  for (auto& test : tests)
+  {
+    int before = failures;
+    printf ( "%s\n", test.name );
+    test.run ();
+    printf ( "  %s\n", failures == before ? "passed" : "FAILED" );
+  }
+
+  FlushLog ();
+
+  printf ( "%d failed checks\n", failures );
+  return failures;
+}